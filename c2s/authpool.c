@@ -0,0 +1,463 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2003 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/** @file c2s/authpool.c
+  * @brief authreg lookups on worker threads
+  *
+  * Password checks can mean a database query and a deliberately slow
+  * hash, so they're done here instead of in the event loop. The caller
+  * hands over the credentials and returns; when the answer comes back
+  * the results are left in the session and the caller's done function
+  * is called, which replays the request that needed them.
+  */
+
+#include "c2s.h"
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <dlfcn.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+  #include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD
+  #include <pthread.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+  #include <sys/eventfd.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+
+/** a single lookup */
+typedef struct authpool_job_st {
+    int                 index;          /**< which module */
+    char                skey[44];       /**< session it's for */
+
+    char                *username;
+    char                *realm;
+    char                password[257];
+
+    int                 exists;         /**< check the user exists first */
+
+    int                 ret_exists;
+    int                 ret_passok;
+
+    struct timeval      start;
+
+    authpool_done_fn    done;
+    void                *arg;
+} *authpool_job_t;
+
+/** a worker thread, with its own copy of each module */
+typedef struct authpool_thread_st {
+    authpool_t          ap;
+    pthread_t           thread;
+    authreg_t           *ars;           /**< NULL where the module can't be copied */
+} *authpool_thread_t;
+
+struct authpool_st {
+    c2s_t               c2s;
+
+    /** what the copies of the modules see; keeps the log they started with */
+    struct c2s_st       view;
+
+    /** modules we have copies of */
+    authreg_t           *ars;
+    int                 nars;
+
+    authpool_thread_t   threads;
+    int                 nthreads;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    jqueue_t            jobs;           /**< waiting lookups, guarded by lock */
+    jqueue_t            done;           /**< finished lookups, guarded by lock */
+    jqueue_t            ready;          /**< finished lookups being called back */
+    int                 stop;
+
+    /** completion notification, both ends are the same eventfd if we have them */
+    int                 notify[2];
+    mio_fd_t            fd;
+
+    /** metrics, guarded by the c2s lock */
+    int                 depth;          /**< lookups outstanding */
+    int                 depth_peak;
+    unsigned long       completed;
+    unsigned long       latency_total;  /**< ms */
+    unsigned long       latency_max;    /**< ms */
+};
+
+static void *_authpool_run(void *arg) {
+    authpool_thread_t t = (authpool_thread_t) arg;
+    authpool_t ap = t->ap;
+    authpool_job_t job;
+    authreg_t ar;
+    char buf[257];
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&ap->lock);
+
+    while(1) {
+        while(jqueue_size(ap->jobs) == 0 && !ap->stop)
+            pthread_cond_wait(&ap->cond, &ap->lock);
+
+        if(ap->stop)
+            break;
+
+        job = (authpool_job_t) jqueue_pull(ap->jobs);
+
+        pthread_mutex_unlock(&ap->lock);
+
+        ar = t->ars[job->index];
+
+        job->ret_exists = 1;
+        if(job->exists)
+            job->ret_exists = (ar->user_exists)(ar, NULL, job->username, job->realm);
+
+        job->ret_passok = 0;
+        if(job->ret_exists && job->password[0] != '\0') {
+            if(ar->check_password != NULL)
+                job->ret_passok = ((ar->check_password)(ar, NULL, job->username, job->realm, job->password) == 0);
+            else if(ar->get_password != NULL)
+                job->ret_passok = ((ar->get_password)(ar, NULL, job->username, job->realm, buf) == 0 && strcmp(job->password, buf) == 0);
+        }
+
+        /* don't keep it around */
+        memset(job->password, 0, sizeof(job->password));
+
+        pthread_mutex_lock(&ap->lock);
+
+        jqueue_push(ap->done, (void *) job, 0);
+
+        /* only need to wake them for the first one */
+        if(jqueue_size(ap->done) == 1)
+            if(write(ap->notify[1], &one, (ap->notify[0] == ap->notify[1]) ? sizeof(one) : 1) < 0)
+                log_debug(ZONE, "couldn't notify main thread: %s", strerror(errno));
+    }
+
+    pthread_mutex_unlock(&ap->lock);
+
+    return NULL;
+}
+
+static void _authpool_job_free(authpool_job_t job) {
+    free(job->username);
+    free(job->realm);
+    free(job);
+}
+
+/** hand the results over, on the thread that has their connection */
+static void _authpool_finish(c2s_t c2s, sess_t sess, void *arg) {
+    authpool_job_t job = (authpool_job_t) arg;
+
+    if(sess != NULL) {
+        sess->ar_pending = 0;
+        sess->ar_ready = 1;
+        sess->ar_exists = job->ret_exists;
+        sess->ar_passok = job->ret_passok;
+    }
+
+    (job->done)(c2s, sess, job->arg);
+
+    if(sess != NULL)
+        sess->ar_ready = 0;
+
+    _authpool_job_free(job);
+}
+
+/** lookups have finished */
+static int _authpool_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    authpool_t ap = (authpool_t) arg;
+    authpool_job_t job;
+    jqueue_t q;
+    sess_t sess;
+    struct timeval now;
+    unsigned long ms;
+    char buf[64];
+
+    if(a != action_READ)
+        return 0;
+
+    while(read(fd->fd, buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&ap->lock);
+    q = ap->done;
+    ap->done = ap->ready;
+    ap->ready = q;
+    pthread_mutex_unlock(&ap->lock);
+
+    gettimeofday(&now, NULL);
+
+    c2s_lock(ap->c2s);
+
+    while((job = (authpool_job_t) jqueue_pull(ap->ready)) != NULL) {
+        ms = (now.tv_sec - job->start.tv_sec) * 1000 + (now.tv_usec - job->start.tv_usec) / 1000;
+
+        ap->depth--;
+        ap->completed++;
+        ap->latency_total += ms;
+        if(ms > ap->latency_max)
+            ap->latency_max = ms;
+
+        /* they might have gone away while we were waiting */
+        sess = xhash_get(ap->c2s->sessions, job->skey);
+        if(sess != NULL)
+            log_debug(ZONE, "auth lookup for %s done in %lums (exists=%d, passok=%d)", job->username, ms, job->ret_exists, job->ret_passok);
+
+        c2s_sess_call(ap->c2s, sess, _authpool_finish, (void *) job);
+    }
+
+    c2s_unlock(ap->c2s);
+
+    return 1;
+}
+
+/** start a copy of a module */
+static authreg_t _authpool_ar_copy(authpool_t ap, authreg_t ar) {
+    ar_module_init_fn init_fn;
+    authreg_t copy;
+
+#ifndef _WIN32
+    init_fn = (ar_module_init_fn) dlsym(ar->handle, "ar_init");
+#else
+    init_fn = (ar_module_init_fn) GetProcAddress((HMODULE) ar->handle, "ar_init");
+#endif
+    if(init_fn == NULL)
+        return NULL;
+
+    copy = (authreg_t) calloc(1, sizeof(struct authreg_st));
+
+    copy->handle = ar->handle;
+    copy->c2s = &ap->view;
+
+    if((init_fn)(copy) != 0 || copy->user_exists == NULL) {
+        if(copy->free != NULL)
+            (copy->free)(copy);
+        free(copy);
+        return NULL;
+    }
+
+    copy->initialized = TRUE;
+
+    return copy;
+}
+
+authpool_t authpool_new(c2s_t c2s, int nthreads) {
+    authpool_t ap;
+    authreg_t ar;
+    authpool_thread_t t;
+    int i, j;
+
+    ap = (authpool_t) calloc(1, sizeof(struct authpool_st));
+
+    ap->c2s = c2s;
+    ap->view = *c2s;
+
+    /* modules that can have more than one instance */
+    ap->ars = (authreg_t *) calloc(xhash_count(c2s->ar_modules), sizeof(authreg_t));
+    if(xhash_iter_first(c2s->ar_modules))
+        do {
+            xhash_iter_get(c2s->ar_modules, NULL, NULL, (void *) &ar);
+            if(ar->initialized && !ar->single)
+                ap->ars[ap->nars++] = ar;
+        } while(xhash_iter_next(c2s->ar_modules));
+
+    if(ap->nars == 0) {
+        log_write(c2s->log, LOG_NOTICE, "no authreg modules can be run on threads, lookups will be done inline");
+        free(ap->ars);
+        free(ap);
+        return NULL;
+    }
+
+#ifdef HAVE_SYS_EVENTFD_H
+    ap->notify[0] = ap->notify[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ap->notify[0] < 0)
+#endif
+    {
+        if(pipe(ap->notify) < 0) {
+            log_write(c2s->log, LOG_ERR, "couldn't create auth notification pipe: %s, lookups will be done inline", strerror(errno));
+            free(ap->ars);
+            free(ap);
+            return NULL;
+        }
+        fcntl(ap->notify[0], F_SETFL, fcntl(ap->notify[0], F_GETFL) | O_NONBLOCK);
+        fcntl(ap->notify[1], F_SETFL, fcntl(ap->notify[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    ap->jobs = jqueue_new();
+    ap->done = jqueue_new();
+    ap->ready = jqueue_new();
+    pthread_mutex_init(&ap->lock, NULL);
+    pthread_cond_init(&ap->cond, NULL);
+
+    ap->nthreads = nthreads;
+    ap->threads = (authpool_thread_t) calloc(nthreads, sizeof(struct authpool_thread_st));
+
+    for(i = 0; i < nthreads; i++) {
+        t = &ap->threads[i];
+        t->ap = ap;
+        t->ars = (authreg_t *) calloc(ap->nars, sizeof(authreg_t));
+
+        for(j = 0; j < ap->nars; j++) {
+            t->ars[j] = _authpool_ar_copy(ap, ap->ars[j]);
+            if(t->ars[j] == NULL) {
+                log_write(c2s->log, LOG_ERR, "couldn't start a copy of an authreg module for thread %d, aborting", i);
+                exit(1);
+            }
+        }
+    }
+
+    for(i = 0; i < nthreads; i++)
+        pthread_create(&ap->threads[i].thread, NULL, _authpool_run, (void *) &ap->threads[i]);
+
+    ap->fd = mio_register(c2s->mio, ap->notify[0], _authpool_mio_callback, (void *) ap);
+    mio_read(c2s->mio, ap->fd);
+
+    log_write(c2s->log, LOG_NOTICE, "started %d authreg threads", nthreads);
+
+    return ap;
+}
+
+void authpool_free(authpool_t ap) {
+    authpool_job_t job;
+    int i, j;
+
+    pthread_mutex_lock(&ap->lock);
+    ap->stop = 1;
+    pthread_cond_broadcast(&ap->cond);
+    pthread_mutex_unlock(&ap->lock);
+
+    for(i = 0; i < ap->nthreads; i++) {
+        pthread_join(ap->threads[i].thread, NULL);
+
+        for(j = 0; j < ap->nars; j++) {
+            authreg_free(ap->threads[i].ars[j]);
+            free(ap->threads[i].ars[j]);
+        }
+        free(ap->threads[i].ars);
+    }
+
+    /* nobody is waiting for these any more */
+    while((job = (authpool_job_t) jqueue_pull(ap->jobs)) != NULL) {
+        (job->done)(ap->c2s, NULL, job->arg);
+        _authpool_job_free(job);
+    }
+    while((job = (authpool_job_t) jqueue_pull(ap->done)) != NULL) {
+        (job->done)(ap->c2s, NULL, job->arg);
+        _authpool_job_free(job);
+    }
+
+    mio_close(ap->c2s->mio, ap->fd);
+    if(ap->notify[1] != ap->notify[0])
+        close(ap->notify[1]);
+
+    jqueue_free(ap->jobs);
+    jqueue_free(ap->done);
+    jqueue_free(ap->ready);
+    pthread_mutex_destroy(&ap->lock);
+    pthread_cond_destroy(&ap->cond);
+
+    free(ap->threads);
+    free(ap->ars);
+    free(ap);
+}
+
+int authpool_check(authpool_t ap, sess_t sess, const char *username, const char *realm, const char *password, int exists, authpool_done_fn done, void *arg) {
+    authpool_job_t job;
+    int i;
+
+    if(ap == NULL)
+        return 1;
+
+    for(i = 0; i < ap->nars && ap->ars[i] != sess->host->ar; i++);
+    if(i == ap->nars)
+        return 1;
+
+    log_debug(ZONE, "queueing auth lookup for %s", username);
+
+    job = (authpool_job_t) calloc(1, sizeof(struct authpool_job_st));
+
+    job->index = i;
+    strcpy(job->skey, sess->skey);
+    job->username = strdup(username);
+    job->realm = strdup(realm);
+    if(password != NULL)
+        snprintf(job->password, sizeof(job->password), "%s", password);
+    job->exists = exists;
+    job->done = done;
+    job->arg = arg;
+    gettimeofday(&job->start, NULL);
+
+    sess->ar_pending = 1;
+
+    ap->depth++;
+    if(ap->depth > ap->depth_peak)
+        ap->depth_peak = ap->depth;
+
+    pthread_mutex_lock(&ap->lock);
+    jqueue_push(ap->jobs, (void *) job, 0);
+    pthread_cond_signal(&ap->cond);
+    pthread_mutex_unlock(&ap->lock);
+
+    return 0;
+}
+
+log_t authpool_log(authpool_t ap) {
+    return ap->view.log;
+}
+
+void authpool_stats(authpool_t ap) {
+    if(ap->completed == 0 && ap->depth == 0)
+        return;
+
+    log_write(ap->c2s->log, LOG_NOTICE, "authreg threads: %d outstanding (peak %d), %lu done, latency avg %lums max %lums",
+        ap->depth, ap->depth_peak, ap->completed,
+        (ap->completed > 0) ? ap->latency_total / ap->completed : 0, ap->latency_max);
+
+    /* start again for the next interval */
+    ap->depth_peak = ap->depth;
+    ap->completed = 0;
+    ap->latency_total = 0;
+    ap->latency_max = 0;
+}
+
+#else
+
+authpool_t authpool_new(c2s_t c2s, int nthreads) {
+    log_write(c2s->log, LOG_ERR, "authreg threads not available (built without thread support), lookups will be done inline");
+    return NULL;
+}
+
+void authpool_free(authpool_t ap) {
+}
+
+int authpool_check(authpool_t ap, sess_t sess, const char *username, const char *realm, const char *password, int exists, authpool_done_fn done, void *arg) {
+    return 1;
+}
+
+log_t authpool_log(authpool_t ap) {
+    return NULL;
+}
+
+void authpool_stats(authpool_t ap) {
+}
+
+#endif
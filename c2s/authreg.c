@@ -242,6 +242,8 @@ static void _authreg_auth_get(c2s_t c2s, sess_t sess, nad_t nad) {
     return;
 }
 
+static void _authreg_auth_checked(c2s_t c2s, sess_t sess, void *arg);
+
 /** auth set handler */
 static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
     int ns, elem, attr, authd = 0;
@@ -302,8 +304,26 @@ static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
         return;
     }
     
+    /* one at a time */
+    if(sess->ar_pending) {
+        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_RESOURCE_CONSTRAINT), 0));
+        return;
+    }
+
+    /* have the authreg threads check the user and password, we'll be back here when they're done */
+    if(!sess->ar_ready) {
+        elem = nad_find_elem(nad, 1, ns, "password", 1);
+        if(elem >= 0)
+            snprintf(str, 257, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
+        else
+            str[0] = '\0';
+
+        if(authpool_check(c2s->authpool, sess, username, sess->host->realm, str, 1, _authreg_auth_checked, (void *) nad) == 0)
+            return;
+    }
+
     /* do we have the user? */
-    if((sess->host->ar->user_exists)(sess->host->ar, sess, username, sess->host->realm) == 0) {
+    if((sess->ar_ready ? sess->ar_exists : (sess->host->ar->user_exists)(sess->host->ar, sess, username, sess->host->realm)) == 0) {
         sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_OLD_UNAUTH), 0));
         return;
     }
@@ -350,7 +370,7 @@ static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
     }
 
     /* plaintext auth (compare) */
-    if(!authd && ar_mechs & AR_MECH_TRAD_PLAIN && sess->host->ar->get_password != NULL)
+    if(!authd && ar_mechs & AR_MECH_TRAD_PLAIN && sess->host->ar->get_password != NULL && !sess->ar_ready)
     {
         elem = nad_find_elem(nad, 1, ns, "password", 1);
         if(elem >= 0)
@@ -367,14 +387,14 @@ static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
         }
     }
 
-    /* plaintext auth (check) */
-    if(!authd && ar_mechs & AR_MECH_TRAD_PLAIN && sess->host->ar->check_password != NULL)
+    /* plaintext auth (check), or whatever the authreg threads found */
+    if(!authd && ar_mechs & AR_MECH_TRAD_PLAIN && (sess->host->ar->check_password != NULL || sess->ar_ready))
     {
         elem = nad_find_elem(nad, 1, ns, "password", 1);
         if(elem >= 0)
         {
             snprintf(str, 1024, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
-            if((sess->host->ar->check_password)(sess->host->ar, sess, username, sess->host->realm, str) == 0)
+            if(sess->ar_ready ? sess->ar_passok : (sess->host->ar->check_password)(sess->host->ar, sess, username, sess->host->realm, str) == 0)
             {
                 log_debug(ZONE, "plaintext auth (check) succeded");
                 authd = 1;
@@ -431,6 +451,18 @@ static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
     return;
 }
 
+/** the authreg threads are done, run the auth set again with their answer */
+static void _authreg_auth_checked(c2s_t c2s, sess_t sess, void *arg) {
+    nad_t nad = (nad_t) arg;
+
+    if(sess == NULL || sess->s == NULL) {
+        nad_free(nad);
+        return;
+    }
+
+    _authreg_auth_set(c2s, sess, nad);
+}
+
 /** register get handler */
 static void _authreg_register_get(c2s_t c2s, sess_t sess, nad_t nad) {
     int attr, ns;
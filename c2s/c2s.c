@@ -22,7 +22,79 @@
 #include "c2s.h"
 #include <stringprep.h>
 
-static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
+/** put the session's timer on the earliest thing it needs to check */
+static void _c2s_sess_schedule(sess_t sess) {
+    c2s_t c2s = sess->c2s;
+    time_t now, next = 0, t;
+
+    if(c2s->io_check_interval == 0 || sess->s == NULL)
+        return;
+
+    now = time(NULL);
+
+    if(c2s->io_check_idle > 0)
+        next = sess->last_activity + c2s->io_check_idle + 1;
+
+    if(c2s->io_check_keepalive > 0) {
+        t = sess->last_activity + c2s->io_check_keepalive + 1;
+        if(t <= now)
+            t = now + c2s->io_check_keepalive;
+        if(next == 0 || t < next)
+            next = t;
+    }
+
+    if(sess->rate != NULL && sess->rate->bad != 0) {
+        t = sess->rate->bad + sess->rate->wait;
+        if(next == 0 || t < next)
+            next = t;
+    }
+
+    if(next == 0)
+        wheel_del(sess->w->timers, &sess->timer);
+    else
+        wheel_at(sess->w->timers, &sess->timer, (long long) next * 1000);
+}
+
+static void _c2s_sess_timer(wheel_t w, wheel_timer_t timer, void *arg) {
+    sess_t sess = (sess_t) arg;
+    c2s_t c2s = sess->c2s;
+    time_t now;
+
+    if(sess->s == NULL)
+        return;
+
+    now = time(NULL);
+
+    if(c2s->io_check_idle > 0 && now > sess->last_activity + c2s->io_check_idle) {
+        c2s_lock(c2s);
+        log_write(c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] timed out", sess->fd->fd, sess->ip, sess->port);
+        c2s_unlock(c2s);
+
+        sx_error(sess->s, stream_err_HOST_GONE, "connection timed out");
+        sx_close(sess->s);
+
+        return;
+    }
+
+    if(c2s->io_check_keepalive > 0 && now > sess->last_activity + c2s->io_check_keepalive && sess->s->state >= state_STREAM) {
+        log_debug(ZONE, "sending keepalive for %d", sess->fd->fd);
+
+        sx_raw_write(sess->s, " ", 1);
+    }
+
+    if(sess->rate != NULL && sess->rate->bad != 0 && rate_check(sess->rate) != 0) {
+        /* read the pending bytes when rate limit is no longer in effect */
+        log_debug(ZONE, "reading throttled %d", sess->fd->fd);
+        sess->s->want_read = 1;
+        sx_can_read(sess->s);
+    }
+
+    /* reading may have closed them */
+    if(sess->s != NULL && sess->s->state < state_CLOSING)
+        _c2s_sess_schedule(sess);
+}
+
+static int _c2s_client_sx_handle(sx_t s, sx_event_t e, void *data, void *arg) {
     sess_t sess = (sess_t) arg;
     sx_buf_t buf = (sx_buf_t) data;
     int rlen, len, ns, elem, attr;
@@ -35,12 +107,12 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
     switch(e) {
         case event_WANT_READ:
             log_debug(ZONE, "want read");
-            mio_read(sess->c2s->mio, sess->fd);
+            mio_read(sess->w->mio, sess->fd);
             break;
 
         case event_WANT_WRITE:
             log_debug(ZONE, "want write");
-            mio_write(sess->c2s->mio, sess->fd);
+            mio_write(sess->w->mio, sess->fd);
             break;
 
         case event_READ:
@@ -52,14 +124,19 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
 
                     /* inform the app if we haven't already */
                     if(!sess->rate_log) {
+                        c2s_lock(sess->c2s);
                         if(s->state >= state_STREAM && sess->resources != NULL)
                             log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s] is being byte rate limited", sess->fd->fd, jid_user(sess->resources->jid));
                         else
                             log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] is being byte rate limited", sess->fd->fd, sess->ip, sess->port);
+                        c2s_unlock(sess->c2s);
 
                         sess->rate_log = 1;
                     }
 
+                    /* come back when they're allowed to read again */
+                    _c2s_sess_schedule(sess);
+
                     return -1;
                 }
 
@@ -86,10 +163,12 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
                     return 0;
                 }
 
+                c2s_lock(sess->c2s);
                 if(s->state >= state_STREAM && sess->resources != NULL)
                     log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s] read error: %s (%d)", sess->fd->fd, jid_user(sess->resources->jid), MIO_STRERROR(MIO_ERROR), MIO_ERROR);
                 else
                     log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] read error: %s (%d)", sess->fd->fd, sess->ip, sess->port, MIO_STRERROR(MIO_ERROR), MIO_ERROR);
+                c2s_unlock(sess->c2s);
 
                 sx_kill(s);
 
@@ -121,10 +200,12 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             if(MIO_WOULDBLOCK)
                 return 0;
 
+            c2s_lock(sess->c2s);
             if(s->state >= state_OPEN && sess->resources != NULL)
                 log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s] write error: %s (%d)", sess->fd->fd, jid_user(sess->resources->jid), MIO_STRERROR(MIO_ERROR), MIO_ERROR);
             else
                 log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s. port=%d] write error: %s (%d)", sess->fd->fd, sess->ip, sess->port, MIO_STRERROR(MIO_ERROR), MIO_ERROR);
+            c2s_unlock(sess->c2s);
 
             sx_kill(s);
 
@@ -232,6 +313,10 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
                 return 0;
             }
 
+            /* stream management counts everything from here */
+            if(sess->ack_enabled)
+                sess->ack_in++;
+
             /* resource bind */
             if((ns = nad_find_scoped_namespace(nad, uri_BIND, NULL)) >= 0 && (elem = nad_find_elem(nad, 0, ns, "bind", 1)) >= 0 && nad_find_attr(nad, 0, -1, "type", "set") >= 0) {
                 bres_t bres;
@@ -467,7 +552,7 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             break;
 
         case event_CLOSED:
-            mio_close(sess->c2s->mio, sess->fd);
+            mio_close(sess->w->mio, sess->fd);
             sess->fd = NULL;
             return -1;
     }
@@ -475,6 +560,21 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
     return 0;
 }
 
+static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
+    sess_t sess = (sess_t) arg;
+    int ret;
+
+    /* moving bytes is the connection's own business, everything else can touch what the other workers see */
+    if(e == event_WANT_READ || e == event_WANT_WRITE || e == event_READ || e == event_WRITE || e == event_CLOSED)
+        return _c2s_client_sx_handle(s, e, data, arg);
+
+    c2s_lock(sess->c2s);
+    ret = _c2s_client_sx_handle(s, e, data, arg);
+    c2s_unlock(sess->c2s);
+
+    return ret;
+}
+
 static int _c2s_client_accept_check(c2s_t c2s, mio_fd_t fd, const char *ip) {
     rate_t rt;
 
@@ -502,13 +602,16 @@ static int _c2s_client_accept_check(c2s_t c2s, mio_fd_t fd, const char *ip) {
     return 0;
 }
 
-static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg);
+
+static int _c2s_client_mio_handle(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
     sess_t sess = (sess_t) arg;
-    c2s_t c2s = (c2s_t) arg;
+    worker_t w = (worker_t) arg;
+    c2s_t c2s;
     bres_t bres;
     struct sockaddr_storage sa;
     socklen_t namelen = sizeof(sa);
-    int port, nbytes, flags = 0;
+    int port, nbytes, tag, detached, flags = 0;
 
     switch(a) {
         case action_READ:
@@ -535,8 +638,13 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
 
             log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect jid=%s, packets: %i, bytes: %d", sess->fd->fd, sess->ip, sess->port, ((sess->resources)?((char*) jid_full(sess->resources->jid)):"unbound"), sess->packet_count, sess->s->tbytes);
 
+            wheel_del(sess->w->timers, &sess->timer);
+
+            /* hang on to the session if they can come back for it */
+            detached = resume_detach(sess);
+
             /* tell the sm to close their session */
-            if(sess->active)
+            if(sess->active && !detached)
                 for(bres = sess->resources; bres != NULL; bres = bres->next)
                     sm_end(sess, bres);
 
@@ -551,17 +659,25 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
                 sess->authreg_private = NULL;
             }
 
-            jqueue_push(sess->c2s->dead, (void *) sess->s, 0);
+            jqueue_push(sess->w->dead, (void *) sess->s, 0);
+
+            if(detached) {
+                sess->s = NULL;
+                sess->fd = NULL;
+                break;
+            }
 
             xhash_zap(sess->c2s->sessions, sess->skey);
 
-            jqueue_push(sess->c2s->dead_sess, (void *) sess, 0);
+            c2s_sess_dead(sess);
 
             break;
 
         case action_ACCEPT:
             log_debug(ZONE, "accept action on fd %d", fd->fd);
 
+            c2s = w->c2s;
+
             if(getpeername(fd->fd, (struct sockaddr *) &sa, &namelen) < 0)
                 return 1;
             port = j_inet_getport(&sa);
@@ -574,6 +690,7 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
             sess = (sess_t) calloc(1, sizeof(struct sess_st));
 
             sess->c2s = c2s;
+            sess->w = w;
 
             sess->fd = fd;
 
@@ -583,7 +700,14 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
             /* they did something */
             sess->last_activity = time(NULL);
 
-            sess->s = sx_new(c2s->sx_env, fd->fd, _c2s_client_sx_callback, (void *) sess);
+            /* a session waiting to be resumed may still be using this id */
+            for(tag = fd->fd; ; tag += c2s->io_max_fds) {
+                sprintf(sess->skey, "%d", tag);
+                if(xhash_get(c2s->sessions, sess->skey) == NULL)
+                    break;
+            }
+
+            sess->s = sx_new(c2s->sx_env, tag, _c2s_client_sx_callback, (void *) sess);
             mio_app(m, fd, _c2s_client_mio_callback, (void *) sess);
 
             if(c2s->stanza_size_limit != 0)
@@ -595,6 +719,9 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
             if(c2s->stanza_rate_total != 0)
                 sess->stanza_rate = rate_new(c2s->stanza_rate_total, c2s->stanza_rate_seconds, c2s->stanza_rate_wait);
 
+            wheel_timer_init(&sess->timer, _c2s_sess_timer, (void *) sess);
+            _c2s_sess_schedule(sess);
+
             /* give IP to SX */
             sess->s->ip = sess->ip;
             sess->s->port = sess->port;
@@ -605,7 +732,6 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
             port = j_inet_getport(&sa);
 
             /* remember it */
-            sprintf(sess->skey, "%d", fd->fd);
             xhash_put(c2s->sessions, sess->skey, (void *) sess);
 
             flags = SX_SASL_OFFER;
@@ -626,6 +752,64 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
     return 0;
 }
 
+static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    c2s_t c2s = (a == action_ACCEPT) ? ((worker_t) arg)->c2s : ((sess_t) arg)->c2s;
+    int ret;
+
+    /* reads and writes are the connection's own business */
+    if(a == action_READ || a == action_WRITE)
+        return _c2s_client_mio_handle(m, a, fd, data, arg);
+
+    c2s_lock(c2s);
+    ret = _c2s_client_mio_handle(m, a, fd, data, arg);
+    c2s_unlock(c2s);
+
+    return ret;
+}
+
+/** set up the listening sockets on each worker, returns 0 if there's nothing to listen on */
+static int _c2s_listen(c2s_t c2s) {
+    worker_t w;
+    int i, listening = 0;
+
+    for(i = 0; i < c2s->nworkers; i++) {
+        w = &c2s->workers[i];
+
+        if(c2s->local_port != 0) {
+            if(c2s->nworkers > 1)
+                w->server_fd = mio_listen_shared(w->mio, c2s->local_port, c2s->local_ip, _c2s_client_mio_callback, (void *) w);
+            else
+                w->server_fd = mio_listen(w->mio, c2s->local_port, c2s->local_ip, _c2s_client_mio_callback, (void *) w);
+            if(w->server_fd == NULL)
+                log_write(c2s->log, LOG_ERR, "[%s, port=%d] worker %d failed to listen", c2s->local_ip, c2s->local_port, i);
+            else
+                listening = 1;
+        }
+
+#ifdef HAVE_SSL
+        if(c2s->local_ssl_port != 0 && c2s->local_pemfile != NULL) {
+            if(c2s->nworkers > 1)
+                w->server_ssl_fd = mio_listen_shared(w->mio, c2s->local_ssl_port, c2s->local_ip, _c2s_client_mio_callback, (void *) w);
+            else
+                w->server_ssl_fd = mio_listen(w->mio, c2s->local_ssl_port, c2s->local_ip, _c2s_client_mio_callback, (void *) w);
+            if(w->server_ssl_fd == NULL)
+                log_write(c2s->log, LOG_ERR, "[%s, port=%d] worker %d failed to listen", c2s->local_ip, c2s->local_ssl_port, i);
+            else
+                listening = 1;
+        }
+#endif
+    }
+
+    if(c2s->workers[0].server_fd != NULL)
+        log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for connections", c2s->local_ip, c2s->local_port);
+#ifdef HAVE_SSL
+    if(c2s->workers[0].server_ssl_fd != NULL)
+        log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for SSL connections", c2s->local_ip, c2s->local_ssl_port);
+#endif
+
+    return listening;
+}
+
 static void _c2s_component_presence(c2s_t c2s, nad_t nad) {
     int attr;
     char from[1024];
@@ -670,7 +854,7 @@ static void _c2s_component_presence(c2s_t c2s, nad_t nad) {
                     log_debug(ZONE, "killing session %s", jid_user(sess->resources->jid));
 
                     sess->active = 0;
-                    if(sess->s) sx_close(sess->s);
+                    c2s_sess_close(c2s, sess);
                 }
             } while(xhash_iter_next(c2s->sessions));
 
@@ -678,6 +862,11 @@ static void _c2s_component_presence(c2s_t c2s, nad_t nad) {
     }
 }
 
+/** a session's packet, come round again on the worker that has their connection */
+static void _c2s_router_replay(c2s_t c2s, sess_t sess, void *arg) {
+    c2s_router_sx_callback(c2s->router, event_PACKET, arg, (void *) c2s);
+}
+
 int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     c2s_t c2s = (c2s_t) arg;
     sx_buf_t buf = (sx_buf_t) data;
@@ -692,12 +881,12 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     switch(e) {
         case event_WANT_READ:
             log_debug(ZONE, "want read");
-            mio_read(c2s->mio, c2s->fd);
+            c2s_router_want(c2s, 0);
             break;
 
         case event_WANT_WRITE:
             log_debug(ZONE, "want write");
-            mio_write(c2s->mio, c2s->fd);
+            c2s_router_want(c2s, 1);
             break;
 
         case event_READ:
@@ -841,40 +1030,17 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 log_debug(ZONE, "coming online");
 
                 /* if we're coming online for the first time, setup listening sockets */
+                if(!c2s->started) {
+                    if(!_c2s_listen(c2s) && c2s->pbx_pipe == NULL) {
 #ifdef HAVE_SSL
-                if(c2s->server_fd == 0 && c2s->server_ssl_fd == 0) {
+                        log_write(c2s->log, LOG_ERR, "both normal and SSL ports are disabled, nothing to do!");
 #else
-                if(c2s->server_fd == 0) {
+                        log_write(c2s->log, LOG_ERR, "server port is disabled, nothing to do!");
 #endif
-                    if(c2s->local_port != 0) {
-                        c2s->server_fd = mio_listen(c2s->mio, c2s->local_port, c2s->local_ip, _c2s_client_mio_callback, (void *) c2s);
-                        if(c2s->server_fd == NULL)
-                            log_write(c2s->log, LOG_ERR, "[%s, port=%d] failed to listen", c2s->local_ip, c2s->local_port);
-                        else
-                            log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for connections", c2s->local_ip, c2s->local_port);
-                    } else
-                        c2s->server_fd = NULL;
+                        exit(1);
+                    }
 
-#ifdef HAVE_SSL
-                    if(c2s->local_ssl_port != 0 && c2s->local_pemfile != NULL) {
-                        c2s->server_ssl_fd = mio_listen(c2s->mio, c2s->local_ssl_port, c2s->local_ip, _c2s_client_mio_callback, (void *) c2s);
-                        if(c2s->server_ssl_fd == NULL)
-                            log_write(c2s->log, LOG_ERR, "[%s, port=%d] failed to listen", c2s->local_ip, c2s->local_ssl_port);
-                        else
-                            log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for SSL connections", c2s->local_ip, c2s->local_ssl_port);
-                    } else
-                        c2s->server_ssl_fd = NULL;
-#endif
-                }
-
-#ifdef HAVE_SSL
-                if(c2s->server_fd == NULL && c2s->server_ssl_fd == NULL && c2s->pbx_pipe == NULL) {
-                    log_write(c2s->log, LOG_ERR, "both normal and SSL ports are disabled, nothing to do!");
-#else
-                if(c2s->server_fd == NULL && c2s->pbx_pipe == NULL) {
-                    log_write(c2s->log, LOG_ERR, "server port is disabled, nothing to do!");
-#endif
-                    exit(1);
+                    c2s_workers_start(c2s);
                 }
 
                 /* open PBX integration FIFO */
@@ -996,6 +1162,12 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 return 0;
             }
 
+            /* the rest is for the worker that has their connection */
+            if(!c2s_sess_local(sess)) {
+                c2s_sess_call(c2s, sess, _c2s_router_replay, (void *) nad);
+                return 0;
+            }
+
             /* if they're pre-stream, then this is leftovers from a previous session */
             if(sess->s && sess->s->state < state_STREAM) {
                 log_debug(ZONE, "session %s is pre-stream", skey);
@@ -1136,6 +1308,9 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
                             sx_close(sess->s);
 
+                        } else if(sess->detached) {
+                            /* gone while they were away, nothing to come back to */
+                            resume_drop(sess);
                         } else {
                             // handle fake PBX sessions
                             if(sess->result != NULL) {
@@ -1159,13 +1334,13 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                         ires->next = bres->next;
                     }
 
-                    log_write(sess->c2s->log, LOG_NOTICE, "[%d] unbound: jid=%s", sess->s->tag, jid_full(bres->jid));
+                    log_write(sess->c2s->log, LOG_NOTICE, "[%s] unbound: jid=%s", sess->skey, jid_full(bres->jid));
 
                     jid_free(bres->jid);
                     free(bres);
 
                     /* and return the unbind result to the client */
-                    if(sess->result != NULL) {
+                    if(sess->result != NULL && sess->s != NULL) {
                         sx_nad_write(sess->s, sess->result);
                         sess->result = NULL;
                     }
@@ -1283,7 +1458,7 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
             /* client packets */
             if(NAD_NURI_L(nad, NAD_ENS(nad, 1)) == strlen(uri_CLIENT) && strncmp(uri_CLIENT, NAD_NURI(nad, NAD_ENS(nad, 1)), strlen(uri_CLIENT)) == 0) {
-                if(!sess->active || !sess->s) {
+                if(!sess->active || (!sess->s && !sess->detached)) {
                     /* its a strange world .. */
                     log_debug(ZONE, "Got packet for %s - dropping", !sess->s ? "session without stream (PBX pipe session?)" : "inactive session");
                     nad_free(nad);
@@ -1320,7 +1495,7 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                         nad->nss[scan].next = nad->nss[ns].next;
                 }
 
-                sx_nad_write_elem(sess->s, nad, 1);
+                resume_write(sess, nad, 1);
 
                 return 0;
             }
@@ -1342,7 +1517,9 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
 int c2s_router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
     c2s_t c2s = (c2s_t) arg;
-    int nbytes;
+    int nbytes, ret = 0;
+
+    c2s_lock(c2s);
 
     switch(a) {
         case action_READ:
@@ -1351,14 +1528,16 @@ int c2s_router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, vo
             ioctl(fd->fd, FIONREAD, &nbytes);
             if(nbytes == 0) {
                 sx_kill(c2s->router);
-                return 0;
+                break;
             }
 
-            return sx_can_read(c2s->router);
+            ret = sx_can_read(c2s->router);
+            break;
 
         case action_WRITE:
             log_debug(ZONE, "write action on fd %d", fd->fd);
-            return sx_can_write(c2s->router);
+            ret = sx_can_write(c2s->router);
+            break;
 
         case action_CLOSE:
             log_debug(ZONE, "close action on fd %d", fd->fd);
@@ -1375,5 +1554,7 @@ int c2s_router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, vo
             break;
     }
 
-    return 0;
+    c2s_unlock(c2s);
+
+    return ret;
 }
@@ -34,6 +34,9 @@
 #ifdef HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #ifdef _WIN32
   #ifdef _USRDLL
@@ -54,6 +57,8 @@ typedef struct c2s_st       *c2s_t;
 typedef struct bres_st      *bres_t;
 typedef struct sess_st      *sess_t;
 typedef struct authreg_st   *authreg_t;
+typedef struct authpool_st  *authpool_t;
+typedef struct worker_st    *worker_t;
 
 /** list of resources bound to session */
 struct bres_st {
@@ -74,6 +79,9 @@ struct bres_st {
 struct sess_st {
     c2s_t               c2s;
 
+    /** the worker whose event loop has their connection, NULL if they never had one */
+    worker_t            w;
+
     mio_fd_t            fd;
 
     char                skey[44];
@@ -97,6 +105,9 @@ struct sess_st {
     time_t              last_activity;
     unsigned int        packet_count;
 
+    /** next idle, keepalive or throttle check */
+    struct wheel_timer_st timer;
+
     /* count of bound resources */
     int                 bound;
     /* list of bound jids */
@@ -114,6 +125,25 @@ struct sess_st {
 
     /* Per user session authreg private data */
     void                *authreg_private;
+
+    /** results of a lookup on the authreg threads */
+    int                 ar_pending;     /* 1 = waiting for them */
+    int                 ar_ready;       /* 1 = results are valid, while the request is replayed */
+    int                 ar_exists;
+    int                 ar_passok;
+
+    /** stream management (XEP-0198) */
+    int                 ack_enabled;
+    int                 ack_requested;  /* 1 = we've asked them for an ack */
+    unsigned int        ack_in;         /* stanzas handled from them */
+    unsigned int        ack_out;        /* stanzas sent to them */
+    unsigned int        ack_h;          /* how many of those they've acked */
+    jqueue_t            unacked;        /* copies of what they haven't acked, if resumable */
+    char                resume_id[41];  /* set if the session can be resumed */
+    time_t              detached;       /* when the connection went away, 0 if it's still here */
+
+    /** on its way out, calls handed to the worker for it are dropped */
+    int                 dead;
 };
 
 /* allowed mechanisms */
@@ -168,9 +198,25 @@ struct c2s_st {
     const char          *router_private_key_password;
     const char          *router_ciphers;
 
-    /** mio context */
+    /** mio context, for the router link and everything that isn't a client */
     mio_t               mio;
 
+    /** event loops, client connections are spread across these */
+    worker_t            workers;
+    int                 nworkers;
+
+#ifdef HAVE_PTHREAD
+    /** guards everything shared when there is more than one worker */
+    pthread_mutex_t     lock;
+    pthread_t           main_thread;
+#endif
+
+    /** the workers asking us to poke the router link, and how they wake us */
+    int                 router_want_read;
+    int                 router_want_write;
+    int                 wake[2];
+    mio_fd_t            wake_fd;
+
     /** sessions */
     xht                 sessions;
 
@@ -183,12 +229,6 @@ struct c2s_st {
     sx_t                router;
     mio_fd_t            fd;
 
-    /** listening sockets */
-    mio_fd_t            server_fd;
-#ifdef HAVE_SSL
-    mio_fd_t            server_ssl_fd;
-#endif
-
     /** config */
     config_t            config;
 
@@ -234,6 +274,11 @@ struct c2s_st {
     /** list of TLS ciphers */
     const char          *local_ciphers;
 
+    /** tls session cache size and timeout, and ticket key lifetime (seconds) */
+    int                 local_ssl_cache;
+    int                 local_ssl_cache_timeout;
+    int                 local_ssl_tickets;
+
     /** http forwarding URL */
     const char          *http_forward;
 
@@ -251,6 +296,12 @@ struct c2s_st {
     /** max file descriptors */
     int                 io_max_fds;
 
+    /** most ready file descriptors to take per event loop, 0 for the default */
+    int                 io_max_events;
+
+    /** most bytes to read from a connection per read event, 0 for the default */
+    int                 io_read_budget;
+
     /** enable Stream Compression */
     int                 compression;
 
@@ -268,6 +319,9 @@ struct c2s_st {
     /** loaded auth/reg modules */
     xht                 ar_modules;
 
+    /** threads for auth/reg lookups */
+    authpool_t          authpool;
+
     /** allowed mechanisms */
     int                 ar_mechanisms;
     int                 ar_ssl_mechanisms;
@@ -295,10 +349,7 @@ struct c2s_st {
     /** access controls */
     access_t            access;
 
-    /** list of sx_t on the way out */
-    jqueue_t            dead;
-
-    /** list of sess on the way out */
+    /** list of sess on the way out that no worker has */
     jqueue_t            dead_sess;
 
     /** this is true if we've connected to the router at least once */
@@ -313,6 +364,62 @@ struct c2s_st {
 
     /** availability of sms that we are servicing */
     xht                 sm_avail;
+
+    /** stream management session resumption */
+    int                 resume_timeout;
+    int                 resume_queue;
+    time_t              resume_next_check;
+
+    /** resumable sessions by resume id, and the ones with no connection by key */
+    xht                 resumable;
+    xht                 detached;
+};
+
+/** something to do on the thread that has the session's connection */
+typedef void (*c2s_call_fn)(c2s_t c2s, sess_t sess, void *arg);
+
+/** an event loop and the client connections attached to it */
+struct worker_st {
+    c2s_t               c2s;
+    int                 index;
+
+    /** managed io for our clients */
+    mio_t               mio;
+
+    /** listening sockets */
+    mio_fd_t            server_fd;
+#ifdef HAVE_SSL
+    mio_fd_t            server_ssl_fd;
+#endif
+
+    /** per-session timers */
+    wheel_t             timers;
+
+    /** list of sx_t on the way out */
+    jqueue_t            dead;
+
+    /** list of sess on the way out */
+    jqueue_t            dead_sess;
+
+    /** calls handed over by other threads */
+    jqueue_t            inbox;
+    jqueue_t            batch;
+    int                 wake[2];
+    mio_fd_t            wake_fd;
+
+    /** answers for the SASL plugin, read after the callback returns */
+    char                sasl_buf[3072];
+
+    /** set when we should exit */
+    int                 stop;
+
+#ifdef HAVE_PTHREAD
+    pthread_t           thread;
+    int                 running;
+
+    /** guards inbox and stop */
+    pthread_mutex_t     inbox_lock;
+#endif
 };
 
 extern sig_atomic_t c2s_lost_router;
@@ -330,6 +437,47 @@ C2S_API int         bind_init(sx_env_t env, sx_plugin_t p, va_list args);
 
 C2S_API void        c2s_pbx_init(c2s_t c2s);
 
+/* workers */
+C2S_API void        c2s_lock(c2s_t c2s);
+C2S_API void        c2s_unlock(c2s_t c2s);
+/** set up the workers, worker 0 uses the main loop if there's only one */
+C2S_API void        c2s_workers_init(c2s_t c2s);
+/** start the threads, once the listeners are in */
+C2S_API void        c2s_workers_start(c2s_t c2s);
+/** stop the threads and free everything they had */
+C2S_API void        c2s_workers_stop(c2s_t c2s);
+C2S_API void        c2s_workers_free(c2s_t c2s);
+/** true if this thread can touch the session's connection */
+C2S_API int         c2s_sess_local(sess_t sess);
+/** run fn on the thread that has the session (now, if that's us), call with the lock held */
+C2S_API void        c2s_sess_call(c2s_t c2s, sess_t sess, c2s_call_fn fn, void *arg);
+/** close the session's stream, from any thread */
+C2S_API void        c2s_sess_close(c2s_t c2s, sess_t sess);
+/** put the session on the way out, call with the lock held */
+C2S_API void        c2s_sess_dead(sess_t sess);
+/** free a session that's on the way out */
+C2S_API void        c2s_sess_free(sess_t sess);
+/** free the sessions and streams a worker has finished with */
+C2S_API void        c2s_worker_cleanup(worker_t w);
+/** the main loop's handler for workers asking after the router link */
+C2S_API int         c2s_wake_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg);
+/** true on the thread that runs the router link */
+C2S_API int         c2s_is_main(c2s_t c2s);
+/** the router link wants reading or writing, from any thread */
+C2S_API void        c2s_router_want(c2s_t c2s, int write);
+
+/* XEP-0198 stream management */
+C2S_API int         resume_init(sx_env_t env, sx_plugin_t p, va_list args);
+/** send a stanza to the client, or queue it if they're away */
+C2S_API void        resume_write(sess_t sess, nad_t nad, int elem);
+/** returns 1 if the session is kept waiting for them to come back */
+C2S_API int         resume_detach(sess_t sess);
+/** end a detached session for good */
+C2S_API void        resume_drop(sess_t sess);
+/** end sessions nobody came back for (or all of them) */
+C2S_API void        resume_expire(c2s_t c2s, int all);
+C2S_API void        resume_free(sess_t sess);
+
 /* My IP Address plugin */
 JABBERD2_API int    address_init(sx_env_t env, sx_plugin_t p, va_list args);
 
@@ -374,6 +522,9 @@ struct authreg_st
     /** Apple extensions for challenge/response authentication methods */
     int         (*create_challenge)(authreg_t ar, sess_t sess, const char *username, const char *realm, char *challenge, int maxlen);
     int         (*check_response)(authreg_t ar, sess_t sess, const char *username, const char *realm, const char *challenge, const char *response);
+
+    /** set by modules that can't have more than one instance, their lookups are done inline */
+    int         single;
 };
 
 /** get a handle for a single module */
@@ -388,6 +539,20 @@ typedef int (*ar_module_init_fn)(authreg_t);
 /** the main authreg processor */
 C2S_API int         authreg_process(c2s_t c2s, sess_t sess, nad_t nad);
 
+/** called when a lookup on the authreg threads is done, sess is NULL if they've gone away */
+typedef void (*authpool_done_fn)(c2s_t c2s, sess_t sess, void *arg);
+
+/** start the authreg threads, NULL if they're not available */
+C2S_API authpool_t  authpool_new(c2s_t c2s, int nthreads);
+C2S_API void        authpool_free(authpool_t ap);
+/** check that the user exists (if exists is set) and the password (if there is one) on the threads.
+    returns 0 if it was queued, 1 if the caller has to do it itself */
+C2S_API int         authpool_check(authpool_t ap, sess_t sess, const char *username, const char *realm, const char *password, int exists, authpool_done_fn done, void *arg);
+/** log the threads' modules are using */
+C2S_API log_t       authpool_log(authpool_t ap);
+/** log queue depth and latency since the last call */
+C2S_API void        authpool_stats(authpool_t ap);
+
 /*
 int     authreg_user_exists(authreg_t ar, const char *username, const char *realm);
 int     authreg_get_password(authreg_t ar, const char *username, const char *realm, char password[257]);
@@ -154,6 +154,10 @@ static void _c2s_config_expand(c2s_t c2s)
 
     c2s->local_ciphers = config_get_one(c2s->config, "local.ciphers", 0);
 
+    c2s->local_ssl_cache = j_atoi(config_get_one(c2s->config, "local.ssl-cache", 0), 20480);
+    c2s->local_ssl_cache_timeout = j_atoi(config_get_one(c2s->config, "local.ssl-cache-timeout", 0), 0);
+    c2s->local_ssl_tickets = j_atoi(config_get_one(c2s->config, "local.ssl-tickets", 0), 0);
+
     c2s->local_ssl_port = j_atoi(config_get_one(c2s->config, "local.ssl-port", 0), 0);
 
     c2s->http_forward = config_get_one(c2s->config, "local.httpforward", 0);
@@ -161,6 +165,8 @@ static void _c2s_config_expand(c2s_t c2s)
     c2s->websocket = (config_get(c2s->config, "io.websocket") != NULL);
 
     c2s->io_max_fds = j_atoi(config_get_one(c2s->config, "io.max_fds", 0), 1024);
+    c2s->io_max_events = j_atoi(config_get_one(c2s->config, "io.max_events", 0), 0);
+    c2s->io_read_budget = j_atoi(config_get_one(c2s->config, "io.read_budget", 0), 0);
 
     c2s->compression = (config_get(c2s->config, "io.compression") != NULL);
 
@@ -168,6 +174,13 @@ static void _c2s_config_expand(c2s_t c2s)
     c2s->io_check_idle = j_atoi(config_get_one(c2s->config, "io.check.idle", 0), 0);
     c2s->io_check_keepalive = j_atoi(config_get_one(c2s->config, "io.check.keepalive", 0), 0);
 
+    elem = config_get(c2s->config, "io.resume");
+    if(elem != NULL)
+    {
+        c2s->resume_timeout = j_atoi(elem->values[0], 0);
+        c2s->resume_queue = j_atoi(j_attr((const char **) elem->attrs[0], "queue"), 500);
+    }
+
     c2s->pbx_pipe = config_get_one(c2s->config, "pbx.pipe", 0);
 
     elem = config_get(c2s->config, "stream_redirect.redirect");
@@ -417,11 +430,18 @@ static int _c2s_router_connect(c2s_t c2s) {
     return 0;
 }
 
-static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cbarg) {
+/** the authreg threads have checked a password, finish the sasl step */
+static void _c2s_sasl_checked(c2s_t c2s, sess_t sess, void *arg) {
+    if(sess != NULL && sess->s != NULL)
+        sx_sasl_resume(c2s->sx_sasl, sess->s);
+}
+
+static int _c2s_sx_sasl_handle(int cb, void *arg, void **res, sx_t s, void *cbarg) {
     c2s_t c2s = (c2s_t) cbarg;
     const char *my_realm, *mech;
     sx_sasl_creds_t creds;
-    static char buf[3072];
+    static char sbuf[3072];
+    char buf[3072], *out;
     char mechbuf[256];
     struct jid_st jid;
     jid_static_buf jid_buf;
@@ -443,6 +463,9 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
      */
     sess = xhash_get(c2s->sessions, skey);
 
+    /* what we hand back is read after we return, so each worker has its own */
+    out = (sess != NULL && sess->w != NULL) ? sess->w->sasl_buf : sbuf;
+
     switch(cb) {
         case sx_sasl_cb_GET_REALM:
 
@@ -463,10 +486,10 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
                     my_realm = s->req_to;
             }
 
-            strncpy(buf, my_realm, 256);
-            *res = (void *)buf;
+            strncpy(out, my_realm, 256);
+            *res = (void *)out;
 
-            log_debug(ZONE, "sx sasl callback: get realm: realm is '%s'", buf);
+            log_debug(ZONE, "sx sasl callback: get realm: realm is '%s'", out);
             return sx_sasl_ret_OK;
             break;
 
@@ -477,8 +500,8 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
             log_debug(ZONE, "sx sasl callback: get pass (authnid=%s, realm=%s)", creds->authnid, creds->realm);
 
             if(sess->host->ar->get_password && (sess->host->ar->get_password)(
-                        sess->host->ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm: "", buf) == 0) {
-                *res = buf;
+                        sess->host->ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm: "", out) == 0) {
+                *res = out;
                 return sx_sasl_ret_OK;
             }
 
@@ -490,6 +513,13 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
 
             log_debug(ZONE, "sx sasl callback: check pass (authnid=%s, realm=%s)", creds->authnid, creds->realm);
 
+            /* the step is being run again with the answer from the authreg threads */
+            if(sess->ar_ready)
+                return sess->ar_passok ? sx_sasl_ret_OK : sx_sasl_ret_FAIL;
+
+            if(authpool_check(c2s->authpool, sess, creds->authnid, (creds->realm != NULL) ? creds->realm : "", creds->pass, 0, _c2s_sasl_checked, NULL) == 0)
+                return sx_sasl_ret_PENDING;
+
             if(sess->host->ar->check_password != NULL) {
                 if ((sess->host->ar->check_password)(
                             sess->host->ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm : "", (char *)creds->pass) == 0)
@@ -548,9 +578,9 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
             /* make node a random string */
             jid_random_part(&jid, jid_NODE);
 
-            strcpy(buf, jid.node);
+            strcpy(out, jid.node);
 
-            *res = (void *)buf;
+            *res = (void *)out;
 
             return sx_sasl_ret_OK;
             break;
@@ -608,43 +638,16 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
 
     return sx_sasl_ret_FAIL;
 }
-static void _c2s_time_checks(c2s_t c2s) {
-    sess_t sess;
-    time_t now;
-    union xhashv xhv;
-
-    now = time(NULL);
-
-    if(xhash_iter_first(c2s->sessions))
-        do {
-            xhv.sess_val = &sess;
-            xhash_iter_get(c2s->sessions, NULL, NULL, xhv.val);
-
-            if(!sess->s) continue;
-
-            if(c2s->io_check_idle > 0 && now > sess->last_activity + c2s->io_check_idle) {
-                log_write(c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] timed out", sess->fd->fd, sess->ip, sess->port);
-
-                sx_error(sess->s, stream_err_HOST_GONE, "connection timed out");
-                sx_close(sess->s);
-
-                continue;
-            }
 
-            if(c2s->io_check_keepalive > 0 && now > sess->last_activity + c2s->io_check_keepalive && sess->s->state >= state_STREAM) {
-                log_debug(ZONE, "sending keepalive for %d", sess->fd->fd);
-
-                sx_raw_write(sess->s, " ", 1);
-            }
+static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cbarg) {
+    c2s_t c2s = (c2s_t) cbarg;
+    int ret;
 
-            if(sess->rate != NULL && sess->rate->bad != 0 && rate_check(sess->rate) != 0) {
-                /* read the pending bytes when rate limit is no longer in effect */
-                log_debug(ZONE, "reading throttled %d", sess->fd->fd);
-                sess->s->want_read = 1;
-                sx_can_read(sess->s);
-            }
+    c2s_lock(c2s);
+    ret = _c2s_sx_sasl_handle(cb, arg, res, s, cbarg);
+    c2s_unlock(c2s);
 
-        } while(xhash_iter_next(c2s->sessions));
+    return ret;
 }
 
 static void _c2s_ar_free(const char *module, int modulelen, void *val, void *arg) {
@@ -657,12 +660,17 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     c2s_t c2s;
     char *config_file;
     int optchar;
-    int mio_timeout;
+    int mio_timeout, timer_ms;
+    int ar_threads;
+    log_t ar_log;
     sess_t sess;
-    bres_t res;
     union xhashv xhv;
     time_t check_time = 0;
+    int i;
     const char *cli_id = 0;
+#ifdef HAVE_SSL
+    char stats[256];
+#endif
 
 #ifdef HAVE_UMASK
     umask((mode_t) 0027);
@@ -773,13 +781,15 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
 
     c2s->sessions = xhash_new(1023);
 
-    c2s->conn_rates = xhash_new(101);
+    c2s->resumable = xhash_new(1023);
+    c2s->detached = xhash_new(101);
 
-    c2s->dead = jqueue_new();
+    c2s->conn_rates = xhash_new(101);
 
     c2s->dead_sess = jqueue_new();
 
     c2s->sx_env = sx_env_new();
+    sx_env_read_budget(c2s->sx_env, c2s->io_read_budget);
 
 #ifdef HAVE_SSL
     /* get the ssl context up and running */
@@ -838,31 +848,60 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     /* get bind up */
     sx_env_plugin(c2s->sx_env, bind_init, c2s);
 
-    c2s->mio = mio_new(c2s->io_max_fds);
+    /* and stream management */
+    sx_env_plugin(c2s->sx_env, resume_init, c2s);
+
+    c2s->mio = mio_new_events(c2s->io_max_fds, c2s->io_max_events);
     if(c2s->mio == NULL) {
         log_write(c2s->log, LOG_ERR, "failed to create MIO, aborting");
         exit(1);
     }
 
+    /* client connections, spread over the workers once we're online */
+    c2s_workers_init(c2s);
+
     /* hosts mapping */
     c2s->hosts = xhash_new(1021);
     _c2s_hosts_expand(c2s);
+
+#ifdef HAVE_SSL
+    /* session resumption for reconnecting clients */
+    if(c2s->sx_ssl != NULL)
+        sx_ssl_session_cache(c2s->sx_ssl, c2s->local_ssl_cache, c2s->local_ssl_cache_timeout, c2s->local_ssl_tickets);
+#endif
     c2s->sm_avail = xhash_new(1021);
 
+    /* authreg lookups on their own threads */
+    ar_threads = j_atoi(config_get_one(c2s->config, "authreg.threads", 0), 0);
+    if(ar_threads > 0)
+        c2s->authpool = authpool_new(c2s, ar_threads);
+
     c2s->retry_left = c2s->retry_init;
     _c2s_router_connect(c2s);
 
-    mio_timeout = ((c2s->io_check_interval != 0 && c2s->io_check_interval < 5) ?
-        c2s->io_check_interval : 5);
-
     while(!c2s_shutdown) {
-        mio_run(c2s->mio, mio_timeout);
+        /* don't sleep past the next session timer, if we have the sessions */
+        mio_timeout = 5000;
+        if(c2s->nworkers == 1 && (timer_ms = wheel_next(c2s->workers[0].timers)) >= 0 && timer_ms < mio_timeout)
+            mio_timeout = timer_ms;
+
+        mio_run_ms(c2s->mio, mio_timeout);
+
+        /* idle, keepalive and throttle checks that are due */
+        if(c2s->nworkers == 1)
+            wheel_run(c2s->workers[0].timers);
+
+        /* the workers see everything from here on */
+        c2s_lock(c2s);
 
         if(c2s_logrotate) {
             set_debug_log_from_config(c2s->config);
 
             log_write(c2s->log, LOG_NOTICE, "reopening log ...");
-            log_free(c2s->log);
+
+            /* authreg threads may be writing to the log we started with, so they keep it */
+            if(c2s->authpool == NULL || c2s->log != authpool_log(c2s->authpool))
+                log_free(c2s->log);
             c2s->log = log_new(c2s->log_type, c2s->log_ident, c2s->log_facility);
             log_write(c2s->log, LOG_NOTICE, "log started");
 
@@ -919,7 +958,9 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
         if(c2s_lost_router) {
             if(c2s->retry_left < 0) {
                 log_write(c2s->log, LOG_NOTICE, "attempting reconnect");
+                c2s_unlock(c2s);
                 sleep(c2s->retry_sleep);
+                c2s_lock(c2s);
                 c2s_lost_router = 0;
                 if (c2s->router) sx_free(c2s->router);
                 _c2s_router_connect(c2s);
@@ -932,51 +973,48 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
             else {
                 log_write(c2s->log, LOG_NOTICE, "attempting reconnect (%d left)", c2s->retry_left);
                 c2s->retry_left--;
+                c2s_unlock(c2s);
                 sleep(c2s->retry_sleep);
+                c2s_lock(c2s);
                 c2s_lost_router = 0;
                 if (c2s->router) sx_free(c2s->router);
                 _c2s_router_connect(c2s);
             }
         }
 
-        /* cleanup dead sess (before sx_t as sess->result uses sx_t nad cache) */
-        while(jqueue_size(c2s->dead_sess) > 0) {
-            sess = (sess_t) jqueue_pull(c2s->dead_sess);
-
-            /* free sess data */
-            if(sess->ip != NULL) free((void*)sess->ip);
-            if(sess->smcomp != NULL) free((void*)sess->smcomp);
-            if(sess->result != NULL) nad_free(sess->result);
-            if(sess->resources != NULL)
-                for(res = sess->resources; res != NULL;) {
-                    bres_t tmp = res->next;
-                    jid_free(res->jid);
-                    free(res);
-                    res = tmp;
-                }
-            if(sess->rate != NULL) rate_free(sess->rate);
-            if(sess->stanza_rate != NULL) rate_free(sess->stanza_rate);
-
-            free(sess);
-        }
+        /* cleanup dead sess that no worker has (PBX sessions) */
+        while(jqueue_size(c2s->dead_sess) > 0)
+            c2s_sess_free((sess_t) jqueue_pull(c2s->dead_sess));
 
-        /* cleanup dead sx_ts */
-        while(jqueue_size(c2s->dead) > 0)
-            sx_free((sx_t) jqueue_pull(c2s->dead));
+        /* and the ones worker 0 has, if it's us */
+        if(c2s->nworkers == 1)
+            c2s_worker_cleanup(&c2s->workers[0]);
 
-        /* time checks */
+        /* periodic stats */
         if(c2s->io_check_interval > 0 && time(NULL) >= c2s->next_check) {
-            log_debug(ZONE, "running time checks");
+            if(c2s->authpool != NULL)
+                authpool_stats(c2s->authpool);
 
-            _c2s_time_checks(c2s);
+#ifdef HAVE_SSL
+            if(c2s->sx_ssl != NULL && sx_ssl_stats_report(c2s->sx_ssl, stats, sizeof(stats)))
+                log_write(c2s->log, LOG_NOTICE, "%s", stats);
+#endif
 
             c2s->next_check = time(NULL) + c2s->io_check_interval;
             log_debug(ZONE, "next time check at %d", c2s->next_check);
         }
 
+        /* end sessions that weren't resumed in time */
+        if(c2s->resume_timeout > 0)
+            resume_expire(c2s, 0);
+
         if(time(NULL) > check_time + 60) {
 #ifdef POOL_DEBUG
             pool_stat(1);
+#endif
+#ifdef HAVE_SSL
+            if(c2s->sx_ssl != NULL)
+                sx_ssl_ticket_rotate(c2s->sx_ssl, time(NULL));
 #endif
             if(c2s->packet_stats != NULL) {
                 int fd = open(c2s->packet_stats, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP);
@@ -996,10 +1034,26 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
 
             check_time = time(NULL);
         }
+
+        c2s_unlock(c2s);
     }
 
     log_write(c2s->log, LOG_NOTICE, "shutting down");
 
+    /* everything is ours from here */
+    c2s_workers_stop(c2s);
+
+    /* finish up with the authreg threads, anything they haven't done is dropped */
+    ar_log = NULL;
+    if(c2s->authpool != NULL) {
+        ar_log = authpool_log(c2s->authpool);
+        authpool_free(c2s->authpool);
+        c2s->authpool = NULL;
+    }
+
+    /* nobody's coming back now */
+    resume_expire(c2s, 1);
+
     if(xhash_iter_first(c2s->sessions))
         do {
             xhv.sess_val = &sess;
@@ -1011,35 +1065,26 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
         } while(xhash_iter_next(c2s->sessions));
 
     /* cleanup dead sess */
-    while(jqueue_size(c2s->dead_sess) > 0) {
-        sess = (sess_t) jqueue_pull(c2s->dead_sess);
-
-        /* free sess data */
-        if(sess->ip != NULL) free((void*)sess->ip);
-        if(sess->result != NULL) nad_free(sess->result);
-        if(sess->resources != NULL)
-            for(res = sess->resources; res != NULL;) {
-                bres_t tmp = res->next;
-                jid_free(res->jid);
-                free(res);
-                res = tmp;
-            }
-
-        free(sess);
-    }
+    while(jqueue_size(c2s->dead_sess) > 0)
+        c2s_sess_free((sess_t) jqueue_pull(c2s->dead_sess));
 
-    while(jqueue_size(c2s->dead) > 0)
-        sx_free((sx_t) jqueue_pull(c2s->dead));
+    for(i = 0; i < c2s->nworkers; i++)
+        c2s_worker_cleanup(&c2s->workers[i]);
 
     if (c2s->fd != NULL) mio_close(c2s->mio, c2s->fd);
     sx_free(c2s->router);
 
+    c2s_workers_free(c2s);
+
     sx_env_free(c2s->sx_env);
 
     mio_free(c2s->mio);
 
     xhash_free(c2s->sessions);
 
+    xhash_free(c2s->resumable);
+    xhash_free(c2s->detached);
+
     xhash_walk(c2s->ar_modules, _c2s_ar_free, NULL);
     xhash_free(c2s->ar_modules);
 
@@ -1051,12 +1096,13 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
 
     xhash_free(c2s->hosts);
 
-    jqueue_free(c2s->dead);
-
     jqueue_free(c2s->dead_sess);
 
     access_free(c2s->access);
 
+    if(ar_log != NULL && ar_log != c2s->log)
+        log_free(ar_log);
+
     log_free(c2s->log);
 
     config_free(c2s->config);
@@ -53,7 +53,7 @@ static void _pbx_read_command(c2s_t c2s) {
 	_pbx_read_pipe(c2s);
 }
 
-static int _pbx_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+static int _pbx_mio_handle(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
 	c2s_t c2s = (c2s_t) arg;
 
     log_debug(ZONE, "action %s on PBX pipe", a==0?"action_ACCEPT":a==1?"action_READ":a==2?"action_WRITE":a==3?"action_CLOSE":"-unknown-");
@@ -81,6 +81,18 @@ static int _pbx_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, v
     return 0;
 }
 
+static int _pbx_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+	c2s_t c2s = (c2s_t) arg;
+	int ret;
+
+	/* commands start and end sessions, which the workers can see */
+	c2s_lock(c2s);
+	ret = _pbx_mio_handle(m, a, fd, data, arg);
+	c2s_unlock(c2s);
+
+	return ret;
+}
+
 static void _pbx_close_pipe(c2s_t c2s) {
 	log_debug(ZONE, "### close_pipe");
 	if(c2s->pbx_pipe_mio_fd)
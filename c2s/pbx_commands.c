@@ -154,6 +154,8 @@ int _pbx_process_command(c2s_t c2s, const char *cmd)
 							sess = (sess_t) calloc(1, sizeof(struct sess_st));
 							sess->c2s = c2s;
 							sess->last_activity = time(NULL);
+							/* no connection, so nothing to check */
+							wheel_timer_init(&sess->timer, NULL, NULL);
 							/* put into sessions hash */
 							snprintf(sess->skey, sizeof(sess->skey), "%s", hashbuf);
 							xhash_put(c2s->sessions, sess->skey, (void *) sess);
@@ -185,7 +187,7 @@ int _pbx_process_command(c2s_t c2s, const char *cmd)
 							/* end the session */
 							sm_end(sess, sess->resources);
 							xhash_zap(c2s->sessions, sess->skey);
-							jqueue_push(c2s->dead_sess, (void *) sess, 0);
+							c2s_sess_dead(sess);
 						}
 
 						break;
@@ -0,0 +1,456 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2003 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/** @file c2s/resume.c
+  * @brief XEP-0198 stream management and session resumption
+  *
+  * Once a client has enabled stream management we count the stanzas
+  * going each way, and if it asked for resumption we keep a copy of
+  * everything it hasn't acked yet. When the connection drops without a
+  * stream close the session stays in c2s (and in the sm) for a while,
+  * with anything the sm sends being queued. A new stream from the same
+  * user can then take it over, skipping the bind and session start,
+  * and gets the unacked stanzas sent again.
+  */
+
+#include "c2s.h"
+
+#define RESUME_ERR(cond) "<failed xmlns='" uri_STREAMMGMT "'><" cond " xmlns='" uri_STANZA_ERR "'/></failed>"
+
+/** find the session for this stream */
+static sess_t _resume_sess(c2s_t c2s, sx_t s, sx_plugin_t p) {
+    char skey[44];
+
+    /* set once they've enabled, sessions can be rekeyed by a resume */
+    if(s->plugin_data[p->index] != NULL)
+        return (sess_t) s->plugin_data[p->index];
+
+    snprintf(skey, sizeof(skey), "%d", s->tag);
+    return (sess_t) xhash_get(c2s->sessions, skey);
+}
+
+/** parse an h attribute */
+static unsigned int _resume_h(nad_t nad, int attr) {
+    char buf[16];
+
+    snprintf(buf, sizeof(buf), "%.*s", NAD_AVAL_L(nad, attr), NAD_AVAL(nad, attr));
+    return (unsigned int) strtoul(buf, NULL, 10);
+}
+
+static void _resume_write(sx_t s, const char *fmt, ...) {
+    char buf[128];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    sx_raw_write(s, buf, len);
+}
+
+/** keep a copy of a stanza until they ack it */
+static void _resume_queue(sess_t sess, nad_t nad, int elem) {
+    const char *out;
+    char *copy;
+    int len;
+
+    sess->ack_out++;
+
+    /* just counting */
+    if(sess->unacked == NULL)
+        return;
+
+    nad_print(nad, elem, &out, &len);
+
+    copy = (char *) malloc(len + 1);
+    memcpy(copy, out, len);
+    copy[len] = '\0';
+
+    jqueue_push(sess->unacked, copy, 0);
+}
+
+/** drop everything up to and including stanza h */
+static int _resume_acked(sess_t sess, unsigned int h) {
+    unsigned int n = h - sess->ack_h;
+
+    if(sess->unacked != NULL) {
+        if(n > (unsigned int) jqueue_size(sess->unacked))
+            return 1;
+
+        for(; n > 0; n--)
+            free(jqueue_pull(sess->unacked));
+    }
+
+    sess->ack_h = h;
+    sess->ack_requested = 0;
+
+    return 0;
+}
+
+/** stop this session being found by resume requests */
+static void _resume_forget(sess_t sess) {
+    if(sess->resume_id[0] != '\0') {
+        xhash_zap(sess->c2s->resumable, sess->resume_id);
+        sess->resume_id[0] = '\0';
+    }
+
+    if(sess->detached) {
+        xhash_zap(sess->c2s->detached, sess->skey);
+        sess->detached = 0;
+    }
+}
+
+void resume_drop(sess_t sess) {
+    bres_t bres;
+
+    if(sess->active)
+        for(bres = sess->resources; bres != NULL; bres = bres->next)
+            sm_end(sess, bres);
+
+    _resume_forget(sess);
+
+    xhash_zap(sess->c2s->sessions, sess->skey);
+
+    c2s_sess_dead(sess);
+}
+
+/** nad write chain, only there once they've enabled */
+static int _resume_wnad_locked(sx_t s, sx_plugin_t p, nad_t nad, int elem) {
+    sess_t sess = (sess_t) s->plugin_data[p->index];
+    c2s_t c2s = (c2s_t) p->private;
+
+    if(sess == NULL)
+        return 1;
+
+    /* only stanzas count */
+    if(!((NAD_ENAME_L(nad, elem) == 7 && strncmp("message", NAD_ENAME(nad, elem), 7) == 0) ||
+         (NAD_ENAME_L(nad, elem) == 8 && strncmp("presence", NAD_ENAME(nad, elem), 8) == 0) ||
+         (NAD_ENAME_L(nad, elem) == 2 && strncmp("iq", NAD_ENAME(nad, elem), 2) == 0)))
+        return 1;
+
+    _resume_queue(sess, nad, elem);
+
+    if(sess->unacked == NULL)
+        return 1;
+
+    /* too much unacked, stop being resumable rather than growing forever */
+    if(jqueue_size(sess->unacked) > c2s->resume_queue) {
+        log_write(c2s->log, LOG_NOTICE, "[%d] too many unacked stanzas, session can't be resumed", s->tag);
+
+        while(jqueue_size(sess->unacked) > 0)
+            free(jqueue_pull(sess->unacked));
+        jqueue_free(sess->unacked);
+        sess->unacked = NULL;
+
+        _resume_forget(sess);
+
+        return 1;
+    }
+
+    /* ask them how they're going before it gets that far */
+    if(!sess->ack_requested && jqueue_size(sess->unacked) >= c2s->resume_queue / 2) {
+        _resume_write(s, "<r xmlns='%s'/>", uri_STREAMMGMT);
+        sess->ack_requested = 1;
+    }
+
+    return 1;
+}
+
+static void _resume_enable(c2s_t c2s, sx_t s, sx_plugin_t p, sess_t sess, nad_t nad) {
+    char str[128];
+    int attr;
+
+    if(!sess->active || sess->ack_enabled) {
+        sx_raw_write(s, RESUME_ERR("unexpected-request"), strlen(RESUME_ERR("unexpected-request")));
+        return;
+    }
+
+    sess->ack_enabled = 1;
+    sess->ack_in = sess->ack_out = sess->ack_h = 0;
+
+    s->plugin_data[p->index] = (void *) sess;
+    _sx_chain_nad_plugin(s, p);
+
+    attr = nad_find_attr(nad, 0, -1, "resume", NULL);
+    if(c2s->resume_timeout == 0 || attr < 0 ||
+       !((NAD_AVAL_L(nad, attr) == 4 && strncmp("true", NAD_AVAL(nad, attr), 4) == 0) || (NAD_AVAL_L(nad, attr) == 1 && NAD_AVAL(nad, attr)[0] == '1'))) {
+        log_debug(ZONE, "stream management enabled for %s", sess->skey);
+
+        _resume_write(s, "<enabled xmlns='%s'/>", uri_STREAMMGMT);
+        return;
+    }
+
+    /* something they can't guess */
+    snprintf(str, sizeof(str), "%s%d%d%p", sess->skey, (int) time(NULL), rand(), (void *) sess);
+    shahash_r(str, sess->resume_id);
+
+    sess->unacked = jqueue_new();
+    xhash_put(c2s->resumable, sess->resume_id, (void *) sess);
+
+    log_debug(ZONE, "stream management enabled for %s, resume id %s", sess->skey, sess->resume_id);
+
+    _resume_write(s, "<enabled xmlns='%s' id='%s' resume='true' max='%d'/>", uri_STREAMMGMT, sess->resume_id, c2s->resume_timeout);
+}
+
+static void _resume_resume(c2s_t c2s, sx_t s, sx_plugin_t p, sess_t sess, nad_t nad) {
+    char previd[41];
+    sess_t old;
+    int attr, i;
+    unsigned int h;
+    char *copy;
+
+    /* has to be an authenticated stream that hasn't started a session */
+    if(s->state != state_OPEN || sess->active || sess->resources != NULL || sess->result != NULL) {
+        sx_raw_write(s, RESUME_ERR("unexpected-request"), strlen(RESUME_ERR("unexpected-request")));
+        return;
+    }
+
+    attr = nad_find_attr(nad, 0, -1, "previd", NULL);
+    if(attr < 0 || NAD_AVAL_L(nad, attr) >= sizeof(previd) || (i = nad_find_attr(nad, 0, -1, "h", NULL)) < 0) {
+        sx_raw_write(s, RESUME_ERR("bad-request"), strlen(RESUME_ERR("bad-request")));
+        return;
+    }
+
+    snprintf(previd, sizeof(previd), "%.*s", NAD_AVAL_L(nad, attr), NAD_AVAL(nad, attr));
+    h = _resume_h(nad, i);
+
+    old = (sess_t) xhash_get(c2s->resumable, previd);
+
+    /* only the same user gets to pick it up */
+    if(old == NULL || old == sess || !old->active || old->resources == NULL || strcmp(jid_user(old->resources->jid), s->auth_id) != 0) {
+        log_debug(ZONE, "no resumable session %s for %s", previd, s->auth_id);
+
+        sx_raw_write(s, RESUME_ERR("item-not-found"), strlen(RESUME_ERR("item-not-found")));
+        return;
+    }
+
+    if(_resume_acked(old, h) != 0) {
+        log_write(c2s->log, LOG_NOTICE, "[%d] resume of %s acked stanzas that were never sent", s->tag, jid_user(old->resources->jid));
+
+        sx_raw_write(s, RESUME_ERR("undefined-condition"), strlen(RESUME_ERR("undefined-condition")));
+        return;
+    }
+
+    /* take it off the lists while it's still keyed under its own ids */
+    _resume_forget(old);
+    xhash_zap(c2s->sessions, old->skey);
+    xhash_zap(c2s->sessions, sess->skey);
+
+    /* the sm knows the session under the old id, so we take that */
+    strcpy(sess->skey, old->skey);
+    old->skey[0] = '\0';
+    xhash_put(c2s->sessions, sess->skey, (void *) sess);
+
+    /* and move the session over */
+    sess->resources = old->resources;
+    sess->bound = old->bound;
+    sess->smcomp = old->smcomp;
+    sess->active = 1;
+
+    old->resources = NULL;
+    old->bound = 0;
+    old->smcomp = NULL;
+    old->active = 0;
+
+    sess->ack_enabled = 1;
+    sess->ack_in = old->ack_in;
+    sess->ack_out = old->ack_out;
+    sess->ack_h = old->ack_h;
+    sess->unacked = old->unacked;
+    old->unacked = NULL;
+
+    strcpy(sess->resume_id, previd);
+    xhash_put(c2s->resumable, sess->resume_id, (void *) sess);
+
+    s->plugin_data[p->index] = (void *) sess;
+    _sx_chain_nad_plugin(s, p);
+
+    /* the old connection might not have noticed it's gone yet */
+    if(old->s != NULL)
+        c2s_sess_close(c2s, old);
+    else
+        c2s_sess_dead(old);
+
+    log_write(c2s->log, LOG_NOTICE, "[%d] resumed: jid=%s, %d unacked", s->tag, jid_full(sess->resources->jid), jqueue_size(sess->unacked));
+
+    _resume_write(s, "<resumed xmlns='%s' previd='%s' h='%u'/>", uri_STREAMMGMT, sess->resume_id, sess->ack_in);
+
+    /* send whatever they didn't get, keeping it until they ack it */
+    for(i = jqueue_size(sess->unacked); i > 0; i--) {
+        copy = (char *) jqueue_pull(sess->unacked);
+        sx_raw_write(s, copy, strlen(copy));
+        jqueue_push(sess->unacked, copy, 0);
+    }
+}
+
+static int _resume_wnad(sx_t s, sx_plugin_t p, nad_t nad, int elem) {
+    c2s_t c2s = (c2s_t) p->private;
+    int ret;
+
+    c2s_lock(c2s);
+    ret = _resume_wnad_locked(s, p, nad, elem);
+    c2s_unlock(c2s);
+
+    return ret;
+}
+
+/** sx features callback */
+static void _resume_features(sx_t s, sx_plugin_t p, nad_t nad) {
+    int ns;
+
+    /* once they're authenticated, for enable or resume */
+    if(s->auth_id != NULL && s->plugin_data[p->index] == NULL) {
+        ns = nad_add_namespace(nad, uri_STREAMMGMT, NULL);
+        nad_append_elem(nad, ns, "sm", 1);
+    }
+}
+
+/** process stream management packets from the client */
+static int _resume_process_locked(sx_t s, sx_plugin_t p, nad_t nad) {
+    c2s_t c2s = (c2s_t) p->private;
+    sess_t sess;
+    int attr;
+
+    /* only want stream management packets from clients */
+    if(s->type != type_SERVER || NAD_ENS(nad, 0) < 0 || NAD_NURI_L(nad, NAD_ENS(nad, 0)) != strlen(uri_STREAMMGMT) || strncmp(NAD_NURI(nad, NAD_ENS(nad, 0)), uri_STREAMMGMT, strlen(uri_STREAMMGMT)) != 0)
+        return 1;
+
+    sess = _resume_sess(c2s, s, p);
+    if(sess == NULL || s->auth_id == NULL) {
+        nad_free(nad);
+        return 0;
+    }
+
+    if(NAD_ENAME_L(nad, 0) == 6 && strncmp("enable", NAD_ENAME(nad, 0), 6) == 0)
+        _resume_enable(c2s, s, p, sess, nad);
+
+    else if(NAD_ENAME_L(nad, 0) == 6 && strncmp("resume", NAD_ENAME(nad, 0), 6) == 0)
+        _resume_resume(c2s, s, p, sess, nad);
+
+    else if(sess->ack_enabled && NAD_ENAME_L(nad, 0) == 1 && NAD_ENAME(nad, 0)[0] == 'r')
+        _resume_write(s, "<a xmlns='%s' h='%u'/>", uri_STREAMMGMT, sess->ack_in);
+
+    else if(sess->ack_enabled && NAD_ENAME_L(nad, 0) == 1 && NAD_ENAME(nad, 0)[0] == 'a') {
+        attr = nad_find_attr(nad, 0, -1, "h", NULL);
+        if(attr >= 0 && _resume_acked(sess, _resume_h(nad, attr)) != 0)
+            log_debug(ZONE, "%s acked stanzas that were never sent", sess->skey);
+    }
+
+    else
+        log_debug(ZONE, "unhandled stream management element '%.*s', dropping packet", NAD_ENAME_L(nad, 0), NAD_ENAME(nad, 0));
+
+    nad_free(nad);
+    return 0;
+}
+
+static int _resume_process(sx_t s, sx_plugin_t p, nad_t nad) {
+    c2s_t c2s = (c2s_t) p->private;
+    int ret;
+
+    /* other workers' sessions can be resumed here */
+    c2s_lock(c2s);
+    ret = _resume_process_locked(s, p, nad);
+    c2s_unlock(c2s);
+
+    return ret;
+}
+
+void resume_write(sess_t sess, nad_t nad, int elem) {
+    if(sess->s != NULL) {
+        sx_nad_write_elem(sess->s, nad, elem);
+        return;
+    }
+
+    /* detached, hold on to it for when they come back */
+    _resume_queue(sess, nad, elem);
+    nad_free(nad);
+
+    if(sess->unacked != NULL && jqueue_size(sess->unacked) > sess->c2s->resume_queue) {
+        log_write(sess->c2s->log, LOG_NOTICE, "[%s] too many stanzas waiting for jid=%s, ending session", sess->skey, jid_full(sess->resources->jid));
+        resume_drop(sess);
+    }
+}
+
+int resume_detach(sess_t sess) {
+    /* they closed the stream themselves, so they're done with it */
+    if(sess->resume_id[0] == '\0' || !sess->active || sess->s == NULL || sess->s->depth < 0)
+        return 0;
+
+    sess->detached = time(NULL);
+    xhash_put(sess->c2s->detached, sess->skey, (void *) sess);
+
+    log_write(sess->c2s->log, LOG_NOTICE, "[%s] detached: jid=%s, resumable for %d seconds", sess->skey, jid_full(sess->resources->jid), sess->c2s->resume_timeout);
+
+    return 1;
+}
+
+void resume_expire(c2s_t c2s, int all) {
+    sess_t sess;
+    time_t now = time(NULL);
+    union xhashv xhv;
+
+    if(!all && now < c2s->resume_next_check)
+        return;
+    c2s->resume_next_check = now + 1;
+
+    if(xhash_iter_first(c2s->detached))
+        do {
+            xhv.sess_val = &sess;
+            xhash_iter_get(c2s->detached, NULL, NULL, xhv.val);
+
+            if(all || now >= sess->detached + c2s->resume_timeout) {
+                log_write(c2s->log, LOG_NOTICE, "[%s] not resumed: jid=%s", sess->skey, jid_full(sess->resources->jid));
+
+                /* off the list here, so the iterator stays sane */
+                xhash_iter_zap(c2s->detached);
+                sess->detached = 0;
+
+                resume_drop(sess);
+            }
+        } while(xhash_iter_next(c2s->detached));
+}
+
+void resume_free(sess_t sess) {
+    if(sess->unacked == NULL)
+        return;
+
+    while(jqueue_size(sess->unacked) > 0)
+        free(jqueue_pull(sess->unacked));
+    jqueue_free(sess->unacked);
+    sess->unacked = NULL;
+}
+
+/** plugin initialiser */
+/** args: c2s */
+int resume_init(sx_env_t env, sx_plugin_t p, va_list args) {
+    c2s_t c2s;
+
+    log_debug(ZONE, "initialising stream management sx plugin");
+
+    c2s = va_arg(args, c2s_t);
+
+    p->features = _resume_features;
+    p->process = _resume_process;
+    p->wnad = _resume_wnad;
+    p->private = (void *) c2s;
+
+    return 0;
+}
@@ -0,0 +1,486 @@
+/* vim: set et ts=4 sw=4: */
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/** @file c2s/worker.c
+  * @brief client connections spread over several event loops
+  *
+  * Each worker has its own mio, timer wheel and listening sockets, all
+  * bound to the same ports with SO_REUSEPORT so the kernel shares the
+  * connections out. A session's stream, fd and timer are only touched by
+  * the worker that accepted it; the session table, hosts, authreg and the
+  * router link are shared under c2s->lock. Anything another thread needs
+  * done to a session (a packet from the router, a finished auth lookup)
+  * is handed to its worker with c2s_sess_call().
+  *
+  * The main thread keeps the router link, the authreg notifications and
+  * the PBX pipe. With one worker it also runs the clients, and none of
+  * the locking is done.
+  */
+
+#include "c2s.h"
+
+/** a call handed to another worker */
+typedef struct handoff_st {
+    c2s_call_fn         fn;
+    sess_t              sess;
+    void                *arg;
+} *handoff_t;
+
+/** the shared tables only need guarding when there are other threads about */
+void c2s_lock(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    if(c2s->nworkers > 1)
+        pthread_mutex_lock(&c2s->lock);
+#endif
+}
+
+void c2s_unlock(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    if(c2s->nworkers > 1)
+        pthread_mutex_unlock(&c2s->lock);
+#endif
+}
+
+/** poke a thread out of mio_run() */
+static void _c2s_poke(int fd) {
+    char c = 0;
+
+    if(fd >= 0 && write(fd, &c, 1) < 0 && !MIO_WOULDBLOCK)
+        log_debug(ZONE, "couldn't wake thread: %s", strerror(errno));
+}
+
+int c2s_sess_local(sess_t sess) {
+#ifdef HAVE_PTHREAD
+    /* nobody else is running their worker's loop */
+    if(sess->w != NULL && sess->w->running)
+        return pthread_equal(pthread_self(), sess->w->thread);
+#endif
+    return 1;
+}
+
+int c2s_is_main(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    if(c2s->nworkers > 1)
+        return pthread_equal(pthread_self(), c2s->main_thread);
+#endif
+    return 1;
+}
+
+void c2s_sess_call(c2s_t c2s, sess_t sess, c2s_call_fn fn, void *arg) {
+#ifdef HAVE_PTHREAD
+    handoff_t h;
+    worker_t w;
+    int idle;
+
+    if(sess == NULL || c2s_sess_local(sess)) {
+        (fn)(c2s, sess, arg);
+        return;
+    }
+
+    w = sess->w;
+
+    h = (handoff_t) malloc(sizeof(struct handoff_st));
+    h->fn = fn;
+    h->sess = sess;
+    h->arg = arg;
+
+    pthread_mutex_lock(&w->inbox_lock);
+    idle = (jqueue_size(w->inbox) == 0);
+    jqueue_push(w->inbox, (void *) h, 0);
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    if(idle)
+        _c2s_poke(w->wake[1]);
+#else
+    (fn)(c2s, sess, arg);
+#endif
+}
+
+static void _c2s_sess_close_call(c2s_t c2s, sess_t sess, void *arg) {
+    if(sess != NULL && sess->s != NULL)
+        sx_close(sess->s);
+}
+
+void c2s_sess_close(c2s_t c2s, sess_t sess) {
+    c2s_sess_call(c2s, sess, _c2s_sess_close_call, NULL);
+}
+
+void c2s_sess_dead(sess_t sess) {
+    sess->dead = 1;
+
+    /* the worker that has their timer frees them */
+    jqueue_push((sess->w != NULL) ? sess->w->dead_sess : sess->c2s->dead_sess, (void *) sess, 0);
+}
+
+void c2s_sess_free(sess_t sess) {
+    bres_t res, tmp;
+
+    if(sess->ip != NULL) free((void *) sess->ip);
+    if(sess->smcomp != NULL) free((void *) sess->smcomp);
+    if(sess->result != NULL) nad_free(sess->result);
+    for(res = sess->resources; res != NULL; res = tmp) {
+        tmp = res->next;
+        jid_free(res->jid);
+        free(res);
+    }
+    if(sess->rate != NULL) rate_free(sess->rate);
+    if(sess->stanza_rate != NULL) rate_free(sess->stanza_rate);
+    resume_free(sess);
+    if(sess->w != NULL)
+        wheel_del(sess->w->timers, &sess->timer);
+
+    free(sess);
+}
+
+/** run what the other threads have left for us */
+static void _c2s_worker_calls(worker_t w) {
+#ifdef HAVE_PTHREAD
+    jqueue_t q;
+    handoff_t h;
+
+    /* take the whole batch, so the others aren't kept waiting */
+    pthread_mutex_lock(&w->inbox_lock);
+    q = w->inbox;
+    w->inbox = w->batch;
+    w->batch = q;
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    c2s_lock(w->c2s);
+
+    while((h = (handoff_t) jqueue_pull(q)) != NULL) {
+        /* they might have gone while this was waiting */
+        (h->fn)(w->c2s, (h->sess != NULL && !h->sess->dead) ? h->sess : NULL, h->arg);
+        free(h);
+    }
+
+    c2s_unlock(w->c2s);
+#endif
+}
+
+static int _c2s_worker_wake_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    char buf[64];
+
+    if(a != action_READ)
+        return 0;
+
+    while(read(fd->fd, buf, sizeof(buf)) > 0);
+
+    _c2s_worker_calls((worker_t) arg);
+
+    /* keep reading */
+    return 1;
+}
+
+/** calls still waiting for a session that's about to be freed get NULL instead */
+static void _c2s_worker_forget(worker_t w, sess_t sess) {
+#ifdef HAVE_PTHREAD
+    _jqueue_node_t n;
+
+    if(w->inbox == NULL)
+        return;
+
+    pthread_mutex_lock(&w->inbox_lock);
+    for(n = w->inbox->front; n != NULL; n = n->prev)
+        if(((handoff_t) n->data)->sess == sess)
+            ((handoff_t) n->data)->sess = NULL;
+    pthread_mutex_unlock(&w->inbox_lock);
+#endif
+}
+
+void c2s_worker_cleanup(worker_t w) {
+    sess_t sess;
+
+    c2s_lock(w->c2s);
+
+    /* cleanup dead sess (before sx_t as sess->result uses sx_t nad cache) */
+    while(jqueue_size(w->dead_sess) > 0) {
+        sess = (sess_t) jqueue_pull(w->dead_sess);
+        _c2s_worker_forget(w, sess);
+        c2s_sess_free(sess);
+    }
+
+    /* cleanup dead sx_ts */
+    while(jqueue_size(w->dead) > 0)
+        sx_free((sx_t) jqueue_pull(w->dead));
+
+    c2s_unlock(w->c2s);
+}
+
+void c2s_router_want(c2s_t c2s, int write) {
+    if(c2s_is_main(c2s)) {
+        if(write)
+            mio_write(c2s->mio, c2s->fd);
+        else
+            mio_read(c2s->mio, c2s->fd);
+        return;
+    }
+
+    /* the router link is on the main loop, have it do it (once) */
+    if(write ? c2s->router_want_write : c2s->router_want_read)
+        return;
+
+    if(write)
+        c2s->router_want_write = 1;
+    else
+        c2s->router_want_read = 1;
+
+    _c2s_poke(c2s->wake[1]);
+}
+
+int c2s_wake_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    c2s_t c2s = (c2s_t) arg;
+    char buf[64];
+
+    if(a != action_READ)
+        return 0;
+
+    while(read(fd->fd, buf, sizeof(buf)) > 0);
+
+    c2s_lock(c2s);
+
+    if(c2s->fd != NULL) {
+        if(c2s->router_want_read)
+            mio_read(c2s->mio, c2s->fd);
+        if(c2s->router_want_write)
+            mio_write(c2s->mio, c2s->fd);
+    }
+    c2s->router_want_read = c2s->router_want_write = 0;
+
+    c2s_unlock(c2s);
+
+    /* keep reading */
+    return 1;
+}
+
+#ifdef HAVE_PTHREAD
+/** a nonblocking pipe, registered for reading */
+static mio_fd_t _c2s_wake_pipe(c2s_t c2s, mio_t m, int wake[2], mio_handler_t app, void *arg) {
+    mio_fd_t fd;
+
+    if(pipe(wake) < 0) {
+        log_write(c2s->log, LOG_ERR, "couldn't create wakeup pipe: %s", strerror(errno));
+        exit(1);
+    }
+    fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, fcntl(wake[1], F_GETFL) | O_NONBLOCK);
+
+    fd = mio_register(m, wake[0], app, arg);
+    mio_read(m, fd);
+
+    return fd;
+}
+#endif
+
+static void _c2s_worker_init(c2s_t c2s, worker_t w, int index) {
+    w->c2s = c2s;
+    w->index = index;
+
+    w->timers = wheel_new(4096, 100);
+    w->dead = jqueue_new();
+    w->dead_sess = jqueue_new();
+
+    w->wake[0] = w->wake[1] = -1;
+
+    /* only one, it just uses the main loop */
+    if(c2s->nworkers == 1) {
+        w->mio = c2s->mio;
+        return;
+    }
+
+#ifdef HAVE_PTHREAD
+    w->mio = mio_new_events(c2s->io_max_fds, c2s->io_max_events);
+    if(w->mio == NULL) {
+        log_write(c2s->log, LOG_ERR, "worker %d: couldn't create mio, aborting", index);
+        exit(1);
+    }
+
+    w->inbox = jqueue_new();
+    w->batch = jqueue_new();
+    pthread_mutex_init(&w->inbox_lock, NULL);
+
+    w->wake_fd = _c2s_wake_pipe(c2s, w->mio, w->wake, _c2s_worker_wake_callback, (void *) w);
+#endif
+}
+
+void c2s_workers_init(c2s_t c2s) {
+    int i;
+
+    c2s->wake[0] = c2s->wake[1] = -1;
+
+    c2s->nworkers = j_atoi(config_get_one(c2s->config, "io.threads", 0), 1);
+    if(c2s->nworkers < 1)
+        c2s->nworkers = 1;
+
+#if !defined(HAVE_PTHREAD) || !defined(SO_REUSEPORT)
+    if(c2s->nworkers > 1) {
+        log_write(c2s->log, LOG_WARNING, "threads or SO_REUSEPORT not available, running %d workers in one", c2s->nworkers);
+        c2s->nworkers = 1;
+    }
+#else
+    if(c2s->nworkers > 1) {
+        pthread_mutexattr_t attr;
+
+        /* sx callbacks can come round again while we have it */
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&c2s->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        c2s->main_thread = pthread_self();
+
+        c2s->wake_fd = _c2s_wake_pipe(c2s, c2s->mio, c2s->wake, c2s_wake_callback, (void *) c2s);
+    }
+#endif
+
+    c2s->workers = (worker_t) calloc(c2s->nworkers, sizeof(struct worker_st));
+    for(i = 0; i < c2s->nworkers; i++)
+        _c2s_worker_init(c2s, &c2s->workers[i], i);
+}
+
+#ifdef HAVE_PTHREAD
+static void *_c2s_worker_run(void *arg) {
+    worker_t w = (worker_t) arg;
+    int stop = 0, timeout, timer_ms;
+
+    log_debug(ZONE, "worker %d running", w->index);
+
+    while(!stop) {
+        /* don't sleep past the next session timer */
+        timeout = 5000;
+        if((timer_ms = wheel_next(w->timers)) >= 0 && timer_ms < timeout)
+            timeout = timer_ms;
+
+        mio_run_ms(w->mio, timeout);
+
+        /* idle, keepalive and throttle checks that are due */
+        wheel_run(w->timers);
+
+        c2s_worker_cleanup(w);
+
+        pthread_mutex_lock(&w->inbox_lock);
+        stop = w->stop;
+        pthread_mutex_unlock(&w->inbox_lock);
+    }
+
+    log_debug(ZONE, "worker %d done", w->index);
+
+    return NULL;
+}
+#endif
+
+void c2s_workers_start(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    sigset_t set, old;
+    int i;
+
+    if(c2s->nworkers == 1)
+        return;
+
+    /* signals are for the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for(i = 0; i < c2s->nworkers; i++) {
+        c2s->workers[i].running = 1;
+        if(pthread_create(&c2s->workers[i].thread, NULL, _c2s_worker_run, (void *) &c2s->workers[i]) != 0) {
+            log_write(c2s->log, LOG_ERR, "couldn't start worker %d, aborting", i);
+            exit(1);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    log_write(c2s->log, LOG_NOTICE, "running %d workers", c2s->nworkers);
+#endif
+}
+
+void c2s_workers_stop(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    int i;
+
+    if(c2s->nworkers == 1 || !c2s->workers[0].running)
+        return;
+
+    for(i = 0; i < c2s->nworkers; i++) {
+        pthread_mutex_lock(&c2s->workers[i].inbox_lock);
+        c2s->workers[i].stop = 1;
+        pthread_mutex_unlock(&c2s->workers[i].inbox_lock);
+        _c2s_poke(c2s->workers[i].wake[1]);
+    }
+    for(i = 0; i < c2s->nworkers; i++)
+        pthread_join(c2s->workers[i].thread, NULL);
+
+    /* it's all ours now, calls for their sessions are done straight away */
+    for(i = 0; i < c2s->nworkers; i++)
+        c2s->workers[i].running = 0;
+    for(i = 0; i < c2s->nworkers; i++)
+        _c2s_worker_calls(&c2s->workers[i]);
+#endif
+}
+
+void c2s_workers_free(c2s_t c2s) {
+    worker_t w;
+    int i;
+
+    for(i = 0; i < c2s->nworkers; i++) {
+        w = &c2s->workers[i];
+
+        c2s_worker_cleanup(w);
+
+        if(w->server_fd != NULL) {
+            mio_app(w->mio, w->server_fd, NULL, NULL);
+            mio_close(w->mio, w->server_fd);
+        }
+#ifdef HAVE_SSL
+        if(w->server_ssl_fd != NULL) {
+            mio_app(w->mio, w->server_ssl_fd, NULL, NULL);
+            mio_close(w->mio, w->server_ssl_fd);
+        }
+#endif
+
+        jqueue_free(w->dead);
+        jqueue_free(w->dead_sess);
+        wheel_free(w->timers);
+
+#ifdef HAVE_PTHREAD
+        if(w->mio != c2s->mio) {
+            mio_close(w->mio, w->wake_fd);
+            close(w->wake[1]);
+            mio_free(w->mio);
+
+            jqueue_free(w->inbox);
+            jqueue_free(w->batch);
+            pthread_mutex_destroy(&w->inbox_lock);
+        }
+#endif
+    }
+
+    free(c2s->workers);
+    c2s->workers = NULL;
+
+#ifdef HAVE_PTHREAD
+    if(c2s->nworkers > 1) {
+        mio_close(c2s->mio, c2s->wake_fd);
+        close(c2s->wake[1]);
+        pthread_mutex_destroy(&c2s->lock);
+    }
+#endif
+}
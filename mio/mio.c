@@ -30,12 +30,17 @@
 #include "mio.h"
 
 mio_t mio_kqueue_new(int maxfd);
-mio_t mio_epoll_new(int maxfd);
+mio_t mio_epoll_new(int maxfd, int events);
 mio_t mio_poll_new(int maxfd);
 mio_t mio_select_new(int maxfd);
 mio_t mio_wsasync_new(int maxfd);
 
 mio_t mio_new(int maxfd)
+{
+  return mio_new_events(maxfd, 0);
+}
+
+mio_t mio_new_events(int maxfd, int events)
 {
   mio_t m = NULL;
 
@@ -45,7 +50,7 @@ mio_t mio_new(int maxfd)
 #endif
 
 #ifdef MIO_EPOLL
-  m = mio_epoll_new(maxfd);
+  m = mio_epoll_new(maxfd, events);
   if (m != NULL) return m;
 #endif
 
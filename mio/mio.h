@@ -129,17 +129,28 @@ typedef struct mio_st
   void (*mio_read)(struct mio_st **m, struct mio_fd_st *fd);
 
   void (*mio_run)(struct mio_st **m, int timeout);
+
+  struct mio_fd_st *(*mio_listen_shared)(struct mio_st **m, int port, const char *sourceip,
+				  mio_handler_t app, void *arg);
 } **mio_t;
 
 /** create/free the mio subsytem */
 JABBERD2_API mio_t mio_new(int maxfd); /* returns NULL if failed */
 
+/** same, but taking up to events ready fds from the kernel each run (0 for the default) */
+JABBERD2_API mio_t mio_new_events(int maxfd, int events);
+
 #define mio_free(m) (*m)->mio_free(m)
 
 /** for creating a new listen socket in this mio (returns new fd or <0) */
 #define mio_listen(m, port, sourceip, app, arg) \
     (*m)->mio_listen(m, port, sourceip, app, arg)
 
+/** same, but other listeners (in this or other mios) can bind the port too, the kernel
+ *  spreads connections across them (returns NULL where SO_REUSEPORT isn't available) */
+#define mio_listen_shared(m, port, sourceip, app, arg) \
+    (*m)->mio_listen_shared(m, port, sourceip, app, arg)
+
 /** for creating a new socket connected to this ip:port (returns new fd or <0, use mio_read/write first) */
 #define mio_connect(m, port, hostip, srcip, app, arg) \
     (*m)->mio_connect(m, port, hostip, srcip, app, arg)
@@ -161,7 +172,10 @@ JABBERD2_API mio_t mio_new(int maxfd); /* returns NULL if failed */
 #define mio_read(m, fd) (*m)->mio_read(m, fd)
 
 /** give some cpu time to mio to check it's sockets, 0 is non-blocking */
-#define mio_run(m, timeout) (*m)->mio_run(m, timeout)
+#define mio_run(m, timeout) (*m)->mio_run(m, (timeout) * 1000)
+
+/** same, with the timeout in milliseconds */
+#define mio_run_ms(m, timeout) ((*m)->mio_run)(m, timeout)
 
 /** all MIO related routines should use those for error reporting */
 #ifndef _WIN32
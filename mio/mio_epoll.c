@@ -23,6 +23,11 @@
    ---------------------------
 */
 
+/* for accept4() */
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE 1
+#endif
+
 #ifdef HAVE_CONFIG_H
 #   include <config.h>
 #endif
@@ -34,8 +39,20 @@
 #include "mio_epoll.h"
 #include "mio_impl.h"
 
-mio_t mio_epoll_new(int maxfd)
+mio_t mio_epoll_new(int maxfd, int events)
 {
-  return _mio_new(maxfd);
+  mio_t m;
+
+  if(events <= 0)
+    events = MIO_EPOLL_EVENTS;
+
+  m = _mio_new(maxfd);
+  if(m == NULL)
+    return NULL;
+
+  MIO(m)->nevents = events;
+  MIO(m)->res_event = calloc(events, sizeof(struct epoll_event));
+
+  return m;
 }
 #endif
@@ -22,11 +22,50 @@
 
 #include <sys/epoll.h>
 
+/* ready fds taken per epoll_wait() unless the app asks for something else */
+#define MIO_EPOLL_EVENTS 256
+
+/* new sockets come out non-blocking, saving a couple of fcntl()s each */
+#ifdef HAVE_ACCEPT4
+# define MIO_ACCEPT4
+#endif
+
+/* interest is dropped lazily. unsetting read or write only forgets that we
+ * want it; the kernel is told when an event we don't want turns up, so an
+ * fd that goes back and forth between blocked and not within a run never
+ * costs an epoll_ctl(). this stays level-triggered, as apps can stop
+ * reading part way through what's waiting */
+
 #define MIO_FUNCS \
+    static void _mio_arm(mio_t m, mio_priv_fd_t mfd, uint32_t events)   \
+    {                                                                   \
+        struct epoll_event event;                                       \
+                                                                        \
+        mfd->events = events;                                           \
+                                                                        \
+        event.events = events;                                          \
+        event.data.u64 = 0;                                             \
+        event.data.ptr = mfd;                                           \
+        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
+                  mfd->mio_fd.fd, &event);                              \
+    }                                                                   \
+                                                                        \
     static int _mio_poll(mio_t m, int t)                                \
     {                                                                   \
-        return epoll_wait(MIO(m)->epoll_fd,                             \
-                          MIO(m)->res_event, 32, t*1000);               \
+        mio_priv_fd_t mfd;                                              \
+        int i, ret;                                                     \
+                                                                        \
+        ret = epoll_wait(MIO(m)->epoll_fd,                              \
+                         MIO(m)->res_event, MIO(m)->nevents, t);        \
+                                                                        \
+        /* stop the ones we've lost interest in waking us again */      \
+        for(i = 0; i < ret; i++) {                                      \
+            mfd = (mio_priv_fd_t) MIO(m)->res_event[i].data.ptr;        \
+            if(MIO(m)->res_event[i].events & (EPOLLIN|EPOLLOUT) & ~mfd->want) \
+                _mio_arm(m, mfd, mfd->want);                            \
+        }                                                               \
+                                                                        \
+        return ret;                                                     \
     }                                                                   \
                                                                         \
     static mio_fd_t _mio_alloc_fd(mio_t m, int fd)                      \
@@ -37,6 +76,7 @@
                                                                         \
         priv_fd->mio_fd.fd = fd;                                        \
         priv_fd->events = 0;                                            \
+        priv_fd->want = 0;                                              \
                                                                         \
         event.events = priv_fd->events;                                 \
         event.data.u64 = 0;                                             \
@@ -48,12 +88,14 @@
 
 
 #define MIO_FD_VARS \
-    uint32_t events;
+    uint32_t events;                                                    \
+    uint32_t want;
 
 #define MIO_VARS \
     int defer_free;                                                     \
     int epoll_fd;                                                       \
-    struct epoll_event res_event[32];
+    int nevents;                                                        \
+    struct epoll_event *res_event;
 
 #define MIO_INIT_VARS(m) \
     do {                                                                \
@@ -69,6 +111,7 @@
 #define MIO_FREE_VARS(m) \
     do {                                                                \
         close(MIO(m)->epoll_fd);                                        \
+        free(MIO(m)->res_event);                                        \
     } while(0)
 
 
@@ -89,66 +132,31 @@
 
 #define MIO_SET_READ(m, mfd) \
     do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events |= EPOLLIN;                                         \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
+        mfd->want |= EPOLLIN;                                           \
+        if(!(mfd->events & EPOLLIN))                                    \
+            _mio_arm(m, mfd, mfd->events | EPOLLIN);                    \
     } while (0)
 
 #define MIO_SET_WRITE(m, mfd) \
     do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events |= EPOLLOUT;                                        \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
+        mfd->want |= EPOLLOUT;                                          \
+        if(!(mfd->events & EPOLLOUT))                                   \
+            _mio_arm(m, mfd, mfd->events | EPOLLOUT);                   \
     } while (0)
 
-#define MIO_UNSET_READ(m, mfd) \
-    do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events &= ~EPOLLIN;                                        \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
-    } while (0)
+#define MIO_UNSET_READ(m, mfd)  mfd->want &= ~EPOLLIN
 
-#define MIO_UNSET_WRITE(m, mfd) \
-    do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events &= ~(EPOLLOUT);                                     \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
-    } while (0)
+#define MIO_UNSET_WRITE(m, mfd) mfd->want &= ~EPOLLOUT
 
 
 #define MIO_CAN_READ(m,iter) \
-    (MIO(m)->res_event[iter].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+    ((MIO(m)->res_event[iter].events & (EPOLLERR|EPOLLHUP)) ||          \
+     (MIO(m)->res_event[iter].events & EPOLLIN &                        \
+      ((mio_priv_fd_t) MIO(m)->res_event[iter].data.ptr)->want))
 
 #define MIO_CAN_WRITE(m,iter) \
-    (MIO(m)->res_event[iter].events & EPOLLOUT)
+    (MIO(m)->res_event[iter].events & EPOLLOUT &                        \
+     ((mio_priv_fd_t) MIO(m)->res_event[iter].data.ptr)->want)
 
 #define MIO_CAN_FREE(m)         (!MIO(m)->defer_free)
 
@@ -90,10 +90,9 @@ static void _mio_debug(int line, const char *msgfmt, ...)
 
 MIO_FUNCS
 
-/** add and set up this fd to this mio */
-static mio_fd_t _mio_setup_fd(mio_t m, int fd, mio_handler_t app, void *arg)
+/** add this fd to this mio, it's already non-blocking */
+static mio_fd_t _mio_add_fd(mio_t m, int fd, mio_handler_t app, void *arg)
 {
-    int flags;
     mio_fd_t mio_fd;
 
     mio_debug(ZONE, "adding fd #%d", fd);
@@ -106,23 +105,27 @@ static mio_fd_t _mio_setup_fd(mio_t m, int fd, mio_handler_t app, void *arg)
     FD(m,mio_fd)->app = app;
     FD(m,mio_fd)->arg = arg;
 
+    return mio_fd;
+}
+
+/** add and set up this fd to this mio */
+static mio_fd_t _mio_setup_fd(mio_t m, int fd, mio_handler_t app, void *arg)
+{
+    int flags;
+
     /* set the socket to non-blocking */
 #if defined(HAVE_FCNTL)
     flags = fcntl(fd, F_GETFL);
     flags |= O_NONBLOCK;
-    if(fcntl(fd, F_SETFL, flags) == -1) {
-        MIO_FREE_FD(m, mio_fd);
+    if(fcntl(fd, F_SETFL, flags) == -1)
         return NULL;
-    }
 #elif defined(HAVE_IOCTL)
     flags = 1;
-    if(ioctl(fd, FIONBIO, &flags) == -1) {
-        MIO_FREE_FD(m, mio_fd);
+    if(ioctl(fd, FIONBIO, &flags) == -1)
         return NULL;
-    }
 #endif
 
-    return mio_fd;
+    return _mio_add_fd(m, fd, app, arg);
 }
 
 /** internal close function */
@@ -152,48 +155,64 @@ static void _mio_close(mio_t m, mio_fd_t fd)
     }
 }
 
-/** internally accept an incoming connection from a listen sock */
+/* most connections taken off a listen socket in one go, so a flood of
+ * them doesn't keep everyone else waiting. the rest are still there for
+ * the next run */
+#define MIO_ACCEPT_MAX 256
+
+/** internally accept incoming connections from a listen sock */
 static void _mio_accept(mio_t m, mio_fd_t fd)
 {
     struct sockaddr_storage serv_addr;
-    socklen_t addrlen = (socklen_t) sizeof(serv_addr);
-    int newfd;
+    socklen_t addrlen;
+    int newfd, n;
     mio_fd_t mio_fd;
     char ip[INET6_ADDRSTRLEN];
 
     mio_debug(ZONE, "accepting on fd #%d", fd->fd);
 
-    /* pull a socket off the accept queue and check */
-    newfd = accept(fd->fd, (struct sockaddr*)&serv_addr, &addrlen);
-    if(newfd < 0) return;
-    if(addrlen <= 0) {
-        close(newfd);
-        return;
-    }
+    for(n = 0; n < MIO_ACCEPT_MAX && FD(m,fd)->type == type_LISTEN; n++) {
+        addrlen = (socklen_t) sizeof(serv_addr);
 
-    j_inet_ntop(&serv_addr, ip, sizeof(ip));
-    mio_debug(ZONE, "new socket accepted fd #%d, %s:%d", newfd, ip, j_inet_getport(&serv_addr));
+        /* pull a socket off the accept queue and check */
+#ifdef MIO_ACCEPT4
+        newfd = accept4(fd->fd, (struct sockaddr*)&serv_addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        newfd = accept(fd->fd, (struct sockaddr*)&serv_addr, &addrlen);
+#endif
+        /* queue's empty, or we're out of fds; either way, next time */
+        if(newfd < 0) return;
+        if(addrlen <= 0) {
+            close(newfd);
+            continue;
+        }
 
-    /* set up the entry for this new socket */
-    mio_fd = _mio_setup_fd(m, newfd, FD(m,fd)->app, FD(m,fd)->arg);
+        j_inet_ntop(&serv_addr, ip, sizeof(ip));
+        mio_debug(ZONE, "new socket accepted fd #%d, %s:%d", newfd, ip, j_inet_getport(&serv_addr));
 
-    if(!mio_fd) {
-        close(newfd);
-        return;
-    }
+        /* set up the entry for this new socket */
+#ifdef MIO_ACCEPT4
+        mio_fd = _mio_add_fd(m, newfd, FD(m,fd)->app, FD(m,fd)->arg);
+#else
+        mio_fd = _mio_setup_fd(m, newfd, FD(m,fd)->app, FD(m,fd)->arg);
+#endif
 
-    /* tell the app about the new socket, if they reject it clean up */
-    if (ACT(m, mio_fd, action_ACCEPT, ip))
-    {
-        mio_debug(ZONE, "accept was rejected for %s:%d", ip, newfd);
-        MIO_REMOVE_FD(m, FD(m,mio_fd));
+        if(!mio_fd) {
+            close(newfd);
+            continue;
+        }
 
-        /* close the socket, and reset all memory */
-        close(newfd);
-        MIO_FREE_FD(m, mio_fd);
-    }
+        /* tell the app about the new socket, if they reject it clean up */
+        if (ACT(m, mio_fd, action_ACCEPT, ip))
+        {
+            mio_debug(ZONE, "accept was rejected for %s:%d", ip, newfd);
+            MIO_REMOVE_FD(m, FD(m,mio_fd));
 
-    return;
+            /* close the socket, and reset all memory */
+            close(newfd);
+            MIO_FREE_FD(m, mio_fd);
+        }
+    }
 }
 
 /** internally change a connecting socket to a normal one */
@@ -225,7 +244,7 @@ static void _mio_run(mio_t m, int timeout)
     int retval;
     MIO_INIT_ITERATOR(iter);
 
-    mio_debug(ZONE, "mio running for %d sec", timeout);
+    mio_debug(ZONE, "mio running for %d ms", timeout);
 
     /* wait for a socket event */
     retval = MIO_CHECK(m, timeout);
@@ -329,8 +348,8 @@ static void _mio_write(mio_t m, mio_fd_t fd)
     MIO_SET_WRITE(m, FD(m,fd));
 }
 
-/** set up a listener in this mio w/ this default app/arg */
-static mio_fd_t _mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg)
+/** set up a listener in this mio w/ this default app/arg, shared lets other sockets bind the same port */
+static mio_fd_t _mio_listen_port(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg, int shared)
 {
     int fd, flag = 1;
     mio_fd_t mio_fd;
@@ -338,6 +357,14 @@ static mio_fd_t _mio_listen(mio_t m, int port, const char *sourceip, mio_handler
 
     if(m == NULL) return NULL;
 
+#ifndef SO_REUSEPORT
+    if(shared)
+    {
+        MIO_SETERROR(EINVAL);
+        return NULL;
+    }
+#endif
+
     mio_debug(ZONE, "mio to listen on %d [%s]", port, sourceip);
 
     memset(&sa, 0, sizeof(sa));
@@ -356,6 +383,14 @@ static mio_fd_t _mio_listen(mio_t m, int port, const char *sourceip, mio_handler
         close(fd);
         return NULL;
     }
+#ifdef SO_REUSEPORT
+    /* the kernel spreads new connections across everyone bound to the port */
+    if(shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&flag, sizeof(flag)) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+#endif
 
     /* set up and bind address info */
     j_inet_setport(&sa, port);
@@ -386,6 +421,16 @@ static mio_fd_t _mio_listen(mio_t m, int port, const char *sourceip, mio_handler
     return mio_fd;
 }
 
+static mio_fd_t _mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg)
+{
+    return _mio_listen_port(m, port, sourceip, app, arg, 0);
+}
+
+static mio_fd_t _mio_listen_shared(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg)
+{
+    return _mio_listen_port(m, port, sourceip, app, arg, 1);
+}
+
 /** create an fd and connect to the given ip/port */
 static mio_fd_t _mio_connect(mio_t m, int port, const char *hostip, const char *srcip, mio_handler_t app, void *arg)
 {
@@ -498,7 +543,8 @@ static mio_t _mio_new(int maxfd)
         _mio_app,
         _mio_close,
         _mio_write, _mio_read,
-        _mio_run
+        _mio_run,
+        _mio_listen_shared
     };
     mio_t m;
 
@@ -58,7 +58,7 @@
         MSG msg; int lResult = 0;                                       \
         MIO(m)->select_fd = NULL;                                       \
         MIO(m)->timer = SetTimer(MIO(m)->hwnd,                          \
-            MIO(m)->timer ? MIO(m)->timer : 0, 1000 * t, NULL);         \
+            MIO(m)->timer ? MIO(m)->timer : 0, t, NULL);                \
         while(!lResult && GetMessage(&msg, NULL, 0, 0))                 \
         {                                                               \
             TranslateMessage(&msg);                                     \
@@ -22,9 +22,274 @@
 
 /** filter manager */
 
+/* rules are compiled when they're loaded. each one goes in one of three
+ * lists: keyed by its from if that's a plain jid, else keyed by its to if
+ * that is, else the rest. the rules a from/to pair can hit are the ones
+ * from those lists that match, in file order, and we remember them for
+ * the pairs we've seen lately. only "what" has to be looked at per packet */
+
+#define FILTER_CACHE_MAX    4096
+
+/** pattern types */
+#define fpat_NONE   (0)     /* not given, only matches a missing address */
+#define fpat_ANY    (1)     /* just stars */
+#define fpat_EXACT  (2)     /* no wildcards */
+#define fpat_PREFIX (3)     /* wildcards are a single trailing star */
+#define fpat_SUFFIX (4)     /* wildcards are a single leading star */
+#define fpat_GLOB   (5)     /* anything else, left to fnmatch */
+
+/** cached rule list for a from/to pair */
+typedef struct fcache_st *fcache_t;
+struct fcache_st {
+    fcache_t    prev, next;
+
+    char        *key;
+    int         keylen;
+
+    int         nacl;
+    acl_t       *acl;
+};
+
+struct filter_st {
+    int         nrules;
+
+    xht         from;
+    xht         to;
+    acl_t       rest;
+
+    /** cache, most recently used at the head */
+    xht         cache;
+    fcache_t    head, tail;
+
+    /** room to collect a rule list before it's cached */
+    acl_t       *scratch;
+};
+
+static int _filter_pat_type(const char *pat, int *len) {
+    int i, stars = 0, special = 0;
+
+    if(pat == NULL)
+        return fpat_NONE;
+
+    *len = strlen(pat);
+
+    for(i = 0; i < *len; i++)
+        if(pat[i] == '*')
+            stars++;
+        else if(pat[i] == '?' || pat[i] == '[' || pat[i] == '\\')
+            special++;
+
+    if(special == 0) {
+        if(stars == *len)
+            return fpat_ANY;
+        if(stars == 0)
+            return fpat_EXACT;
+
+        /* the length we compare is everything but the star */
+        if(stars == 1 && pat[*len - 1] == '*') {
+            (*len)--;
+            return fpat_PREFIX;
+        }
+        if(stars == 1 && pat[0] == '*') {
+            (*len)--;
+            return fpat_SUFFIX;
+        }
+    }
+
+    return fpat_GLOB;
+}
+
+static int _filter_pat_match(int type, const char *pat, int plen, const char *str) {
+    int len;
+
+    if(type == fpat_NONE)
+        return str == NULL;
+
+    if(str == NULL)
+        return 0;
+
+    switch(type) {
+        case fpat_ANY:
+            return 1;
+
+        case fpat_EXACT:
+            return strcmp(pat, str) == 0;
+
+        case fpat_PREFIX:
+            return strncmp(pat, str, plen) == 0;
+
+        case fpat_SUFFIX:
+            len = strlen(str);
+            return len >= plen && memcmp(str + len - plen, pat + 1, plen) == 0;
+    }
+
+    /* do filename-like match */
+    return fnmatch(pat, str, 0) == 0;
+}
+
+/** chain a rule onto the end of an index entry, so they stay in order */
+static void _filter_index_add(xht idx, const char *key, acl_t acl) {
+    acl_t last;
+
+    last = (acl_t) xhash_get(idx, key);
+    if(last == NULL) {
+        xhash_put(idx, key, (void *) acl);
+        return;
+    }
+
+    while(last->next_idx != NULL)
+        last = last->next_idx;
+    last->next_idx = acl;
+}
+
+static filter_t _filter_compile(acl_t list) {
+    filter_t f;
+    acl_t acl, rest_tail = NULL;
+
+    f = (filter_t) calloc(1, sizeof(struct filter_st));
+    f->from = xhash_new(101);
+    f->to = xhash_new(101);
+    f->cache = xhash_new(1021);
+
+    for(acl = list; acl != NULL; acl = acl->next) {
+        acl->index = f->nrules++;
+        acl->from_type = _filter_pat_type(acl->from, &acl->from_len);
+        acl->to_type = _filter_pat_type(acl->to, &acl->to_len);
+        acl->next_idx = NULL;
+
+        if(acl->from_type == fpat_EXACT)
+            _filter_index_add(f->from, acl->from, acl);
+        else if(acl->to_type == fpat_EXACT)
+            _filter_index_add(f->to, acl->to, acl);
+        else {
+            if(rest_tail != NULL)
+                rest_tail->next_idx = acl;
+            else
+                f->rest = acl;
+            rest_tail = acl;
+        }
+    }
+
+    f->scratch = (acl_t *) malloc(sizeof(acl_t) * (f->nrules + 1));
+
+    return f;
+}
+
+static void _filter_free(filter_t f) {
+    fcache_t fc, next;
+
+    for(fc = f->head; fc != NULL; fc = next) {
+        next = fc->next;
+        free(fc);
+    }
+
+    xhash_free(f->from);
+    xhash_free(f->to);
+    xhash_free(f->cache);
+    free(f->scratch);
+    free(f);
+}
+
+/** the rules this pair could hit, cached */
+static fcache_t _filter_lookup(filter_t f, const char *key, int keylen, const char *from, const char *to) {
+    fcache_t fc;
+    acl_t a, b, c, acl;
+    int n = 0;
+
+    fc = (fcache_t) xhash_getx(f->cache, key, keylen);
+    if(fc != NULL) {
+        /* to the front */
+        if(fc != f->head) {
+            fc->prev->next = fc->next;
+            if(fc->next != NULL)
+                fc->next->prev = fc->prev;
+            else
+                f->tail = fc->prev;
+
+            fc->prev = NULL;
+            fc->next = f->head;
+            f->head->prev = fc;
+            f->head = fc;
+        }
+
+        return fc;
+    }
+
+    /* merge the three lists back into file order, keeping the ones that match */
+    a = from != NULL ? (acl_t) xhash_get(f->from, from) : NULL;
+    b = to != NULL ? (acl_t) xhash_get(f->to, to) : NULL;
+    c = f->rest;
+
+    while(a != NULL || b != NULL || c != NULL) {
+        acl = a;
+        if(acl == NULL || (b != NULL && b->index < acl->index))
+            acl = b;
+        if(acl == NULL || (c != NULL && c->index < acl->index))
+            acl = c;
+
+        if(acl == a) a = a->next_idx;
+        else if(acl == b) b = b->next_idx;
+        else c = c->next_idx;
+
+        if(_filter_pat_match(acl->from_type, acl->from, acl->from_len, from) &&
+           _filter_pat_match(acl->to_type, acl->to, acl->to_len, to))
+            f->scratch[n++] = acl;
+    }
+
+    /* make room */
+    if(xhash_count(f->cache) >= FILTER_CACHE_MAX) {
+        fc = f->tail;
+        f->tail = fc->prev;
+        f->tail->next = NULL;
+
+        xhash_zapx(f->cache, fc->key, fc->keylen);
+        free(fc);
+    }
+
+    /* one allocation, the rule list and the key follow */
+    fc = (fcache_t) malloc(sizeof(struct fcache_st) + sizeof(acl_t) * n + keylen);
+    fc->acl = (acl_t *) (fc + 1);
+    fc->nacl = n;
+    memcpy(fc->acl, f->scratch, sizeof(acl_t) * n);
+    fc->key = (char *) (fc->acl + n);
+    fc->keylen = keylen;
+    memcpy(fc->key, key, keylen);
+
+    fc->prev = NULL;
+    fc->next = f->head;
+    if(f->head != NULL)
+        f->head->prev = fc;
+    else
+        f->tail = fc;
+    f->head = fc;
+
+    xhash_putx(f->cache, fc->key, fc->keylen, (void *) fc);
+
+    return fc;
+}
+
+/** length of the jid without its resource */
+static int _filter_bare(const char *jid, int len) {
+    const char *c;
+
+    /* skip node part */
+    c = memchr(jid, '@', len);
+    if(c == NULL)
+        c = jid;
+
+    c = memchr(c, '/', len - (c - jid));
+
+    return c != NULL ? c - jid : len;
+}
+
 void filter_unload(router_t r) {
     acl_t acl, tmp;
 
+    if(r->filter_idx != NULL) {
+        _filter_free(r->filter_idx);
+        r->filter_idx = NULL;
+    }
+
     acl = r->filter;
 
     while(acl != NULL) {
@@ -192,6 +457,8 @@ int filter_load(router_t r) {
 
     nad_free(nad);
 
+    r->filter_idx = _filter_compile(r->filter);
+
     log_write(r->log, LOG_NOTICE, "loaded filters (%d rules)", nfilters);
 
     r->filter_load = time(NULL);
@@ -201,57 +468,55 @@ int filter_load(router_t r) {
 
 int filter_packet(router_t r, nad_t nad) {
     acl_t acl;
-    int ato, afrom, error = 0;
-    char *cur, *to = NULL, *from = NULL;
+    fcache_t fc;
+    int ato, afrom, flen = 0, tlen = 0, keylen, i, error = 0;
+    char keybuf[1024], *key, *to = NULL, *from = NULL;
 
     ato = nad_find_attr(nad, 1, -1, "to", NULL);
     afrom = nad_find_attr(nad, 1, -1, "from", NULL);
-    if(ato >= 0 && NAD_AVAL_L(nad,ato) > 0) {
-        to = (char *) malloc(sizeof(char) * (NAD_AVAL_L(nad, ato) + 1));
-        sprintf(to, "%.*s", NAD_AVAL_L(nad, ato), NAD_AVAL(nad, ato));
-        cur = strstr(to, "@");       /* skip node part */
-        if(cur != NULL)
-            cur = strstr(cur, "/");
-        else
-            cur = strstr(to, "/");
-        if(cur != NULL) *cur = '\0'; /* remove the resource part */
-    }
-    if(afrom >= 0 && NAD_AVAL_L(nad,afrom) > 0) {
-        from = (char *) malloc(sizeof(char) * (NAD_AVAL_L(nad, afrom) + 1));
-        sprintf(from, "%.*s", NAD_AVAL_L(nad, afrom), NAD_AVAL(nad, afrom));
-        cur = strstr(from, "@");
-        if(cur != NULL)
-            cur = strstr(cur, "/");
-        else
-            cur = strstr(from, "/");
-        if(cur != NULL) *cur = '\0';
-    }
-
-    for(acl = r->filter; acl != NULL; acl = acl->next) {
-        if( from == NULL && acl->from != NULL) continue;        /* no match if NULL matched vs not-NULL */
-        if( to == NULL && acl->to != NULL ) continue;
-        if( from != NULL && acl->from == NULL) continue;        /* no match if not-NULL matched vs NULL */
-        if( to != NULL && acl->to == NULL ) continue;
-        if( from != NULL && acl->from != NULL && fnmatch(acl->from, from, 0) != 0 ) continue;        /* do filename-like match */
-        if( to != NULL && acl->to != NULL && fnmatch(acl->to, to, 0) != 0 ) continue;
+    if(ato >= 0 && NAD_AVAL_L(nad,ato) > 0)
+        tlen = _filter_bare(NAD_AVAL(nad, ato), NAD_AVAL_L(nad, ato));
+    else
+        ato = -1;
+    if(afrom >= 0 && NAD_AVAL_L(nad,afrom) > 0)
+        flen = _filter_bare(NAD_AVAL(nad, afrom), NAD_AVAL_L(nad, afrom));
+    else
+        afrom = -1;
+
+    /* the cache key is both bare jids, marked so a missing one isn't an empty one.
+     * each half is a string in its own right, so they double as from and to */
+    keylen = flen + tlen + 4;
+    key = keylen <= sizeof(keybuf) ? keybuf : (char *) malloc(keylen);
+
+    key[0] = afrom >= 0 ? 'f' : '-';
+    if(afrom >= 0) memcpy(key + 1, NAD_AVAL(nad, afrom), flen);
+    key[flen + 1] = '\0';
+    key[flen + 2] = ato >= 0 ? 't' : '-';
+    if(ato >= 0) memcpy(key + flen + 3, NAD_AVAL(nad, ato), tlen);
+    key[keylen - 1] = '\0';
+
+    if(afrom >= 0) from = key + 1;
+    if(ato >= 0) to = key + flen + 3;
+
+    fc = _filter_lookup(r->filter_idx, key, keylen, from, to);
+
+    for(i = 0; i < fc->nacl; i++) {
+        acl = fc->acl[i];
         if( acl->what != NULL && nad_find_elem_path(nad, 0, -1, acl->what) < 0 ) continue;        /* match packet type */
         log_debug(ZONE, "matched packet %s->%s vs rule (%s %s->%s)", from, to, acl->what, acl->from, acl->to);
         if( acl->dump != NULL ) {
             const char *out;
             int len;
-            FILE *fd;
-            fd = fopen(acl->dump, "a");
-            if (fd == NULL) {
-                log_write(r->log, LOG_ERR, "filter: cannot open dump file %s: \"%s\", disabling dump for this rule.", acl->dump, strerror(errno));
-                free(acl->dump);
-                acl->dump = NULL;
-            } else {
-                nad_print(nad, 1, &out, &len);
-                fwrite(out, len, 1, fd);
-                /* Add newlines between the stanzas to improve human readability. */
-                fwrite("\n", 1, 1, fd);
-                fclose(fd);
-            }
+            logrec_t rec;
+
+            nad_print(nad, 1, &out, &len);
+
+            /* Add newlines between the stanzas to improve human readability. */
+            rec = logwriter_rec(acl->dump, NULL, 0, len + 1);
+            memcpy(rec->data, out, len);
+            rec->data[len] = '\n';
+
+            logwriter_push(r->logwriter, rec);
         }
         if (acl->log) {
             if (acl->redirect) log_write(r->log, LOG_NOTICE, "filter: redirect packet from=%s to=%s - rule (from=%s to=%s what=%s), new to=%s", from, to, acl->from, acl->to, acl->what, acl->redirect);
@@ -262,8 +527,7 @@ int filter_packet(router_t r, nad_t nad) {
         break;
     }
 
-    if(to != NULL) free(to);
-    if(from != NULL) free(from);
+    if(key != keybuf) free(key);
     return error;
 }
 
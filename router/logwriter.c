@@ -0,0 +1,465 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* background writer for the message log and filter dumps. workers hand
+ * it finished records and go straight back to routing; it keeps the files
+ * open, writes whatever has built up in one go and syncs every so often.
+ * if it can't keep up, records are dropped and counted rather than making
+ * the workers wait for the disk */
+
+#include "router.h"
+
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+
+typedef struct lwfile_st *lwfile_t;
+struct lwfile_st {
+    char        *name;
+    FILE        *fp;
+
+    long        size;
+    time_t      opened;
+
+    /** written to since the last flush, and since the last sync */
+    int         dirty;
+    int         unsynced;
+
+    /** couldn't open it, don't try again till the next reopen */
+    int         failed;
+};
+
+struct logwriter_st {
+    /** most records we'll hold before dropping */
+    int         max;
+
+    /** seconds between syncs, 0 leaves it to the os */
+    int         sync;
+
+    /** rotate when the file gets this big (bytes), or this old (seconds) */
+    long        rotate_size;
+    int         rotate_time;
+
+    /** open files, key is the file name. writer only */
+    xht         files;
+
+    /** timestamp cache. writer only */
+    time_t      stamped;
+    char        stamp[32];
+
+    time_t      last_sync;
+
+    /** records waiting to be written, and the state the router looks at */
+    logrec_t    head, tail;
+    int         count;
+    unsigned long dropped;
+    char        error[256];
+    int         reopen;
+    int         stop;
+
+#ifdef HAVE_PTHREAD
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+#endif
+};
+
+static void _lw_close(lwfile_t f) {
+    if(f->fp == NULL)
+        return;
+
+    fclose(f->fp);
+    f->fp = NULL;
+    f->dirty = f->unsynced = 0;
+}
+
+static void _lw_error(logwriter_t lw, const char *what, const char *name) {
+    char error[256];
+
+    snprintf(error, sizeof(error), "%s %s: %s", what, name, strerror(errno));
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&lw->lock);
+#endif
+    strcpy(lw->error, error);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&lw->lock);
+#endif
+}
+
+static int _lw_open(logwriter_t lw, lwfile_t f, const char *header) {
+    int fd;
+
+    if(f->failed)
+        return 1;
+
+    /* these can hold private conversations, so keep them to ourselves */
+    fd = open(f->name, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if(fd < 0 || (f->fp = fdopen(fd, "a")) == NULL) {
+        _lw_error(lw, "unable to open", f->name);
+        if(fd >= 0)
+            close(fd);
+        f->failed = 1;
+        return 1;
+    }
+
+    fseek(f->fp, 0, SEEK_END);
+    f->size = ftell(f->fp);
+    f->opened = time(NULL);
+
+    if(f->size <= 0 && header != NULL)
+        f->size = fprintf(f->fp, "%s", header);
+
+    return 0;
+}
+
+static void _lw_rotate(logwriter_t lw, lwfile_t f, time_t now) {
+    char name[1024], stamp[32];
+    struct stat st;
+    struct tm *tm;
+    int i;
+#ifdef HAVE_PTHREAD
+    struct tm tms;
+
+    tm = localtime_r(&now, &tms);
+#else
+    tm = localtime(&now);
+#endif
+
+    _lw_close(f);
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", tm);
+    snprintf(name, sizeof(name), "%s.%s", f->name, stamp);
+
+    /* more than one in a second, don't go over the last one */
+    for(i = 1; stat(name, &st) == 0; i++)
+        snprintf(name, sizeof(name), "%s.%s.%d", f->name, stamp, i);
+
+    /* if it won't move we just carry on with the one we've got */
+    if(rename(f->name, name) != 0)
+        _lw_error(lw, "unable to rotate", f->name);
+}
+
+/** does this file need rotating before we write to it */
+static int _lw_rotate_due(logwriter_t lw, lwfile_t f, time_t now) {
+    if(f->fp == NULL)
+        return 0;
+
+    if(lw->rotate_size > 0 && f->size >= lw->rotate_size)
+        return 1;
+
+    /* on the interval boundary, so files line up rather than running from whenever we started */
+    if(lw->rotate_time > 0 && now / lw->rotate_time != f->opened / lw->rotate_time)
+        return 1;
+
+    return 0;
+}
+
+static const char *_lw_stamp(logwriter_t lw, time_t t) {
+    struct tm *tm;
+#ifdef HAVE_PTHREAD
+    struct tm tms;
+#endif
+
+    if(t == lw->stamped)
+        return lw->stamp;
+
+#ifdef HAVE_PTHREAD
+    tm = localtime_r(&t, &tms);
+#else
+    tm = localtime(&t);
+#endif
+
+    /* ISO8601 timestamp */
+    if(strftime(lw->stamp, sizeof(lw->stamp), "%Y-%m-%dT%H:%M:%S%z", tm) == 0)
+        lw->stamp[0] = '\0';
+    lw->stamped = t;
+
+    return lw->stamp;
+}
+
+static void _lw_write(logwriter_t lw, logrec_t rec, time_t now) {
+    lwfile_t f;
+    int len;
+
+    f = (lwfile_t) xhash_get(lw->files, rec->file);
+    if(f == NULL) {
+        f = (lwfile_t) calloc(1, sizeof(struct lwfile_st));
+        f->name = strdup(rec->file);
+        xhash_put(lw->files, f->name, (void *) f);
+    }
+
+    if(_lw_rotate_due(lw, f, now))
+        _lw_rotate(lw, f, now);
+
+    if(f->fp == NULL && _lw_open(lw, f, rec->header) != 0)
+        return;
+
+    len = 0;
+    if(rec->stamp != 0)
+        len = fprintf(f->fp, "%s ", _lw_stamp(lw, rec->stamp));
+
+    if(fwrite(rec->data, 1, rec->len, f->fp) != (size_t) rec->len || len < 0) {
+        _lw_error(lw, "unable to write to", f->name);
+        _lw_close(f);
+        return;
+    }
+
+    f->size += len + rec->len;
+    f->dirty = 1;
+}
+
+/** push out everything written since last time, and sync if it's been a while */
+static void _lw_flush(logwriter_t lw, time_t now) {
+    lwfile_t f;
+    union xhashv xhv;
+    int sync;
+
+    sync = (lw->sync > 0 && now >= lw->last_sync + lw->sync);
+
+    xhv.val = (void **) &f;
+    if(xhash_iter_first(lw->files))
+        do {
+            xhash_iter_get(lw->files, NULL, NULL, xhv.val);
+            if(f->fp == NULL)
+                continue;
+
+            if(f->dirty) {
+                fflush(f->fp);
+                f->dirty = 0;
+                f->unsynced = 1;
+            }
+
+#ifdef HAVE_PTHREAD
+            if(sync && f->unsynced) {
+                fsync(fileno(f->fp));
+                f->unsynced = 0;
+            }
+#endif
+        } while(xhash_iter_next(lw->files));
+
+    if(sync)
+        lw->last_sync = now;
+}
+
+/** close everything, they'll be opened again as they're needed */
+static void _lw_reopen(logwriter_t lw) {
+    lwfile_t f;
+    union xhashv xhv;
+
+    xhv.val = (void **) &f;
+    if(xhash_iter_first(lw->files))
+        do {
+            xhash_iter_get(lw->files, NULL, NULL, xhv.val);
+            _lw_close(f);
+            f->failed = 0;
+        } while(xhash_iter_next(lw->files));
+}
+
+static void _lw_write_list(logwriter_t lw, logrec_t rec) {
+    logrec_t next;
+    time_t now = time(NULL);
+
+    for(; rec != NULL; rec = next) {
+        next = rec->next;
+        _lw_write(lw, rec, now);
+        free(rec);
+    }
+
+    _lw_flush(lw, now);
+}
+
+#ifdef HAVE_PTHREAD
+static void *_lw_run(void *arg) {
+    logwriter_t lw = (logwriter_t) arg;
+    logrec_t list;
+    struct timespec ts;
+    int stop = 0, reopen;
+
+    while(!stop) {
+        pthread_mutex_lock(&lw->lock);
+
+        /* wake up now and then even when it's quiet, for syncs and rotation */
+        if(lw->head == NULL && !lw->stop && !lw->reopen) {
+            ts.tv_sec = time(NULL) + 1;
+            ts.tv_nsec = 0;
+            pthread_cond_timedwait(&lw->cond, &lw->lock, &ts);
+        }
+
+        /* take the lot, and write it without holding anyone up */
+        list = lw->head;
+        lw->head = lw->tail = NULL;
+        lw->count = 0;
+
+        reopen = lw->reopen;
+        lw->reopen = 0;
+        stop = lw->stop;
+
+        pthread_mutex_unlock(&lw->lock);
+
+        if(reopen)
+            _lw_reopen(lw);
+
+        _lw_write_list(lw, list);
+    }
+
+    return NULL;
+}
+#endif
+
+logwriter_t logwriter_new(int max, int sync, long rotate_size, int rotate_time) {
+    logwriter_t lw;
+
+    lw = (logwriter_t) calloc(1, sizeof(struct logwriter_st));
+
+    lw->max = max > 0 ? max : 1;
+    lw->sync = sync;
+    lw->rotate_size = rotate_size;
+    lw->rotate_time = rotate_time;
+
+    lw->files = xhash_new(11);
+    lw->last_sync = time(NULL);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&lw->lock, NULL);
+    pthread_cond_init(&lw->cond, NULL);
+
+    if(pthread_create(&lw->thread, NULL, _lw_run, (void *) lw) != 0) {
+        pthread_cond_destroy(&lw->cond);
+        pthread_mutex_destroy(&lw->lock);
+        xhash_free(lw->files);
+        free(lw);
+        return NULL;
+    }
+#endif
+
+    return lw;
+}
+
+void logwriter_free(logwriter_t lw) {
+    lwfile_t f;
+    union xhashv xhv;
+
+#ifdef HAVE_PTHREAD
+    /* it writes out whatever is left before it goes */
+    pthread_mutex_lock(&lw->lock);
+    lw->stop = 1;
+    pthread_cond_signal(&lw->cond);
+    pthread_mutex_unlock(&lw->lock);
+
+    pthread_join(lw->thread, NULL);
+
+    pthread_cond_destroy(&lw->cond);
+    pthread_mutex_destroy(&lw->lock);
+#endif
+
+    xhv.val = (void **) &f;
+    if(xhash_iter_first(lw->files))
+        do {
+            xhash_iter_get(lw->files, NULL, NULL, xhv.val);
+            _lw_close(f);
+            free(f->name);
+            free(f);
+        } while(xhash_iter_next(lw->files));
+
+    xhash_free(lw->files);
+    free(lw);
+}
+
+logrec_t logwriter_rec(const char *file, const char *header, time_t stamp, int len) {
+    logrec_t rec;
+    int flen = strlen(file);
+
+    /* one allocation, the data and the file name follow the record */
+    rec = (logrec_t) malloc(sizeof(struct logrec_st) + len + flen + 1);
+
+    rec->next = NULL;
+    rec->header = header;
+    rec->stamp = stamp;
+    rec->len = len;
+    rec->data = (char *) (rec + 1);
+    rec->file = rec->data + len;
+    memcpy(rec->file, file, flen + 1);
+
+    return rec;
+}
+
+int logwriter_push(logwriter_t lw, logrec_t rec) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&lw->lock);
+
+    if(lw->count >= lw->max) {
+        lw->dropped++;
+        pthread_mutex_unlock(&lw->lock);
+        free(rec);
+        return 1;
+    }
+
+    if(lw->tail != NULL)
+        lw->tail->next = rec;
+    else
+        lw->head = rec;
+    lw->tail = rec;
+
+    /* it only needs telling if it's gone to sleep on an empty queue */
+    if(lw->count++ == 0)
+        pthread_cond_signal(&lw->cond);
+
+    pthread_mutex_unlock(&lw->lock);
+#else
+    /* no threads, but we still keep the files open */
+    _lw_write_list(lw, rec);
+#endif
+
+    return 0;
+}
+
+void logwriter_reopen(logwriter_t lw) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&lw->lock);
+    lw->reopen = 1;
+    pthread_cond_signal(&lw->cond);
+    pthread_mutex_unlock(&lw->lock);
+#else
+    _lw_reopen(lw);
+#endif
+}
+
+void logwriter_report(logwriter_t lw, log_t log) {
+    unsigned long dropped;
+    char error[256];
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&lw->lock);
+#endif
+    dropped = lw->dropped;
+    lw->dropped = 0;
+    strcpy(error, lw->error);
+    lw->error[0] = '\0';
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&lw->lock);
+#endif
+
+    if(dropped > 0)
+        log_write(log, LOG_WARNING, "log writer falling behind, dropped %lu records", dropped);
+
+    if(error[0] != '\0')
+        log_write(log, LOG_ERR, "log writer: %s", error);
+}
@@ -116,8 +116,16 @@ static void _router_config_expand(router_t r)
     r->local_private_key_password = config_get_one(r->config, "local.private_key_password", 0);
 
     r->local_ciphers = config_get_one(r->config, "local.ciphers", 0);
+    r->local_ssl_cache = j_atoi(config_get_one(r->config, "local.ssl-cache", 0), 20480);
+    r->local_ssl_cache_timeout = j_atoi(config_get_one(r->config, "local.ssl-cache-timeout", 0), 0);
+    r->local_ssl_tickets = j_atoi(config_get_one(r->config, "local.ssl-tickets", 0), 0);
 
     r->io_max_fds = j_atoi(config_get_one(r->config, "io.max_fds", 0), 1024);
+    r->io_read_budget = j_atoi(config_get_one(r->config, "io.read_budget", 0), 0);
+
+    r->nworkers = j_atoi(config_get_one(r->config, "io.threads", 0), 1);
+    if(r->nworkers < 1)
+        r->nworkers = 1;
 
     elem = config_get(r->config, "io.limits.bytes");
     if(elem != NULL)
@@ -228,7 +236,9 @@ static int _router_sx_sasl_callback(int cb, void *arg, void ** res, sx_t s, void
 
             log_debug(ZONE, "sx sasl callback: get pass (authnid=%s, realm=%s)", creds->authnid, creds->realm);
 
+            router_lock(r);
             pass = xhash_get(r->users, creds->authnid);
+            router_unlock(r);
             if(pass == NULL)
                 return sx_sasl_ret_FAIL;
 
@@ -241,9 +251,13 @@ static int _router_sx_sasl_callback(int cb, void *arg, void ** res, sx_t s, void
 
             log_debug(ZONE, "sx sasl callback: check pass (authnid=%s, realm=%s)", creds->authnid, creds->realm);
 
+            router_lock(r);
             pass = xhash_get(r->users, creds->authnid);
-            if(pass == NULL || strcmp(creds->pass, pass) != 0)
+            if(pass == NULL || strcmp(creds->pass, pass) != 0) {
+                router_unlock(r);
                 return sx_sasl_ret_OK;
+            }
+            router_unlock(r);
 
             return sx_sasl_ret_FAIL;
             break;
@@ -272,27 +286,207 @@ static int _router_sx_sasl_callback(int cb, void *arg, void ** res, sx_t s, void
     return sx_sasl_ret_FAIL;
 }
 
-static void _router_time_checks(router_t r) {
+static void _router_time_checks(worker_t w) {
+   router_t r = w->r;
    component_t target;
    time_t now;
    union xhashv xhv;
 
    now = time(NULL);
 
-   /* loop the components and distribute an space on idle connections*/
+   router_lock(r);
+
+   /* loop our components and distribute an space on idle connections*/
    if(xhash_iter_first(r->components))
        do {
           xhv.comp_val = &target;
           xhash_iter_get(r->components, NULL, NULL, xhv.val);
 
+          if(target->w != w)
+              continue;
+
          if(r->check_keepalive > 0 && target->last_activity > 0 && now > target->last_activity + r->check_keepalive && target->s->state >= state_STREAM) {
                log_debug(ZONE, "sending keepalive for %d", target->fd->fd);
                sx_raw_write(target->s, " ", 1);
           }
        } while(xhash_iter_next(r->components));
+
+   router_unlock(r);
    return;
 }
 
+/** how many components this worker still has */
+static int _router_worker_ncomp(worker_t w) {
+    component_t comp;
+    union xhashv xhv;
+    int n = 0;
+
+    router_lock(w->r);
+    xhv.comp_val = &comp;
+    if(xhash_iter_first(w->r->components))
+        do {
+            xhash_iter_get(w->r->components, NULL, NULL, xhv.val);
+            if(comp->w == w)
+                n++;
+        } while(xhash_iter_next(w->r->components));
+    router_unlock(w->r);
+
+    return n;
+}
+
+static void _router_worker_init(router_t r, worker_t w, int index) {
+    w->r = r;
+    w->index = index;
+
+    w->dead = jqueue_new();
+    w->closefd = jqueue_new();
+
+    w->wake[0] = w->wake[1] = -1;
+
+    /* only one, it just uses the main loop */
+    if(r->nworkers == 1) {
+        w->mio = r->mio;
+        return;
+    }
+
+#ifdef HAVE_PTHREAD
+    w->mio = mio_new(r->io_max_fds);
+    if(w->mio == NULL) {
+        log_write(r->log, LOG_ERR, "worker %d: couldn't create mio, aborting", index);
+        exit(1);
+    }
+
+    w->inbox = jqueue_new();
+    w->batch = jqueue_new();
+    pthread_mutex_init(&w->inbox_lock, NULL);
+
+    if(pipe(w->wake) < 0) {
+        log_write(r->log, LOG_ERR, "worker %d: couldn't create wakeup pipe: %s", index, strerror(errno));
+        exit(1);
+    }
+    fcntl(w->wake[1], F_SETFL, fcntl(w->wake[1], F_GETFL) | O_NONBLOCK);
+
+    w->wake_fd = mio_register(w->mio, w->wake[0], router_wake_callback, (void *) w);
+    mio_read(w->mio, w->wake_fd);
+#endif
+}
+
+static void _router_worker_cleanup(worker_t w) {
+    /* cleanup dead sx_ts */
+    while(jqueue_size(w->dead) > 0)
+        sx_free((sx_t) jqueue_pull(w->dead));
+
+    /* cleanup closed fd */
+    while(jqueue_size(w->closefd) > 0)
+        mio_close(w->mio, (mio_fd_t) jqueue_pull(w->closefd));
+}
+
+static void _router_worker_checks(worker_t w) {
+    router_t r = w->r;
+
+    /* time checks */
+    if(r->check_interval > 0 && time(NULL) >= w->next_check) {
+        log_debug(ZONE, "running time checks for worker %d", w->index);
+
+        _router_time_checks(w);
+
+        w->next_check = time(NULL) + r->check_interval;
+        log_debug(ZONE, "next time check at %d", w->next_check);
+    }
+}
+
+/** close our components, and give them a chance to go away quietly */
+static void _router_worker_close(worker_t w) {
+    router_t r = w->r;
+    component_t comp;
+    union xhashv xhv;
+    time_t close_wait_max;
+
+    close_wait_max = time(NULL) + 30; /* time limit for component shutdown */
+
+    router_lock(r);
+    xhv.comp_val = &comp;
+    if(xhash_iter_first(r->components))
+        do {
+            xhash_iter_get(r->components, NULL, NULL, xhv.val);
+            if(comp != NULL && comp->w == w) {
+                log_debug(ZONE, "close component %p", comp);
+                sx_close(comp->s);
+            }
+        } while(xhash_iter_next(r->components));
+    router_unlock(r);
+
+    while(_router_worker_ncomp(w) > 0 && time(NULL) < close_wait_max) {
+        mio_run(w->mio, 1);
+        _router_worker_cleanup(w);
+    }
+}
+
+static void _router_worker_free(worker_t w) {
+    _router_worker_cleanup(w);
+
+    jqueue_free(w->dead);
+    jqueue_free(w->closefd);
+
+#ifdef HAVE_PTHREAD
+    if(w->mio != w->r->mio) {
+        mio_close(w->mio, w->wake_fd);
+        close(w->wake[1]);
+        mio_free(w->mio);
+
+        jqueue_free(w->inbox);
+        jqueue_free(w->batch);
+        pthread_mutex_destroy(&w->inbox_lock);
+    }
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static void *_router_worker_run(void *arg) {
+    worker_t w = (worker_t) arg;
+    int stop = 0;
+
+    log_debug(ZONE, "worker %d running", w->index);
+
+    while(!stop) {
+        mio_run(w->mio, 5);
+
+        _router_worker_cleanup(w);
+
+        _router_worker_checks(w);
+
+        pthread_mutex_lock(&w->inbox_lock);
+        w->epoch++;
+        stop = w->stop;
+        pthread_mutex_unlock(&w->inbox_lock);
+    }
+
+    _router_worker_close(w);
+
+    log_debug(ZONE, "worker %d done", w->index);
+
+    return NULL;
+}
+
+/** free the old log once every worker has been round its loop since it was replaced */
+static void _router_stale_log(router_t r) {
+    worker_t w;
+    int i, moved = 1;
+
+    for(i = 0; i < r->nworkers && moved; i++) {
+        w = &r->workers[i];
+        pthread_mutex_lock(&w->inbox_lock);
+        moved = (w->epoch != w->stale_epoch);
+        pthread_mutex_unlock(&w->inbox_lock);
+    }
+
+    if(moved) {
+        log_free(r->stale_log);
+        r->stale_log = NULL;
+    }
+}
+#endif
+
 
 JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Router", NULL)
 {
@@ -300,14 +494,18 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
     char *config_file;
     int optchar;
     rate_t rt;
-    component_t comp;
     union xhashv xhv;
-    int close_wait_max;
+    log_t log;
+    int i;
     const char *cli_id = 0;
 
 #ifdef POOL_DEBUG
     time_t pool_time = 0;
 #endif
+#ifdef HAVE_SSL
+    time_t ssl_time = time(NULL);
+    char stats[256];
+#endif
 
 #ifdef HAVE_UMASK
     umask((mode_t) 0027);
@@ -414,17 +612,18 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
 
     r->log_sinks = xhash_new(101);
 
-    r->dead = jqueue_new();
-    r->closefd = jqueue_new();
     r->deadroutes = jqueue_new();
 
     r->sx_env = sx_env_new();
+    sx_env_read_budget(r->sx_env, r->io_read_budget);
 
 #ifdef HAVE_SSL
     if(r->local_pemfile != NULL) {
         r->sx_ssl = sx_env_plugin(r->sx_env, sx_ssl_init, NULL, r->local_pemfile, NULL, NULL, r->local_private_key_password, r->local_ciphers);
         if(r->sx_ssl == NULL)
             log_write(r->log, LOG_ERR, "failed to load SSL pemfile, SSL disabled");
+        else
+            sx_ssl_session_cache(r->sx_ssl, r->local_ssl_cache, r->local_ssl_cache_timeout, r->local_ssl_tickets);
     }
 #endif
 
@@ -437,6 +636,42 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
 
     r->mio = mio_new(r->io_max_fds);
 
+#ifndef HAVE_PTHREAD
+    if(r->nworkers > 1) {
+        log_write(r->log, LOG_WARNING, "threads not available, running %d workers in one", r->nworkers);
+        r->nworkers = 1;
+    }
+#else
+    if(r->nworkers > 1)
+        pthread_mutex_init(&r->lock, NULL);
+#endif
+
+    /* message log and filter dumps are written from their own thread */
+    r->logwriter = logwriter_new(j_atoi(config_get_one(r->config, "message_logging.queue", 0), 10000),
+                                 j_atoi(config_get_one(r->config, "message_logging.sync", 0), 5),
+                                 (long) j_atoi(config_get_one(r->config, "message_logging.rotate.size", 0), 0) * 1024,
+                                 j_atoi(config_get_one(r->config, "message_logging.rotate.time", 0), 0));
+    if(r->logwriter == NULL) {
+        log_write(r->log, LOG_ERR, "couldn't start log writer, aborting");
+        exit(1);
+    }
+
+    r->workers = (worker_t) calloc(r->nworkers, sizeof(struct worker_st));
+    for(i = 0; i < r->nworkers; i++)
+        _router_worker_init(r, &r->workers[i], i);
+
+#ifdef HAVE_PTHREAD
+    if(r->nworkers > 1) {
+        for(i = 0; i < r->nworkers; i++)
+            if(pthread_create(&r->workers[i].thread, NULL, _router_worker_run, (void *) &r->workers[i]) != 0) {
+                log_write(r->log, LOG_ERR, "couldn't start worker %d, aborting", i);
+                exit(1);
+            }
+
+        log_write(r->log, LOG_NOTICE, "running %d workers", r->nworkers);
+    }
+#endif
+
     r->fd = mio_listen(r->mio, r->local_port, r->local_ip, router_mio_callback, (void *) r);
     if(r->fd == NULL) {
         log_write(r->log, LOG_ERR, "[%s, port=%d] unable to listen (%s)", r->local_ip, r->local_port, MIO_STRERROR(MIO_ERROR));
@@ -449,15 +684,33 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
     {
         mio_run(r->mio, 5);
 
-        if(router_logrotate)
+        /* the last reopen has to have finished before we can do another */
+        if(router_logrotate && r->stale_log == NULL)
         {
             set_debug_log_from_config(r->config);
 
             log_write(r->log, LOG_NOTICE, "reopening log ...");
-            log_free(r->log);
+            log = r->log;
             r->log = log_new(r->log_type, r->log_ident, r->log_facility);
+            if(r->nworkers == 1)
+                log_free(log);
+#ifdef HAVE_PTHREAD
+            else {
+                /* the workers might still be writing to it */
+                r->stale_log = log;
+                for(i = 0; i < r->nworkers; i++) {
+                    pthread_mutex_lock(&r->workers[i].inbox_lock);
+                    r->workers[i].stale_epoch = r->workers[i].epoch;
+                    pthread_mutex_unlock(&r->workers[i].inbox_lock);
+                }
+            }
+#endif
             log_write(r->log, LOG_NOTICE, "log started");
 
+            logwriter_reopen(r->logwriter);
+
+            router_lock(r);
+
             log_write(r->log, LOG_NOTICE, "reloading filter ...");
             filter_unload(r);
             filter_load(r);
@@ -466,30 +719,40 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
             user_table_unload(r);
             user_table_load(r);
 
+            router_unlock(r);
+
             router_logrotate = 0;
         }
 
-        /* cleanup dead sx_ts */
-        while(jqueue_size(r->dead) > 0)
-            sx_free((sx_t) jqueue_pull(r->dead));
-
-        /* cleanup closed fd */
-        while(jqueue_size(r->closefd) > 0)
-            mio_close(r->mio, (mio_fd_t) jqueue_pull(r->closefd));
+        if(r->nworkers == 1)
+            _router_worker_cleanup(&r->workers[0]);
 
         /* cleanup dead routes */
+        router_lock(r);
         while(jqueue_size(r->deadroutes) > 0)
             routes_free((routes_t) jqueue_pull(r->deadroutes));
+        router_unlock(r);
+
+        logwriter_report(r->logwriter, r->log);
 
-        /* time checks */
-        if(r->check_interval > 0 && time(NULL) >= r->next_check) {
-            log_debug(ZONE, "running time checks");
+        if(r->nworkers == 1)
+            _router_worker_checks(&r->workers[0]);
+#ifdef HAVE_PTHREAD
+        else if(r->stale_log != NULL)
+            _router_stale_log(r);
+#endif
+
+#ifdef HAVE_SSL
+        /* ticket keys, and how resumption is doing */
+        if(r->sx_ssl != NULL && time(NULL) > ssl_time + 60) {
+            sx_ssl_ticket_rotate(r->sx_ssl, time(NULL));
 
-            _router_time_checks(r);
+            if(r->check_interval > 0 && sx_ssl_stats_report(r->sx_ssl, stats, sizeof(stats)))
+                log_write(r->log, LOG_NOTICE, "%s", stats);
 
-            r->next_check = time(NULL) + r->check_interval;
-            log_debug(ZONE, "next time check at %d", r->next_check);
+            ssl_time = time(NULL);
         }
+#endif
 
 #ifdef POOL_DEBUG
         if(time(NULL) > pool_time + 60) {
@@ -515,32 +778,31 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
      *     their destinations
      */
 
-    close_wait_max = 30; /* time limit for component shutdown */
-
-    /* close connections to components */
-    xhv.comp_val = &comp;
-    if(xhash_iter_first(r->components))
-        do {
-            xhash_iter_get(r->components, NULL, NULL, xhv.val);
-            log_debug(ZONE, "close component %p", comp);
-            if (comp) sx_close(comp->s);
-            mio_run(r->mio, 5000);
-            if (1 > close_wait_max--) break;
-            sleep(1);
-            while(jqueue_size(r->closefd) > 0)
-                mio_close(r->mio, (mio_fd_t) jqueue_pull(r->closefd));
-        } while (xhash_iter_next(r->components));
+    /* close connections to components, each worker looks after its own */
+    if(r->nworkers == 1)
+        _router_worker_close(&r->workers[0]);
+#ifdef HAVE_PTHREAD
+    else
+    {
+        for(i = 0; i < r->nworkers; i++) {
+            pthread_mutex_lock(&r->workers[i].inbox_lock);
+            r->workers[i].stop = 1;
+            pthread_mutex_unlock(&r->workers[i].inbox_lock);
+            router_wake(&r->workers[i]);
+        }
+        for(i = 0; i < r->nworkers; i++)
+            pthread_join(r->workers[i].thread, NULL);
+    }
+#endif
 
     xhash_free(r->components);
 
-    /* cleanup dead sx_ts */
-    while(jqueue_size(r->dead) > 0)
-       sx_free((sx_t) jqueue_pull(r->dead));
-    jqueue_free(r->dead);
+    /* everything that's going to be logged has been by now */
+    logwriter_free(r->logwriter);
 
-    while(jqueue_size(r->closefd) > 0)
-        mio_close(r->mio, (mio_fd_t) jqueue_pull(r->closefd));
-    jqueue_free(r->closefd);
+    for(i = 0; i < r->nworkers; i++)
+        _router_worker_free(&r->workers[i]);
+    free(r->workers);
 
     /* cleanup dead routes - probably just showed up (route was just closed) */
     while(jqueue_size(r->deadroutes) > 0)
@@ -583,8 +845,15 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
 
     access_free(r->access);
 
+    if(r->stale_log != NULL)
+        log_free(r->stale_log);
     log_free(r->log);
 
+#ifdef HAVE_PTHREAD
+    if(r->nworkers > 1)
+        pthread_mutex_destroy(&r->lock);
+#endif
+
     config_free(r->config);
 
     free(r);
@@ -32,6 +32,70 @@ typedef struct broadcast_st {
     nad_t         nad;
 } *broadcast_t;
 
+/** recipients of a multicast route that go to the same component */
+typedef struct mcast_st {
+    component_t   target;
+    nad_t         nad;
+} *mcast_t;
+
+/** things handed from one worker to another */
+typedef enum {
+    handoff_PACKET,         /**< packet for a component, goes through its throttle queue */
+    handoff_DIRECT,         /**< packet for a component, straight to its stream */
+    handoff_ACCEPT          /**< new connection for the worker to take over */
+} handoff_type_t;
+
+typedef struct handoff_st {
+    handoff_type_t      type;
+    component_t         comp;
+    nad_t               nad;
+
+    /** accepted socket */
+    int                 fd;
+    char                ip[INET6_ADDRSTRLEN];
+    int                 port;
+} *handoff_t;
+
+static void _router_comp_send(component_t src, component_t target, nad_t nad, handoff_type_t type);
+
+/** the shared tables only need guarding when there are other threads about */
+void router_lock(router_t r) {
+#ifdef HAVE_PTHREAD
+    if(r->nworkers > 1)
+        pthread_mutex_lock(&r->lock);
+#endif
+}
+
+void router_unlock(router_t r) {
+#ifdef HAVE_PTHREAD
+    if(r->nworkers > 1)
+        pthread_mutex_unlock(&r->lock);
+#endif
+}
+
+/** poke a worker out of mio_run() */
+void router_wake(worker_t w) {
+    char c = 0;
+
+    if(w->wake[1] >= 0 && write(w->wake[1], &c, 1) < 0 && !MIO_WOULDBLOCK)
+        log_debug(ZONE, "couldn't wake worker %d: %s", w->index, strerror(errno));
+}
+
+/** queue something for another worker, waking it if it was idle */
+static void _router_handoff(worker_t w, handoff_t h) {
+#ifdef HAVE_PTHREAD
+    int idle;
+
+    pthread_mutex_lock(&w->inbox_lock);
+    idle = (jqueue_size(w->inbox) == 0);
+    jqueue_push(w->inbox, (void *) h, 0);
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    if(idle)
+        router_wake(w);
+#endif
+}
+
 /** broadcast a packet */
 static void _router_broadcast(const char *key, int keylen, void *val, void *arg) {
     int i;
@@ -43,7 +107,7 @@ static void _router_broadcast(const char *key, int keylen, void *val, void *arg)
         if(routes->comp[i] == bc->src || routes->comp[i]->legacy)
             continue;
 
-        sx_nad_write(routes->comp[i]->s, nad_copy(bc->nad));
+        _router_comp_send(bc->src, routes->comp[i], nad_copy(bc->nad), handoff_DIRECT);
     }
 }
 
@@ -150,6 +214,50 @@ static void _router_process_handshake(component_t comp, nad_t nad) {
     nad_free(nad);
 }
 
+/** fnv-1a, carrying on from a previous value */
+static unsigned long long _route_hash(unsigned long long h, const char *str, int len) {
+    int i;
+
+    for(i = 0; i < len; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+#define ROUTE_HASH_INIT (0xcbf29ce484222325ULL)
+
+/** splitmix64 finaliser, so close keys score very differently */
+static unsigned long long _route_mix(unsigned long long h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return h;
+}
+
+/** rendezvous hashing - each target scores the key once per unit of weight,
+ *  and the best score wins. when a target comes or goes, only the keys it
+ *  wins (or won) move */
+static int _route_pick(routes_t targets, unsigned long long key) {
+    unsigned long long score, best = 0;
+    int i, w, dest = 0;
+
+    for(i = 0; i < targets->ncomp; i++)
+        for(w = 0; w < targets->comp[i]->weight; w++) {
+            score = _route_mix(key ^ targets->comp[i]->rhash ^ ((unsigned long long) w * 0x9e3779b97f4a7c15ULL));
+            if(score > best) {
+                best = score;
+                dest = i;
+            }
+        }
+
+    return dest;
+}
+
 void routes_free(routes_t routes) {
     if(routes->name) free((void*)routes->name);
     if(routes->comp) free(routes->comp);
@@ -203,7 +311,7 @@ static void _router_process_bind(component_t comp, nad_t nad) {
     int attr, multi, n;
     jid_t name;
     alias_t alias;
-    char *user, *c;
+    char *user, *c, weight[8];
 
     attr = nad_find_attr(nad, 0, -1, "name", NULL);
     if(attr < 0 || (name = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr))) == NULL) {
@@ -292,8 +400,34 @@ static void _router_process_bind(component_t comp, nad_t nad) {
         xhash_put(comp->r->log_sinks, pstrdup(xhash_pool(comp->r->log_sinks), name->domain), (void *) comp);
     }
 
+    /* multicast routes */
+    if((attr = nad_find_elem(nad, 0, NAD_ENS(nad, 0), "multicast", 1)) >= 0) {
+        log_debug(ZONE, "[%s] takes multicast routes", name->domain);
+
+        comp->multicast = 1;
+
+        /* let them know we do too */
+        nad_drop_elem(nad, attr);
+        nad_set_attr(nad, 0, -1, "multicast", "true", 4);
+    }
+
     free(user);
 
+    /* a stable name keeps them in the same place among the other instances when they reconnect */
+    if(multi >= 0) {
+        if((attr = nad_find_attr(nad, 0, -1, "instance", NULL)) >= 0)
+            comp->rhash = _route_hash(ROUTE_HASH_INIT, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+
+        if((attr = nad_find_attr(nad, 0, -1, "weight", NULL)) >= 0) {
+            snprintf(weight, sizeof(weight), "%.*s", NAD_AVAL_L(nad, attr), NAD_AVAL(nad, attr));
+            comp->weight = j_atoi(weight, 1);
+            if(comp->weight < 1)
+                comp->weight = 1;
+            if(comp->weight > 100)
+                comp->weight = 100;
+        }
+    }
+
     n = _route_add(comp->r->routes, name->domain, comp, multi<0?route_SINGLE:route_MULTI_TO);
     xhash_put(comp->routes, pstrdup(xhash_pool(comp->routes), name->domain), (void *) comp);
 
@@ -399,15 +533,110 @@ static void _router_comp_write(component_t comp, nad_t nad) {
     sx_nad_write_elem(comp->s, nad, 1);
 }
 
+/** write to a component, via its worker if it isn't ours. called with the router locked */
+static void _router_comp_send(component_t src, component_t target, nad_t nad, handoff_type_t type) {
+    handoff_t h;
+
+    if(target->w == src->w) {
+        if(type == handoff_DIRECT)
+            sx_nad_write(target->s, nad);
+        else
+            _router_comp_write(target, nad);
+        return;
+    }
+
+    log_debug(ZONE, "handing packet for %s, port %d to worker %d", target->ip, target->port, target->w->index);
+
+    h = (handoff_t) calloc(1, sizeof(struct handoff_st));
+    h->type = type;
+    h->comp = target;
+    h->nad = nad;
+
+    _router_handoff(target->w, h);
+}
+
 static void _router_route_log_sink(const char *key, int keylen, void *val, void *arg) {
     component_t comp = (component_t) val;
-    nad_t nad = (nad_t) arg;
+    broadcast_t bc = (broadcast_t) arg;
+    nad_t nad;
 
     log_debug(ZONE, "copying route to '%.*s' (%s, port %d)", keylen, key, comp->ip, comp->port);
 
-    nad = nad_copy(nad);
+    nad = nad_copy(bc->nad);
     nad_set_attr(nad, 0, -1, "type", "log", 3);
-    _router_comp_write(comp, nad);
+    _router_comp_send(bc->src, comp, nad, handoff_PACKET);
+}
+
+static void _router_process_route(component_t comp, nad_t nad);
+
+/** split a multicast route up by destination component. ones that can't take it get unicast routes */
+static void _router_process_multicast(component_t comp, nad_t nad, jid_t from) {
+    int addrs, ns, elem, addr, attr, dlen, split, ngroups = 0, i;
+    const char *domain;
+    nad_t tmpl;
+    routes_t targets;
+    component_t target;
+    struct mcast_st *groups = NULL;
+
+    addrs = stanza_multicast_addresses(nad);
+    if(addrs < 0) {
+        log_debug(ZONE, "multicast route without addresses, dropping");
+        nad_free(nad);
+        return;
+    }
+
+    tmpl = nad_copy(nad);
+    nad_drop_elem(tmpl, addrs);
+
+    /* filters and logging work on single packets */
+    split = (comp->r->filter != NULL || xhash_count(comp->r->log_sinks) > 0 || comp->r->message_logging_enabled);
+
+    ns = NAD_ENS(nad, addrs);
+    for(elem = nad_find_elem(nad, addrs, ns, "address", 1); elem >= 0; elem = nad_find_elem(nad, elem, ns, "address", 0)) {
+        attr = nad_find_attr(nad, elem, -1, "to", NULL);
+        if(attr < 0 || NAD_AVAL_L(nad, attr) == 0)
+            continue;
+
+        domain = stanza_jid_domain(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr), &dlen);
+
+        target = NULL;
+        if(!split) {
+            targets = xhash_getx(comp->r->routes, domain, dlen);
+            if(targets == NULL && comp->r->default_route != NULL && strcmp(from->domain, comp->r->default_route) != 0)
+                targets = xhash_get(comp->r->routes, comp->r->default_route);
+
+            if(targets != NULL && targets->ncomp == 1 && targets->comp[0]->multicast)
+                target = targets->comp[0];
+        }
+
+        /* no way to pass this one on as part of a group, route it by itself */
+        if(target == NULL) {
+            _router_process_route(comp, stanza_multicast_unicast(tmpl, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr)));
+            continue;
+        }
+
+        for(i = 0; i < ngroups && groups[i].target != target; i++);
+        if(i == ngroups) {
+            groups = (struct mcast_st *) realloc(groups, sizeof(struct mcast_st) * (ngroups + 1));
+            groups[i].target = target;
+            groups[i].nad = nad_copy(tmpl);
+            nad_set_attr(groups[i].nad, 0, -1, "to", domain, dlen);
+            nad_append_elem(groups[i].nad, ns, "addresses", 1);
+            ngroups++;
+        }
+
+        addr = nad_append_elem(groups[i].nad, ns, "address", 2);
+        nad_set_attr(groups[i].nad, addr, -1, "to", NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+    }
+
+    for(i = 0; i < ngroups; i++) {
+        log_debug(ZONE, "writing multicast route to %s, port %d", groups[i].target->ip, groups[i].target->port);
+        _router_comp_send(comp, groups[i].target, groups[i].nad, handoff_PACKET);
+    }
+
+    free(groups);
+    nad_free(tmpl);
+    nad_free(nad);
 }
 
 static void _router_process_route(component_t comp, nad_t nad) {
@@ -419,6 +648,7 @@ static void _router_process_route(component_t comp, nad_t nad) {
     routes_t targets;
     component_t target;
     union xhashv xhv;
+    struct broadcast_st bc;
 
     /* init static jid */
     jid_static(&sto,&sto_buf);
@@ -491,8 +721,12 @@ static void _router_process_route(component_t comp, nad_t nad) {
         }
 
         /* copy to any log sinks */
-        if(xhash_count(comp->r->log_sinks) > 0)
-            xhash_walk(comp->r->log_sinks, _router_route_log_sink, (void *) nad);
+        if(xhash_count(comp->r->log_sinks) > 0) {
+            bc.r = comp->r;
+            bc.src = comp;
+            bc.nad = nad;
+            xhash_walk(comp->r->log_sinks, _router_route_log_sink, (void *) &bc);
+        }
 
         /* get route candidate */
         if(targets->ncomp == 1) {
@@ -528,33 +762,21 @@ static void _router_process_route(component_t comp, nad_t nad) {
             }
             if(to->node == NULL || strlen(to->node) == 0) {
                 /* no node in destination JID - going random */
-                dest = rand();
-                log_debug(ZONE, "randomized to %u %% %d = %d", dest, targets->ncomp, dest % targets->ncomp);
+                dest = rand() % targets->ncomp;
+                log_debug(ZONE, "randomized to %d of %d", dest, targets->ncomp);
             }
             else {
                 /* use JID hash */
-                unsigned char hashval[20];
-                unsigned int *val;
-                int i;
+                unsigned long long key;
 
-                shahash_raw(jid_user(to), hashval);
+                key = _route_hash(ROUTE_HASH_INIT, to->node, strlen(to->node));
+                key = _route_hash(key, "@", 1);
+                key = _route_hash(key, to->domain, strlen(to->domain));
 
-                val = (unsigned int *) hashval;
-                dest = *val;
-                for(i=1; i < 20 / (sizeof(unsigned int)/sizeof(unsigned char)); i++, val++) {
-                    dest ^= *val;
-                }
-                dest >>= 2;
-
-                log_debug(ZONE, "JID %s hashed to %u %% %d = %d", jid_user(to), dest, targets->ncomp, dest % targets->ncomp);
+                dest = _route_pick(targets, key);
 
-                /* jid_user() calls jid_expand() which may allocate some memory in _user and _full */
-                if (to->_user != NULL )
-                    free(to->_user);
-                if (to->_full != NULL )
-                    free(to->_full);
+                log_debug(ZONE, "JID %s@%s hashed to %d of %d", to->node, to->domain, dest, targets->ncomp);
             }
-            dest = dest % targets->ncomp;
         }
 
         target = targets->comp[dest];
@@ -596,7 +818,31 @@ static void _router_process_route(component_t comp, nad_t nad) {
                 jid_free(jid_route_to);
         }
 
-        _router_comp_write(target, nad);
+        _router_comp_send(comp, target, nad, handoff_PACKET);
+
+        return;
+    }
+
+    /* multicast */
+    if(NAD_AVAL_L(nad, atype) == 9 && strncmp("multicast", NAD_AVAL(nad, atype), 9) == 0) {
+        if(from == NULL) {
+            log_debug(ZONE, "multicast route with missing or invalid from, bouncing");
+            nad_set_attr(nad, 0, -1, "error", "400", 3);
+            _router_comp_write(comp, nad);
+            return;
+        }
+
+        log_debug(ZONE, "multicast route from %s", from->domain);
+
+        /* check the from */
+        if(xhash_get(comp->routes, from->domain) == NULL) {
+            log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] tried to send a packet from '%s', but that name is not bound to this component", comp->ip, comp->port, from->domain);
+            nad_set_attr(nad, 0, -1, "error", "401", 3);
+            _router_comp_write(comp, nad);
+            return;
+        }
+
+        _router_process_multicast(comp, nad, from);
 
         return;
     }
@@ -629,7 +875,7 @@ static void _router_process_route(component_t comp, nad_t nad) {
                 if(target != comp) {
                     log_debug(ZONE, "writing broadcast to %s, port %d", target->ip, target->port);
 
-                    _router_comp_write(target, nad_copy(nad));
+                    _router_comp_send(comp, target, nad_copy(nad), handoff_PACKET);
                 }
             } while(xhash_iter_next(comp->r->components));
 
@@ -686,12 +932,12 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     switch(e) {
         case event_WANT_READ:
             log_debug(ZONE, "want read");
-            mio_read(comp->r->mio, comp->fd);
+            mio_read(comp->w->mio, comp->fd);
             break;
 
         case event_WANT_WRITE:
             log_debug(ZONE, "want write");
-            mio_write(comp->r->mio, comp->fd);
+            mio_write(comp->w->mio, comp->fd);
             break;
 
         case event_READ:
@@ -792,6 +1038,9 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             /* component, old skool */
             comp->legacy = 1;
 
+            /* its packets get rewritten in both directions, no point keeping the wire form */
+            s->flags &= ~SX_RAW_PASSTHROUGH;
+
             /* enabled? */
             if(comp->r->local_secret == NULL) {
                 sx_error(s, stream_err_INVALID_NAMESPACE, "support for legacy components not available");      /* !!! correct error? */
@@ -821,6 +1070,7 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                         return 0;
                     }
 
+                router_lock(comp->r);
 
                 n = _route_add(comp->r->routes, s->req_to, comp, route_MULTI_FROM);
                 xhash_put(comp->routes, pstrdup(xhash_pool(comp->routes), s->req_to), (void *) comp);
@@ -847,6 +1097,8 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                         _router_advertise(comp->r, alias->name, comp, 0);
                     }
                 }
+
+                router_unlock(comp->r);
             }
 
             break;
@@ -933,19 +1185,25 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
             /* bind a name to this component */
             if(NAD_ENAME_L(nad, 0) == 4 && strncmp("bind", NAD_ENAME(nad, 0), 4) == 0) {
+                router_lock(comp->r);
                 _router_process_bind(comp, nad);
+                router_unlock(comp->r);
                 return 0;
             }
 
             /* unbind a name from this component */
             if(NAD_ENAME_L(nad, 0) == 6 && strncmp("unbind", NAD_ENAME(nad, 0), 6) == 0) {
+                router_lock(comp->r);
                 _router_process_unbind(comp, nad);
+                router_unlock(comp->r);
                 return 0;
             }
 
             /* route packets */
             if(NAD_ENAME_L(nad, 0) == 5 && strncmp("route", NAD_ENAME(nad, 0), 5) == 0) {
+                router_lock(comp->r);
                 _router_process_route(comp, nad);
+                router_unlock(comp->r);
                 return 0;
             }
 
@@ -964,9 +1222,9 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
         {
             /* close comp->fd by putting it in closefd ... unless it is already there */
             _jqueue_node_t n;
-            for (n = comp->r->closefd->front; n != NULL; n = n->prev)
+            for (n = comp->w->closefd->front; n != NULL; n = n->prev)
                 if (n->data == comp->fd) break;
-            if (!n) jqueue_push(comp->r->closefd, (void *) comp->fd, 0 /*priority*/);
+            if (!n) jqueue_push(comp->w->closefd, (void *) comp->fd, 0 /*priority*/);
             return 0;
         }
     }
@@ -1025,12 +1283,114 @@ static void _router_route_unbind_walker(const char *key, int keylen, void *val,
     free(local_key);
 }
 
+/** set up a component on a new connection, owned by worker w */
+static void _router_comp_new(worker_t w, mio_fd_t fd, const char *ip, int port) {
+    router_t r = w->r;
+    component_t comp;
+
+    comp = (component_t) calloc(1, sizeof(struct component_st));
+
+    comp->r = r;
+    comp->w = w;
+
+    comp->fd = fd;
+
+    snprintf(comp->ip, INET6_ADDRSTRLEN, "%s", ip);
+    comp->port = port;
+
+    snprintf(comp->ipport, INET6_ADDRSTRLEN + 6, "%s:%d", comp->ip, comp->port);
+
+    /* until they tell us who they are */
+    comp->rhash = _route_hash(ROUTE_HASH_INIT, comp->ipport, strlen(comp->ipport));
+    comp->weight = 1;
+
+    comp->s = sx_new(r->sx_env, fd->fd, _router_sx_callback, (void *) comp);
+    mio_app(w->mio, fd, router_mio_callback, (void *) comp);
+
+    if(r->byte_rate_total != 0)
+        comp->rate = rate_new(r->byte_rate_total, r->byte_rate_seconds, r->byte_rate_wait);
+
+    comp->routes = xhash_new(51);
+
+    /* register component */
+    log_debug(ZONE, "new component (%p) \"%s\" on worker %d", comp, comp->ipport, w->index);
+    router_lock(r);
+    xhash_put(r->components, comp->ipport, (void *) comp);
+    router_unlock(r);
+
+#ifdef HAVE_SSL
+    sx_server_init(comp->s, SX_SSL_STARTTLS_OFFER | SX_SASL_OFFER | SX_RAW_PASSTHROUGH);
+#else
+    sx_server_init(comp->s, SX_SASL_OFFER | SX_RAW_PASSTHROUGH);
+#endif
+}
+
+/** process whatever the other threads have left for this worker */
+int router_wake_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    worker_t w = (worker_t) arg;
+    jqueue_t q;
+    handoff_t h;
+    mio_fd_t nfd;
+    char buf[64];
+
+    if(a != action_READ)
+        return 0;
+
+    while(read(fd->fd, buf, sizeof(buf)) > 0);
+
+#ifdef HAVE_PTHREAD
+    /* take the whole batch, so the others aren't kept waiting while we write */
+    pthread_mutex_lock(&w->inbox_lock);
+    q = w->inbox;
+    w->inbox = w->batch;
+    w->batch = q;
+    pthread_mutex_unlock(&w->inbox_lock);
+#else
+    q = w->inbox;
+#endif
+
+    while((h = (handoff_t) jqueue_pull(q)) != NULL) {
+        switch(h->type) {
+            case handoff_PACKET:
+                if(h->comp != NULL)
+                    _router_comp_write(h->comp, h->nad);
+                break;
+
+            case handoff_DIRECT:
+                if(h->comp != NULL)
+                    sx_nad_write(h->comp->s, h->nad);
+                break;
+
+            case handoff_ACCEPT:
+                nfd = mio_register(w->mio, h->fd, router_mio_callback, NULL);
+                if(nfd == NULL) {
+                    log_write(w->r->log, LOG_ERR, "[%s, port=%d] worker %d couldn't take connection", h->ip, h->port, w->index);
+                    close(h->fd);
+                    break;
+                }
+
+                _router_comp_new(w, nfd, h->ip, h->port);
+                break;
+        }
+
+        free(h);
+    }
+
+    /* keep reading */
+    return 1;
+}
+
 int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
     component_t comp = (component_t) arg;
     router_t r = (router_t) arg;
     struct sockaddr_storage sa;
     socklen_t namelen = sizeof(sa);
     int port, nbytes;
+    worker_t w;
+#ifdef HAVE_PTHREAD
+    _jqueue_node_t n;
+    handoff_t h;
+#endif
 
     switch(a) {
         case action_READ:
@@ -1062,12 +1422,31 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
 
             log_write(r->log, LOG_NOTICE, "[%s, port=%d] disconnect", comp->ip, comp->port);
 
+            router_lock(r);
+
             /* unbind names */
             xhash_walk(comp->routes, _router_route_unbind_walker, (void *) comp);
 
             /* deregister component */
             xhash_zap(r->components, comp->ipport);
 
+            router_unlock(r);
+
+#ifdef HAVE_PTHREAD
+            /* nobody can find us now, drop anything already on its way */
+            if(r->nworkers > 1) {
+                pthread_mutex_lock(&comp->w->inbox_lock);
+                for(n = comp->w->inbox->front; n != NULL; n = n->prev) {
+                    h = (handoff_t) n->data;
+                    if(h->comp == comp) {
+                        nad_free(h->nad);
+                        h->comp = NULL;
+                    }
+                }
+                pthread_mutex_unlock(&comp->w->inbox_lock);
+            }
+#endif
+
             xhash_free(comp->routes);
 
             if(comp->tq != NULL)
@@ -1076,7 +1455,7 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
 
             rate_free(comp->rate);
 
-            jqueue_push(comp->r->dead, (void *) comp->s, 0);
+            jqueue_push(comp->w->dead, (void *) comp->s, 0);
 
             free(comp);
 
@@ -1094,35 +1473,33 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
             if(_router_accept_check(r, fd, (char *) data) != 0)
                 return 1;
 
-            comp = (component_t) calloc(1, sizeof(struct component_st));
-
-            comp->r = r;
-
-            comp->fd = fd;
-
-            snprintf(comp->ip, INET6_ADDRSTRLEN, "%s", (char *) data);
-            comp->port = port;
-
-            snprintf(comp->ipport, INET6_ADDRSTRLEN + 6, "%s:%d", comp->ip, comp->port);
-
-            comp->s = sx_new(r->sx_env, fd->fd, _router_sx_callback, (void *) comp);
-            mio_app(m, fd, router_mio_callback, (void *) comp);
-
-            if(r->byte_rate_total != 0)
-                comp->rate = rate_new(r->byte_rate_total, r->byte_rate_seconds, r->byte_rate_wait);
-
-            comp->routes = xhash_new(51);
+            /* spread components across the workers */
+            w = &r->workers[r->next_worker];
+            r->next_worker = (r->next_worker + 1) % r->nworkers;
+
+#ifdef HAVE_PTHREAD
+            if(r->nworkers > 1) {
+                /* give the worker its own copy of the socket, and let mio drop ours */
+                h = (handoff_t) calloc(1, sizeof(struct handoff_st));
+                h->type = handoff_ACCEPT;
+                h->fd = dup(fd->fd);
+                snprintf(h->ip, INET6_ADDRSTRLEN, "%s", (char *) data);
+                h->port = port;
+
+                if(h->fd < 0) {
+                    log_write(r->log, LOG_ERR, "[%s, port=%d] couldn't hand connection to worker: %s", h->ip, h->port, strerror(errno));
+                    free(h);
+                    return 1;
+                }
 
-            /* register component */
-            log_debug(ZONE, "new component (%p) \"%s\"", comp, comp->ipport);
-            xhash_put(r->components, comp->ipport, (void *) comp);
+                _router_handoff(w, h);
 
-#ifdef HAVE_SSL
-            sx_server_init(comp->s, SX_SSL_STARTTLS_OFFER | SX_SASL_OFFER);
-#else
-            sx_server_init(comp->s, SX_SASL_OFFER);
+                return 1;
+            }
 #endif
 
+            _router_comp_new(w, fd, (char *) data, port);
+
             break;
     }
 
@@ -1131,15 +1508,11 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
 
 
 int message_log(nad_t nad, router_t r, const char *msg_from, const char *msg_to) {
-    time_t t;
-    struct tm *time_pos;
-    char timestamp[25];
-    struct stat filestat;
-    FILE *message_file;
-    short int new_msg_file = 0;
-    int i;
+    logrec_t rec;
+    int i, from_len, to_len;
     int nad_body_len = 0;
-    char *nad_body = NULL;
+    const char *nad_body = NULL;
+    char *out;
     int elem;
 
     assert((int) (nad != NULL));
@@ -1158,57 +1531,29 @@ int message_log(nad_t nad, router_t r, const char *msg_from, const char *msg_to)
     nad_body_len = NAD_CDATA_L(nad, elem);
     nad_body = NAD_CDATA(nad, elem);
 
-    // temporary replace line endings with 0x01, ASCII: <control> SOH <start of heading>
-    for (i = 0; i < nad_body_len; i++) {
-        if (nad_body[i] == '\n') {
-            nad_body[i] = 0x01;
-        }
-    }
-
-    // Log our message
-    umask((mode_t) 0077);
-    if (stat(r->message_logging_file, &filestat)) {
-        new_msg_file = 1;
-    }
-
-    if ((message_file = fopen(r->message_logging_file, "a")) == NULL) {
-        log_write(r->log, LOG_ERR, "Unable to open message log for writing: %s", strerror(errno));
-        return 1;
-    }
-
-    if (new_msg_file) {
-        if (! fprintf(message_file, "# This message log is created by the jabberd router.\n"))
-        {
-            log_write(r->log, LOG_ERR, "Unable to write to message log: %s", strerror(errno));
-            fclose(message_file);
-            return 1;
-        }
-        fprintf(message_file, "# See router.xml for logging options.\n");
-        fprintf(message_file, "# Format: DateTime FromJID ToJID MessageBody<line end>\n");
-    }
-
-    /* ISO8601 timestamp */
-    t = time(NULL);
-    time_pos = localtime(&t);
-    if (strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S%z", time_pos) == 0) {
-        log_write(r->log, LOG_ERR, "strftime failed: %s", strerror(errno));
-    }
-
-    elem = fprintf(message_file, "%s %s %s %.*s\n", timestamp, msg_from, msg_to, nad_body_len, nad_body);
-
-    fclose(message_file);
-
-    // revert line endings
+    from_len = strlen(msg_from);
+    to_len = strlen(msg_to);
+
+    // the writer puts the timestamp on the front
+    rec = logwriter_rec(r->message_logging_file,
+                        "# This message log is created by the jabberd router.\n"
+                        "# See router.xml for logging options.\n"
+                        "# Format: DateTime FromJID ToJID MessageBody<line end>\n",
+                        time(NULL), from_len + to_len + nad_body_len + 3);
+
+    out = rec->data;
+    memcpy(out, msg_from, from_len);
+    out += from_len;
+    *out++ = ' ';
+    memcpy(out, msg_to, to_len);
+    out += to_len;
+    *out++ = ' ';
+
+    // line endings become 0x01, ASCII: <control> SOH <start of heading>
     for (i = 0; i < nad_body_len; i++) {
-        if (nad_body[i] == 0x01) {
-            nad_body[i] = '\n';
-        }
+        *out++ = (nad_body[i] == '\n') ? 0x01 : nad_body[i];
     }
+    *out = '\n';
 
-    if (!elem) {
-        log_write(r->log, LOG_ERR, "Unable to write to message log: %s", strerror(errno));
-        return 1;
-    }
-
-    return 0;
+    return logwriter_push(r->logwriter, rec);
 }
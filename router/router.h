@@ -47,11 +47,17 @@
 #ifdef HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 typedef struct router_st    *router_t;
+typedef struct worker_st    *worker_t;
 typedef struct component_st *component_t;
 typedef struct routes_st    *routes_t;
 typedef struct alias_st     *alias_t;
+typedef struct logwriter_st *logwriter_t;
+typedef struct logrec_st    *logrec_t;
 
 typedef struct acl_s *acl_t;
 struct acl_s {
@@ -64,8 +70,16 @@ struct acl_s {
     char *dump;
     int log;
     acl_t next;
+
+    /** compiled form, see filter.c */
+    int index;
+    int from_type, from_len;
+    int to_type, to_len;
+    acl_t next_idx;
 };
 
+typedef struct filter_st *filter_t;
+
 struct router_st {
     /** our id */
     const char          *id;
@@ -81,6 +95,9 @@ struct router_st {
     acl_t               filter;
     time_t              filter_load;
 
+    /** filter rules compiled for lookup */
+    filter_t            filter_idx;
+
     /** logging */
     log_t               log;
 
@@ -97,9 +114,17 @@ struct router_st {
     const char          *local_private_key_password;
     const char          *local_ciphers;
 
+    /** tls session cache size and timeout, and ticket key lifetime (seconds) */
+    int                 local_ssl_cache;
+    int                 local_ssl_cache_timeout;
+    int                 local_ssl_tickets;
+
     /** max file descriptors */
     int                 io_max_fds;
 
+    /** most bytes to read from a connection per read event, 0 for the default */
+    int                 io_read_budget;
+
     /** access controls */
     access_t            access;
 
@@ -130,8 +155,6 @@ struct router_st {
     int                 check_interval;
     int                 check_keepalive;
 
-    time_t              next_check;
-
     /** attached components, key is 'ip:port', var is component_t */
     xht                 components;
 
@@ -150,24 +173,75 @@ struct router_st {
     /** access control lists */
     xht                 aci;
 
+    /** list of routes_t waiting to be cleaned up */
+    jqueue_t            deadroutes;
+
+    /** event loops, components are spread across these */
+    worker_t            workers;
+    int                 nworkers;
+    int                 next_worker;
+
+    /** log replaced by a reopen, freed once every worker has moved past it */
+    log_t               stale_log;
+
+#ifdef HAVE_PTHREAD
+    /** guards the tables above when there is more than one worker */
+    pthread_mutex_t     lock;
+#endif
+
+    /** simple message logging */
+	int message_logging_enabled;
+	const char *message_logging_file;
+
+    /** writes the message log and filter dumps off the routing path */
+    logwriter_t         logwriter;
+};
+
+/** an event loop and the components attached to it */
+struct worker_st {
+    router_t            r;
+    int                 index;
+
+    /** managed io for our components */
+    mio_t               mio;
+
     /** list of sx_t waiting to be cleaned up */
     jqueue_t            dead;
 
     /** list of mio_fd_t waiting to be closed */
     jqueue_t            closefd;
 
-    /** list of routes_t waiting to be cleaned up */
-    jqueue_t            deadroutes;
+    /** time checks */
+    time_t              next_check;
 
-    /** simple message logging */
-	int message_logging_enabled;
-	const char *message_logging_file;
+    /** packets and connections handed over by other threads */
+    jqueue_t            inbox;
+    jqueue_t            batch;
+    int                 wake[2];
+    mio_fd_t            wake_fd;
+
+    /** loop counter, lets the main thread know when we're past a log reopen */
+    unsigned long       epoch;
+    unsigned long       stale_epoch;
+
+    /** set when we should close our components and exit */
+    int                 stop;
+
+#ifdef HAVE_PTHREAD
+    pthread_t           thread;
+
+    /** guards inbox, epoch and stop */
+    pthread_mutex_t     inbox_lock;
+#endif
 };
 
 /** a single component */
 struct component_st {
     router_t            r;
 
+    /** the worker whose event loop owns us */
+    worker_t            w;
+
     /** file descriptor */
     mio_fd_t            fd;
 
@@ -191,6 +265,13 @@ struct component_st {
     /** true if this is an old component:accept stream */
     int                 legacy;
 
+    /** true if this component expands multicast routes itself */
+    int                 multicast;
+
+    /** where we sit among the other components on a multi route */
+    unsigned long long  rhash;
+    int                 weight;
+
     /** throttle queue */
     jqueue_t            tq;
 
@@ -221,6 +302,10 @@ struct alias_st {
 };
 
 int     router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg);
+int     router_wake_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg);
+void    router_wake(worker_t w);
+void    router_lock(router_t r);
+void    router_unlock(router_t r);
 void    router_sx_handshake(sx_t s, sx_buf_t buf, void *arg);
 
 xht     aci_load(router_t r);
@@ -236,6 +321,28 @@ int     filter_packet(router_t r, nad_t nad);
 
 int     message_log(nad_t nad, router_t r, const char *msg_from, const char *msg_to);
 
+/** a record for the log writer, the data and file name live in the same allocation */
+struct logrec_st {
+    logrec_t            next;
+
+    /** written first when the file is new */
+    const char          *header;
+
+    /** if set, the record is prefixed with this time */
+    time_t              stamp;
+
+    char                *file;
+    char                *data;
+    int                 len;
+};
+
+logwriter_t logwriter_new(int max, int sync, long rotate_size, int rotate_time);
+void        logwriter_free(logwriter_t lw);
+logrec_t    logwriter_rec(const char *file, const char *header, time_t stamp, int len);
+int         logwriter_push(logwriter_t lw, logrec_t rec);
+void        logwriter_reopen(logwriter_t lw);
+void        logwriter_report(logwriter_t lw, log_t log);
+
 void routes_free(routes_t routes);
 
 /* union for xhash_iter_get to comply with strict-alias rules for gcc3 */
@@ -60,6 +60,36 @@ static void _in_result(conn_t in, nad_t nad);
 static void _in_verify(conn_t in, nad_t nad);
 static void _in_packet(conn_t in, nad_t nad);
 
+/** wake up for the next idle check */
+static void _in_schedule(conn_t in) {
+    s2s_t s2s = in->s2s;
+    time_t t;
+
+    if(s2s->check_interval == 0 || s2s->check_idle == 0)
+        return;
+
+    /* nothing to time out until the first packet, stream initiation is checked elsewhere */
+    t = in->last_packet + s2s->check_idle + 1;
+    if(in->last_packet == 0)
+        t = time(NULL) + s2s->check_idle;
+
+    wheel_at(s2s->timers, &in->timer, (long long) t * 1000);
+}
+
+static void _in_timer(wheel_t w, wheel_timer_t timer, void *arg) {
+    conn_t in = (conn_t) arg;
+    s2s_t s2s = in->s2s;
+
+    /* idle timeouts - disconnect connections through which no packets have been sent for <idle> seconds */
+    if(in->online && in->last_packet > 0 && time(NULL) > in->last_packet + s2s->check_idle && in->s->state >= state_STREAM) {
+        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", in->fd->fd, in->ip, in->port);
+        sx_close(in->s);
+        return;
+    }
+
+    _in_schedule(in);
+}
+
 int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
     conn_t in = (conn_t) arg;
     s2s_t s2s = (s2s_t) arg;
@@ -92,6 +122,8 @@ int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg)
             /* !!! logging */
             log_write(in->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i", fd->fd, in->ip, in->port, in->packet_count);
 
+            wheel_del(in->s2s->timers, &in->timer);
+
             jqueue_push(in->s2s->dead, (void *) in->s, 0);
 
             /* remove from open streams hash if online, or open connections if not */
@@ -136,6 +168,9 @@ int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg)
             in->s = sx_new(s2s->sx_env, in->fd->fd, _in_sx_callback, (void *) in);
             mio_app(m, in->fd, in_mio_callback, (void *) in);
 
+            wheel_timer_init(&in->timer, _in_timer, (void *) in);
+            _in_schedule(in);
+
             if(s2s->stanza_size_limit != 0)
                 in->s->rbytesmax = s2s->stanza_size_limit;
 
@@ -181,8 +181,13 @@ static void _s2s_config_expand(s2s_t s2s) {
     s2s->local_verify_mode = j_atoi(config_get_one(s2s->config, "local.verify-mode", 0), 0);
     s2s->local_private_key_password = config_get_one(s2s->config, "local.private_key_password", 0);
     s2s->local_ciphers = config_get_one(s2s->config, "local.ciphers", 0);
+    s2s->local_ssl_cache = j_atoi(config_get_one(s2s->config, "local.ssl-cache", 0), 20480);
+    s2s->local_ssl_cache_timeout = j_atoi(config_get_one(s2s->config, "local.ssl-cache-timeout", 0), 0);
+    s2s->local_ssl_tickets = j_atoi(config_get_one(s2s->config, "local.ssl-tickets", 0), 0);
 
     s2s->io_max_fds = j_atoi(config_get_one(s2s->config, "io.max_fds", 0), 1024);
+    s2s->io_max_events = j_atoi(config_get_one(s2s->config, "io.max_events", 0), 0);
+    s2s->io_read_budget = j_atoi(config_get_one(s2s->config, "io.read_budget", 0), 0);
 
     s2s->compression = (config_get(s2s->config, "io.compression") != NULL);
 
@@ -497,75 +502,6 @@ static void _s2s_time_checks(s2s_t s2s) {
 
     }
 
-    /* keepalives */
-    if(s2s->out_reuse) {
-        if(xhash_iter_first(s2s->out_host))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->out_host, NULL, NULL, xhv.val);
-
-                if(s2s->check_keepalive > 0 && conn->last_activity > 0 && now > conn->last_activity + s2s->check_keepalive && conn->s->state >= state_STREAM) {
-                    log_debug(ZONE, "sending keepalive for %d", conn->fd->fd);
-
-                    sx_raw_write(conn->s, " ", 1);
-                }
-            } while(xhash_iter_next(s2s->out_host));
-    } else {
-        if(xhash_iter_first(s2s->out_dest))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->out_dest, NULL, NULL, xhv.val);
-
-                if(s2s->check_keepalive > 0 && conn->last_activity > 0 && now > conn->last_activity + s2s->check_keepalive && conn->s->state >= state_STREAM) {
-                    log_debug(ZONE, "sending keepalive for %d", conn->fd->fd);
-
-                    sx_raw_write(conn->s, " ", 1);
-                }
-            } while(xhash_iter_next(s2s->out_dest));
-    }
-
-    /* idle timeouts - disconnect connections through which no packets have been sent for <idle> seconds */
-    if(s2s->check_idle > 0) {
-
-        /* outgoing connections */
-        if(s2s->out_reuse) {
-            if(xhash_iter_first(s2s->out_host))
-                do {
-                    xhv.conn_val = &conn;
-                    xhash_iter_get(s2s->out_host, (const char **) &key, &keylen, xhv.val);
-                    log_debug(ZONE, "checking idle state for %.*s", keylen, key);
-                    if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                        sx_close(conn->s);
-                    }
-                } while(xhash_iter_next(s2s->out_host));
-        } else {
-            if(xhash_iter_first(s2s->out_dest))
-                do {
-                    xhv.conn_val = &conn;
-                    xhash_iter_get(s2s->out_dest, (const char **) &key, &keylen, xhv.val);
-                    log_debug(ZONE, "checking idle state for %s (%s)", conn->dkey, conn->key);
-                    if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                        sx_close(conn->s);
-                    }
-                } while(xhash_iter_next(s2s->out_dest));
-        }
-
-        /* incoming connections */
-        if(xhash_iter_first(s2s->in))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->in, (const char **) &key, &keylen, xhv.val);
-                log_debug(ZONE, "checking idle state for %.*s", keylen, key);
-                if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                    log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                    sx_close(conn->s);
-                }
-            } while(xhash_iter_next(s2s->in));
-
-    }
-
     return;
 }
 
@@ -825,12 +761,16 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     char *config_file;
     int optchar;
     conn_t conn;
+    int mio_timeout, timer_ms;
     jqueue_t q;
     dnscache_t dns;
     dnsres_t res;
     union xhashv xhv;
     time_t check_time = 0, now = 0;
     const char *cli_id = 0;
+#ifdef HAVE_SSL
+    char stats[256];
+#endif
 
 #ifdef HAVE_UMASK
     umask((mode_t) 0027);
@@ -935,7 +875,10 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     s2s->dead = jqueue_new();
     s2s->dead_conn = jqueue_new();
 
+    s2s->timers = wheel_new(4096, 100);
+
     s2s->sx_env = sx_env_new();
+    sx_env_read_budget(s2s->sx_env, s2s->io_read_budget);
 
 #ifdef HAVE_SSL
     /* get the ssl context up and running */
@@ -976,9 +919,15 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     s2s->hosts = xhash_new(1021);
     _s2s_hosts_expand(s2s);
 
+#ifdef HAVE_SSL
+    /* session resumption for reconnecting peers */
+    if(s2s->sx_ssl != NULL)
+        sx_ssl_session_cache(s2s->sx_ssl, s2s->local_ssl_cache, s2s->local_ssl_cache_timeout, s2s->local_ssl_tickets);
+#endif
+
     s2s->sx_db = sx_env_plugin(s2s->sx_env, s2s_db_init);
 
-    s2s->mio = mio_new(s2s->io_max_fds);
+    s2s->mio = mio_new_events(s2s->io_max_fds, s2s->io_max_events);
 
     if((s2s->udns_fd = dns_init(NULL, 1)) < 0) {
         log_write(s2s->log, LOG_ERR, "unable to initialize dns library, aborting");
@@ -990,7 +939,15 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     _s2s_router_connect(s2s);
 
     while(!s2s_shutdown) {
-        mio_run(s2s->mio, dns_timeouts(0, 5, time(NULL)));
+        /* don't sleep past the next connection timer */
+        mio_timeout = dns_timeouts(0, 5, time(NULL)) * 1000;
+        if((timer_ms = wheel_next(s2s->timers)) >= 0 && timer_ms < mio_timeout)
+            mio_timeout = timer_ms;
+
+        mio_run_ms(s2s->mio, mio_timeout);
+
+        /* keepalives and idle timeouts that are due */
+        wheel_run(s2s->timers);
 
         now = time(NULL);
 
@@ -1053,6 +1010,11 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
 
             _s2s_time_checks(s2s);
 
+#ifdef HAVE_SSL
+            if(s2s->sx_ssl != NULL && sx_ssl_stats_report(s2s->sx_ssl, stats, sizeof(stats)))
+                log_write(s2s->log, LOG_NOTICE, "%s", stats);
+#endif
+
             s2s->next_check = now + s2s->check_interval;
             log_debug(ZONE, "next time check at %d", s2s->next_check);
         }
@@ -1070,6 +1032,10 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
         if(now > check_time + 60) {
 #ifdef POOL_DEBUG
             pool_stat(1);
+#endif
+#ifdef HAVE_SSL
+            if(s2s->sx_ssl != NULL)
+                sx_ssl_ticket_rotate(s2s->sx_ssl, now);
 #endif
             if(s2s->packet_stats != NULL) {
                 int fd = open(s2s->packet_stats, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP);
@@ -1210,6 +1176,8 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     jqueue_free(s2s->dead);
     jqueue_free(s2s->dead_conn);
 
+    wheel_free(s2s->timers);
+
     sx_free(s2s->router);
 
     sx_env_free(s2s->sx_env);
@@ -108,6 +108,60 @@ static void _out_verify(conn_t out, nad_t nad);
 static void _dns_result_aaaa(struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data);
 static void _dns_result_a(struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data);
 
+/** wake up for the next keepalive or idle check */
+static void _out_schedule(conn_t out) {
+    s2s_t s2s = out->s2s;
+    time_t now, next = 0, t;
+
+    if(s2s->check_interval == 0)
+        return;
+
+    now = time(NULL);
+
+    if(s2s->check_keepalive > 0) {
+        t = out->last_activity + s2s->check_keepalive + 1;
+        if(out->last_activity == 0 || t <= now)
+            t = now + s2s->check_keepalive;
+        next = t;
+    }
+
+    if(s2s->check_idle > 0) {
+        t = out->last_packet + s2s->check_idle + 1;
+        if(out->last_packet == 0)
+            t = now + s2s->check_idle;
+        if(next == 0 || t < next)
+            next = t;
+    }
+
+    if(next != 0)
+        wheel_at(s2s->timers, &out->timer, (long long) next * 1000);
+}
+
+static void _out_timer(wheel_t w, wheel_timer_t timer, void *arg) {
+    conn_t out = (conn_t) arg;
+    s2s_t s2s = out->s2s;
+    time_t now;
+
+    now = time(NULL);
+
+    if(out->s->state >= state_STREAM) {
+        /* idle timeouts - disconnect connections through which no packets have been sent for <idle> seconds */
+        if(s2s->check_idle > 0 && out->last_packet > 0 && now > out->last_packet + s2s->check_idle) {
+            log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", out->fd->fd, out->ip, out->port);
+            sx_close(out->s);
+            return;
+        }
+
+        if(s2s->check_keepalive > 0 && out->last_activity > 0 && now > out->last_activity + s2s->check_keepalive) {
+            log_debug(ZONE, "sending keepalive for %d", out->fd->fd);
+
+            sx_raw_write(out->s, " ", 1);
+        }
+    }
+
+    _out_schedule(out);
+}
+
 /** queue the packet */
 static void _out_packet_queue(s2s_t s2s, pkt_t pkt) {
     char *rkey = s2s_route_key(NULL, pkt->from->domain, pkt->to->domain);
@@ -586,6 +640,9 @@ int out_route(s2s_t s2s, const char *route, int routelen, conn_t *out, int allow
 
                 (*out)->s = sx_new(s2s->sx_env, (*out)->fd->fd, _out_sx_callback, (void *) *out);
 
+                wheel_timer_init(&(*out)->timer, _out_timer, (void *) *out);
+                _out_schedule(*out);
+
 #ifdef HAVE_SSL
                 /* Send a stream version of 1.0 if we can do STARTTLS */
                 if(s2s->sx_ssl != NULL) {
@@ -1327,6 +1384,8 @@ static int _out_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, v
         case action_CLOSE:
             log_debug(ZONE, "close action on fd %d", fd->fd);
 
+            wheel_del(out->s2s->timers, &out->timer);
+
             jqueue_push(out->s2s->dead, (void *) out->s, 0);
 
             log_write(out->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i", fd->fd, out->ip, out->port, out->packet_count);
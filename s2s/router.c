@@ -20,14 +20,74 @@
 
 #include "s2s.h"
 
+/** a unicast route from the router, off it goes */
+static void _s2s_router_route(nad_t nad, void *arg) {
+    s2s_t s2s = (s2s_t) arg;
+    int attr, elem, i;
+    pkt_t pkt;
+
+    /* packets to us */
+    attr = nad_find_attr(nad, 0, -1, "to", NULL);
+    if(NAD_AVAL_L(nad, attr) == strlen(s2s->id) && strncmp(s2s->id, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr)) == 0) {
+        log_debug(ZONE, "dropping unknown or invalid packet for s2s component proper");
+        nad_free(nad);
+
+        return;
+    }
+
+    /* mangle error packet to create bounce */
+    if((attr = nad_find_attr(nad, 0, -1, "error", NULL)) >= 0) {
+        log_debug(ZONE, "bouncing error packet");
+        elem = stanza_err_REMOTE_SERVER_NOT_FOUND;
+        if(attr >= 0) {
+            for(i=0; _stanza_errors[i].code != NULL; i++)
+                if(strncmp(_stanza_errors[i].code, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr)) == 0) {
+                    elem = stanza_err_BAD_REQUEST + i;
+                    break;
+                }
+        }
+        stanza_tofrom(stanza_tofrom(stanza_error(nad, 1, elem), 1), 0);
+        if( (elem = nad_find_attr(nad, 1, -1, "to", NULL)) >= 0 )
+            nad_set_attr(nad, 0, -1, "to",  NAD_AVAL(nad, elem), NAD_AVAL_L(nad, elem));
+    }
+
+    /* new packet */
+    pkt = (pkt_t) calloc(1, sizeof(struct pkt_st));
+
+    pkt->nad = nad;
+
+    if((attr = nad_find_attr(pkt->nad, 1, -1, "from", NULL)) >= 0 && NAD_AVAL_L(pkt->nad, attr) > 0)
+        pkt->from = jid_new(NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
+    else {
+        attr = nad_find_attr(nad, 0, -1, "from", NULL);
+        pkt->from = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+    }
+
+    if((attr = nad_find_attr(pkt->nad, 1, -1, "to", NULL)) >= 0 && NAD_AVAL_L(pkt->nad, attr) > 0)
+        pkt->to = jid_new(NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
+    else {
+        attr = nad_find_attr(nad, 0, -1, "to", NULL);
+        pkt->to = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+    }
+
+    /* change the packet so it looks like it came to us, so the router won't reject it if we bounce it later */
+    nad_set_attr(nad, 0, -1, "to", s2s->id, 0);
+
+    /* flag dialback */
+    if(NAD_NURI_L(pkt->nad, 0) == uri_DIALBACK_L && strncmp(uri_DIALBACK, NAD_NURI(pkt->nad, 0), uri_DIALBACK_L) == 0)
+        pkt->db = 1;
+
+    /* send it out */
+    out_packet(s2s, pkt);
+}
+
 /** our master callback */
 int s2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     s2s_t s2s = (s2s_t) arg;
     sx_buf_t buf = (sx_buf_t) data;
     sx_error_t *sxe;
     nad_t nad;
-    int len, ns, elem, attr, i;
-    pkt_t pkt;
+    int len, ns, elem, attr;
 
     switch(e) {
         case event_WANT_READ:
@@ -114,6 +174,7 @@ int s2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             nad_append_attr(nad, -1, "name", s2s->id);
             if(s2s->router_default)
                 nad_append_elem(nad, ns, "default", 1);
+            nad_append_elem(nad, ns, "multicast", 1);
 
             log_debug(ZONE, "requesting component bind for '%s'", s2s->id);
 
@@ -217,65 +278,20 @@ int s2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 return 0;
             }
 
-            if(nad_find_attr(nad, 0, -1, "type", NULL) >= 0) {
-                log_debug(ZONE, "dropping non-unicast packet");
+            /* multicast routes get expanded here, at the last hop */
+            if(nad_find_attr(nad, 0, -1, "type", "multicast") >= 0) {
+                stanza_multicast_split(nad, _s2s_router_route, (void *) s2s);
                 nad_free(nad);
                 return 0;
             }
 
-            /* packets to us */
-            attr = nad_find_attr(nad, 0, -1, "to", NULL);
-            if(NAD_AVAL_L(nad, attr) == strlen(s2s->id) && strncmp(s2s->id, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr)) == 0) {
-                log_debug(ZONE, "dropping unknown or invalid packet for s2s component proper");
+            if(nad_find_attr(nad, 0, -1, "type", NULL) >= 0) {
+                log_debug(ZONE, "dropping non-unicast packet");
                 nad_free(nad);
-
                 return 0;
             }
 
-            /* mangle error packet to create bounce */
-            if((attr = nad_find_attr(nad, 0, -1, "error", NULL)) >= 0) {
-                log_debug(ZONE, "bouncing error packet");
-                elem = stanza_err_REMOTE_SERVER_NOT_FOUND;
-                if(attr >= 0) {
-                    for(i=0; _stanza_errors[i].code != NULL; i++)
-                        if(strncmp(_stanza_errors[i].code, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr)) == 0) {
-                            elem = stanza_err_BAD_REQUEST + i;
-                            break;
-                        }
-                }
-                stanza_tofrom(stanza_tofrom(stanza_error(nad, 1, elem), 1), 0);
-                if( (elem = nad_find_attr(nad, 1, -1, "to", NULL)) >= 0 )
-                    nad_set_attr(nad, 0, -1, "to",  NAD_AVAL(nad, elem), NAD_AVAL_L(nad, elem));
-            }
-
-            /* new packet */
-            pkt = (pkt_t) calloc(1, sizeof(struct pkt_st));
-
-            pkt->nad = nad;
-
-            if((attr = nad_find_attr(pkt->nad, 1, -1, "from", NULL)) >= 0 && NAD_AVAL_L(pkt->nad, attr) > 0)
-                pkt->from = jid_new(NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
-            else {
-                attr = nad_find_attr(nad, 0, -1, "from", NULL);
-                pkt->from = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
-            }
-
-            if((attr = nad_find_attr(pkt->nad, 1, -1, "to", NULL)) >= 0 && NAD_AVAL_L(pkt->nad, attr) > 0)
-                pkt->to = jid_new(NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
-            else {
-                attr = nad_find_attr(nad, 0, -1, "to", NULL);
-                pkt->to = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
-            }
-
-            /* change the packet so it looks like it came to us, so the router won't reject it if we bounce it later */
-            nad_set_attr(nad, 0, -1, "to", s2s->id, 0);
-
-            /* flag dialback */
-            if(NAD_NURI_L(pkt->nad, 0) == uri_DIALBACK_L && strncmp(uri_DIALBACK, NAD_NURI(pkt->nad, 0), uri_DIALBACK_L) == 0)
-                pkt->db = 1;
-
-            /* send it out */
-            out_packet(s2s, pkt);
+            _s2s_router_route(nad, (void *) s2s);
 
             return 0;
 
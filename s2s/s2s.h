@@ -141,12 +141,23 @@ struct s2s_st {
     /** list of TLS ciphers */
     const char          *local_ciphers;
 
+    /** tls session cache size and timeout, and ticket key lifetime (seconds) */
+    int                 local_ssl_cache;
+    int                 local_ssl_cache_timeout;
+    int                 local_ssl_tickets;
+
     /** hosts mapping */
     xht                 hosts;
 
     /** max file descriptors */
     int                 io_max_fds;
 
+    /** most ready file descriptors to take per event loop, 0 for the default */
+    int                 io_max_events;
+
+    /** most bytes to read from a connection per read event, 0 for the default */
+    int                 io_read_budget;
+
     /** maximum stanza size */
     int                 stanza_size_limit;
 
@@ -180,6 +191,9 @@ struct s2s_st {
     time_t              last_invalid_check;
 
     time_t              next_check;
+
+    /** per-connection keepalive and idle timers */
+    wheel_t             timers;
     time_t              next_expiry;
 
     /** Apple security options */
@@ -283,6 +297,9 @@ struct conn_st {
     time_t              last_activity;
     time_t              last_packet;
 
+    /** next keepalive or idle check */
+    struct wheel_timer_st timer;
+
     unsigned int        packet_count;
 };
 
@@ -29,7 +29,6 @@
 
 /** main packet dispatcher */
 void dispatch(sm_t sm, pkt_t pkt) {
-    user_t user;
     mod_ret_t ret;
 
     /* handle broadcasts */
@@ -125,6 +124,18 @@ void dispatch(sm_t sm, pkt_t pkt) {
         return;
     }
 
+    /* wait for their data if we're fetching it */
+    if(user_park(sm, pkt->to, pkt))
+        return;
+
+    dispatch_user(sm, pkt);
+}
+
+/** deliver a packet to a user */
+void dispatch_user(sm_t sm, pkt_t pkt) {
+    user_t user;
+    mod_ret_t ret;
+
     /* get the user */
     user = user_load(sm, pkt->to);
     if(user == NULL) {
@@ -165,6 +176,6 @@ void dispatch(sm_t sm, pkt_t pkt) {
     }
 
     /* if they have no sessions, they were only loaded to do delivery, so free them */
-    if(user->sessions == NULL)
+    if(user->sessions == NULL && !user->held)
         user_free(user);
 }
@@ -112,6 +112,8 @@ static void _sm_config_expand(sm_t sm)
     sm->router_private_key_password = config_get_one(sm->config, "router.private_key_password", 0);
     sm->router_ciphers = config_get_one(sm->config, "router.ciphers", 0);
 
+    sm->router_weight = j_atoi(config_get_one(sm->config, "router.weight", 0), 1);
+
     sm->retry_init = j_atoi(config_get_one(sm->config, "router.retry.init", 0), 3);
     sm->retry_lost = j_atoi(config_get_one(sm->config, "router.retry.lost", 0), 3);
     if((sm->retry_sleep = j_atoi(config_get_one(sm->config, "router.retry.sleep", 0), 2)) < 1)
@@ -194,10 +196,23 @@ static int _sm_router_connect(sm_t sm) {
     return 0;
 }
 
+/** storage calls have completed */
+static int _sm_storage_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    sm_t sm = (sm_t) arg;
+
+    if(a != action_READ)
+        return 0;
+
+    storage_async_poll(sm->st);
+
+    return 1;
+}
+
 JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server: Session Manager", "jabberd2router\0")
 {
     int optchar;
     sess_t sess;
+    log_t st_log;
     char id[1024];
 #ifdef POOL_DEBUG
     time_t pool_time = 0;
@@ -332,6 +347,11 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     xhash_put(sm->xmlns, uri_DISCO_INFO, (void *) ns_DISCO_INFO);
     sm->xmlns_refcount = xhash_new(101);
 
+    /* data for loading users, filled in by the modules */
+    sm->prefetch = xhash_new(11);
+    sm->loading = xhash_new(401);
+    sm->later = jqueue_new();
+
     /* supported features */
     sm->features = xhash_new(101);
 
@@ -373,6 +393,10 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     sm->mio = mio_new(MIO_MAXFD);
 
+    /* storage calls completing on the worker threads */
+    if(storage_async(sm->st))
+        mio_read(sm->mio, mio_register(sm->mio, storage_async_fd(sm->st), _sm_storage_callback, (void *) sm));
+
     /* vHosts map */
     sm->hosts = xhash_new(1021);
     _sm_hosts_expand(sm);
@@ -381,14 +405,28 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     _sm_router_connect(sm);
     
     while(!sm_shutdown) {
-        mio_run(sm->mio, 5);
+        /* don't wait around if there's work to get on with */
+        if(jqueue_size(sm->later) > 0)
+            mio_run_ms(sm->mio, 0);
+        else
+            mio_run(sm->mio, 5);
+
+        sm_later_run(sm);
+
+        /* write out held storage replaces that are due */
+        storage_flush(sm->st, 0);
 
         if(sm_logrotate) {
             set_debug_log_from_config(sm->config);
 
             log_write(sm->log, LOG_NOTICE, "reopening log ...");
-            log_free(sm->log);
+
+            /* storage threads may be writing to the log we started with, so they keep it */
+            if(sm->log != sm->st->log || !storage_async(sm->st))
+                log_free(sm->log);
             sm->log = log_new(sm->log_type, sm->log_ident, sm->log_facility);
+            if(!storage_async(sm->st))
+                sm->st->log = sm->log;
             log_write(sm->log, LOG_NOTICE, "log started");
 
             sm_logrotate = 0;
@@ -437,11 +475,21 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     xhash_free(sm->sessions);
 
+    /* drop anything still waiting for user data */
+    user_park_free(sm);
+
+    /* let anything still waiting tidy up, the sessions it was for are gone */
+    while(sm_later_run(sm) > 0);
+    jqueue_free(sm->later);
+
     if (sm->fd) mio_close(sm->mio, sm->fd);
     mio_free(sm->mio);
 
     mm_free(sm->mm);
+    st_log = sm->st->log;
     storage_free(sm->st);
+    if(st_log != sm->log)
+        log_free(st_log);
 
     aci_unload(sm->acls);
     xhash_free(sm->acls);
@@ -449,6 +497,8 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     xhash_free(sm->xmlns);
     xhash_free(sm->xmlns_refcount);
     xhash_free(sm->users);
+    xhash_free(sm->prefetch);
+    xhash_free(sm->loading);
     xhash_free(sm->hosts);
     xhash_free(sm->query_rates);
 
@@ -76,5 +76,7 @@ DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     mod->user_create = _active_user_create;
     mod->user_delete = _active_user_delete;
 
+    user_prefetch(mod->mm->sm, "active");
+
     return 0;
 }
@@ -27,87 +27,577 @@
   * $Revision: 1.26 $
   */
 
+/** a queue size, so we don't have to ask storage for every message */
+typedef struct _offline_count_st {
+    char    *jid;
+    int     count;
+
+    struct _offline_count_st *prev, *next;  /**< most recently used first */
+} *offline_count_t;
+
 typedef struct _mod_offline_st {
     int dropmessages;
     int storeheadlines;
     int dropsubscriptions;
     int userquota;
+    int page;               /**< queued packets delivered each time round the main loop */
+    xht counts;             /**< queue sizes we know about, keyed by bare jid */
+    int maxcounts;          /**< how many queue sizes we keep */
+    offline_count_t first, last;
 } *mod_offline_t;
 
-static mod_ret_t _offline_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt) {
-    st_ret_t ret;
+/** a queue being delivered to a session, a page at a time */
+typedef struct _offline_spool_st {
+    mod_instance_t  mi;
+    sess_t          sess;       /**< NULL once the session has gone */
+    char            *owner;
+    os_t            os;         /**< NULL until the fetch comes back */
+    int             more;       /**< os iterator is sitting on something not yet delivered */
+    int             again;      /**< they came back while we were busy, there may be more stored since */
+    int             paged;      /**< storage hands us the queue a page at a time, and we delete what's been delivered */
+    int             skip;       /**< stored packets we couldn't decode, left at the front of the queue */
+    int             *seqs;      /**< sequence numbers from this page that have been dealt with, not yet deleted */
+    int             nseqs;
+} *offline_spool_t;
+
+static void _offline_count_unlink(mod_offline_t offline, offline_count_t oc) {
+    if(oc->prev != NULL) oc->prev->next = oc->next;
+    else offline->first = oc->next;
+
+    if(oc->next != NULL) oc->next->prev = oc->prev;
+    else offline->last = oc->prev;
+
+    oc->prev = oc->next = NULL;
+}
+
+/** move a queue size to the front, so it's the last to be forgotten */
+static void _offline_count_touch(mod_offline_t offline, offline_count_t oc) {
+    if(offline->first == oc)
+        return;
+
+    if(oc->prev != NULL)
+        _offline_count_unlink(offline, oc);
+
+    oc->next = offline->first;
+    if(offline->first != NULL)
+        offline->first->prev = oc;
+    offline->first = oc;
+
+    if(offline->last == NULL)
+        offline->last = oc;
+}
+
+/** forget a queue size, the next message will ask storage again */
+static void _offline_count_drop(mod_offline_t offline, const char *jid) {
+    offline_count_t oc;
+
+    oc = (offline_count_t) xhash_get(offline->counts, jid);
+    if(oc == NULL)
+        return;
+
+    _offline_count_unlink(offline, oc);
+
+    xhash_zap(offline->counts, jid);
+    free(oc->jid);
+    free(oc);
+}
+
+static void _offline_count_set(mod_offline_t offline, const char *jid, int count) {
+    offline_count_t oc;
+
+    oc = (offline_count_t) xhash_get(offline->counts, jid);
+    if(oc == NULL) {
+        /* make room by forgetting the one used longest ago */
+        if(xhash_count(offline->counts) >= offline->maxcounts && offline->last != NULL)
+            _offline_count_drop(offline, offline->last->jid);
+
+        oc = (offline_count_t) calloc(1, sizeof(struct _offline_count_st));
+        oc->jid = strdup(jid);
+        xhash_put(offline->counts, oc->jid, (void *) oc);
+    }
+
+    oc->count = count;
+
+    _offline_count_touch(offline, oc);
+}
+
+/** adjust a queue size, if we know it */
+static void _offline_count_add(mod_offline_t offline, const char *jid, int n) {
+    offline_count_t oc;
+
+    oc = (offline_count_t) xhash_get(offline->counts, jid);
+    if(oc == NULL)
+        return;
+
+    oc->count += n;
+    if(oc->count < 0)
+        oc->count = 0;
+
+    _offline_count_touch(offline, oc);
+}
+
+static void _offline_count_free(const char *key, int keylen, void *val, void *arg) {
+    offline_count_t oc = (offline_count_t) val;
+
+    free(oc->jid);
+    free(oc);
+}
+
+/** true if the queued packet has an expiry and it has passed */
+static int _offline_expired(pkt_t queued) {
+    int ns, elem, attr;
+    char cttl[15], cstamp[18];
+    time_t ttl, stamp;
+
+    if((ns = nad_find_scoped_namespace(queued->nad, uri_EXPIRE, NULL)) >= 0 &&
+       (elem = nad_find_elem(queued->nad, 1, ns, "x", 1)) >= 0 &&
+       (attr = nad_find_attr(queued->nad, elem, -1, "seconds", NULL)) >= 0) {
+        snprintf(cttl, 15, "%.*s", NAD_AVAL_L(queued->nad, attr), NAD_AVAL(queued->nad, attr));
+        ttl = atoi(cttl);
+
+        /* it should have a x:delay stamp, because we stamp everything we store */
+        if((ns = nad_find_scoped_namespace(queued->nad, uri_DELAY, NULL)) >= 0 &&
+           (elem = nad_find_elem(queued->nad, 1, ns, "x", 1)) >= 0 &&
+           (attr = nad_find_attr(queued->nad, elem, -1, "stamp", NULL)) >= 0) {
+            snprintf(cstamp, 18, "%.*s", NAD_AVAL_L(queued->nad, attr), NAD_AVAL(queued->nad, attr));
+            stamp = datetime_in(cstamp);
+
+            if(stamp + ttl <= time(NULL))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void _offline_spool_free(offline_spool_t spool) {
+    if(spool->os != NULL)
+        os_free(spool->os);
+    free(spool->seqs);
+    free(spool->owner);
+    free(spool);
+}
+
+/** delete the packets from this page that have been dealt with */
+static void _offline_spool_delete(offline_spool_t spool) {
+    mod_offline_t offline = (mod_offline_t) spool->mi->mod->private;
+    char *filter;
+    int i, len;
+
+    if(spool->nseqs == 0)
+        return;
+
+    filter = (char *) malloc(sizeof(char) * (4 + spool->nseqs * 32));
+
+    len = sprintf(filter, "(|");
+    for(i = 0; i < spool->nseqs; i++)
+        len += sprintf(&filter[len], "(object-sequence=%d)", spool->seqs[i]);
+    sprintf(&filter[len], ")");
+
+    log_debug(ZONE, "deleting %d delivered packets from the queue for %s", spool->nseqs, spool->owner);
+
+    storage_submit(spool->mi->sm->st, st_op_DELETE, "queue", spool->owner, filter, NULL, NULL, NULL);
+    free(filter);
+
+    spool->nseqs = 0;
+
+    _offline_count_drop(offline, spool->owner);
+}
+
+/** a queued packet we couldn't decode stays in the queue, rather than being lost */
+static void _offline_keep_raw(offline_spool_t spool, os_object_t o) {
+    os_t os;
+    char *str;
+
+    log_write(spool->mi->sm->log, LOG_ERR, "queued packet for %s can't be decoded, leaving it in the queue", spool->owner);
+
+    /* it's still there, the next page starts after it */
+    if(spool->paged) {
+        spool->skip++;
+        return;
+    }
+
+    /* it's been deleted already, so it goes back as it was */
+    if(!os_object_get_str(spool->os, o, "xml", &str) || str == NULL)
+        return;
+
+    os = os_new();
+    os_object_put(os_object_new(os), "xml", str, os_type_STRING);
+
+    /* storage frees the object set */
+    storage_submit(spool->mi->sm->st, st_op_PUT, "queue", spool->owner, NULL, os, NULL, NULL);
+}
+
+/** put back whatever the spool didn't get to. if storage gave us a page,
+ *  the rest is still there, and only what went out is deleted */
+static void _offline_spool_restore(offline_spool_t spool) {
+    mod_offline_t offline = (mod_offline_t) spool->mi->mod->private;
     os_t os;
     os_object_t o;
     nad_t nad;
+    int n = 0;
+
+    if(spool->paged) {
+        _offline_spool_delete(spool);
+        spool->more = 0;
+        return;
+    }
+
+    if(!spool->more)
+        return;
+
+    os = os_new();
+
+    do {
+        nad = os_object_copy_nad(spool->os, os_iter_object(spool->os), "xml");
+        if(nad == NULL) {
+            _offline_keep_raw(spool, os_iter_object(spool->os));
+            continue;
+        }
+
+        o = os_object_new(os);
+        os_object_put_nad_bin(o, "xml", nad);
+        nad_free(nad);
+        n++;
+    } while(os_iter_next(spool->os));
+
+    spool->more = 0;
+
+    log_debug(ZONE, "putting %d undelivered packets back in the queue for %s", n, spool->owner);
+
+    _offline_count_drop(offline, spool->owner);
+
+    /* storage frees the object set */
+    if(n > 0)
+        storage_submit(spool->mi->sm->st, st_op_PUT, "queue", spool->owner, NULL, os, NULL, NULL);
+    else
+        os_free(os);
+}
+
+static void _offline_spool(sm_t sm, void *arg);
+static void _offline_fetched(st_ret_t ret, os_t os, int count, void *arg);
+
+/** get the next page of the queue, each one is deleted once it's been delivered.
+ *  if storage can't do pages, take all of it. then the delete goes in right
+ *  behind the get, so nothing stored from here on can be deleted without being fetched */
+static void _offline_fetch(sm_t sm, offline_spool_t spool) {
+    mod_offline_t offline = (mod_offline_t) spool->mi->mod->private;
+
+    spool->again = 0;
+
+    if(spool->paged)
+        storage_submit_page(sm->st, "queue", spool->owner, NULL, spool->skip, offline->page, _offline_fetched, (void *) spool);
+    else {
+        storage_submit(sm->st, st_op_GET, "queue", spool->owner, NULL, NULL, _offline_fetched, (void *) spool);
+        storage_submit(sm->st, st_op_DELETE, "queue", spool->owner, NULL, NULL, NULL, NULL);
+    }
+
+    _offline_count_drop(offline, spool->owner);
+}
+
+/** deliver the next page of the queue */
+static void _offline_spool_page(sm_t sm, offline_spool_t spool) {
+    mod_offline_t offline = (mod_offline_t) spool->mi->mod->private;
+    os_object_t o;
+    nad_t nad;
     pkt_t queued;
-    int ns, elem, attr;
-    char cttl[15], cstamp[18];
-    time_t ttl, stamp;
+    int n, seq;
+
+    for(n = 0; n < offline->page && spool->more; n++) {
+        o = os_iter_object(spool->os);
+        nad = os_object_copy_nad(spool->os, o, "xml");
+        if(nad == NULL)
+            _offline_keep_raw(spool, o);
+        else if(spool->paged) {
+            /* it goes once it's dealt with. without a sequence we can't delete it, so step over it next time */
+            if(os_object_get_int(spool->os, o, "object-sequence", &seq))
+                spool->seqs[spool->nseqs++] = seq;
+            else
+                spool->skip++;
+        }
+
+        spool->more = os_iter_next(spool->os);
+
+        if(nad == NULL)
+            continue;
+
+        queued = pkt_new(sm, nad);
+        if(queued == NULL) {
+            log_debug(ZONE, "invalid queued packet, not delivering");
+            continue;
+        }
+
+        /* check expiry as necessary */
+        if(_offline_expired(queued)) {
+            log_debug(ZONE, "queued packet has expired, dropping");
+            pkt_free(queued);
+            continue;
+        }
+
+        log_debug(ZONE, "delivering queued packet to %s", jid_full(spool->sess->jid));
+        pkt_sess(queued, spool->sess);
+    }
+
+    /* rest of it next time round */
+    if(spool->more) {
+        sm_later(sm, _offline_spool, (void *) spool);
+        return;
+    }
+
+    if(spool->paged) {
+        _offline_spool_delete(spool);
+
+        /* a full page, so there's probably another */
+        if(os_count(spool->os) >= offline->page)
+            spool->again = 1;
+    }
+
+    /* they went away and came back, so there may be more now */
+    if(spool->again) {
+        os_free(spool->os);
+        spool->os = NULL;
+        _offline_fetch(sm, spool);
+        return;
+    }
+
+    spool->sess->module_data[spool->mi->mod->index] = NULL;
+    _offline_spool_free(spool);
+}
+
+static void _offline_spool(sm_t sm, void *arg) {
+    offline_spool_t spool = (offline_spool_t) arg;
+
+    /* session went away, and took the rest back to storage */
+    if(spool->sess == NULL) {
+        _offline_spool_free(spool);
+        return;
+    }
+
+    /* went unavailable, so keep the rest until they come back */
+    if(!spool->sess->available) {
+        spool->sess->module_data[spool->mi->mod->index] = NULL;
+        _offline_spool_restore(spool);
+        _offline_spool_free(spool);
+        return;
+    }
+
+    _offline_spool_page(sm, spool);
+}
+
+static void _offline_fetched(st_ret_t ret, os_t os, int count, void *arg) {
+    offline_spool_t spool = (offline_spool_t) arg;
+    sm_t sm = spool->mi->sm;
+
+    if(ret != st_SUCCESS || os == NULL) {
+        log_debug(ZONE, "storage_get returned %d", ret);
+        if(os != NULL)
+            os_free(os);
+
+        /* nothing now, but maybe since */
+        if(spool->sess != NULL && spool->again) {
+            _offline_fetch(sm, spool);
+            return;
+        }
+
+        if(spool->sess != NULL)
+            spool->sess->module_data[spool->mi->mod->index] = NULL;
+        _offline_spool_free(spool);
+        return;
+    }
+
+    /* it's ours now. if it isn't a page, the delete is right behind and anything we don't get to goes back */
+    spool->os = os;
+    spool->more = os_iter_first(os);
+
+    /* gone, or not available any more, so it all goes back for next time.
+     * (without storage threads we're still inside the presence that asked, so it isn't available yet) */
+    if(spool->sess == NULL || (storage_async(sm->st) && !spool->sess->available)) {
+        if(spool->sess != NULL)
+            spool->sess->module_data[spool->mi->mod->index] = NULL;
+        _offline_spool_restore(spool);
+        _offline_spool_free(spool);
+        return;
+    }
+
+    _offline_spool_page(sm, spool);
+}
+
+static mod_ret_t _offline_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt) {
+    mod_offline_t offline = (mod_offline_t) mi->mod->private;
+    offline_spool_t spool;
 
     /* if they're becoming available for the first time */
     if(pkt->type == pkt_PRESENCE && sess->pri >= 0 && pkt->to == NULL && sess->user->top == NULL) {
 
-        ret = storage_get(pkt->sm->st, "queue", jid_user(sess->jid), NULL, &os);
-        if(ret != st_SUCCESS) {
-            log_debug(ZONE, "storage_get returned %d", ret);
+        /* still busy from last time */
+        spool = (offline_spool_t) sess->module_data[mi->mod->index];
+        if(spool != NULL) {
+            spool->again = 1;
             return mod_PASS;
         }
-        
-        if(os_iter_first(os))
-            do {
-                o = os_iter_object(os);
-
-                if(os_object_get_nad(os, o, "xml", &nad)) {
-                    queued = pkt_new(pkt->sm, nad_copy(nad));
-                    if(queued == NULL) {
-                        log_debug(ZONE, "invalid queued packet, not delivering");
-                    } else {
-                        /* check expiry as necessary */
-                        if((ns = nad_find_scoped_namespace(queued->nad, uri_EXPIRE, NULL)) >= 0 &&
-                           (elem = nad_find_elem(queued->nad, 1, ns, "x", 1)) >= 0 &&
-                           (attr = nad_find_attr(queued->nad, elem, -1, "seconds", NULL)) >= 0) {
-                            snprintf(cttl, 15, "%.*s", NAD_AVAL_L(queued->nad, attr), NAD_AVAL(queued->nad, attr));
-                            ttl = atoi(cttl);
-
-                            /* it should have a x:delay stamp, because we stamp everything we store */
-                            if((ns = nad_find_scoped_namespace(queued->nad, uri_DELAY, NULL)) >= 0 &&
-                               (elem = nad_find_elem(queued->nad, 1, ns, "x", 1)) >= 0 &&
-                               (attr = nad_find_attr(queued->nad, elem, -1, "stamp", NULL)) >= 0) {
-                                snprintf(cstamp, 18, "%.*s", NAD_AVAL_L(queued->nad, attr), NAD_AVAL(queued->nad, attr));
-                                stamp = datetime_in(cstamp);
-
-                                if(stamp + ttl <= time(NULL)) {
-                                    log_debug(ZONE, "queued packet has expired, dropping");
-                                    pkt_free(queued);
-                                    continue;
-                                }
-                            }
-                        }
-
-                        log_debug(ZONE, "delivering queued packet to %s", jid_full(sess->jid));
-                        pkt_sess(queued, sess);
-                    }
-                }
-            } while(os_iter_next(os));
 
-        os_free(os);
+        spool = (offline_spool_t) calloc(1, sizeof(struct _offline_spool_st));
+        spool->mi = mi;
+        spool->sess = sess;
+        spool->owner = strdup(jid_user(sess->jid));
+
+        spool->paged = storage_pages(mi->sm->st, "queue");
+        if(spool->paged)
+            spool->seqs = (int *) malloc(sizeof(int) * offline->page);
 
-        /* drop the spool */
-        storage_delete(pkt->sm->st, "queue", jid_user(sess->jid), NULL);
+        sess->module_data[mi->mod->index] = (void *) spool;
+
+        /* without storage threads this comes straight back, and the first page goes out now */
+        _offline_fetch(pkt->sm, spool);
     }
 
     /* pass it so that other modules and mod_presence can get it */
     return mod_PASS;
 }
 
+static void _offline_sess_end(mod_instance_t mi, sess_t sess) {
+    offline_spool_t spool = (offline_spool_t) sess->module_data[mi->mod->index];
+
+    if(spool == NULL)
+        return;
+
+    sess->module_data[mi->mod->index] = NULL;
+
+    /* still fetching, or waiting for the next page. either way, it puts back
+     * what it has and frees the spool */
+    if(spool->os != NULL)
+        _offline_spool_restore(spool);
+    spool->sess = NULL;
+}
+
+/** XEP-0022 - send offline events if they asked for it */
+static void _offline_event(sm_t sm, pkt_t pkt) {
+    int ns, elem, attr;
+    pkt_t event;
+
+    /* if there's an id element, then this is a notification, not a request, so ignore it */
+
+    if((ns = nad_find_scoped_namespace(pkt->nad, uri_EVENT, NULL)) >= 0 &&
+       (elem = nad_find_elem(pkt->nad, 1, ns, "x", 1)) >= 0 &&
+       nad_find_elem(pkt->nad, elem, ns, "offline", 1) >= 0 && 
+       nad_find_elem(pkt->nad, elem, ns, "id", 1) < 0) {
+
+        event = pkt_create(sm, "message", NULL, jid_full(pkt->from), jid_full(pkt->to));
+
+        attr = nad_find_attr(pkt->nad, 1, -1, "type", NULL);
+        if(attr >= 0)
+            nad_set_attr(event->nad, 1, -1, "type", NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
+
+        ns = nad_add_namespace(event->nad, uri_EVENT, NULL);
+        nad_append_elem(event->nad, ns, "x", 2);
+        nad_append_elem(event->nad, ns, "offline", 3);
+
+        nad_append_elem(event->nad, ns, "id", 3);
+        attr = nad_find_attr(pkt->nad, 1, -1, "id", NULL);
+        if(attr >= 0)
+            nad_append_cdata(event->nad, NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr), 4);
+
+        pkt_router(event);
+    }
+}
+
+/** a packet being stored by the storage threads */
+typedef struct _offline_store_st {
+    mod_instance_t  mi;
+    pkt_t           pkt;
+} *offline_store_t;
+
+static void _offline_stored(st_ret_t ret, os_t os, int count, void *arg) {
+    offline_store_t store = (offline_store_t) arg;
+    mod_offline_t offline = (mod_offline_t) store->mi->mod->private;
+    pkt_t pkt = store->pkt;
+
+    free(store);
+
+    /* we counted it when we sent it off */
+    if(ret == st_FAILED || ret == st_NOTIMPL)
+        _offline_count_add(offline, jid_user(pkt->to), -1);
+
+    switch(ret) {
+        case st_FAILED:
+            pkt_router(pkt_error(pkt, stanza_err_INTERNAL_SERVER_ERROR));
+            return;
+
+        case st_NOTIMPL:
+            pkt_router(pkt_error(pkt, stanza_err_SERVICE_UNAVAILABLE));     /* xmpp-im 9.5#4 */
+            return;
+
+        default:
+            _offline_event(pkt->sm, pkt);
+            pkt_free(pkt);
+            return;
+    }
+}
+
+static void _offline_store(offline_store_t store) {
+    mod_offline_t offline = (mod_offline_t) store->mi->mod->private;
+    pkt_t pkt = store->pkt;
+    os_t os;
+    os_object_t o;
+
+    log_debug(ZONE, "saving packet for later");
+
+    pkt_delay(pkt, time(NULL), pkt->to->domain);
+
+    os = os_new();
+    o = os_object_new(os);
+
+    os_object_put_nad_bin(o, "xml", pkt->nad);
+
+    _offline_count_add(offline, jid_user(pkt->to), 1);
+
+    /* storage frees the object set */
+    storage_submit(pkt->sm->st, st_op_PUT, "queue", jid_user(pkt->to), NULL, os, _offline_stored, (void *) store);
+}
+
+/** true if this queue is full */
+static int _offline_full(mod_offline_t offline, const char *jid) {
+    offline_count_t oc = (offline_count_t) xhash_get(offline->counts, jid);
+
+    log_debug(ZONE, "queue size for %s is %i", jid, oc->count);
+
+    return oc->count >= offline->userquota;
+}
+
+static void _offline_counted(st_ret_t ret, os_t os, int count, void *arg) {
+    offline_store_t store = (offline_store_t) arg;
+    mod_offline_t offline = (mod_offline_t) store->mi->mod->private;
+    const char *jid = jid_user(store->pkt->to);
+
+    log_debug(ZONE, "storage_count ret is %i queue size is %i", ret, count);
+
+    /* if someone else counted while we were waiting, theirs has our puts in it too */
+    if(xhash_get(offline->counts, jid) == NULL) {
+        if(ret != st_SUCCESS && ret != st_NOTFOUND) {
+            _offline_store(store);
+            return;
+        }
+
+        _offline_count_set(offline, jid, ret == st_SUCCESS ? count : 0);
+    }
+
+    /* if the user's quota is exceeded, return an error */
+    if(_offline_full(offline, jid)) {
+        pkt_router(pkt_error(store->pkt, stanza_err_SERVICE_UNAVAILABLE));
+        free(store);
+        return;
+    }
+
+    _offline_store(store);
+}
+
 static mod_ret_t _offline_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
     mod_offline_t offline = (mod_offline_t) mi->mod->private;
-    int ns, elem, attr;
     os_t os;
     os_object_t o;
-    pkt_t event;
     st_ret_t ret;
     int queuesize;
+    offline_store_t store;
 
     /* send messages to the top sessions */
     if(user->top != NULL && (pkt->type & pkt_MESSAGE || pkt->type & pkt_S10N)) {
@@ -136,14 +626,19 @@ static mod_ret_t _offline_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
         return mod_HANDLED;
     }
 
-    /* if user quotas are enabled, count the number of offline messages this user has in the queue */
-    if(offline->userquota > 0) {
-        ret = storage_count(user->sm->st, "queue", jid_user(user->jid), NULL, &queuesize);
+    /* if user quotas are enabled, find out how many offline messages this user has in the queue. we only ask storage the first time */
+    if(offline->userquota > 0 && (pkt->type & pkt_MESSAGE) && !storage_async(user->sm->st)) {
+        if(xhash_get(offline->counts, jid_user(user->jid)) == NULL) {
+            ret = storage_count(user->sm->st, "queue", jid_user(user->jid), NULL, &queuesize);
 
-        log_debug(ZONE, "storage_count ret is %i queue size is %i", ret, queuesize);
+            log_debug(ZONE, "storage_count ret is %i queue size is %i", ret, queuesize);
+
+            if(ret == st_SUCCESS || ret == st_NOTFOUND)
+                _offline_count_set(offline, jid_user(user->jid), ret == st_SUCCESS ? queuesize : 0);
+        }
 
         /* if the user's quota is exceeded, return an error */
-        if (ret == st_SUCCESS && (pkt->type & pkt_MESSAGE) && queuesize >= offline->userquota)
+        if(xhash_get(offline->counts, jid_user(user->jid)) != NULL && _offline_full(offline, jid_user(user->jid)))
            return -stanza_err_SERVICE_UNAVAILABLE;
     }
 
@@ -159,6 +654,23 @@ static mod_ret_t _offline_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
             return mod_HANDLED;
         }
 
+        /* let the storage threads do it, and finish up when they're done */
+        if(storage_async(user->sm->st)) {
+            store = (offline_store_t) calloc(1, sizeof(struct _offline_store_st));
+            store->mi = mi;
+            store->pkt = pkt;
+
+            if(offline->userquota > 0 && (pkt->type & pkt_MESSAGE)) {
+                if(xhash_get(offline->counts, jid_user(user->jid)) == NULL)
+                    storage_submit(user->sm->st, st_op_COUNT, "queue", jid_user(user->jid), NULL, NULL, _offline_counted, (void *) store);
+                else
+                    _offline_counted(st_SUCCESS, NULL, 0, (void *) store);
+            } else
+                _offline_store(store);
+
+            return mod_HANDLED;
+        }
+
 	log_debug(ZONE, "saving packet for later");
 
         pkt_delay(pkt, time(NULL), user->jid->domain);
@@ -167,7 +679,7 @@ static mod_ret_t _offline_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
         os = os_new();
         o = os_object_new(os);
 
-        os_object_put(o, "xml", pkt->nad, os_type_NAD);
+        os_object_put_nad_bin(o, "xml", pkt->nad);
 
         /* store it */
         switch(storage_put(user->sm->st, "queue", jid_user(user->jid), os)) {
@@ -182,31 +694,9 @@ static mod_ret_t _offline_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
             default:
                 os_free(os);
 
-                /* XEP-0022 - send offline events if they asked for it */
-                /* if there's an id element, then this is a notification, not a request, so ignore it */
-
-                if((ns = nad_find_scoped_namespace(pkt->nad, uri_EVENT, NULL)) >= 0 &&
-                   (elem = nad_find_elem(pkt->nad, 1, ns, "x", 1)) >= 0 &&
-                   nad_find_elem(pkt->nad, elem, ns, "offline", 1) >= 0 && 
-                   nad_find_elem(pkt->nad, elem, ns, "id", 1) < 0) {
-
-                    event = pkt_create(user->sm, "message", NULL, jid_full(pkt->from), jid_full(pkt->to));
-
-                    attr = nad_find_attr(pkt->nad, 1, -1, "type", NULL);
-                    if(attr >= 0)
-                        nad_set_attr(event->nad, 1, -1, "type", NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
-
-                    ns = nad_add_namespace(event->nad, uri_EVENT, NULL);
-                    nad_append_elem(event->nad, ns, "x", 2);
-                    nad_append_elem(event->nad, ns, "offline", 3);
+                _offline_count_add(offline, jid_user(user->jid), 1);
 
-                    nad_append_elem(event->nad, ns, "id", 3);
-                    attr = nad_find_attr(pkt->nad, 1, -1, "id", NULL);
-                    if(attr >= 0)
-                        nad_append_cdata(event->nad, NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr), 4);
-
-                    pkt_router(event);
-                }
+                _offline_event(user->sm, pkt);
 
                 pkt_free(pkt);
                 return mod_HANDLED;
@@ -216,65 +706,59 @@ static mod_ret_t _offline_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
     return mod_PASS;
 }
 
-static void _offline_user_delete(mod_instance_t mi, jid_t jid) {
-    os_t os;
-    os_object_t o;
+/** bounce what was in the queue of a user that's gone */
+static void _offline_bounce(st_ret_t ret, os_t os, int count, void *arg) {
+    mod_instance_t mi = (mod_instance_t) arg;
     nad_t nad;
     pkt_t queued;
-    int ns, elem, attr;
-    char cttl[15], cstamp[18];
-    time_t ttl, stamp;
+
+    if(os == NULL)
+        return;
+
+    if(ret == st_SUCCESS && os_iter_first(os))
+        do {
+            nad = os_object_copy_nad(os, os_iter_object(os), "xml");
+            if(nad == NULL)
+                continue;
+
+            queued = pkt_new(mi->sm, nad);
+            if(queued == NULL) {
+                log_debug(ZONE, "invalid queued packet, not delivering");
+                continue;
+            }
+
+            /* check expiry as necessary */
+            if(_offline_expired(queued)) {
+                log_debug(ZONE, "queued packet has expired, dropping");
+                pkt_free(queued);
+                continue;
+            }
+
+            log_debug(ZONE, "bouncing queued packet from %s", jid_full(queued->from));
+            pkt_router(pkt_error(queued, stanza_err_ITEM_NOT_FOUND));
+        } while(os_iter_next(os));
+
+    os_free(os);
+}
+
+static void _offline_user_delete(mod_instance_t mi, jid_t jid) {
+    mod_offline_t offline = (mod_offline_t) mi->mod->private;
 
     log_debug(ZONE, "deleting queue for %s", jid_user(jid));
 
-    /* bounce the queue */
-    if(storage_get(mi->mod->mm->sm->st, "queue", jid_user(jid), NULL, &os) == st_SUCCESS) {
-        if(os_iter_first(os))
-            do {
-                o = os_iter_object(os);
-
-                if(os_object_get_nad(os, o, "xml", &nad)) {
-                    queued = pkt_new(mi->mod->mm->sm, nad_copy(nad));
-                    if(queued == NULL) {
-                        log_debug(ZONE, "invalid queued packet, not delivering");
-                    } else {
-                        /* check expiry as necessary */
-                        if((ns = nad_find_scoped_namespace(queued->nad, uri_EXPIRE, NULL)) >= 0 &&
-                           (elem = nad_find_elem(queued->nad, 1, ns, "x", 1)) >= 0 &&
-                           (attr = nad_find_attr(queued->nad, elem, -1, "seconds", NULL)) >= 0) {
-                            snprintf(cttl, 15, "%.*s", NAD_AVAL_L(queued->nad, attr), NAD_AVAL(queued->nad, attr));
-                            ttl = atoi(cttl);
-
-                            /* it should have a x:delay stamp, because we stamp everything we store */
-                            if((ns = nad_find_scoped_namespace(queued->nad, uri_DELAY, NULL)) >= 0 &&
-                               (elem = nad_find_elem(queued->nad, 1, ns, "x", 1)) >= 0 &&
-                               (attr = nad_find_attr(queued->nad, elem, -1, "stamp", NULL)) >= 0) {
-                                snprintf(cstamp, 18, "%.*s", NAD_AVAL_L(queued->nad, attr), NAD_AVAL(queued->nad, attr));
-                                stamp = datetime_in(cstamp);
-
-                                if(stamp + ttl <= time(NULL)) {
-                                    log_debug(ZONE, "queued packet has expired, dropping");
-                                    pkt_free(queued);
-                                    continue;
-                                }
-                            }
-                        }
-
-                        log_debug(ZONE, "bouncing queued packet from %s", jid_full(queued->from));
-                        pkt_router(pkt_error(queued, stanza_err_ITEM_NOT_FOUND));
-                    }
-                }
-            } while(os_iter_next(os));
+    /* these go behind any puts still in flight for them, so those are bounced too */
+    storage_submit(mi->sm->st, st_op_GET, "queue", jid_user(jid), NULL, NULL, _offline_bounce, (void *) mi);
+    storage_submit(mi->sm->st, st_op_DELETE, "queue", jid_user(jid), NULL, NULL, NULL, NULL);
 
-        os_free(os);
-    }
-    
-    storage_delete(mi->sm->st, "queue", jid_user(jid), NULL);
+    _offline_count_drop(offline, jid_user(jid));
 }
 
 static void _offline_free(module_t mod) {
     mod_offline_t offline = (mod_offline_t) mod->private;
 
+    xhash_walk(offline->counts, _offline_count_free, NULL);
+    xhash_free(offline->counts);
+
     free(offline);
 }
 
@@ -301,9 +785,20 @@ DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
 
     offline->userquota = j_atoi(config_get_one(mod->mm->sm->config, "offline.userquota", 0), 0);
 
+    offline->page = j_atoi(config_get_one(mod->mm->sm->config, "offline.page", 0), 100);
+    if(offline->page <= 0)
+        offline->page = 100;
+
+    offline->maxcounts = j_atoi(config_get_one(mod->mm->sm->config, "offline.quotacache", 0), 10000);
+    if(offline->maxcounts <= 0)
+        offline->maxcounts = 10000;
+
+    offline->counts = xhash_new(1023);
+
     mod->private = offline;
 
     mod->in_sess = _offline_in_sess;
+    mod->sess_end = _offline_sess_end;
     mod->pkt_user = _offline_pkt_user;
     mod->user_delete = _offline_user_delete;
     mod->free = _offline_free;
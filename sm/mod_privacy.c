@@ -33,6 +33,8 @@ static int ns_BLOCKING = 0;
 typedef struct zebra_st         *zebra_t;
 typedef struct zebra_list_st    *zebra_list_t;
 typedef struct zebra_item_st    *zebra_item_t;
+typedef struct zebra_index_st   *zebra_index_t;
+typedef struct zebra_entry_st   *zebra_entry_t;
 
 typedef enum {
     zebra_NONE,
@@ -49,6 +51,18 @@ typedef enum {
     block_IQ = 0x08
 } zebra_block_type_t;
 
+/** kinds of packet, as far as item blocking goes */
+typedef enum {
+    class_IN_MESSAGE,
+    class_IN_PRESENCE,
+    class_IN_IQ,
+    class_IN_OTHER,
+    class_OUT_PRESENCE,
+    class_OUT_MESSAGE,
+    class_OUT_OTHER,
+    class_COUNT
+} zebra_class_t;
+
 /** zebra data for a single user */
 struct zebra_st {
     xht             lists;
@@ -62,6 +76,8 @@ struct zebra_list_st {
     char            *name;
 
     zebra_item_t    items, last;
+
+    zebra_index_t   index;      /* built on first use, see _privacy_index() */
 };
 
 struct zebra_item_st {
@@ -83,6 +99,26 @@ struct zebra_item_st {
     zebra_item_t        next, prev;
 };
 
+/** position of the first item that decides each class of packet, -1 if none */
+struct zebra_entry_st {
+    int                 first[class_COUNT];
+};
+
+/** a list compiled down to lookup tables */
+struct zebra_index_st {
+    pool_t              p;          /* NULL until built */
+
+    zebra_item_t        *items;     /* in list order */
+
+    xht                 jids;       /* key is item jid */
+    xht                 groups;     /* key is group name */
+
+    struct zebra_entry_st s10n[4];  /* see _privacy_s10n() */
+    struct zebra_entry_st any;      /* fall-through items */
+
+    int                 roster;     /* true if there are group or s10n items */
+};
+
 typedef struct privacy_st {
     /* currently active list */
     zebra_list_t        active;
@@ -315,90 +351,219 @@ static int _privacy_user_load(mod_instance_t mi, user_t user) {
     return 0;
 }
 
-/** returns 0 if the packet should be allowed, otherwise 1 */
-static int _privacy_action(user_t user, zebra_list_t zlist, jid_t jid, pkt_type_t ptype, int in) {
+static void _privacy_entry_init(zebra_entry_t e) {
+    int c;
+
+    for(c = 0; c < class_COUNT; c++)
+        e->first[c] = -1;
+}
+
+/** whether an item has a say in this class of packet */
+static int _privacy_blocks(zebra_item_t zitem, zebra_class_t c) {
+    /* no packet blocking, applies to everything */
+    if(zitem->block == block_NONE)
+        return 1;
+
+    switch(c) {
+        case class_IN_MESSAGE:
+            return zitem->block & block_MESSAGE;
+        case class_IN_PRESENCE:
+            return zitem->block & block_PRES_IN;
+        case class_IN_IQ:
+            return zitem->block & block_IQ;
+        case class_OUT_PRESENCE:
+            return zitem->block & block_PRES_OUT;
+        case class_OUT_MESSAGE:
+            /* XXX block_MESSAGE for XEP-0191 while it violates XEP-0016 */
+            return zitem->block & block_MESSAGE;
+        default:
+            return 0;
+    }
+}
+
+static zebra_class_t _privacy_class(pkt_type_t ptype, int in) {
+    if(in) {
+        if(ptype & pkt_MESSAGE)
+            return class_IN_MESSAGE;
+        if(ptype & pkt_PRESENCE)
+            return class_IN_PRESENCE;
+        if(ptype & pkt_IQ)
+            return class_IN_IQ;
+        return class_IN_OTHER;
+    }
+
+    if(ptype & pkt_PRESENCE && ptype != pkt_PRESENCE_PROBE)
+        return class_OUT_PRESENCE;
+    if(ptype & pkt_MESSAGE)
+        return class_OUT_MESSAGE;
+    return class_OUT_OTHER;
+}
+
+static int _privacy_s10n(int to, int from) {
+    return (to ? 2 : 0) | (from ? 1 : 0);
+}
+
+/** note an item against its entry, if nothing earlier already decides */
+static void _privacy_entry_add(zebra_entry_t e, zebra_item_t zitem, int pos) {
+    int c;
+
+    for(c = 0; c < class_COUNT; c++)
+        if(e->first[c] < 0 && _privacy_blocks(zitem, c))
+            e->first[c] = pos;
+}
+
+static zebra_entry_t _privacy_entry_get(zebra_index_t ix, xht h, const char *key) {
+    zebra_entry_t e;
+
+    e = (zebra_entry_t) xhash_get(h, key);
+    if(e == NULL) {
+        e = (zebra_entry_t) pmalloco(ix->p, sizeof(struct zebra_entry_st));
+        _privacy_entry_init(e);
+        xhash_put(h, pstrdup(ix->p, key), (void *) e);
+    }
+
+    return e;
+}
+
+/** throw away the compiled form, it gets rebuilt on next use */
+static void _privacy_index_reset(zebra_index_t ix) {
+    if(ix->p == NULL)
+        return;
+
+    xhash_free(ix->jids);
+    xhash_free(ix->groups);
+    pool_free(ix->p);
+
+    ix->p = NULL;
+    ix->items = NULL;
+}
+
+static void _privacy_index_free(zebra_index_t ix) {
+    _privacy_index_reset(ix);
+    free(ix);
+}
+
+/** call after changing a list's items in place */
+static void _privacy_list_changed(zebra_list_t zlist) {
+    if(zlist->index != NULL)
+        _privacy_index_reset(zlist->index);
+}
+
+/** get the compiled form of a list, building it if need be */
+static zebra_index_t _privacy_index(zebra_list_t zlist) {
+    zebra_index_t ix = zlist->index;
     zebra_item_t scan;
-    int match, i;
-    item_t ritem;
-    char domres[2048];
+    int n, i;
 
-    log_debug(ZONE, "running match on list %s for %s (packet type 0x%x) (%s)", zlist->name, jid_full(jid), ptype, in ? "incoming" : "outgoing");
+    if(ix == NULL) {
+        ix = zlist->index = (zebra_index_t) calloc(1, sizeof(struct zebra_index_st));
+        pool_cleanup(zlist->p, (pool_cleanup_t) _privacy_index_free, ix);
+    }
 
-    /* loop over the list, trying to find a match */
-    for(scan = zlist->items; scan != NULL; scan = scan->next) {
-        match = 0;
+    if(ix->p != NULL)
+        return ix;
+
+    log_debug(ZONE, "compiling list %s", zlist->name);
+
+    for(n = 0, scan = zlist->items; scan != NULL; scan = scan->next) n++;
+
+    ix->p = pool_new();
+    ix->items = (zebra_item_t *) pmalloc(ix->p, sizeof(zebra_item_t) * (n + 1));
+    ix->jids = xhash_new(n > 0 ? n : 1);
+    ix->groups = xhash_new(11);
+
+    for(i = 0; i < 4; i++)
+        _privacy_entry_init(&ix->s10n[i]);
+    _privacy_entry_init(&ix->any);
+    ix->roster = 0;
+
+    /* items are already in order, so the first one to land on an entry wins */
+    for(i = 0, scan = zlist->items; scan != NULL; scan = scan->next, i++) {
+        ix->items[i] = scan;
 
         switch(scan->type) {
             case zebra_NONE:
-                /* fall through, all packets match this */
-                match = 1;
+                _privacy_entry_add(&ix->any, scan, i);
                 break;
 
             case zebra_JID:
-                snprintf(domres, sizeof(domres) / sizeof(domres[0]), "%s/%s", jid->domain, jid->resource);
+                _privacy_entry_add(_privacy_entry_get(ix, ix->jids, jid_full(scan->jid)), scan, i);
+                break;
 
-                /* jid check - match node@dom/res, then node@dom, then dom/resource, then dom */
-                if(jid_compare_full(scan->jid, jid) == 0 ||
-                   strcmp(jid_full(scan->jid), jid_user(jid)) == 0 ||
-                   strcmp(jid_full(scan->jid), domres) == 0 ||
-                   strcmp(jid_full(scan->jid), jid->domain) == 0)
-                    match = 1;
+            case zebra_GROUP:
+                _privacy_entry_add(_privacy_entry_get(ix, ix->groups, scan->group), scan, i);
+                ix->roster = 1;
+                break;
 
+            case zebra_S10N:
+                _privacy_entry_add(&ix->s10n[_privacy_s10n(scan->to, scan->from)], scan, i);
+                ix->roster = 1;
                 break;
+        }
+    }
 
-            case zebra_GROUP:
-                /* roster group check - get the roster item, node@dom/res, then node@dom, then dom */
-                ritem = xhash_get(user->roster, jid_full(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid_user(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid->domain);
+    return ix;
+}
 
-                /* got it, do the check */
-                if(ritem != NULL)
-                    for(i = 0; i < ritem->ngroups; i++)
-                        if(strcmp(scan->group, ritem->groups[i]) == 0)
-                            match = 1;
+/** keep the earliest deciding item */
+static int _privacy_entry_best(zebra_entry_t e, zebra_class_t c, int best) {
+    if(e == NULL || e->first[c] < 0)
+        return best;
 
-                break;
+    if(best < 0 || e->first[c] < best)
+        return e->first[c];
 
-            case zebra_S10N:
-                /* roster item check - get the roster item, node@dom/res, then node@dom, then dom */
-                ritem = xhash_get(user->roster, jid_full(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid_user(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid->domain);
+    return best;
+}
+
+/** returns 0 if the packet should be allowed, otherwise 1 */
+static int _privacy_action(user_t user, zebra_list_t zlist, jid_t jid, pkt_type_t ptype, int in) {
+    zebra_index_t ix;
+    zebra_class_t c;
+    int best, i;
+    item_t ritem;
+    char domres[2048];
 
-                /* got it, do the check */
-                if(ritem != NULL)
-                    if(scan->to == ritem->to && scan->from == ritem->from)
-                        match = 1;
+    log_debug(ZONE, "running match on list %s for %s (packet type 0x%x) (%s)", zlist->name, jid_full(jid), ptype, in ? "incoming" : "outgoing");
 
-                break;
+    ix = _privacy_index(zlist);
+    c = _privacy_class(ptype, in);
+
+    /* fall through, all packets match this */
+    best = _privacy_entry_best(&ix->any, c, -1);
+
+    /* jid check - match node@dom/res, then node@dom, then dom/resource, then dom */
+    if(xhash_count(ix->jids) > 0) {
+        best = _privacy_entry_best(xhash_get(ix->jids, jid_full(jid)), c, best);
+        best = _privacy_entry_best(xhash_get(ix->jids, jid_user(jid)), c, best);
+        if(jid->resource[0] != '\0') {
+            snprintf(domres, sizeof(domres) / sizeof(domres[0]), "%s/%s", jid->domain, jid->resource);
+            best = _privacy_entry_best(xhash_get(ix->jids, domres), c, best);
         }
+        best = _privacy_entry_best(xhash_get(ix->jids, jid->domain), c, best);
+    }
 
-        /* if we matched a rule, we have to do packet block matching */
-        if(match) {
-            /* no packet blocking, matching done */
-            if(scan->block == block_NONE)
-                return scan->deny;
-
-            /* incoming checks block_MESSAGE, block_PRES_IN and block_IQ */
-            if(in) {
-                if(ptype & pkt_MESSAGE && scan->block & block_MESSAGE)
-                    return scan->deny;
-                if(ptype & pkt_PRESENCE && scan->block & block_PRES_IN)
-                    return scan->deny;
-                if(ptype & pkt_IQ && scan->block & block_IQ)
-                    return scan->deny;
-            } else if((ptype & pkt_PRESENCE && scan->block & block_PRES_OUT && ptype != pkt_PRESENCE_PROBE) ||
-                      (ptype & pkt_MESSAGE && scan->block & block_MESSAGE)) {
-                /* outgoing check, block_PRES_OUT */
-                /* XXX and block_MESSAGE for XEP-0191 while it violates XEP-0016 */
-                return scan->deny;
-            }
+    /* roster checks - get the roster item, node@dom/res, then node@dom, then dom */
+    if(ix->roster) {
+        ritem = xhash_get(user->roster, jid_full(jid));
+        if(ritem == NULL) ritem = xhash_get(user->roster, jid_user(jid));
+        if(ritem == NULL) ritem = xhash_get(user->roster, jid->domain);
+
+        if(ritem != NULL) {
+            for(i = 0; i < ritem->ngroups; i++)
+                best = _privacy_entry_best(xhash_get(ix->groups, ritem->groups[i]), c, best);
+
+            best = _privacy_entry_best(&ix->s10n[_privacy_s10n(ritem->to, ritem->from)], c, best);
         }
     }
 
     /* didn't match the list, so allow */
-    return 0;
+    if(best < 0)
+        return 0;
+
+    log_debug(ZONE, "matched item %d (order %d)", best, ix->items[best]->order);
+
+    return ix->items[best]->deny;
 }
 
 /** check incoming packets */
@@ -627,6 +792,8 @@ static void _unblock_jid(user_t user, storage_t st, zebra_list_t zlist, jid_t ji
             if (zlist->last == scan)
                 zlist->last = scan->prev;
 
+            _privacy_list_changed(zlist);
+
             /* and from the storage */
             sprintf(filter, "(&(list=%zu:%s)(type=3:jid)(value=%zu:%s))",
                     strlen(urn_BLOCKING), urn_BLOCKING, strlen(jid_full(scan->jid)), jid_full(scan->jid));
@@ -805,6 +972,7 @@ static mod_ret_t _privacy_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt) {
                             zlist->items->prev = zitem;
                             zlist->items = zitem;
                         }
+                        _privacy_list_changed(zlist);
 
                         /* and into the storage backend */
                         os = os_new();
@@ -1329,6 +1497,9 @@ DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     mod->user_delete = _privacy_user_delete;
     mod->free = _privacy_free;
 
+    user_prefetch(mod->mm->sm, "privacy-items");
+    user_prefetch(mod->mm->sm, "privacy-default");
+
     ns_PRIVACY = sm_register_ns(mod->mm->sm, uri_PRIVACY);
     feature_register(mod->mm->sm, uri_PRIVACY);
     ns_BLOCKING = sm_register_ns(mod->mm->sm, urn_BLOCKING);
@@ -846,6 +846,9 @@ DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     mod->user_delete = _roster_user_delete;
     mod->free = _roster_free;
 
+    user_prefetch(mod->mm->sm, "roster-items");
+    user_prefetch(mod->mm->sm, "roster-groups");
+
     feature_register(mod->mm->sm, uri_ROSTER);
 
     return 0;
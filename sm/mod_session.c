@@ -88,6 +88,12 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
         if(pkt->type == pkt_SESS) {
             jid = jid_new(NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
 
+            /* come back when their data has been fetched */
+            if(jid != NULL && user_park(sm, jid, pkt)) {
+                jid_free(jid);
+                return mod_HANDLED;
+            }
+
             if(jid != NULL)
                 sess = sess_start(sm, jid);
 
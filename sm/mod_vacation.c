@@ -249,6 +249,8 @@ DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     mod->user_delete = _vacation_user_delete;
     mod->free = _vacation_free; /* mmm good! :) */
 
+    user_prefetch(mod->mm->sm, "vacation-settings");
+
     ns_VACATION = sm_register_ns(mod->mm->sm, uri_VACATION);
     feature_register(mod->mm->sm, uri_VACATION);
 
@@ -376,9 +376,32 @@ void pkt_id_new(pkt_t pkt) {
     return;
 }
 
+/** remove sm specifics before a packet leaves us */
+static void _pkt_strip_session(nad_t nad) {
+    int ns, scan;
+
+    ns = nad_find_namespace(nad, 1, uri_SESSION, NULL);
+    /* remove them if there is no session elements in packet */
+    if(ns >= 0 && nad_find_elem(nad, 0, ns, NULL, 1) < 0) {
+        nad_set_attr(nad, 1, ns, "c2s", NULL, 0);
+        nad_set_attr(nad, 1, ns, "sm", NULL, 0);
+
+        /* forget about the internal namespace too */
+        if(nad->elems[1].ns == ns)
+            nad->elems[1].ns = nad->nss[ns].next;
+
+        else {
+            for(scan = nad->elems[1].ns; nad->nss[scan].next != -1 && nad->nss[scan].next != ns; scan = nad->nss[scan].next);
+
+            /* got it */
+            if(nad->nss[scan].next != -1)
+                nad->nss[scan].next = nad->nss[ns].next;
+        }
+    }
+}
+
 void pkt_router(pkt_t pkt) {
     mod_ret_t ret;
-    int ns, scan;
 
     if(pkt == NULL) return;
 
@@ -420,26 +443,7 @@ void pkt_router(pkt_t pkt) {
             return;
 
         case mod_PASS:
-            
-            /* remove sm specifics */
-            ns = nad_find_namespace(pkt->nad, 1, uri_SESSION, NULL);
-            /* remove them if there is no session elements in packet */
-            if(ns >= 0 && nad_find_elem(pkt->nad, 0, ns, NULL, 1) < 0) {
-                nad_set_attr(pkt->nad, 1, ns, "c2s", NULL, 0);
-                nad_set_attr(pkt->nad, 1, ns, "sm", NULL, 0);
-
-                /* forget about the internal namespace too */
-                if(pkt->nad->elems[1].ns == ns)
-                    pkt->nad->elems[1].ns = pkt->nad->nss[ns].next;
-
-                else {
-                    for(scan = pkt->nad->elems[1].ns; pkt->nad->nss[scan].next != -1 && pkt->nad->nss[scan].next != ns; scan = pkt->nad->nss[scan].next);
-
-                    /* got it */
-                    if(pkt->nad->nss[scan].next != -1)
-                        pkt->nad->nss[scan].next = pkt->nad->nss[ns].next;
-                }
-            }
+            _pkt_strip_session(pkt->nad);
 
             sx_nad_write(pkt->sm->router, pkt->nad);
 
@@ -456,6 +460,87 @@ void pkt_router(pkt_t pkt) {
     }
 }
 
+/** send a copy of pkt from one jid to several others, as a single multicast route if the router takes them. pkt is left alone */
+void pkt_multicast(pkt_t pkt, jid_t from, jid_t *to, int nto) {
+    sm_t sm = pkt->sm;
+    nad_t nad, shell = NULL;
+    pkt_t check;
+    mod_ret_t ret;
+    int i, ns, elem, n = 0;
+
+    /* nothing to gain, or the router doesn't know them */
+    if(!sm->multicast || nto < 2) {
+        for(i = 0; i < nto; i++)
+            pkt_router(pkt_dup(pkt, jid_full(to[i]), jid_full(from)));
+        return;
+    }
+
+    nad = nad_copy(pkt->nad);
+
+    nad_set_attr(nad, 1, -1, "to", NULL, 0);
+    nad_set_attr(nad, 1, -1, "from", jid_full(from), 0);
+    _pkt_strip_session(nad);
+
+    nad_set_attr(nad, 0, -1, "to", NULL, 0);
+    nad_set_attr(nad, 0, -1, "from", sm->id, 0);
+    nad_set_attr(nad, 0, -1, "type", "multicast", 9);
+
+    /* the out-router chain still sees each recipient, but only gets the top element to look at */
+    if(sm->mm->nout_router > 0) {
+        shell = nad_copy(nad);
+        while(shell->ecur > 2)
+            nad_drop_elem(shell, 2);
+    }
+
+    ns = NAD_ENS(nad, 0);
+    nad_append_elem(nad, ns, "addresses", 1);
+
+    for(i = 0; i < nto; i++) {
+        if(shell != NULL) {
+            check = (pkt_t) calloc(1, sizeof(struct pkt_st));
+
+            check->sm = sm;
+            check->type = pkt->type;
+            check->nad = nad_copy(shell);
+            check->to = jid_dup(to[i]);
+            check->from = jid_dup(from);
+            check->rto = jid_new(to[i]->domain, -1);
+            check->rfrom = jid_new(sm->id, -1);
+
+            nad_set_attr(check->nad, 0, -1, "to", to[i]->domain, 0);
+            nad_set_attr(check->nad, 0, -1, "type", NULL, 0);
+            nad_set_attr(check->nad, 1, -1, "to", jid_full(to[i]), 0);
+
+            ret = mm_out_router(sm->mm, check);
+            if(ret == mod_HANDLED)
+                continue;
+
+            if(ret != mod_PASS) {
+                pkt_router(pkt_error(check, -ret));
+                continue;
+            }
+
+            pkt_free(check);
+        }
+
+        elem = nad_append_elem(nad, ns, "address", 2);
+        nad_set_attr(nad, elem, -1, "to", jid_full(to[i]), 0);
+        n++;
+    }
+
+    if(shell != NULL)
+        nad_free(shell);
+
+    if(n == 0) {
+        nad_free(nad);
+        return;
+    }
+
+    log_debug(ZONE, "multicasting pkt to %d recipients", n);
+
+    sx_nad_write(sm->router, nad);
+}
+
 void pkt_sess(pkt_t pkt, sess_t sess) {
     mod_ret_t ret;
 
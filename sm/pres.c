@@ -68,12 +68,26 @@ static void _pres_top(user_t user) {
     }
 }
 
+/** room for everyone a session might send presence to */
+static jid_t *_pres_rcpt_alloc(sess_t sess) {
+    sess_t sscan;
+    jid_t scan;
+    int n;
+
+    n = xhash_count(sess->user->roster) + 1;
+    for(sscan = sess->user->sessions; sscan != NULL; sscan = sscan->next) n++;
+    for(scan = sess->A; scan != NULL; scan = scan->next) n++;
+
+    return (jid_t *) malloc(sizeof(jid_t) * n);
+}
+
 /** presence updates from a session */
 void pres_update(sess_t sess, pkt_t pkt) {
     item_t item;
-    int self;
-    jid_t scan, next;
+    int self, nrcpt, nprobe;
+    jid_t scan, next, *rcpt, *probe;
     sess_t sscan;
+    pkt_t pres;
 
     switch(pkt->type) {
         case pkt_PRESENCE:
@@ -85,6 +99,9 @@ void pres_update(sess_t sess, pkt_t pkt) {
             sess->pres = pkt;
 
             /* B1: forward to all in T, unless in E */
+            rcpt = _pres_rcpt_alloc(sess);
+            probe = _pres_rcpt_alloc(sess);
+            nrcpt = nprobe = 0;
 
             /* loop the roster, looking for trusted */
             self = 0;
@@ -95,7 +112,7 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 /* if we're coming available, and we can see them, we need to probe them */
                 if(!sess->available && item->to) {
                     log_debug(ZONE, "probing %s", jid_full(item->jid));
-                    pkt_router(pkt_create(sess->user->sm, "presence", "probe", jid_full(item->jid), jid_user(sess->jid)));
+                    probe[nprobe++] = item->jid;
 
                     /* flag if we probed ourselves */
                     if(strcmp(jid_user(sess->jid), jid_full(item->jid)) == 0)
@@ -105,10 +122,16 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 /* if they can see us, forward */
                 if(item->from && !jid_search(sess->E, item->jid)) {
                     log_debug(ZONE, "forwarding available to %s", jid_full(item->jid));
-                    pkt_router(pkt_dup(pkt, jid_full(item->jid), jid_full(sess->jid)));
+                    rcpt[nrcpt++] = item->jid;
                 }
             } while(xhash_iter_next(sess->user->roster));
 
+            if(nprobe > 0) {
+                pres = pkt_create(sess->user->sm, "presence", "probe", NULL, jid_user(sess->jid));
+                pkt_multicast(pres, pres->from, probe, nprobe);
+                pkt_free(pres);
+            }
+
             /* probe ourselves if we need to and didn't already */
             if(!self && !sess->available) {
                 log_debug(ZONE, "probing ourselves");
@@ -119,10 +142,15 @@ void pres_update(sess_t sess, pkt_t pkt) {
             for(sscan = sess->user->sessions; sscan != NULL; sscan = sscan->next) {
                 if(sscan != sess && sscan->available && !sscan->fake) {
                     log_debug(ZONE, "forwarding available to our session %s", jid_full(sscan->jid));
-                    pkt_router(pkt_dup(pkt, jid_full(sscan->jid), jid_full(sess->jid)));
+                    rcpt[nrcpt++] = sscan->jid;
                 }
             }
 
+            pkt_multicast(pkt, sess->jid, rcpt, nrcpt);
+
+            free(rcpt);
+            free(probe);
+
             /* update vars */
             sess->available = 1;
 
@@ -144,6 +172,8 @@ void pres_update(sess_t sess, pkt_t pkt) {
             }
 
             /* B2: forward to all in T and A, unless in E */
+            rcpt = _pres_rcpt_alloc(sess);
+            nrcpt = 0;
 
             /* loop the roster, looking for trusted */
             if(xhash_iter_first(sess->user->roster))
@@ -154,7 +184,7 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 if(item->from && !jid_search(sess->E, item->jid)) {
 
                     log_debug(ZONE, "forwarding unavailable to %s", jid_full(item->jid));
-                    pkt_router(pkt_dup(pkt, jid_full(item->jid), jid_full(sess->jid)));
+                    rcpt[nrcpt++] = item->jid;
                 }
             } while(xhash_iter_next(sess->user->roster));
 
@@ -162,17 +192,21 @@ void pres_update(sess_t sess, pkt_t pkt) {
             for(scan = sess->A; scan != NULL; scan = scan->next)
                 if(!pres_trust(sess->user, scan)) {
                     log_debug(ZONE, "forwarding unavailable to %s", jid_full(scan));
-                    pkt_router(pkt_dup(pkt, jid_full(scan), jid_full(sess->jid)));
+                    rcpt[nrcpt++] = scan;
                 }
 
             /* forward to our active sessions */
             for(sscan = sess->user->sessions; sscan != NULL; sscan = sscan->next) {
                 if(sscan != sess && sscan->available && !sscan->fake) {
                     log_debug(ZONE, "forwarding available to our session %s", jid_full(sscan->jid));
-                    pkt_router(pkt_dup(pkt, jid_full(sscan->jid), jid_full(sess->jid)));
+                    rcpt[nrcpt++] = sscan->jid;
                 }
             }
 
+            pkt_multicast(pkt, sess->jid, rcpt, nrcpt);
+
+            free(rcpt);
+
             /* drop A, E */
             scan = sess->A;
             while(scan != NULL) {
@@ -93,7 +93,10 @@ void sess_end(sess_t sess) {
     if(sess->user->sessions == NULL) {
         mm_user_unload(sess->user->sm->mm, sess->user);
         log_write(sess->user->sm->log, LOG_NOTICE, "user unloaded jid=%s", jid_user(sess->jid));
-        user_free(sess->user);
+
+        /* still delivering waiting packets, they'll free it when they're done */
+        if(!sess->user->held)
+            user_free(sess->user);
     }
 
     /* free the session */
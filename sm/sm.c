@@ -29,6 +29,20 @@
 
 sig_atomic_t sm_lost_router = 0;
 
+/** one recipient of a multicast route */
+static void _sm_multicast_packet(nad_t nad, void *arg) {
+    sm_t sm = (sm_t) arg;
+    pkt_t pkt;
+
+    pkt = pkt_new(sm, nad);
+    if(pkt == NULL) {
+        log_debug(ZONE, "invalid packet, dropping");
+        return;
+    }
+
+    dispatch(sm, pkt);
+}
+
 /** our master callback */
 int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     sm_t sm = (sm_t) arg;
@@ -37,7 +51,7 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     nad_t nad;
     pkt_t pkt;
     int len, ns, elem, attr;
-    char *domain;
+    char *domain, weight[8];
 
     switch(e) {
         case event_WANT_READ:
@@ -122,6 +136,7 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             ns = nad_add_namespace(nad, uri_COMPONENT, NULL);
             nad_append_elem(nad, ns, "bind", 0);
             nad_append_attr(nad, -1, "name", sm->id);
+            nad_append_elem(nad, ns, "multicast", 1);
             log_debug(ZONE, "requesting component bind for '%s'", sm->id);
             sx_nad_write(sm->router, nad);
 
@@ -138,6 +153,12 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 elem = nad_append_elem(nad, ns, "bind", 0);
                 nad_set_attr(nad, elem, -1, "name", domain, len);
                 nad_append_attr(nad, -1, "multi", "to");
+                /* keep our share of users when we reconnect */
+                nad_append_attr(nad, -1, "instance", sm->id);
+                if(sm->router_weight != 1) {
+                    snprintf(weight, sizeof(weight), "%d", sm->router_weight);
+                    nad_append_attr(nad, -1, "weight", weight);
+                }
                 log_debug(ZONE, "requesting domain bind for '%.*s'", len, domain);
                 sx_nad_write(sm->router, nad);
             
@@ -208,6 +229,11 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
                 log_debug(ZONE, "coming online");
 
+                /* routers that know about multicast routes say so */
+                sm->multicast = (nad_find_attr(nad, 0, -1, "multicast", NULL) >= 0);
+                if(sm->multicast)
+                    log_debug(ZONE, "router takes multicast routes");
+
                 /* we're online */
                 sm->online = sm->started = 1;
                 log_write(sm->log, LOG_NOTICE, "%s ready for sessions", sm->id);
@@ -218,6 +244,13 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
             log_debug(ZONE, "got a packet");
 
+            /* multicast routes get expanded here, at the last hop */
+            if(NAD_ENAME_L(nad, 0) == 5 && strncmp("route", NAD_ENAME(nad, 0), 5) == 0 && nad_find_attr(nad, 0, -1, "type", "multicast") >= 0) {
+                stanza_multicast_split(nad, _sm_multicast_packet, (void *) sm);
+                nad_free(nad);
+                return 0;
+            }
+
             pkt = pkt_new(sm, nad);
             if (pkt == NULL) {
                 log_debug(ZONE, "invalid packet, dropping");
@@ -265,7 +298,7 @@ int sm_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg)
             sm_lost_router = 1;
 
             /* we're offline */
-            sm->online = 0;
+            sm->online = sm->multicast = 0;
 
             break;
 
@@ -392,3 +425,33 @@ int sm_storage_rate_limit(sm_t sm, const char *owner) {
     }
     return FALSE;
 }
+
+/** a call waiting for the main loop */
+typedef struct _sm_later_st {
+    sm_later_fn fn;
+    void        *arg;
+} *_sm_later_t;
+
+void sm_later(sm_t sm, sm_later_fn fn, void *arg) {
+    _sm_later_t l;
+
+    l = (_sm_later_t) malloc(sizeof(struct _sm_later_st));
+    l->fn = fn;
+    l->arg = arg;
+
+    jqueue_push(sm->later, (void *) l, 0);
+}
+
+int sm_later_run(sm_t sm) {
+    _sm_later_t l;
+    int n;
+
+    /* only the ones already here, new ones wait for the next time round */
+    for(n = jqueue_size(sm->later); n > 0; n--) {
+        l = (_sm_later_t) jqueue_pull(sm->later);
+        (l->fn)(sm, l->arg);
+        free(l);
+    }
+
+    return jqueue_size(sm->later);
+}
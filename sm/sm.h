@@ -176,6 +176,7 @@ struct sm_st {
     const char          *router_private_key_password;    /** password for private key if pemfile
                                                              key is encrypted */
     const char          *router_ciphers;    /** TLS ciphers */
+    int                 router_weight;      /**< share of users to take when other sms serve the same domains */
 
     mio_t               mio;                /**< mio context */
 
@@ -221,6 +222,8 @@ struct sm_st {
 
     int                 online;             /**< true if we're currently bound in the router */
 
+    int                 multicast;          /**< true if the router takes multicast routes from us */
+
     xht                 hosts;              /**< vHosts map */
 
     /** Database query rate limits */
@@ -228,6 +231,12 @@ struct sm_st {
     int                 query_rate_seconds;
     int                 query_rate_wait;
     xht                 query_rates;
+
+    /** Asynchronous user loading */
+    xht                 prefetch;           /**< storage types fetched before a user is loaded (key is type) */
+    xht                 loading;            /**< users being fetched, and their waiting packets (key is user@@domain) */
+
+    jqueue_t            later;              /**< calls to make from the main loop, for work done a piece at a time */
 };
 
 /** data for a single user */
@@ -247,6 +256,8 @@ struct user_st {
     time_t              active;             /**< time that user first logged in (ever) */
 
     void                **module_data;      /**< per-user module data */
+
+    int                 held;               /**< true while waiting packets are delivered, so it isn't freed */
 };
 
 /** data for a single session */
@@ -295,7 +306,14 @@ SM_API int             sm_get_ns(sm_t sm, const char *uri);
 
 SM_API int             sm_storage_rate_limit(sm_t sm, const char *owner);
 
+/** call fn from the main loop, once what's waiting to be read and written has had a go */
+typedef void (*sm_later_fn)(sm_t sm, void *arg);
+SM_API void            sm_later(sm_t sm, sm_later_fn fn, void *arg);
+/** make the calls that were waiting, returns how many more have been asked for since */
+SM_API int             sm_later_run(sm_t sm);
+
 SM_API void            dispatch(sm_t sm, pkt_t pkt);
+SM_API void            dispatch_user(sm_t sm, pkt_t pkt);
 
 SM_API pkt_t           pkt_error(pkt_t pkt, int err);
 SM_API pkt_t           pkt_tofrom(pkt_t pkt);
@@ -308,6 +326,7 @@ SM_API void            pkt_id_new(pkt_t pkt);
 SM_API void            pkt_delay(pkt_t pkt, time_t t, const char *from);
 
 SM_API void            pkt_router(pkt_t pkt);
+SM_API void            pkt_multicast(pkt_t pkt, jid_t from, jid_t *to, int nto);
 SM_API void            pkt_sess(pkt_t pkt, sess_t sess);
 
 SM_API int             pres_trust(user_t user, jid_t jid);
@@ -327,6 +346,9 @@ SM_API user_t          user_load(sm_t sm, jid_t jid);
 SM_API void            user_free(user_t user);
 SM_API int             user_create(sm_t sm, jid_t jid);
 SM_API void            user_delete(sm_t sm, jid_t jid);
+SM_API void            user_prefetch(sm_t sm, const char *type);
+SM_API int             user_park(sm_t sm, jid_t jid, pkt_t pkt);
+SM_API void            user_park_free(sm_t sm);
 
 SM_API void            feature_register(sm_t sm, const char *feature);
 SM_API void            feature_unregister(sm_t sm, const char *feature);
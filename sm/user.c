@@ -84,6 +84,175 @@ void user_free(user_t user) {
     pool_free(user->p);
 }
 
+/** a user whose data is being fetched */
+typedef struct user_loading_st {
+    pool_t      p;
+    sm_t        sm;
+    jid_t       jid;
+
+    jqueue_t    pkts;       /**< packets waiting for them */
+    int         pending;    /**< fetches still outstanding */
+    int         delivering; /**< true while the waiting packets are delivered */
+} *user_loading_t;
+
+/** a single fetch */
+typedef struct user_fetch_st {
+    user_loading_t  ul;
+    const char      *type;
+} *user_fetch_t;
+
+/** have this type fetched for users before they're loaded */
+void user_prefetch(sm_t sm, const char *type) {
+    if(xhash_get(sm->prefetch, type) != NULL)
+        return;
+
+    log_debug(ZONE, "prefetching %s for users", type);
+
+    type = pstrdup(xhash_pool(sm->prefetch), type);
+    xhash_put(sm->prefetch, type, (void *) type);
+}
+
+/** everything is here, load them and deliver the packets */
+static void _user_loaded(user_loading_t ul) {
+    sm_t sm = ul->sm;
+    user_t user;
+    pkt_t pkt;
+    const char *type;
+    int typelen;
+
+    log_debug(ZONE, "fetched data for %s, delivering %d packets", jid_user(ul->jid), jqueue_size(ul->pkts));
+
+    user = user_load(sm, ul->jid);
+    if(user != NULL)
+        user->held = 1;
+
+    /* packets go straight through from here, even if they don't exist */
+    ul->delivering = 1;
+
+    while((pkt = (pkt_t) jqueue_pull(ul->pkts)) != NULL) {
+        /* session starts go back through the router chain, everything else is for the user */
+        if(pkt->type & pkt_SESS)
+            dispatch(sm, pkt);
+        else
+            dispatch_user(sm, pkt);
+    }
+
+    xhash_zap(sm->loading, jid_user(ul->jid));
+
+    /* anything user_load didn't want */
+    if(xhash_iter_first(sm->prefetch))
+        do {
+            xhash_iter_get(sm->prefetch, &type, &typelen, NULL);
+            storage_preload_drop(sm->st, type, jid_user(ul->jid));
+        } while(xhash_iter_next(sm->prefetch));
+
+    if(user != NULL) {
+        user->held = 0;
+
+        if(user->sessions == NULL)
+            user_free(user);
+    }
+
+    jqueue_free(ul->pkts);
+    pool_free(ul->p);
+}
+
+static void _user_fetched(st_ret_t ret, os_t os, int count, void *arg) {
+    user_fetch_t uf = (user_fetch_t) arg;
+    user_loading_t ul = uf->ul;
+
+    /* user_load will pick it up from here */
+    storage_preload(ul->sm->st, uf->type, jid_user(ul->jid), ret, os);
+
+    ul->pending--;
+    if(ul->pending == 0)
+        _user_loaded(ul);
+}
+
+/** if the user isn't loaded, fetch their data in the background and hold the packet until it arrives */
+int user_park(sm_t sm, jid_t jid, pkt_t pkt) {
+    user_loading_t ul;
+    user_fetch_t *uf;
+    const char *type;
+    int typelen, n, i;
+    pool_t p;
+
+    if(!storage_async(sm->st) || xhash_count(sm->prefetch) == 0)
+        return 0;
+
+    /* already fetching */
+    ul = (user_loading_t) xhash_get(sm->loading, jid_user(jid));
+    if(ul != NULL && ul->delivering)
+        return 0;
+
+    if(ul != NULL) {
+        log_debug(ZONE, "still fetching data for %s, holding packet", jid_user(jid));
+        jqueue_push(ul->pkts, (void *) pkt, 0);
+        return 1;
+    }
+
+    /* already loaded, or no such domain */
+    if(xhash_get(sm->users, jid_user(jid)) != NULL || xhash_get(sm->hosts, jid->domain) == NULL)
+        return 0;
+
+    log_debug(ZONE, "fetching data for %s, holding packet", jid_user(jid));
+
+    p = pool_new();
+
+    ul = (user_loading_t) pmalloco(p, sizeof(struct user_loading_st));
+    ul->p = p;
+    ul->sm = sm;
+    ul->jid = jid_dup(jid);
+    pool_cleanup(p, (void (*)(void *)) jid_free, ul->jid);
+    ul->pkts = jqueue_new();
+
+    jqueue_push(ul->pkts, (void *) pkt, 0);
+
+    xhash_put(sm->loading, jid_user(ul->jid), (void *) ul);
+
+    /* a fetch can complete inline, and the last one walks the prefetch
+     * list and frees ul, so set them all up before submitting any */
+    uf = (user_fetch_t *) malloc(sizeof(user_fetch_t) * xhash_count(sm->prefetch));
+
+    n = 0;
+    if(xhash_iter_first(sm->prefetch))
+        do {
+            xhash_iter_get(sm->prefetch, &type, &typelen, NULL);
+
+            uf[n] = (user_fetch_t) pmalloco(p, sizeof(struct user_fetch_st));
+            uf[n]->ul = ul;
+            uf[n]->type = type;
+            n++;
+        } while(xhash_iter_next(sm->prefetch));
+
+    ul->pending = n;
+
+    for(i = 0; i < n; i++)
+        storage_submit(sm->st, st_op_GET, uf[i]->type, jid_user(ul->jid), NULL, NULL, _user_fetched, (void *) uf[i]);
+
+    free(uf);
+
+    return 1;
+}
+
+/** drop the packets waiting for users, at shutdown */
+void user_park_free(sm_t sm) {
+    user_loading_t ul;
+    pkt_t pkt;
+
+    if(xhash_iter_first(sm->loading))
+        do {
+            xhash_iter_get(sm->loading, NULL, NULL, (void *) &ul);
+
+            while((pkt = (pkt_t) jqueue_pull(ul->pkts)) != NULL)
+                pkt_free(pkt);
+            jqueue_free(ul->pkts);
+
+            xhash_iter_zap(sm->loading);
+            pool_free(ul->p);
+        } while(xhash_iter_next(sm->loading));
+}
+
 /** initialise a user */
 int user_create(sm_t sm, jid_t jid) {
     user_t user;
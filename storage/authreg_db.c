@@ -293,6 +293,9 @@ int ar_init(authreg_t ar)
     DB_ENV *env;
     moddata_t data;
 
+    /* the db environment can only be opened once */
+    ar->single = 1;
+
     path = config_get_one(ar->c2s->config, "authreg.db.path", 0);
     if(path == NULL)
     {
@@ -23,6 +23,7 @@
 #define _XOPEN_SOURCE 500
 #include "c2s.h"
 #include <mysql.h>
+#include <errmsg.h>
 #include <stdlib.h>
 #include <openssl/rand.h>
 
@@ -34,6 +35,9 @@
 #else
 #ifdef HAVE_CRYPT
 #include <unistd.h>
+#ifdef HAVE_CRYPT_R
+#include <crypt.h>
+#endif
 #endif
 #endif
 
@@ -75,6 +79,25 @@ typedef struct mysqlcontext_st {
 #endif
 } *mysqlcontext_t;
 
+#ifdef HAVE_CRYPT
+/** crypt() hands every thread the same buffer, and checks run on the authreg
+ *  threads. without crypt_r the module is kept to one of them */
+static void _ar_mysql_crypt(const char *password, const char *salt, char *out, int outlen) {
+#ifdef HAVE_CRYPT_R
+    struct crypt_data *cd = (struct crypt_data *) calloc(1, sizeof(struct crypt_data));
+    char *crypted = crypt_r(password, salt, cd);
+#else
+    char *crypted = crypt(password, salt);
+#endif
+
+    snprintf(out, outlen, "%s", crypted != NULL ? crypted : "*");
+
+#ifdef HAVE_CRYPT_R
+    free(cd);
+#endif
+}
+#endif
+
 #ifdef HAVE_SSL
 static void calc_a1hash(const char *username, const char *realm, const char *password, char *a1hash)
 {
@@ -94,17 +117,17 @@ static void calc_a1hash(const char *username, const char *realm, const char *pas
 
 static void bcrypt_hash(const char *password, int cost, char* hash)
 {
-    char salt[16];
+    char salt[16], setting[BCRYPT_GENSALT_OUTPUT_SIZE], out[BCRYPT_OUTPUT_SIZE];
     if(!RAND_bytes(salt, 16)) abort(); //we've got a problem
 
-    char* gen = bcrypt_gensalt("$2y$", cost, salt, 16);
-    strcpy(hash, bcrypt(password, gen));
+    char* gen = crypt_gensalt_rn("$2y$", cost, salt, 16, setting, sizeof(setting));
+    strcpy(hash, bcrypt_r(password, gen, out));
 }
 
 static int bcrypt_verify(const char *password, const char* hash)
 {
-    char *ret;
-    ret = bcrypt(password, hash);
+    char *ret, out[BCRYPT_OUTPUT_SIZE];
+    ret = bcrypt_r(password, hash, out);
 
     if(strlen(ret) != strlen(hash))
         return 1;
@@ -128,6 +151,30 @@ static int bcrypt_needs_rehash(int current_cost, const char* hash)
 }
 #endif
 
+/** run a query. rather than pinging the server before every one, we try again
+ *  if it turns out the connection had gone; the library reconnects for us */
+static int _ar_mysql_query(authreg_t ar, const char *sql) {
+    mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
+    MYSQL *conn = ctx->conn;
+    unsigned int err;
+
+    log_debug(ZONE, "prepared sql: %s", sql);
+
+    if(mysql_query(conn, sql) == 0)
+        return 0;
+
+    err = mysql_errno(conn);
+    if(err != CR_SERVER_GONE_ERROR && err != CR_SERVER_LOST)
+        return 1;
+
+    log_write(ar->c2s->log, LOG_ERR, "mysql: lost connection to database, attempting reconnect");
+
+    if(mysql_ping(conn) != 0)
+        return 1;
+
+    return mysql_query(conn, sql);
+}
+
 static MYSQL_RES *_ar_mysql_get_user_tuple(authreg_t ar, const char *username, const char *realm) {
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
     MYSQL *conn = ctx->conn;
@@ -135,11 +182,6 @@ static MYSQL_RES *_ar_mysql_get_user_tuple(authreg_t ar, const char *username, c
     char euser[MYSQL_LU*2+1], erealm[MYSQL_LR*2+1], sql[1024 + MYSQL_LU*2 + MYSQL_LR*2 + 1];  /* query(1024) + euser + erealm + \0(1) */
     MYSQL_RES *res;
 
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
-        return NULL;
-    }
-
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
 
@@ -148,9 +190,7 @@ static MYSQL_RES *_ar_mysql_get_user_tuple(authreg_t ar, const char *username, c
 
     sprintf(sql, ctx->sql_select, euser, erealm);
 
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    if(mysql_query(conn, sql) != 0) {
+    if(_ar_mysql_query(ar, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(conn));
         return NULL;
     }
@@ -223,11 +263,6 @@ static int _ar_mysql_set_password(authreg_t ar, sess_t sess, const char *usernam
     char iuser[MYSQL_LU+1], irealm[MYSQL_LR+1];
     char euser[MYSQL_LU*2+1], erealm[MYSQL_LR*2+1], epass[513], sql[1024+MYSQL_LU*2+MYSQL_LR*2+512+1];  /* query(1024) + euser + erealm + epass(512) + \0(1) */
 
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
-        return 1;
-    }
-
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
 
@@ -240,7 +275,7 @@ static int _ar_mysql_set_password(authreg_t ar, sess_t sess, const char *usernam
         for(i=0; i<22; i++)
             salt[16+i] = salter[rand()%64];
         salt[38] = '\0';
-        strcpy(password, crypt(password, salt));
+        _ar_mysql_crypt(password, salt, password, 257);
     }
 #endif
 
@@ -260,9 +295,7 @@ static int _ar_mysql_set_password(authreg_t ar, sess_t sess, const char *usernam
 
     sprintf(sql, ctx->sql_setpassword, epass, euser, erealm);
 
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    if(mysql_query(conn, sql) != 0) {
+    if(_ar_mysql_query(ar, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql update failed: %s", mysql_error(conn));
         return 1;
     }
@@ -274,7 +307,7 @@ static int _ar_mysql_check_password(authreg_t ar, sess_t sess, const char *usern
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
     char db_pw_value[257];
 #ifdef HAVE_CRYPT
-    char *crypted_pw;
+    char crypted_pw[257];
 #endif
 #ifdef HAVE_SSL
     char a1hash_pw[33];
@@ -293,7 +326,7 @@ static int _ar_mysql_check_password(authreg_t ar, sess_t sess, const char *usern
 
 #ifdef HAVE_CRYPT
         case MPC_CRYPT:
-                crypted_pw = crypt(password,db_pw_value);
+                _ar_mysql_crypt(password, db_pw_value, crypted_pw, sizeof(crypted_pw));
                 ret = (strcmp(crypted_pw, db_pw_value) != 0);
                 break;
 #endif
@@ -350,11 +383,6 @@ static int _ar_mysql_create_user(authreg_t ar, sess_t sess, const char *username
 
     mysql_free_result(res);
 
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
-        return 1;
-    }
-
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
 
@@ -363,9 +391,7 @@ static int _ar_mysql_create_user(authreg_t ar, sess_t sess, const char *username
 
     sprintf(sql, ctx->sql_create, euser, erealm);
 
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    if(mysql_query(conn, sql) != 0) {
+    if(_ar_mysql_query(ar, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(conn));
         return 1;
     }
@@ -379,11 +405,6 @@ static int _ar_mysql_delete_user(authreg_t ar, sess_t sess, const char *username
     char iuser[MYSQL_LU+1], irealm[MYSQL_LR+1];
     char euser[MYSQL_LU*2+1], erealm[MYSQL_LR*2+1], sql[1024+MYSQL_LU*2+MYSQL_LR*2+1];    /* query(1024) + euser + erealm + \0(1) */
 
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
-        return 1;
-    }
-
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
 
@@ -392,9 +413,7 @@ static int _ar_mysql_delete_user(authreg_t ar, sess_t sess, const char *username
 
     sprintf(sql, ctx->sql_delete, euser, erealm);
 
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    if(mysql_query(conn, sql) != 0) {
+    if(_ar_mysql_query(ar, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(conn));
         return 1;
     }
@@ -534,6 +553,12 @@ DLLEXPORT int ar_init(authreg_t ar) {
         mysqlcontext->password_type = MPC_PLAIN;
     }
 
+#if defined(HAVE_CRYPT) && !defined(HAVE_CRYPT_R)
+    /* crypt() isn't safe to call from more than one thread at a time */
+    if(mysqlcontext->password_type == MPC_CRYPT)
+        ar->single = 1;
+#endif
+
     /* craft the default SQL statements */
     /* we leave unused statements allocated to simplify code - a small price to pay */
     /* bounds checking and parameter format verification will be perfomed if the statement is used (see next section) */
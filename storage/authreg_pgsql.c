@@ -32,6 +32,9 @@
 #else
 #ifdef HAVE_CRYPT
 #include <unistd.h>
+#ifdef HAVE_CRYPT_R
+#include <crypt.h>
+#endif
 #endif
 #endif
 
@@ -61,6 +64,17 @@ enum pgsql_pws_crypt {
 static char salter[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ./";
 #endif
 
+/* our statements, prepared on the connection the first time they're used */
+enum pgsql_stmt {
+    ST_CREATE,
+    ST_SELECT,
+    ST_SETPASSWORD,
+    ST_DELETE,
+    ST_CHECK_PASSWORD
+};
+
+static const char *_ar_pgsql_stmt_names[] = { "ar_create", "ar_select", "ar_setpassword", "ar_delete", "ar_checkpassword" };
+
 typedef struct pgsqlcontext_st {
   PGconn * conn;
   const char * sql_create;
@@ -69,12 +83,32 @@ typedef struct pgsqlcontext_st {
   const char * sql_delete;
   const char * sql_check_password;
   const char * field_password;
+  int prepared;     /* bit for each enum pgsql_stmt prepared on this connection */
   enum pgsql_pws_crypt password_type;
 #ifdef HAVE_SSL
   int bcrypt_cost;
 #endif
   } *pgsqlcontext_t;
 
+#ifdef HAVE_CRYPT
+/** crypt() hands every thread the same buffer, and checks run on the authreg
+ *  threads. without crypt_r the module is kept to one of them */
+static void _ar_pgsql_crypt(const char *password, const char *salt, char *out, int outlen) {
+#ifdef HAVE_CRYPT_R
+    struct crypt_data *cd = (struct crypt_data *) calloc(1, sizeof(struct crypt_data));
+    char *crypted = crypt_r(password, salt, cd);
+#else
+    char *crypted = crypt(password, salt);
+#endif
+
+    snprintf(out, outlen, "%s", crypted != NULL ? crypted : "*");
+
+#ifdef HAVE_CRYPT_R
+    free(cd);
+#endif
+}
+#endif
+
 #ifdef HAVE_SSL
 static void calc_a1hash(const char *username, const char *realm, const char *password, char *a1hash)
 {
@@ -94,18 +128,18 @@ static void calc_a1hash(const char *username, const char *realm, const char *pas
 
 static void bcrypt_hash(const char *password, int cost, char* hash)
 {
-    char salt[16];
+    char salt[16], setting[BCRYPT_GENSALT_OUTPUT_SIZE], out[BCRYPT_OUTPUT_SIZE];
     if(!RAND_bytes(salt, 16))
         ; //we've got a problem
 
-    char* gen = bcrypt_gensalt("$2y$", cost, salt, 16);
-    strcpy(hash, bcrypt(password, gen));
+    char* gen = crypt_gensalt_rn("$2y$", cost, salt, 16, setting, sizeof(setting));
+    strcpy(hash, bcrypt_r(password, gen, out));
 }
 
 static int bcrypt_verify(const char *password, const char* hash)
 {
-    char *ret;
-    ret = bcrypt(password, hash);
+    char *ret, out[BCRYPT_OUTPUT_SIZE];
+    ret = bcrypt_r(password, hash, out);
 
     if(strlen(ret) != strlen(hash))
         return 1;
@@ -129,42 +163,73 @@ static int bcrypt_needs_rehash(int current_cost, const char* hash)
 }
 #endif
 
-static PGresult *_ar_pgsql_get_user_tuple(authreg_t ar, const char *username, const char *realm) {
+/** run one of our statements, preparing it first if this connection hasn't seen it yet.
+ *  returns NULL (and logs) unless the result status is ok */
+static PGresult *_ar_pgsql_exec(authreg_t ar, enum pgsql_stmt st, const char *sql, int nparams, const char **vals, ExecStatusType ok) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
     PGconn *conn = ctx->conn;
-
-    char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
-    char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], sql[1024+PGSQL_LU*2+PGSQL_LR*2+1];  /* query(1024) + euser + erealm + \0(1) */
     PGresult *res;
+    int retry;
 
-    snprintf(iuser, PGSQL_LU+1, "%s", username);
-    snprintf(irealm, PGSQL_LR+1, "%s", realm);
+    for(retry = 0; ; retry++) {
+        res = NULL;
+
+        if(!(ctx->prepared & (1 << st))) {
+            log_debug(ZONE, "preparing %s: %s", _ar_pgsql_stmt_names[st], sql);
 
-    PQescapeString(euser, iuser, strlen(iuser));
-    PQescapeString(erealm, irealm, strlen(irealm));
+            res = PQprepare(conn, _ar_pgsql_stmt_names[st], sql, nparams, NULL);
+            if(PQresultStatus(res) == PGRES_COMMAND_OK) {
+                ctx->prepared |= 1 << st;
+                PQclear(res);
+                res = NULL;
+            }
+        }
 
-    sprintf(sql, ctx->sql_select, euser, erealm);
+        if(res == NULL)
+            res = PQexecPrepared(conn, _ar_pgsql_stmt_names[st], nparams, vals, NULL, NULL, 0);
 
-    log_debug(ZONE, "prepared sql: %s", sql);
+        if(PQresultStatus(res) == ok || PQstatus(conn) == CONNECTION_OK || retry)
+            break;
 
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(conn) != CONNECTION_OK) {
         log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
         PQclear(res);
         PQreset(conn);
+
+        /* new connection, nothing prepared on it */
+        ctx->prepared = 0;
+
         if(PQstatus(conn) != CONNECTION_OK) {
             log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database failed, will retry later: %s", PQerrorMessage(conn));
             return NULL;
         }
-
-        res = PQexec(conn, sql);
     }
-    if(PQresultStatus(res) != PGRES_TUPLES_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
+
+    if(PQresultStatus(res) != ok) {
+        log_write(ar->c2s->log, LOG_ERR, "pgsql: sql %s failed: %s", _ar_pgsql_stmt_names[st] + 3, PQresultErrorMessage(res));
         PQclear(res);
         return NULL;
     }
 
+    return res;
+}
+
+static PGresult *_ar_pgsql_get_user_tuple(authreg_t ar, const char *username, const char *realm) {
+    pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
+
+    char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
+    const char *vals[2];
+    PGresult *res;
+
+    snprintf(iuser, PGSQL_LU+1, "%s", username);
+    snprintf(irealm, PGSQL_LR+1, "%s", realm);
+
+    vals[0] = iuser;
+    vals[1] = irealm;
+
+    res = _ar_pgsql_exec(ar, ST_SELECT, ctx->sql_select, 2, vals, PGRES_TUPLES_OK);
+    if(res == NULL)
+        return NULL;
+
     if(PQntuples(res) != 1) {
         PQclear(res);
         return NULL;
@@ -215,41 +280,22 @@ static int _ar_pgsql_get_password(authreg_t ar, sess_t sess, const char *usernam
 static int _ar_pgsql_dbcheck_password(authreg_t ar, sess_t sess, const char *username, const char *realm, char password[257])
 {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
 
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1], ipassword[PGSQL_LR+1];
-    char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], epassword[PGSQL_LR*2+1], sql[1024+PGSQL_LU*2+PGSQL_LR*2+1+PGSQL_LR*2+1];  /* query(1024) + euser + erealm + \0(1) */
+    const char *vals[3];
     PGresult *res;
 
     snprintf(iuser, PGSQL_LU+1, "%s", username);
     snprintf(irealm, PGSQL_LR+1, "%s", realm);
     snprintf(ipassword, PGSQL_LR+1, "%s", password);
 
-    PQescapeString(euser, iuser, strlen(iuser));
-    PQescapeString(erealm, irealm, strlen(irealm));
-    PQescapeString(epassword, ipassword, strlen(ipassword));
-
-    sprintf(sql, ctx->sql_check_password, euser, epassword, erealm);
-
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-        if(PQstatus(conn) != CONNECTION_OK) {
-            log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database failed, will retry later: %s", PQerrorMessage(conn));
-            return 1;
-        }
+    vals[0] = iuser;
+    vals[1] = ipassword;
+    vals[2] = irealm;
 
-        res = PQexec(conn, sql);
-    }
-    if(PQresultStatus(res) != PGRES_TUPLES_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
-        PQclear(res);
+    res = _ar_pgsql_exec(ar, ST_CHECK_PASSWORD, ctx->sql_check_password, 3, vals, PGRES_TUPLES_OK);
+    if(res == NULL)
         return 1;
-    }
 
     if(PQntuples(res) != 1) {
         log_write(ar->c2s->log, LOG_ERR, "pgsql: Empty result");
@@ -283,9 +329,8 @@ static int _ar_pgsql_dbcheck_password(authreg_t ar, sess_t sess, const char *use
 
 static int _ar_pgsql_set_password(authreg_t ar, sess_t sess, const char *username, const char *realm, char password[257]) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
-    char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], epass[513], sql[1024+PGSQL_LU*2+PGSQL_LR*2+512+1];  /* query(1024) + euser + erealm + epass(512) + \0(1) */
+    const char *vals[3];
     PGresult *res;
 
     snprintf(iuser, PGSQL_LU+1, "%s", username);
@@ -300,7 +345,7 @@ static int _ar_pgsql_set_password(authreg_t ar, sess_t sess, const char *usernam
         for(i=0; i<22; i++)
             salt[16+i] = salter[rand()%64];
         salt[38] = '\0';
-        strcpy(password, crypt(password, salt));
+        _ar_pgsql_crypt(password, salt, password, 257);
     }
 #endif
 
@@ -312,31 +357,13 @@ static int _ar_pgsql_set_password(authreg_t ar, sess_t sess, const char *usernam
     }
 #endif
 
-    PQescapeString(euser, iuser, strlen(iuser));
-    PQescapeString(erealm, irealm, strlen(irealm));
-    PQescapeString(epass, password, strlen(password));
+    vals[0] = password;
+    vals[1] = iuser;
+    vals[2] = irealm;
 
-    sprintf(sql, ctx->sql_setpassword, epass, euser, erealm);
-
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-
-        if(PQstatus(conn) != CONNECTION_OK) {
-            log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database failed, will retry later: %s", PQerrorMessage(conn));
-            return 1;
-        }
-        res = PQexec(conn, sql);
-    }
-    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: sql update failed: %s", PQresultErrorMessage(res));
-        PQclear(res);
+    res = _ar_pgsql_exec(ar, ST_SETPASSWORD, ctx->sql_setpassword, 3, vals, PGRES_COMMAND_OK);
+    if(res == NULL)
         return 1;
-    }
 
     PQclear(res);
 
@@ -348,7 +375,7 @@ static int _ar_pgsql_check_password(authreg_t ar, sess_t sess, const char *usern
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
     char db_pw_value[257];
 #ifdef HAVE_CRYPT
-    char *crypted_pw;
+    char crypted_pw[257];
 #endif
 #ifdef HAVE_SSL
     char a1hash_pw[33];
@@ -367,7 +394,7 @@ static int _ar_pgsql_check_password(authreg_t ar, sess_t sess, const char *usern
 
 #ifdef HAVE_CRYPT
         case MPC_CRYPT:
-                crypted_pw = crypt(password,db_pw_value);
+                _ar_pgsql_crypt(password, db_pw_value, crypted_pw, sizeof(crypted_pw));
                 ret = (strcmp(crypted_pw, db_pw_value) != 0);
                 break;
 #endif
@@ -411,9 +438,8 @@ static int _ar_pgsql_check_password(authreg_t ar, sess_t sess, const char *usern
 
 static int _ar_pgsql_create_user(authreg_t ar, sess_t sess, const char *username, const char *realm) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
-    char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], sql[1024+PGSQL_LU*2+PGSQL_LR*2+1];  /* query(1024) + euser + erealm + \0(1) */
+    const char *vals[2];
     PGresult *res;
 
     res = _ar_pgsql_get_user_tuple(ar, username, realm);
@@ -427,31 +453,12 @@ static int _ar_pgsql_create_user(authreg_t ar, sess_t sess, const char *username
     snprintf(iuser, PGSQL_LU+1, "%s", username);
     snprintf(irealm, PGSQL_LR+1, "%s", realm);
 
-    PQescapeString(euser, iuser, strlen(iuser));
-    PQescapeString(erealm, irealm, strlen(irealm));
-
-    sprintf(sql, ctx->sql_create, euser, erealm);
+    vals[0] = iuser;
+    vals[1] = irealm;
 
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-
-        if(PQstatus(conn) != CONNECTION_OK) {
-            log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database failed, will retry later: %s", PQerrorMessage(conn));
-            return 1;
-        }
-
-        res = PQexec(conn, sql);
-    }
-    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
-        PQclear(res);
+    res = _ar_pgsql_exec(ar, ST_CREATE, ctx->sql_create, 2, vals, PGRES_COMMAND_OK);
+    if(res == NULL)
         return 1;
-    }
 
     PQclear(res);
 
@@ -460,39 +467,19 @@ static int _ar_pgsql_create_user(authreg_t ar, sess_t sess, const char *username
 
 static int _ar_pgsql_delete_user(authreg_t ar, sess_t sess, const char *username, const char *realm) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
-    char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], sql[1024+PGSQL_LU*2+PGSQL_LR*2+1];    /* query(1024) + euser + erealm + \0(1) */
+    const char *vals[2];
     PGresult *res;
 
     snprintf(iuser, PGSQL_LU+1, "%s", username);
     snprintf(irealm, PGSQL_LR+1, "%s", realm);
 
-    PQescapeString(euser, iuser, strlen(iuser));
-    PQescapeString(erealm, irealm, strlen(irealm));
-
-    sprintf(sql, ctx->sql_delete, euser, erealm);
-
-    log_debug(ZONE, "prepared sql: %s", sql);
-
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-
-        if(PQstatus(conn) != CONNECTION_OK) {
-            log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database failed, will retry later: %s", PQerrorMessage(conn));
-            return 1;
-        }
+    vals[0] = iuser;
+    vals[1] = irealm;
 
-        res = PQexec(conn, sql);
-    }
-    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: sql delete failed: %s", PQresultErrorMessage(res));
-        PQclear(res);
+    res = _ar_pgsql_exec(ar, ST_DELETE, ctx->sql_delete, 2, vals, PGRES_COMMAND_OK);
+    if(res == NULL)
         return 1;
-    }
 
     PQclear(res);
 
@@ -562,6 +549,49 @@ static const char * _ar_pgsql_check_template( const char * template, const char
       return 0;
 }
 
+/* Turn a checked sprintf template into SQL with $1, $2... where the */
+/* %s placeholders were, so values are sent alongside the statement */
+/* instead of being escaped into it. A quoted '%s' becomes just $n; */
+/* a %s inside a longer quoted string is concatenated in. */
+static char * _ar_pgsql_template_sql( const char * template ) {
+    const char *c;
+    char *sql, *s;
+    int n = 0, quoted = 0;
+
+    /* a %s grows to at most "' || $nn || '" */
+    sql = s = malloc( strlen( template ) * 7 + 1 );
+
+    for( c = template; *c != '\0'; c++ )
+    {
+      if( !quoted && strncmp( c, "'%s'", 4 ) == 0 )
+      {
+        s += sprintf( s, "$%d", ++n );
+        c += 3;
+        continue;
+      }
+
+      if( c[0] == '%' && c[1] == '%' )
+      {
+        *s++ = '%';
+        c++;
+        continue;
+      }
+
+      if( c[0] == '%' && c[1] == 's' )
+      {
+        s += sprintf( s, quoted ? "' || $%d || '" : "$%d", ++n );
+        c++;
+        continue;
+      }
+
+      if( *c == '\'' ) quoted = !quoted;
+      *s++ = *c;
+    }
+    *s = '\0';
+
+    return sql;
+}
+
 /* Ensure the SQL template is less than 1K long and contains the */
 /* required parameter placeholders.  If there is an error, it is   */
 /* written to the error log. */
@@ -638,6 +668,12 @@ int ar_init(authreg_t ar) {
         pgsqlcontext->password_type = MPC_PLAIN;
     }
 
+#if defined(HAVE_CRYPT) && !defined(HAVE_CRYPT_R)
+    /* crypt() isn't safe to call from more than one thread at a time */
+    if(pgsqlcontext->password_type == MPC_CRYPT)
+        ar->single = 1;
+#endif
+
     /* craft the default SQL statements */
     /* we leave unused statements allocated to simplify code - a small price to pay */
     /* bounds checking and parameter format verification will be perfomed if the statement is used (see next section) */
@@ -697,6 +733,37 @@ int ar_init(authreg_t ar) {
     else
         ar->check_password = _ar_pgsql_check_password;
 
+    if (fail) {
+        free(create);
+        free(select);
+        free(setpassword);
+        free(delete);
+        return fail;
+    }
+
+    /* values are bound, not pasted in */
+    template = _ar_pgsql_template_sql( pgsqlcontext->sql_create );
+    free( (void *) pgsqlcontext->sql_create );
+    pgsqlcontext->sql_create = template;
+
+    template = _ar_pgsql_template_sql( pgsqlcontext->sql_select );
+    free( (void *) pgsqlcontext->sql_select );
+    pgsqlcontext->sql_select = template;
+
+    template = _ar_pgsql_template_sql( pgsqlcontext->sql_setpassword );
+    free( (void *) pgsqlcontext->sql_setpassword );
+    pgsqlcontext->sql_setpassword = template;
+
+    template = _ar_pgsql_template_sql( pgsqlcontext->sql_delete );
+    free( (void *) pgsqlcontext->sql_delete );
+    pgsqlcontext->sql_delete = template;
+
+    if (pgsqlcontext->sql_check_password) {
+        template = _ar_pgsql_template_sql( pgsqlcontext->sql_check_password );
+        free( (void *) pgsqlcontext->sql_check_password );
+        pgsqlcontext->sql_check_password = template;
+    }
+
     /* echo our configuration to debug */
     log_debug( ZONE, "SQL to create account: %s", pgsqlcontext->sql_create );
     log_debug( ZONE, "SQL to query user information: %s", pgsqlcontext->sql_select );
@@ -709,8 +776,6 @@ int ar_init(authreg_t ar) {
     free(setpassword);
     free(delete);
 
-    if (fail) return fail;
-
 #ifdef HAVE_SSL
     if(sx_openssl_initialized)
     PQinitSSL(0);
@@ -254,6 +254,9 @@ int ar_init(authreg_t ar)
     int to[2], from[2], ret;
     char buf[1024], *tok, *c;
 
+    /* a single child process, talked to serially */
+    ar->single = 1;
+
     data = (moddata_t) calloc(1, sizeof(struct moddata_st));
 
     data->exec = config_get_one(ar->c2s->config, "authreg.pipe.exec", 0);
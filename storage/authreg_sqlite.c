@@ -41,6 +41,9 @@
 #else
 #ifdef HAVE_CRYPT
 #include <unistd.h>
+#ifdef HAVE_CRYPT_R
+#include <crypt.h>
+#endif
 #endif
 #endif
 
@@ -79,6 +82,25 @@ typedef struct moddata_st {
     enum sqlite3_pws_crypt password_type;
 } *moddata_t;
 
+#ifdef HAVE_CRYPT
+/** crypt() hands every thread the same buffer, and checks run on the authreg
+ *  threads. without crypt_r the module is kept to one of them */
+static void _ar_sqlite_crypt(const char *password, const char *salt, char *out, int outlen) {
+#ifdef HAVE_CRYPT_R
+    struct crypt_data *cd = (struct crypt_data *) calloc(1, sizeof(struct crypt_data));
+    char *crypted = crypt_r(password, salt, cd);
+#else
+    char *crypted = crypt(password, salt);
+#endif
+
+    snprintf(out, outlen, "%s", crypted != NULL ? crypted : "*");
+
+#ifdef HAVE_CRYPT_R
+    free(cd);
+#endif
+}
+#endif
+
 #ifdef HAVE_SSL
 static void calc_a1hash(const char *username, const char *realm, const char *password, char *a1hash)
 {
@@ -188,7 +210,7 @@ _ar_sqlite_check_password(authreg_t ar, sess_t sess, const char *username, const
 
     char db_pw_value[257];
 #ifdef HAVE_CRYPT
-    char *crypted_pw;
+    char crypted_pw[257];
 #endif
 #ifdef HAVE_SSL
     char a1hash_pw[33];
@@ -209,7 +231,7 @@ _ar_sqlite_check_password(authreg_t ar, sess_t sess, const char *username, const
 
 #ifdef HAVE_CRYPT
         case MPC_CRYPT:
-                crypted_pw = crypt(password,db_pw_value);
+                _ar_sqlite_crypt(password, db_pw_value, crypted_pw, sizeof(crypted_pw));
                 ret = (strcmp(crypted_pw, db_pw_value) != 0);
                 break;
 #endif
@@ -267,7 +289,7 @@ _ar_sqlite_set_password(authreg_t ar, sess_t sess, const char *username, const c
        for(i=0; i<22; i++)
            salt[16+i] = salter[rand()%64];
 
-       strcpy(password, crypt(password, salt));
+       _ar_sqlite_crypt(password, salt, password, 257);
     }
 #endif
 #ifdef HAVE_SSL
@@ -450,6 +472,12 @@ ar_init(authreg_t ar)
         data->password_type = MPC_PLAIN;
     }
 
+#if defined(HAVE_CRYPT) && !defined(HAVE_CRYPT_R)
+    /* crypt() isn't safe to call from more than one thread at a time */
+    if(data->password_type == MPC_CRYPT)
+        ar->single = 1;
+#endif
+
     ar->private = data;
 
     ar->user_exists = _ar_sqlite_user_exists;
@@ -122,6 +122,103 @@ void os_object_free(os_object_t o) {
     o->os->count--;
 }
 
+static void _os_copy_field(const char *key, int keylen, void *val, void *arg) {
+    os_field_t osf = (os_field_t) val;
+    os_object_t o = (os_object_t) arg;
+    int ival;
+
+    switch(osf->type) {
+        case os_type_BOOLEAN:
+        case os_type_INTEGER:
+            ival = (int) (intptr_t) osf->val;
+            os_object_put(o, osf->key, &ival, osf->type);
+            break;
+
+        case os_type_STRING:
+        case os_type_NAD:
+            os_object_put(o, osf->key, osf->val, osf->type);
+            break;
+
+        default:
+            break;
+    }
+}
+
+os_t os_copy(os_t os) {
+    os_t copy;
+    os_object_t o;
+
+    copy = os_new();
+
+    /* walk them directly, so the caller's iterators are left alone */
+    for(o = os->head; o != NULL; o = o->next)
+        xhash_walk(o->hash, _os_copy_field, (void *) os_object_new(copy));
+
+    return copy;
+}
+
+/** nads stored as strings are "NAD" and the xml, or "NAB" and the serialized nad in base64 */
+static nad_t _os_nad_decode(const char *key, const char *str) {
+    char *buf;
+    int len;
+    nad_t nad;
+
+    if(strncmp(str, "NAB", 3) != 0) {
+        nad = nad_parse(str + 3, strlen(str) - 3);
+        if(nad == NULL)
+            log_debug(ZONE, "cell returned from storage for key %s has unparseable XML content (%lu bytes)", key, strlen(str)-3);
+        return nad;
+    }
+
+    len = strlen(str) - 3;
+    buf = (char *) malloc(sizeof(char) * apr_base64_decode_len(str + 3, len));
+    len = apr_base64_decode(buf, str + 3, len);
+
+    if(len <= 0 || (nad = nad_deserialize(buf, len)) == NULL) {
+        log_debug(ZONE, "cell returned from storage for key %s has a broken serialized nad (%d bytes)", key, len);
+        nad = NULL;
+    }
+
+    free(buf);
+
+    return nad;
+}
+
+void os_object_put_nad_bin(os_object_t o, const char *key, nad_t nad) {
+    nad_t copy;
+    char *buf, *str;
+    int len;
+
+    /* the copy leaves out anything that's been replaced */
+    copy = nad_copy(nad);
+    nad_serialize(copy, &buf, &len);
+    nad_free(copy);
+
+    str = (char *) malloc(sizeof(char) * (apr_base64_encode_len(len) + 3));
+    memcpy(str, "NAB", 3);
+    apr_base64_encode(str + 3, buf, len);
+    free(buf);
+
+    os_object_put(o, key, str, os_type_STRING);
+    free(str);
+}
+
+nad_t os_object_copy_nad(os_t os, os_object_t o, const char *key) {
+    os_field_t osf;
+
+    osf = (os_field_t) xhash_get(o->hash, key);
+    if(osf == NULL)
+        return NULL;
+
+    if(osf->type == os_type_NAD)
+        return nad_copy((nad_t) osf->val);
+
+    if(osf->type == os_type_STRING && strlen((char *) osf->val) >= 3)
+        return _os_nad_decode(key, (char *) osf->val);
+
+    return NULL;
+}
+
 /* wrappers for os_object_put to avoid breaking strict-aliasing rules in gcc3 */
 
 void os_object_put_time(os_object_t o, const char *key, const time_t *val) {
@@ -256,10 +353,9 @@ int os_object_get(os_t os, os_object_t o, const char *key, void **val, os_type_t
                    *val = osf->val;  
             } else {
                    /* parse the string into a NAD */
-                   nad = nad_parse(((char *) osf->val) + 3, strlen(osf->val) - 3); 
+                   nad = _os_nad_decode(key, (char *) osf->val);
                    if(nad == NULL) {
                             /* unparseable NAD */
-                            log_debug(ZONE, "cell returned from storage for key %s has unparseable XML content (%lu bytes)", key, strlen(osf->val)-3);
                             *val = NULL;
                             return 0;
                    } 
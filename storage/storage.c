@@ -33,7 +33,80 @@
 #else
   #include <dlfcn.h>
 #endif /* _WIN32 */
+#ifdef HAVE_PTHREAD
+  #include <pthread.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+  #include <sys/eventfd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+  #include <fcntl.h>
+#endif
+#ifdef HAVE_UNISTD_H
+  #include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+/** a queued call */
+typedef struct st_job_st {
+    st_op_t     op;
+    st_driver_t drv;            /**< main thread's driver, workers use their own copy */
+
+    char        *type;
+    char        *owner;
+    char        *filter;
+
+    os_t        os;
+    int         count;
+    int         offset, limit;  /**< page of a get, limit 0 for all of it */
+    st_ret_t    ret;
+
+    st_done_fn  done;
+    void        *arg;
+} *st_job_t;
+
+typedef struct st_async_st *st_async_t;
+
+/** a worker thread, with its own connection for each driver */
+typedef struct st_worker_st {
+    st_async_t      async;
+
+    pthread_t       thread;
+    pthread_cond_t  cond;
+
+    jqueue_t        jobs;       /**< waiting calls, guarded by async->lock */
+
+    xht             drivers;    /**< our copies of the drivers (key is driver name) */
+    xht             types;      /**< types our copies know about (key is type name) */
+} *st_worker_t;
+
+/** worker pool */
+struct st_async_st {
+    storage_t       st;
+
+    st_worker_t     workers;
+    int             nworkers;
+
+    /** drivers the workers have copies of (key is driver name) */
+    xht             pooled;
+
+    pthread_mutex_t lock;
+    jqueue_t        done;       /**< completed calls, guarded by lock */
+    jqueue_t        ready;      /**< completed calls being called back */
+    int             stop;
+
+    /** completion notification, both ends are the same eventfd if we have them */
+    int             notify[2];
+};
+
+static void _st_async_new(storage_t st, int nworkers);
+static void _st_async_free(storage_t st);
+#endif
 
+static void _st_preload_free(const char *key, int keylen, void *val, void *arg);
+static void _st_held_free(const char *key, int keylen, void *val, void *arg);
+static st_driver_t _st_driver_for(storage_t st, const char *type, st_ret_t *ret);
+static void _st_submit(storage_t st, st_op_t op, const char *type, const char *owner, const char *filter, int offset, int limit, os_t os, st_done_fn done, void *arg);
 
 storage_t storage_new(config_t config, log_t log) {
     storage_t st;
@@ -48,6 +121,8 @@ storage_t storage_new(config_t config, log_t log) {
     st->log = log;
     st->drivers = xhash_new(101);
     st->types = xhash_new(101);
+    st->preload = xhash_new(101);
+    st->writebehind = xhash_new(101);
 
     /* register types declared in the config file */
     elem = config_get(st->config, "storage.driver");
@@ -63,6 +138,29 @@ storage_t storage_new(config_t config, log_t log) {
         }
     }
 
+    /* types whose replaces are held and written out later */
+    elem = config_get(st->config, "storage.writebehind.type");
+    if(elem != NULL) {
+        st->wbtypes = xhash_new(11);
+        for(i = 0; i < elem->nvalues; i++)
+            xhash_put(st->wbtypes, pstrdup(xhash_pool(st->wbtypes), elem->values[i]), (void *) st);
+
+        st->wbinterval = j_atoi(config_get_one(st->config, "storage.writebehind.interval", 0), 10);
+        st->wbmax = j_atoi(config_get_one(st->config, "storage.writebehind.max", 0), 1000);
+        st->wbbatch = j_atoi(config_get_one(st->config, "storage.writebehind.batch", 0), 100);
+        if(st->wbbatch <= 0)
+            st->wbbatch = 100;
+
+        log_write(st->log, LOG_NOTICE, "holding replaces of %d storage types for up to %d seconds", elem->nvalues, st->wbinterval);
+    }
+
+#ifdef HAVE_PTHREAD
+    /* worker threads for asynchronous calls */
+    i = j_atoi(config_get_one(st->config, "storage.threads", 0), 0);
+    if(i > 0)
+        _st_async_new(st, i);
+#endif
+
     return st;
 }
 
@@ -75,11 +173,28 @@ static void _st_driver_reaper(const char *driver, int driverlen, void *val, void
 }
 
 void storage_free(storage_t st) {
+    /* anything we're holding goes out ahead of the queue being finished off */
+    while(xhash_count(st->writebehind) > 0)
+        storage_flush(st, 1);
+
+#ifdef HAVE_PTHREAD
+    /* finish off anything still queued */
+    if(st->async != NULL)
+        _st_async_free(st);
+#endif
+
     /* close down drivers */
     xhash_walk(st->drivers, _st_driver_reaper, NULL);
 
+    xhash_walk(st->preload, _st_preload_free, NULL);
+    xhash_walk(st->writebehind, _st_held_free, NULL);
+
     xhash_free(st->drivers);
     xhash_free(st->types);
+    xhash_free(st->preload);
+    xhash_free(st->writebehind);
+    if(st->wbtypes != NULL)
+        xhash_free(st->wbtypes);
     free(st);
 }
 
@@ -192,12 +307,313 @@ st_ret_t storage_add_type(storage_t st, const char *driver, const char *type) {
     return st_SUCCESS;
 }
 
+/** a held result */
+typedef struct st_preload_st {
+    char        *key;
+    st_ret_t    ret;
+    os_t        os;
+} *st_preload_t;
+
+static char *_st_preload_key(const char *type, const char *owner) {
+    char *key;
+    int tlen = strlen(type), olen = strlen(owner);
+
+    key = (char *) malloc(tlen + olen + 2);
+    memcpy(key, type, tlen);
+    key[tlen] = ' ';
+    memcpy(key + tlen + 1, owner, olen + 1);
+
+    return key;
+}
+
+static void _st_preload_free(const char *key, int keylen, void *val, void *arg) {
+    st_preload_t pl = (st_preload_t) val;
+
+    if(pl->os != NULL)
+        os_free(pl->os);
+    free(pl->key);
+    free(pl);
+}
+
+void storage_preload(storage_t st, const char *type, const char *owner, st_ret_t ret, os_t os) {
+    st_preload_t pl;
+
+    if(type == NULL || owner == NULL) {
+        if(os != NULL)
+            os_free(os);
+        return;
+    }
+
+    log_debug(ZONE, "holding result for type=%s owner=%s ret=%d", type, owner, ret);
+
+    storage_preload_drop(st, type, owner);
+
+    pl = (st_preload_t) calloc(1, sizeof(struct st_preload_st));
+    pl->key = _st_preload_key(type, owner);
+    pl->ret = ret;
+    pl->os = os;
+
+    xhash_put(st->preload, pl->key, (void *) pl);
+}
+
+void storage_preload_drop(storage_t st, const char *type, const char *owner) {
+    st_preload_t pl;
+    char *key;
+
+    if(type == NULL || owner == NULL || xhash_count(st->preload) == 0)
+        return;
+
+    key = _st_preload_key(type, owner);
+    pl = (st_preload_t) xhash_get(st->preload, key);
+    free(key);
+
+    if(pl == NULL)
+        return;
+
+    xhash_zap(st->preload, pl->key);
+    _st_preload_free(NULL, 0, (void *) pl, NULL);
+}
+
+/** hand over a held result, the caller gets the object set */
+static int _st_preload_take(storage_t st, const char *type, const char *owner, os_t *os, st_ret_t *ret) {
+    st_preload_t pl;
+    char *key;
+
+    if(type == NULL || owner == NULL)
+        return 0;
+
+    key = _st_preload_key(type, owner);
+    pl = (st_preload_t) xhash_get(st->preload, key);
+    free(key);
+
+    if(pl == NULL)
+        return 0;
+
+    log_debug(ZONE, "using held result for type=%s owner=%s", type, owner);
+
+    xhash_zap(st->preload, pl->key);
+
+    *ret = pl->ret;
+    if(pl->ret == st_SUCCESS)
+        *os = pl->os;
+    else if(pl->os != NULL)
+        os_free(pl->os);
+
+    free(pl->key);
+    free(pl);
+
+    return 1;
+}
+
+/** a replace being held */
+typedef struct st_held_st {
+    char        *key;
+    char        *type;
+    const char  *owner;         /**< points into the key */
+    os_t        os;
+    int         async;          /**< came from storage_submit, so goes back out that way */
+} *st_held_t;
+
+static void _st_held_free(const char *key, int keylen, void *val, void *arg) {
+    st_held_t held = (st_held_t) val;
+
+    if(held->os != NULL)
+        os_free(held->os);
+    free(held->type);
+    free(held->key);
+    free(held);
+}
+
+static st_held_t _st_held_get(storage_t st, const char *type, const char *owner) {
+    st_held_t held;
+    char *key;
+
+    if(type == NULL || owner == NULL || xhash_count(st->writebehind) == 0)
+        return NULL;
+
+    key = _st_preload_key(type, owner);
+    held = (st_held_t) xhash_get(st->writebehind, key);
+    free(key);
+
+    return held;
+}
+
+/** is this a replace we can hold on to */
+static int _st_wb_holds(storage_t st, const char *type, const char *owner, const char *filter) {
+    return st->wbtypes != NULL && filter == NULL && type != NULL && owner != NULL && xhash_get(st->wbtypes, type) != NULL;
+}
+
+/** hold a replace instead of making it, takes the object set */
+static void _st_wb_hold(storage_t st, const char *type, const char *owner, os_t os, int async) {
+    st_held_t held;
+
+    log_debug(ZONE, "holding replace for type=%s owner=%s", type, owner);
+
+    held = _st_held_get(st, type, owner);
+    if(held != NULL) {
+        /* the one we had never needs to be written */
+        os_free(held->os);
+    } else {
+        if(xhash_count(st->writebehind) == 0)
+            st->wbsince = time(NULL);
+
+        held = (st_held_t) calloc(1, sizeof(struct st_held_st));
+        held->key = _st_preload_key(type, owner);
+        held->type = strdup(type);
+        held->owner = held->key + strlen(type) + 1;
+
+        xhash_put(st->writebehind, held->key, (void *) held);
+    }
+
+    held->os = os;
+    held->async = async;
+
+    if(xhash_count(st->writebehind) >= st->wbmax)
+        storage_flush(st, 1);
+}
+
+static void _st_wb_done(st_ret_t ret, os_t os, int count, void *arg) {
+    storage_t st = (storage_t) arg;
+
+    if(ret != st_SUCCESS)
+        log_write(st->log, LOG_ERR, "storage: couldn't write out held data (%d)", ret);
+}
+
+/** make a held replace, and free it */
+static void _st_wb_write(storage_t st, st_held_t held) {
+    st_driver_t drv;
+    st_ret_t ret;
+
+    log_debug(ZONE, "writing out held replace for type=%s owner=%s", held->type, held->owner);
+
+    if(held->async) {
+        /* behind anything else queued for them */
+        _st_submit(st, st_op_REPLACE, held->type, held->owner, NULL, 0, 0, held->os, _st_wb_done, (void *) st);
+        held->os = NULL;
+    } else {
+        drv = _st_driver_for(st, held->type, &ret);
+        if(drv != NULL)
+            ret = (drv->replace)(drv, held->type, held->owner, NULL, held->os);
+
+        if(ret != st_SUCCESS)
+            log_write(st->log, LOG_ERR, "storage: couldn't write out held data for type=%s owner=%s (%d)", held->type, held->owner, ret);
+    }
+
+    _st_held_free(NULL, 0, (void *) held, NULL);
+}
+
+/** write out anything held for this type and owner, before a call that needs to see it */
+static void _st_wb_settle(storage_t st, const char *type, const char *owner) {
+    st_held_t held;
+
+    if((held = _st_held_get(st, type, owner)) == NULL)
+        return;
+
+    xhash_zap(st->writebehind, held->key);
+    _st_wb_write(st, held);
+}
+
+/** forget anything held for this type and owner, it's about to be deleted anyway */
+static void _st_wb_drop(storage_t st, const char *type, const char *owner) {
+    st_held_t held;
+
+    if((held = _st_held_get(st, type, owner)) == NULL)
+        return;
+
+    log_debug(ZONE, "dropping held replace for type=%s owner=%s", type, owner);
+
+    xhash_zap(st->writebehind, held->key);
+    _st_held_free(NULL, 0, (void *) held, NULL);
+}
+
+/** answer a get from what we're holding */
+static int _st_wb_get(storage_t st, const char *type, const char *owner, os_t *os, st_ret_t *ret) {
+    st_held_t held;
+
+    if((held = _st_held_get(st, type, owner)) == NULL)
+        return 0;
+
+    log_debug(ZONE, "using held replace for type=%s owner=%s", type, owner);
+
+    /* same as the driver would say once it's written */
+    if(os_count(held->os) == 0) {
+        *ret = st_NOTFOUND;
+        return 1;
+    }
+
+    *os = os_copy(held->os);
+    *ret = st_SUCCESS;
+
+    return 1;
+}
+
+void storage_flush(storage_t st, int force) {
+    st_held_t *batch;
+    st_driver_t drv, *begun;
+    st_ret_t ret;
+    void *val;
+    int n, nbegun = 0, i, j;
+
+    if(xhash_count(st->writebehind) == 0)
+        return;
+
+    if(!force && xhash_count(st->writebehind) < st->wbmax && time(NULL) < st->wbsince + st->wbinterval)
+        return;
+
+    /* only so many each time round, the rest are still due next time */
+    n = xhash_count(st->writebehind);
+    if(n > st->wbbatch)
+        n = st->wbbatch;
+
+    log_debug(ZONE, "writing out %d of %d held replaces", n, xhash_count(st->writebehind));
+
+    /* take them out first, anything held while we're at it waits for next time */
+    batch = (st_held_t *) malloc(sizeof(st_held_t) * n);
+    begun = (st_driver_t *) malloc(sizeof(st_driver_t) * n);
+
+    i = 0;
+    if(xhash_iter_first(st->writebehind))
+        do {
+            xhash_iter_get(st->writebehind, NULL, NULL, &val);
+            batch[i++] = (st_held_t) val;
+            xhash_iter_zap(st->writebehind);
+        } while(i < n && xhash_iter_next(st->writebehind));
+    n = i;
+
+    /* the ones written here can go to their driver in one transaction */
+    for(i = 0; i < n; i++) {
+        if(batch[i]->async && storage_async(st))
+            continue;
+
+        drv = _st_driver_for(st, batch[i]->type, &ret);
+        if(drv == NULL || drv->batch == NULL)
+            continue;
+
+        for(j = 0; j < nbegun && begun[j] != drv; j++);
+        if(j == nbegun && (drv->batch)(drv, 1) == st_SUCCESS)
+            begun[nbegun++] = drv;
+    }
+
+    for(i = 0; i < n; i++)
+        _st_wb_write(st, batch[i]);
+
+    for(j = 0; j < nbegun; j++)
+        (begun[j]->batch)(begun[j], 0);
+
+    free(begun);
+    free(batch);
+}
+
 st_ret_t storage_put(storage_t st, const char *type, const char *owner, os_t os) {
     st_driver_t drv;
     st_ret_t ret;
 
     log_debug(ZONE, "storage_put: type=%s owner=%s os=%X", type, owner, os);
 
+    /* anything we're holding is out of date now */
+    storage_preload_drop(st, type, owner);
+    _st_wb_settle(st, type, owner);
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -224,6 +640,17 @@ st_ret_t storage_get(storage_t st, const char *type, const char *owner, const ch
 
     log_debug(ZONE, "storage_get: type=%s owner=%s filter=%s", type, owner, filter);
 
+    /* it hasn't been written yet, so anything fetched ahead is older than this */
+    if(filter == NULL && _st_wb_get(st, type, owner, os, &ret)) {
+        storage_preload_drop(st, type, owner);
+        return ret;
+    }
+    _st_wb_settle(st, type, owner);
+
+    /* maybe we already have it */
+    if(filter == NULL && xhash_count(st->preload) > 0 && _st_preload_take(st, type, owner, os, &ret))
+        return ret;
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -286,6 +713,8 @@ st_ret_t storage_count(storage_t st, const char *type, const char *owner, const
 
     log_debug(ZONE, "storage_count: type=%s owner=%s filter=%s", type, owner, filter);
 
+    _st_wb_settle(st, type, owner);
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -312,6 +741,13 @@ st_ret_t storage_delete(storage_t st, const char *type, const char *owner, const
 
     log_debug(ZONE, "storage_zap: type=%s owner=%s filter=%s", type, owner, filter);
 
+    storage_preload_drop(st, type, owner);
+
+    if(filter == NULL)
+        _st_wb_drop(st, type, owner);
+    else
+        _st_wb_settle(st, type, owner);
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -338,6 +774,15 @@ st_ret_t storage_replace(storage_t st, const char *type, const char *owner, cons
 
     log_debug(ZONE, "storage_replace: type=%s owner=%s filter=%s os=%X", type, owner, filter, os);
 
+    storage_preload_drop(st, type, owner);
+
+    /* the caller keeps theirs */
+    if(_st_wb_holds(st, type, owner, filter)) {
+        _st_wb_hold(st, type, owner, os_copy(os), 0);
+        return st_SUCCESS;
+    }
+    _st_wb_settle(st, type, owner);
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -358,6 +803,459 @@ st_ret_t storage_replace(storage_t st, const char *type, const char *owner, cons
     return (drv->replace)(drv, type, owner, filter, os);
 }
 
+/** run a call against a driver */
+static st_ret_t _st_call(st_driver_t drv, st_op_t op, const char *type, const char *owner, const char *filter, int offset, int limit, os_t *os, int *count) {
+    switch(op) {
+        case st_op_PUT:
+            return (drv->put)(drv, type, owner, *os);
+
+        case st_op_GET:
+            if(limit > 0 && drv->get_page != NULL)
+                return (drv->get_page)(drv, type, owner, filter, offset, limit, os);
+            return (drv->get)(drv, type, owner, filter, os);
+
+        case st_op_COUNT:
+            return ((drv->count != NULL) ? (drv->count)(drv, type, owner, filter, count) : st_NOTIMPL);
+
+        case st_op_DELETE:
+            return (drv->delete)(drv, type, owner, filter);
+
+        case st_op_REPLACE:
+            return (drv->replace)(drv, type, owner, filter, *os);
+    }
+
+    return st_NOTIMPL;
+}
+
+/** find the driver for a type, registering it with the default if we have to */
+static st_driver_t _st_driver_for(storage_t st, const char *type, st_ret_t *ret) {
+    st_driver_t drv;
+
+    *ret = st_SUCCESS;
+
+    drv = xhash_get(st->types, type);
+    if(drv != NULL)
+        return drv;
+
+    drv = st->default_drv;
+    if(drv == NULL) {
+        log_debug(ZONE, "no driver associated with type, and no default driver");
+        *ret = st_NOTIMPL;
+        return NULL;
+    }
+
+    *ret = storage_add_type(st, drv->name, type);
+    if(*ret != st_SUCCESS)
+        return NULL;
+
+    return drv;
+}
+
+#ifdef HAVE_PTHREAD
+static void _st_job_free(st_job_t job) {
+    if(job->os != NULL && (job->op == st_op_PUT || job->op == st_op_REPLACE || job->done == NULL))
+        os_free(job->os);
+
+    free(job->type);
+    free(job->owner);
+    if(job->filter != NULL) free(job->filter);
+    free(job);
+}
+
+/** hand a finished call back to the main thread, call with the lock held */
+static void _st_job_done(st_async_t async, st_job_t job) {
+    uint64_t one = 1;
+
+    jqueue_push(async->done, (void *) job, 0);
+
+    /* only need to wake them for the first one */
+    if(jqueue_size(async->done) == 1)
+        if(write(async->notify[1], &one, (async->notify[0] == async->notify[1]) ? sizeof(one) : 1) < 0)
+            log_debug(ZONE, "couldn't notify main thread: %s", strerror(errno));
+}
+
+/** run a call on one of our copies of the driver */
+static void _st_job_run(st_worker_t w, st_job_t job) {
+    st_driver_t drv;
+
+    drv = (st_driver_t) xhash_get(w->drivers, job->drv->name);
+
+    /* our copy needs to know about the type first */
+    if(xhash_get(w->types, job->type) == NULL) {
+        job->ret = (drv->add_type)(drv, job->type);
+        if(job->ret != st_SUCCESS)
+            return;
+
+        xhash_put(w->types, pstrdup(xhash_pool(w->types), job->type), (void *) drv);
+    }
+
+    job->ret = _st_call(drv, job->op, job->type, job->owner, job->filter, job->offset, job->limit, &job->os, &job->count);
+}
+
+static void *_st_worker_run(void *arg) {
+    st_worker_t w = (st_worker_t) arg;
+    st_async_t async = w->async;
+    st_job_t job;
+
+    pthread_mutex_lock(&async->lock);
+
+    while(1) {
+        /* drain the queue before we stop */
+        while(jqueue_size(w->jobs) == 0 && !async->stop)
+            pthread_cond_wait(&w->cond, &async->lock);
+
+        job = (st_job_t) jqueue_pull(w->jobs);
+        if(job == NULL)
+            break;
+
+        pthread_mutex_unlock(&async->lock);
+
+        _st_job_run(w, job);
+
+        pthread_mutex_lock(&async->lock);
+
+        _st_job_done(async, job);
+    }
+
+    pthread_mutex_unlock(&async->lock);
+
+    return NULL;
+}
+
+/** start a copy of a driver for each worker, the driver is only pooled if they all get one */
+static void _st_async_drivers(const char *name, int namelen, void *val, void *arg) {
+    st_driver_t drv = (st_driver_t) val, copy;
+    st_async_t async = (st_async_t) arg;
+    storage_t st = async->st;
+    st_driver_init_fn init_fn;
+    int i;
+
+    if(drv->single) {
+        log_debug(ZONE, "driver '%s' can only have one connection, its calls will be run inline", drv->name);
+        return;
+    }
+
+#ifndef _WIN32
+    init_fn = (st_driver_init_fn) dlsym(drv->handle, "st_init");
+#else
+    init_fn = (st_driver_init_fn) GetProcAddress((HMODULE) drv->handle, "st_init");
+#endif
+    if(init_fn == NULL)
+        return;
+
+    for(i = 0; i < async->nworkers; i++) {
+        copy = (st_driver_t) calloc(1, sizeof(struct st_driver_st));
+
+        copy->handle = drv->handle;
+        copy->st = st;
+        copy->name = drv->name;
+
+        if((init_fn)(copy) == st_FAILED) {
+            log_write(st->log, LOG_ERR, "couldn't open another connection for storage driver '%s', its calls will be run inline", drv->name);
+            free(copy);
+            break;
+        }
+
+        xhash_put(async->workers[i].drivers, drv->name, (void *) copy);
+    }
+
+    if(i == async->nworkers) {
+        xhash_put(async->pooled, drv->name, (void *) drv);
+        return;
+    }
+
+    /* close the copies we did get */
+    while(--i >= 0) {
+        copy = (st_driver_t) xhash_get(async->workers[i].drivers, drv->name);
+        xhash_zap(async->workers[i].drivers, drv->name);
+
+        (copy->free)(copy);
+        free(copy);
+    }
+}
+
+static void _st_worker_driver_free(const char *name, int namelen, void *val, void *arg) {
+    st_driver_t drv = (st_driver_t) val;
+
+    (drv->free)(drv);
+
+    free(drv);
+}
+
+static void _st_async_new(storage_t st, int nworkers) {
+    st_async_t async;
+    st_worker_t w;
+    int i;
+
+    async = (st_async_t) calloc(1, sizeof(struct st_async_st));
+
+    async->st = st;
+    async->pooled = xhash_new(101);
+    async->done = jqueue_new();
+    async->ready = jqueue_new();
+    pthread_mutex_init(&async->lock, NULL);
+
+#ifdef HAVE_SYS_EVENTFD_H
+    async->notify[0] = async->notify[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(async->notify[0] < 0)
+#endif
+    {
+        if(pipe(async->notify) < 0) {
+            log_write(st->log, LOG_ERR, "couldn't create storage notification pipe: %s, storage calls will complete inline", strerror(errno));
+            xhash_free(async->pooled);
+            jqueue_free(async->done);
+            jqueue_free(async->ready);
+            pthread_mutex_destroy(&async->lock);
+            free(async);
+            return;
+        }
+        fcntl(async->notify[0], F_SETFL, fcntl(async->notify[0], F_GETFL) | O_NONBLOCK);
+        fcntl(async->notify[1], F_SETFL, fcntl(async->notify[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    async->nworkers = nworkers;
+    async->workers = (st_worker_t) calloc(nworkers, sizeof(struct st_worker_st));
+
+    for(i = 0; i < nworkers; i++) {
+        w = &async->workers[i];
+
+        w->async = async;
+        w->jobs = jqueue_new();
+        w->drivers = xhash_new(11);
+        w->types = xhash_new(101);
+        pthread_cond_init(&w->cond, NULL);
+    }
+
+    xhash_walk(st->drivers, _st_async_drivers, (void *) async);
+
+    st->async = (void *) async;
+
+    for(i = 0; i < nworkers; i++)
+        pthread_create(&async->workers[i].thread, NULL, _st_worker_run, (void *) &async->workers[i]);
+
+    log_write(st->log, LOG_NOTICE, "started %d storage worker threads", nworkers);
+}
+
+static void _st_async_free(storage_t st) {
+    st_async_t async = (st_async_t) st->async;
+    st_worker_t w;
+    st_job_t job;
+    int i;
+
+    pthread_mutex_lock(&async->lock);
+    async->stop = 1;
+    for(i = 0; i < async->nworkers; i++)
+        pthread_cond_signal(&async->workers[i].cond);
+    pthread_mutex_unlock(&async->lock);
+
+    for(i = 0; i < async->nworkers; i++) {
+        w = &async->workers[i];
+
+        pthread_join(w->thread, NULL);
+
+        xhash_walk(w->drivers, _st_worker_driver_free, NULL);
+        xhash_free(w->drivers);
+        xhash_free(w->types);
+        jqueue_free(w->jobs);
+        pthread_cond_destroy(&w->cond);
+    }
+
+    /* nobody is waiting for these any more */
+    while((job = (st_job_t) jqueue_pull(async->done)) != NULL) {
+        if(job->op == st_op_GET && job->os != NULL) {
+            os_free(job->os);
+            job->os = NULL;
+        }
+        _st_job_free(job);
+    }
+
+    close(async->notify[0]);
+    if(async->notify[1] != async->notify[0])
+        close(async->notify[1]);
+
+    free(async->workers);
+    xhash_free(async->pooled);
+    jqueue_free(async->done);
+    jqueue_free(async->ready);
+    pthread_mutex_destroy(&async->lock);
+    free(async);
+
+    st->async = NULL;
+}
+#endif
+
+void storage_submit(storage_t st, st_op_t op, const char *type, const char *owner, const char *filter, os_t os, st_done_fn done, void *arg) {
+    st_ret_t ret;
+
+    if(op == st_op_REPLACE && _st_wb_holds(st, type, owner, filter)) {
+        storage_preload_drop(st, type, owner);
+        _st_wb_hold(st, type, owner, os, 1);
+
+        if(done != NULL)
+            (done)(st_SUCCESS, NULL, 0, arg);
+
+        return;
+    }
+
+    if(op == st_op_GET && filter == NULL && _st_wb_get(st, type, owner, &os, &ret)) {
+        if(done != NULL)
+            (done)(ret, (ret == st_SUCCESS) ? os : NULL, 0, arg);
+        else if(ret == st_SUCCESS)
+            os_free(os);
+
+        return;
+    }
+
+    if(op == st_op_DELETE && filter == NULL)
+        _st_wb_drop(st, type, owner);
+    else
+        _st_wb_settle(st, type, owner);
+
+    _st_submit(st, op, type, owner, filter, 0, 0, os, done, arg);
+}
+
+void storage_submit_page(storage_t st, const char *type, const char *owner, const char *filter, int offset, int limit, st_done_fn done, void *arg) {
+    _st_wb_settle(st, type, owner);
+
+    _st_submit(st, st_op_GET, type, owner, filter, offset, limit, NULL, done, arg);
+}
+
+int storage_pages(storage_t st, const char *type) {
+    st_driver_t drv;
+    st_ret_t ret;
+
+    drv = _st_driver_for(st, type, &ret);
+
+    return (drv != NULL && drv->get_page != NULL);
+}
+
+/** queue a call, without looking at what we're holding */
+static void _st_submit(storage_t st, st_op_t op, const char *type, const char *owner, const char *filter, int offset, int limit, os_t os, st_done_fn done, void *arg) {
+    st_driver_t drv;
+    st_ret_t ret;
+    int count = 0;
+#ifdef HAVE_PTHREAD
+    st_async_t async = (st_async_t) st->async;
+    st_worker_t w;
+    st_job_t job;
+    const char *c;
+    unsigned int h;
+#endif
+
+    log_debug(ZONE, "storage_submit: op=%d type=%s owner=%s filter=%s", op, type, owner, filter);
+
+    if(op != st_op_GET && op != st_op_COUNT)
+        storage_preload_drop(st, type, owner);
+
+    drv = _st_driver_for(st, type, &ret);
+
+#ifdef HAVE_PTHREAD
+    if(async != NULL) {
+        job = (st_job_t) calloc(1, sizeof(struct st_job_st));
+
+        job->op = op;
+        job->drv = drv;
+        job->type = strdup(type);
+        job->owner = strdup(owner);
+        job->filter = (filter != NULL) ? strdup(filter) : NULL;
+        job->offset = offset;
+        job->limit = limit;
+        job->os = os;
+        job->ret = ret;
+        job->done = done;
+        job->arg = arg;
+
+        /* no driver, or one that doesn't have a copy on the workers, so do it now */
+        if(drv == NULL || xhash_get(async->pooled, drv->name) == NULL) {
+            if(drv != NULL)
+                job->ret = _st_call(drv, op, job->type, job->owner, job->filter, job->offset, job->limit, &job->os, &job->count);
+
+            pthread_mutex_lock(&async->lock);
+            _st_job_done(async, job);
+            pthread_mutex_unlock(&async->lock);
+
+            return;
+        }
+
+        /* calls for one owner always go to the same worker, so they stay in order */
+        for(h = 0, c = owner; *c != '\0'; c++)
+            h = h * 31 + (unsigned char) *c;
+        w = &async->workers[h % async->nworkers];
+
+        pthread_mutex_lock(&async->lock);
+        jqueue_push(w->jobs, (void *) job, 0);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&async->lock);
+
+        return;
+    }
+#endif
+
+    /* no workers, just do it */
+    if(drv != NULL)
+        ret = _st_call(drv, op, type, owner, filter, offset, limit, &os, &count);
+
+    if(done != NULL)
+        (done)(ret, (op == st_op_GET && ret == st_SUCCESS) ? os : NULL, count, arg);
+    else if(op == st_op_GET && ret == st_SUCCESS)
+        os_free(os);
+
+    if(os != NULL && (op == st_op_PUT || op == st_op_REPLACE))
+        os_free(os);
+}
+
+int storage_async(storage_t st) {
+    return (st->async != NULL);
+}
+
+int storage_async_fd(storage_t st) {
+#ifdef HAVE_PTHREAD
+    if(st->async != NULL)
+        return ((st_async_t) st->async)->notify[0];
+#endif
+
+    return -1;
+}
+
+void storage_async_poll(storage_t st) {
+#ifdef HAVE_PTHREAD
+    st_async_t async = (st_async_t) st->async;
+    st_job_t job;
+    jqueue_t q;
+    char buf[64];
+
+    if(async == NULL)
+        return;
+
+    /* clear the notification */
+    while(read(async->notify[0], buf, sizeof(buf)) > 0);
+
+    /* take everything that's finished */
+    pthread_mutex_lock(&async->lock);
+    q = async->done;
+    async->done = async->ready;
+    async->ready = q;
+    pthread_mutex_unlock(&async->lock);
+
+    while((job = (st_job_t) jqueue_pull(async->ready)) != NULL) {
+        log_debug(ZONE, "storage call done: op=%d type=%s owner=%s ret=%d", job->op, job->type, job->owner, job->ret);
+
+        if(job->op == st_op_GET && job->ret != st_SUCCESS)
+            job->os = NULL;
+
+        if(job->done != NULL) {
+            (job->done)(job->ret, (job->op == st_op_GET) ? job->os : NULL, job->count, job->arg);
+
+            /* callee has the result now */
+            if(job->op == st_op_GET)
+                job->os = NULL;
+        }
+
+        _st_job_free(job);
+    }
+#endif
+}
+
 static st_filter_t _storage_filter(pool_t p, const char *f, int len) {
     char *c, *key, *val, *sub;
     int vallen;
@@ -107,6 +107,9 @@ ST_API os_t        os_new(void);
 /** free an object set */
 ST_API void        os_free(os_t os);
 
+/** make a copy of an object set, the caller frees it */
+ST_API os_t        os_copy(os_t os);
+
 /** number of objects in a set */
 ST_API int         os_count(os_t os);
 
@@ -140,6 +143,13 @@ ST_API int         os_object_get_time(os_t os, os_object_t o, const char *key, t
 /** wrappers for os_object_put to avoid breaking strict-aliasing rules in gcc3 */
 ST_API void        os_object_put_time(os_object_t o, const char *key, const time_t *val);
 
+/** add a nad as a string holding its serialized form, which is quicker to turn
+    back into a nad than xml. the form doesn't depend on the platform */
+ST_API void        os_object_put_nad_bin(os_object_t o, const char *key, nad_t nad);
+
+/** get a field as a new nad that the caller frees, without keeping one in the object */
+ST_API nad_t       os_object_copy_nad(os_t os, os_object_t o, const char *key);
+
 /** set field iterator to first field (1 = exists, 0 = doesn't exist) */
 ST_API int         os_object_iter_first(os_object_t o);
 /** set field iterator to next field (1 = exists, 0 = doesn't exist) */
@@ -170,6 +180,18 @@ struct storage_st {
 
     st_driver_t default_drv;    /**< default driver (used when there is no module
                                      explicitly registered for a type) */
+
+    void        *async;         /**< worker threads for asynchronous calls, NULL if
+                                     they complete inline */
+
+    xht         preload;        /**< results fetched ahead of a storage_get (key is "type owner") */
+
+    xht         wbtypes;        /**< types whose replaces are held and written out later, NULL if none */
+    xht         writebehind;    /**< replaces being held (key is "type owner") */
+    int         wbinterval;     /**< seconds to hold them for */
+    int         wbmax;          /**< how many to hold before writing them out anyway */
+    int         wbbatch;        /**< most to write out each time round */
+    time_t      wbsince;        /**< when the oldest held one came in */
 };
 
 /** data for a single storage driver */
@@ -189,6 +211,9 @@ struct st_driver_st {
     st_ret_t    (*put)(st_driver_t drv, const char *type, const char *owner, os_t os);
     /** get handler */
     st_ret_t    (*get)(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os);
+    /** get at most limit objects, after skipping offset, in the order they were
+        put. optional, and each object must carry its "object-sequence" */
+    st_ret_t    (*get_page)(st_driver_t drv, const char *type, const char *owner, const char *filter, int offset, int limit, os_t *os);
     /** get custom SQL request */
     st_ret_t    (*get_custom_sql)(st_driver_t drv, const char *request, os_t *os);
     /** count handler */
@@ -201,9 +226,16 @@ struct st_driver_st {
 #endif
     /** replace handler */
     st_ret_t    (*replace)(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os);
+    /** called with begin set before a run of calls that can share a transaction,
+        and without it after them. optional */
+    st_ret_t    (*batch)(st_driver_t drv, int begin);
 
     /** called when driver is freed */
     void        (*free)(st_driver_t drv);
+
+    /** set by drivers that can only have one connection open, their
+        asynchronous calls are run on the calling thread */
+    int         single;
 };
 
 /** allocate a storage manager instance */
@@ -227,6 +259,44 @@ ST_API st_ret_t        storage_delete(storage_t st, const char *type, const char
 /** replace objects matching this filter with objects in this set (atomic delete + get) */
 ST_API st_ret_t        storage_replace(storage_t st, const char *type, const char *owner, const char *filter, os_t os);
 
+/** storage operations, for asynchronous calls */
+typedef enum {
+    st_op_PUT,
+    st_op_GET,
+    st_op_COUNT,
+    st_op_DELETE,
+    st_op_REPLACE
+} st_op_t;
+
+/** called on the main thread when an asynchronous call completes. os is
+    the result of a get (callee frees it), count the result of a count */
+typedef void (*st_done_fn)(st_ret_t ret, os_t os, int count, void *arg);
+
+/** queue a call for the worker threads. calls for the same owner complete
+    in the order they were made, except that replaces and gets of write-behind
+    types can complete straight away. os is freed once a put or replace is done */
+ST_API void            storage_submit(storage_t st, st_op_t op, const char *type, const char *owner, const char *filter, os_t os, st_done_fn done, void *arg);
+/** queue a get of at most limit objects, after skipping offset. if the driver
+    can't do pages it's an ordinary get, and all of them come back */
+ST_API void            storage_submit_page(storage_t st, const char *type, const char *owner, const char *filter, int offset, int limit, st_done_fn done, void *arg);
+/** true if the driver for this type can do pages */
+ST_API int             storage_pages(storage_t st, const char *type);
+/** true if calls are run on worker threads (storage.threads) */
+ST_API int             storage_async(storage_t st);
+/** fd that becomes readable when calls have completed, -1 if not async */
+ST_API int             storage_async_fd(storage_t st);
+/** run the callbacks for completed calls */
+ST_API void            storage_async_poll(storage_t st);
+
+/** hold a result, so the next storage_get for this type and owner (with no filter) returns it without asking the driver */
+ST_API void            storage_preload(storage_t st, const char *type, const char *owner, st_ret_t ret, os_t os);
+/** forget a held result that nobody asked for */
+ST_API void            storage_preload_drop(storage_t st, const char *type, const char *owner);
+
+/** write out held replaces if they're due, or if force is set. at most
+    storage.writebehind.batch go each call, the rest stay held and due */
+ST_API void            storage_flush(storage_t st, int force);
+
 /** type for the driver init function */
 typedef st_ret_t (*st_driver_init_fn)(st_driver_t);
 
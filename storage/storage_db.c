@@ -602,5 +602,8 @@ st_ret_t st_init(st_driver_t drv) {
     drv->delete = _st_db_delete;
     drv->free = _st_db_free;
 
+    /* reopening the environment would run recovery under the first one */
+    drv->single = 1;
+
     return st_SUCCESS;
 }
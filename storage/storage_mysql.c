@@ -28,6 +28,8 @@
 #include "storage.h"
 #include <inttypes.h>
 #include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
 
 /** internal structure, holds our data */
 typedef struct drvdata_st {
@@ -36,10 +38,31 @@ typedef struct drvdata_st {
     const char *prefix;
 
     int txn;
+
+    xht stmts;                  /* statements prepared on this connection, keyed by their sql */
+    unsigned long thread_id;    /* the connection they were prepared on */
 } *drvdata_t;
 
+/** a prepared statement, lives as long as the connection does */
+typedef struct stmt_st {
+    char *sql;
+    MYSQL_STMT *stmt;
+} *stmt_t;
+
+/** a parameter list, grown as the sql is built */
+typedef struct params_st {
+    const char  **vals;
+    int         n, max;
+} *params_t;
+
 #define FALLBACK_BLOCKSIZE (4096)
 
+/* statements we'll keep before starting over */
+#define STMT_MAX (256)
+
+/* result column buffers start this big, and grow if something longer turns up */
+#define COLUMN_SIZE (256)
+
 /** internal: do and return the math and ensure it gets realloc'd */
 static size_t _st_mysql_realloc(char **oblocks, size_t len) {
     void *nblocks;
@@ -69,93 +92,226 @@ static size_t _st_mysql_realloc(char **oblocks, size_t len) {
 /** this is the safety check used to make sure there's always enough mem */
 #define MYSQL_SAFE(blocks, size, len) if((unsigned int)(size) >= (unsigned int)(len)) len = _st_mysql_realloc(&(blocks),(size + 1));
 
-static void _st_mysql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, int *buflen, int *nbuf) {
+static void _st_mysql_stmt_free(const char *key, int keylen, void *val, void *arg) {
+    stmt_t st = (stmt_t) val;
+
+    mysql_stmt_close(st->stmt);
+    free(st->sql);
+    free(st);
+}
+
+/** forget our prepared statements */
+static void _st_mysql_stmt_flush(drvdata_t data) {
+    xhash_walk(data->stmts, _st_mysql_stmt_free, NULL);
+    xhash_free(data->stmts);
+    data->stmts = xhash_new(101);
+}
+
+/** per-connection setup, done once rather than before every transaction */
+static void _st_mysql_session(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    data->thread_id = mysql_thread_id(data->conn);
+
+    if(data->txn && mysql_query(data->conn, "SET SESSION TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0)
+        log_write(drv->st->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
+}
+
+/** the client library reconnects on its own. when it has, our statements and session settings went with the old connection */
+static void _st_mysql_check(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    if(mysql_thread_id(data->conn) == data->thread_id)
+        return;
+
+    log_write(drv->st->log, LOG_NOTICE, "mysql: reconnected to database");
+
+    _st_mysql_stmt_flush(data);
+    _st_mysql_session(drv);
+}
+
+/** errors that mean the connection (or the statement on it) has gone away */
+static int _st_mysql_gone(unsigned int err) {
+    return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST || err == ER_UNKNOWN_STMT_HANDLER;
+}
+
+/** prepare this sql on the connection, unless we already have */
+static stmt_t _st_mysql_prepare(st_driver_t drv, const char *sql, unsigned int *err) {
     drvdata_t data = (drvdata_t) drv->private;
+    stmt_t st;
+    MYSQL_STMT *stmt;
+
+    st = (stmt_t) xhash_get(data->stmts, sql);
+    if(st != NULL)
+        return st;
+
+    /* something is making lots of different ones, start again */
+    if(xhash_count(data->stmts) >= STMT_MAX) {
+        log_debug(ZONE, "statement cache full, emptying it");
+        _st_mysql_stmt_flush(data);
+    }
+
+    log_debug(ZONE, "preparing: %s", sql);
+
+    stmt = mysql_stmt_init(data->conn);
+    if(stmt == NULL) {
+        *err = mysql_errno(data->conn);
+        log_write(drv->st->log, LOG_ERR, "mysql: sql prepare failed: %s", mysql_error(data->conn));
+        return NULL;
+    }
+
+    if(mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+        *err = mysql_stmt_errno(stmt);
+        log_write(drv->st->log, LOG_ERR, "mysql: sql prepare failed: %s", mysql_stmt_error(stmt));
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    st = (stmt_t) calloc(1, sizeof(struct stmt_st));
+    st->sql = strdup(sql);
+    st->stmt = stmt;
+
+    xhash_put(data->stmts, st->sql, (void *) st);
+
+    return st;
+}
+
+/** run some sql with these parameters, preparing it the first time we see it.
+ *  if the connection went away we reconnect and try once more. returns NULL on failure */
+static MYSQL_STMT *_st_mysql_exec(st_driver_t drv, const char *sql, params_t pp, const char *what) {
+    drvdata_t data = (drvdata_t) drv->private;
+    MYSQL_BIND *bind = NULL;
+    stmt_t st;
+    unsigned int err = 0;
+    int i, tries;
+
+    if(pp->n > 0) {
+        bind = (MYSQL_BIND *) calloc(pp->n, sizeof(MYSQL_BIND));
+        for(i = 0; i < pp->n; i++) {
+            bind[i].buffer_type = MYSQL_TYPE_STRING;
+            bind[i].buffer = (void *) pp->vals[i];
+            bind[i].buffer_length = strlen(pp->vals[i]);
+        }
+    }
+
+    for(tries = 0; tries < 2; tries++) {
+        _st_mysql_check(drv);
+
+        if((st = _st_mysql_prepare(drv, sql, &err)) != NULL) {
+            if((bind == NULL || mysql_stmt_bind_param(st->stmt, bind) == 0) && mysql_stmt_execute(st->stmt) == 0) {
+                free(bind);
+                return st->stmt;
+            }
+
+            err = mysql_stmt_errno(st->stmt);
+            log_write(drv->st->log, LOG_ERR, "mysql: sql %s failed: %s", what, mysql_stmt_error(st->stmt));
+        }
+
+        if(!_st_mysql_gone(err))
+            break;
+
+        log_write(drv->st->log, LOG_ERR, "mysql: lost connection to database, attempting reconnect");
+        mysql_ping(data->conn);
+        _st_mysql_stmt_flush(data);
+    }
+
+    free(bind);
+
+    return NULL;
+}
+
+static int _st_mysql_param(params_t pp, const char *val) {
+    if(pp->n == pp->max) {
+        pp->max += 8;
+        pp->vals = (const char **) realloc(pp->vals, sizeof(char *) * pp->max);
+    }
+
+    pp->vals[pp->n++] = val;
+
+    return pp->n;
+}
+
+static void _st_mysql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, int *buflen, int *nbuf, params_t pp) {
     st_filter_t scan;
-    char *cval;
-    int vlen;
 
     switch(f->type) {
         case st_filter_type_PAIR:
+            _st_mysql_param(pp, f->val);
 
-            /* do sql escape processing of f->val */
-            cval = (char *) malloc(sizeof(char) * ((strlen((char *) f->val) * 2) + 1));
-            vlen = mysql_real_escape_string(data->conn, cval, (char *) f->val, strlen((char *) f->val));
-
-            MYSQL_SAFE((*buf), *buflen + 12 + strlen(f->key) + vlen, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( `%s` = \'%s\' ) ", f->key, cval);
-            free(cval);
+            MYSQL_SAFE((*buf), *nbuf + 12 + strlen(f->key), *buflen);
+            *nbuf += sprintf(&((*buf)[*nbuf]), "( `%s` = ? ) ", f->key);
 
             break;
 
         case st_filter_type_AND:
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, pp);
 
                 if(scan->next != NULL) {
-                    MYSQL_SAFE((*buf), *buflen + 4, *buflen);
+                    MYSQL_SAFE((*buf), *nbuf + 4, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "AND ");
                 }
             }
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_OR:
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, pp);
 
                 if(scan->next != NULL) {
-                    MYSQL_SAFE((*buf), *buflen + 3, *buflen);
+                    MYSQL_SAFE((*buf), *nbuf + 3, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "OR ");
                 }
             }
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_NOT:
-            MYSQL_SAFE((*buf), *buflen + 6, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 6, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( NOT ");
 
-            _st_mysql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf);
+            _st_mysql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf, pp);
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
     }
 }
 
-static char *_st_mysql_convert_filter(st_driver_t drv, const char *owner, const char *filter) {
+/** build "<head> `<type>` WHERE <filter><tail>" with placeholders, and the values to go in them.
+ *  the values point into the filter, so pool_free(*f) once it has been run */
+static char *_st_mysql_convert_filter(st_driver_t drv, const char *head, const char *type, const char *owner, const char *filter, const char *tail, params_t pp, st_filter_t *f) {
     char *buf = NULL;
     int buflen = 0, nbuf = 0;
-    st_filter_t f;
-
-    MYSQL_SAFE(buf, 23 + strlen(owner), buflen);
 
-    nbuf = sprintf(buf, "`collection-owner` = '%s'", owner);
+    MYSQL_SAFE(buf, strlen(head) + strlen(type) + 40, buflen);
+    nbuf = sprintf(buf, "%s `%s` WHERE `collection-owner` = ?", head, type);
+    _st_mysql_param(pp, owner);
 
-    f = storage_filter(filter);
-    if(f == NULL)
-        return buf;
+    *f = storage_filter(filter);
+    if(*f != NULL) {
+        MYSQL_SAFE(buf, nbuf + 5, buflen);
+        nbuf += sprintf(&buf[nbuf], " AND ");
 
-    MYSQL_SAFE(buf, buflen + 5, buflen);
-    nbuf += sprintf(&buf[nbuf], " AND ");
-
-    _st_mysql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf);
+        _st_mysql_convert_filter_recursive(drv, *f, &buf, &buflen, &nbuf, pp);
+    }
 
-    pool_free(f->p);
+    MYSQL_SAFE(buf, nbuf + strlen(tail), buflen);
+    strcpy(&buf[nbuf], tail);
 
     return buf;
 }
@@ -168,12 +324,15 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
     drvdata_t data = (drvdata_t) drv->private;
     char *left = NULL, *right = NULL;
     int lleft = 0, lright = 0, nleft, nright;
+    struct params_st pp = { NULL, 0, 0 };
+    char **cvals = NULL;
     os_object_t o;
     char *key, *cval = NULL;
     void *val;
     os_type_t ot;
     const char *xml;
-    int xlen;
+    int xlen, n, i;
+    MYSQL_STMT *stmt;
     char tbuf[128];
 
     if(os_count(os) == 0)
@@ -186,11 +345,14 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
 
     if(os_iter_first(os))
         do {
+            pp.n = 0;
+
             MYSQL_SAFE(left, strlen(type) + 35, lleft);
             nleft = sprintf(left, "INSERT INTO `%s` ( `collection-owner`", type);
 
-            MYSQL_SAFE(right, strlen(owner) + 14, lright);
-            nright = sprintf(right, " ) VALUES ( '%s'", owner);
+            MYSQL_SAFE(right, 14, lright);
+            nright = sprintf(right, " ) VALUES ( ?");
+            _st_mysql_param(&pp, owner);
 
             o = os_iter_object(os);
             if(os_object_iter_first(o))
@@ -213,15 +375,15 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
                             break;
 
                         case os_type_STRING:
-                            cval = (char *) malloc(sizeof(char) * ((strlen((char *) val) * 2) + 1));
-                            mysql_real_escape_string(data->conn, cval, (char *) val, strlen((char *) val));
+                            cval = strdup((char *) val);
                             break;
 
                         case os_type_NAD:
                             nad_print((nad_t) val, 0, &xml, &xlen);
-                            cval = (char *) malloc(sizeof(char) * ((xlen * 2) + 4));
-                            mysql_real_escape_string(data->conn, &cval[3], xml, xlen);
-                            strncpy(cval, "NAD", 3);
+                            cval = (char *) malloc(sizeof(char) * (xlen + 4));
+                            memcpy(&cval[3], xml, xlen);
+                            memcpy(cval, "NAD", 3);
+                            cval[xlen + 3] = '\0';
                             break;
 
                         case os_type_UNKNOWN:
@@ -230,24 +392,31 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
 
                     log_debug(ZONE, "key %s val %s", key, cval);
 
-                    MYSQL_SAFE(left, lleft + strlen(key) + 4, lleft);
-                    nleft += sprintf(&left[nleft], ", `%s`", key);
+                    /* values are freed once it has run */
+                    n = _st_mysql_param(&pp, cval);
+                    cvals = (char **) realloc(cvals, sizeof(char *) * pp.max);
+                    cvals[n - 1] = cval;
 
-                    MYSQL_SAFE(right, lright + strlen(cval) + 4, lright);
-                    nright += sprintf(&right[nright], ", '%s'", cval);
+                    MYSQL_SAFE(left, nleft + strlen(key) + 4, lleft);
+                    nleft += sprintf(&left[nleft], ", `%s`", key);
 
-                    free(cval);
+                    MYSQL_SAFE(right, nright + 3, lright);
+                    nright += sprintf(&right[nright], ", ?");
                 } while(os_object_iter_next(o));
 
-            MYSQL_SAFE(left, lleft + strlen(right) + 2, lleft);
+            MYSQL_SAFE(left, nleft + nright + 2, lleft);
             sprintf(&left[nleft], "%s )", right);
 
-            log_debug(ZONE, "prepared sql: %s", left);
+            stmt = _st_mysql_exec(drv, left, &pp, "insert");
+
+            for(i = 1; i < pp.n; i++)
+                free(cvals[i]);
 
-            if(mysql_query(data->conn, left) != 0) {
-                log_write(drv->st->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(data->conn));
+            if(stmt == NULL) {
                 free(left);
                 free(right);
+                free(pp.vals);
+                free(cvals);
                 return st_FAILED;
             }
 
@@ -255,40 +424,35 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
 
     free(left);
     free(right);
+    free(pp.vals);
+    free(cvals);
 
     return st_SUCCESS;
 }
 
 static st_ret_t _st_mysql_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
+    int txn;
 
     if(os_count(os) == 0)
         return st_SUCCESS;
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
-        return st_FAILED;
-    }
-
-    if(data->txn) {
-        if(mysql_query(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0) {
-            log_write(drv->st->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
-            return st_FAILED;
-        }
+    /* a single insert is atomic on its own */
+    txn = data->txn && os_count(os) > 1;
 
+    if(txn)
         if(mysql_query(data->conn, "BEGIN") != 0) {
             log_write(drv->st->log, LOG_ERR, "mysql: sql transaction begin failed: %s", mysql_error(data->conn));
             return st_FAILED;
         }
-    }
 
     if(_st_mysql_put_guts(drv, type, owner, os) != st_SUCCESS) {
-        if(data->txn)
+        if(txn)
             mysql_query(data->conn, "ROLLBACK");
         return st_FAILED;
     }
 
-    if(data->txn)
+    if(txn)
         if(mysql_query(data->conn, "COMMIT") != 0) {
             log_write(drv->st->log, LOG_ERR, "mysql: sql transaction commit failed: %s", mysql_error(data->conn));
             mysql_query(data->conn, "ROLLBACK");
@@ -298,86 +462,118 @@ static st_ret_t _st_mysql_put(st_driver_t drv, const char *type, const char *own
     return st_SUCCESS;
 }
 
-static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+static st_ret_t _st_mysql_get_page(st_driver_t drv, const char *type, const char *owner, const char *filter, int offset, int limit, os_t *os) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+    char *buf;
+    struct params_st pp = { NULL, 0, 0 };
+    st_filter_t f;
+    MYSQL_STMT *stmt;
     MYSQL_RES *res;
-    int ntuples, nfields, i, j;
+    MYSQL_BIND *bind;
+    unsigned long *lengths;
+    my_bool *nulls;
+    int ntuples, nfields, i, j, ret;
     MYSQL_FIELD *fields;
-    MYSQL_ROW tuple;
     os_object_t o;
     char *val;
     os_type_t ot;
     int ival;
-    char tbuf[128];
-
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
-        return st_FAILED;
-    }
+    char tbuf[128], tail[80];
 
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    if(limit > 0)
+        snprintf(tail, sizeof(tail), " ORDER BY `object-sequence` LIMIT %d OFFSET %d", limit, offset);
+    else
+        strcpy(tail, " ORDER BY `object-sequence`");
 
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 50, buflen);
-    sprintf(buf, "SELECT * FROM `%s` WHERE %s ORDER BY `object-sequence`", type, cond);
-    free(cond);
+    buf = _st_mysql_convert_filter(drv, "SELECT * FROM", type, owner, filter, tail, &pp, &f);
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    stmt = _st_mysql_exec(drv, buf, &pp, "select");
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(data->conn));
-        free(buf);
-        return st_FAILED;
-    }
     free(buf);
+    free(pp.vals);
+    if(f != NULL)
+        pool_free(f->p);
 
-    res = mysql_store_result(data->conn);
-    if(res == NULL) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_error(data->conn));
+    if(stmt == NULL)
+        return st_FAILED;
+
+    if(mysql_stmt_store_result(stmt) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_stmt_error(stmt));
         return st_FAILED;
     }
 
-    ntuples = mysql_num_rows(res);
+    ntuples = mysql_stmt_num_rows(stmt);
     if(ntuples == 0) {
-        mysql_free_result(res);
+        mysql_stmt_free_result(stmt);
         return st_NOTFOUND;
     }
 
     log_debug(ZONE, "%d tuples returned", ntuples);
 
+    res = mysql_stmt_result_metadata(stmt);
+    if(res == NULL) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return st_FAILED;
+    }
+
     nfields = mysql_num_fields(res);
 
     if(nfields == 0) {
         log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
         mysql_free_result(res);
+        mysql_stmt_free_result(stmt);
         return st_NOTFOUND;
     }
 
     fields = mysql_fetch_fields(res);
 
+    /* everything comes back as a string, same as the text protocol would give us */
+    bind = (MYSQL_BIND *) calloc(nfields, sizeof(MYSQL_BIND));
+    lengths = (unsigned long *) calloc(nfields, sizeof(unsigned long));
+    nulls = (my_bool *) calloc(nfields, sizeof(my_bool));
+
+    for(j = 0; j < nfields; j++) {
+        bind[j].buffer_type = MYSQL_TYPE_STRING;
+        bind[j].buffer = malloc(COLUMN_SIZE);
+        bind[j].buffer_length = COLUMN_SIZE - 1;
+        bind[j].length = &lengths[j];
+        bind[j].is_null = &nulls[j];
+    }
+
+    mysql_stmt_bind_result(stmt, bind);
+
     *os = os_new();
 
     for(i = 0; i < ntuples; i++) {
-        o = os_object_new(*os);
-
-        if((tuple = mysql_fetch_row(res)) == NULL)
+        ret = mysql_stmt_fetch(stmt);
+        if(ret != 0 && ret != MYSQL_DATA_TRUNCATED)
             break;
 
+        o = os_object_new(*os);
+
         for(j = 0; j < nfields; j++) {
             if(strcmp(fields[j].name, "collection-owner") == 0)
                 continue;
 
-            if(tuple[j] == NULL)
+            if(nulls[j])
                 continue;
 
-            // mysql_fetch_lengths(res); // TODO check if mysql_fetch_lengths must be called.
+            /* didn't fit, make room and get the rest of it */
+            if(lengths[j] > bind[j].buffer_length) {
+                bind[j].buffer = realloc(bind[j].buffer, lengths[j] + 1);
+                bind[j].buffer_length = lengths[j];
+                mysql_stmt_fetch_column(stmt, &bind[j], j, 0);
+                mysql_stmt_bind_result(stmt, bind);
+            }
+
+            val = (char *) bind[j].buffer;
+            val[lengths[j]] = '\0';
 
             switch(fields[j].type) {
                 case FIELD_TYPE_TINY:   /* tinyint */
@@ -398,8 +594,6 @@ static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *own
                     continue;
             }
 
-            val = tuple[j];
-
             switch(ot) {
                 case os_type_BOOLEAN:
                     ival = (val[0] == '0') ? 0 : 1;
@@ -422,110 +616,97 @@ static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *own
         }
     }
 
+    mysql_stmt_free_result(stmt);
     mysql_free_result(res);
 
+    for(j = 0; j < nfields; j++)
+        free(bind[j].buffer);
+    free(bind);
+    free(lengths);
+    free(nulls);
+
     return st_SUCCESS;
 }
 
+static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+    return _st_mysql_get_page(drv, type, owner, filter, 0, 0, os);
+}
+
 static st_ret_t _st_mysql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
-    MYSQL_RES *res;
-    int ntuples, nfields;
-    MYSQL_ROW tuple;
+    char *buf;
+    struct params_st pp = { NULL, 0, 0 };
+    st_filter_t f;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND bind;
+    long long cnt = 0;
+    int ret;
     char tbuf[128];
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
-        return st_FAILED;
-    }
-
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
-
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 31, buflen);
-    sprintf(buf, "SELECT COUNT(*) FROM `%s` WHERE %s", type, cond);
-    free(cond);
+    buf = _st_mysql_convert_filter(drv, "SELECT COUNT(*) FROM", type, owner, filter, "", &pp, &f);
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    stmt = _st_mysql_exec(drv, buf, &pp, "select");
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(data->conn));
-        free(buf);
-        return st_FAILED;
-    }
     free(buf);
+    free(pp.vals);
+    if(f != NULL)
+        pool_free(f->p);
 
-    res = mysql_store_result(data->conn);
-    if(res == NULL) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_error(data->conn));
+    if(stmt == NULL)
         return st_FAILED;
-    }
 
-    ntuples = mysql_num_rows(res);
-    if(ntuples == 0) {
-        mysql_free_result(res);
-        return st_NOTFOUND;
-    }
+    memset(&bind, 0, sizeof(bind));
+    bind.buffer_type = MYSQL_TYPE_LONGLONG;
+    bind.buffer = &cnt;
 
-    log_debug(ZONE, "%d tuples returned", ntuples);
+    mysql_stmt_bind_result(stmt, &bind);
 
-    nfields = mysql_num_fields(res);
+    ret = mysql_stmt_fetch(stmt);
+    mysql_stmt_free_result(stmt);
 
-    if(nfields == 0) {
-        log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
-        mysql_free_result(res);
+    if(ret == MYSQL_NO_DATA)
         return st_NOTFOUND;
-    }
 
-    if((tuple = mysql_fetch_row(res)) == NULL)
-        return st_NOTFOUND;
+    if(ret != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_stmt_error(stmt));
+        return st_FAILED;
+    }
 
     if (count!=NULL)
-        *count = atoi(tuple[0]);
-
-    mysql_free_result(res);
+        *count = (int) cnt;
 
     return st_SUCCESS;
 }
 
 static st_ret_t _st_mysql_delete(st_driver_t drv, const char *type, const char *owner, const char *filter) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+    char *buf;
+    struct params_st pp = { NULL, 0, 0 };
+    st_filter_t f;
+    MYSQL_STMT *stmt;
     char tbuf[128];
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
-        return st_FAILED;
-    }
-
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    buf = _st_mysql_convert_filter(drv, "DELETE FROM", type, owner, filter, "", &pp, &f);
 
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 21, buflen);
-    sprintf(buf, "DELETE FROM `%s` WHERE %s", type, cond);
-    free(cond);
+    stmt = _st_mysql_exec(drv, buf, &pp, "delete");
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    free(buf);
+    free(pp.vals);
+    if(f != NULL)
+        pool_free(f->p);
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql delete failed: %s", mysql_error(data->conn));
-        free(buf);
+    if(stmt == NULL)
         return st_FAILED;
-    }
-    free(buf);
 
     return st_SUCCESS;
 }
@@ -533,22 +714,11 @@ static st_ret_t _st_mysql_delete(st_driver_t drv, const char *type, const char *
 static st_ret_t _st_mysql_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
-        return st_FAILED;
-    }
-
-    if(data->txn) {
-        if(mysql_query(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0) {
-            log_write(drv->st->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
-            return st_FAILED;
-        }
-
+    if(data->txn)
         if(mysql_query(data->conn, "BEGIN") != 0) {
             log_write(drv->st->log, LOG_ERR, "mysql: sql transaction begin failed: %s", mysql_error(data->conn));
             return st_FAILED;
         }
-    }
 
     if(_st_mysql_delete(drv, type, owner, filter) == st_FAILED) {
         if(data->txn)
@@ -575,6 +745,9 @@ static st_ret_t _st_mysql_replace(st_driver_t drv, const char *type, const char
 static void _st_mysql_free(st_driver_t drv) {
     drvdata_t data = (drvdata_t) drv->private;
 
+    xhash_walk(data->stmts, _st_mysql_stmt_free, NULL);
+    xhash_free(data->stmts);
+
     mysql_close(data->conn);
 
     free(data);
@@ -626,12 +799,17 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
 
     data->prefix = config_get_one(drv->st->config, "storage.mysql.prefix", 0);
 
+    data->stmts = xhash_new(101);
+
     drv->private = (void *) data;
 
+    _st_mysql_session(drv);
+
     drv->add_type = _st_mysql_add_type;
     drv->put = _st_mysql_put;
     drv->count = _st_mysql_count;
     drv->get = _st_mysql_get;
+    drv->get_page = _st_mysql_get_page;
     drv->delete = _st_mysql_delete;
     drv->replace = _st_mysql_replace;
     drv->free = _st_mysql_free;
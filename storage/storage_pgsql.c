@@ -36,10 +36,22 @@ typedef struct drvdata_st {
     const char *prefix;
 
     int txn;
+
+    xht stmts;          /* statements prepared on this connection, keyed by their sql */
+    int nstmts;         /* for naming them */
 } *drvdata_t;
 
+/** a prepared statement, lives as long as the connection does */
+typedef struct stmt_st {
+    char *sql;
+    char name[16];
+} *stmt_t;
+
 #define FALLBACK_BLOCKSIZE (4096)
 
+/* statements we'll keep before starting over */
+#define STMT_MAX (256)
+
 /** internal: do and return the math and ensure it gets realloc'd */
 static size_t _st_pgsql_realloc(char **oblocks, size_t len) {
     void *nblocks;
@@ -69,92 +81,222 @@ static size_t _st_pgsql_realloc(char **oblocks, size_t len) {
 /** this is the safety check used to make sure there's always enough mem */
 #define PGSQL_SAFE(blocks, size, len) if((size) >= len) len = _st_pgsql_realloc(&(blocks),(size + 1));
 
-static void _st_pgsql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, unsigned int *buflen, unsigned int *nbuf) {
+static void _st_pgsql_stmt_free(const char *key, int keylen, void *val, void *arg) {
+    stmt_t st = (stmt_t) val;
+
+    free(st->sql);
+    free(st);
+}
+
+/** forget our prepared statements, the server has (or is about to) */
+static void _st_pgsql_stmt_flush(drvdata_t data) {
+    xhash_walk(data->stmts, _st_pgsql_stmt_free, NULL);
+    xhash_free(data->stmts);
+    data->stmts = xhash_new(101);
+}
+
+/** lost the connection, get it back. prepared statements don't survive this */
+static void _st_pgsql_reset(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
+
+    PQreset(data->conn);
+    _st_pgsql_stmt_flush(data);
+}
+
+/** prepare this sql on the connection, unless we already have */
+static stmt_t _st_pgsql_prepare(st_driver_t drv, const char *sql, int nparams) {
+    drvdata_t data = (drvdata_t) drv->private;
+    stmt_t st;
+    PGresult *res;
+    char name[16];
+
+    st = (stmt_t) xhash_get(data->stmts, sql);
+    if(st != NULL)
+        return st;
+
+    /* something is making lots of different ones, start again */
+    if(xhash_count(data->stmts) >= STMT_MAX) {
+        log_debug(ZONE, "statement cache full, emptying it");
+        PQclear(PQexec(data->conn, "DEALLOCATE ALL"));
+        _st_pgsql_stmt_flush(data);
+    }
+
+    snprintf(name, sizeof(name), "st%d", data->nstmts++);
+
+    log_debug(ZONE, "preparing %s: %s", name, sql);
+
+    res = PQprepare(data->conn, name, sql, nparams, NULL);
+
+    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
+        PQclear(res);
+        _st_pgsql_reset(drv);
+        res = PQprepare(data->conn, name, sql, nparams, NULL);
+    }
+
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_write(drv->st->log, LOG_ERR, "pgsql: sql prepare failed: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return NULL;
+    }
+
+    PQclear(res);
+
+    st = (stmt_t) calloc(1, sizeof(struct stmt_st));
+    st->sql = strdup(sql);
+    strcpy(st->name, name);
+
+    xhash_put(data->stmts, st->sql, (void *) st);
+
+    return st;
+}
+
+/** run some sql with these parameters, preparing it the first time we see it.
+ *  returns NULL if it couldn't even be prepared */
+static PGresult *_st_pgsql_exec(st_driver_t drv, const char *sql, int nparams, const char **vals, ExecStatusType ok) {
+    drvdata_t data = (drvdata_t) drv->private;
+    stmt_t st;
+    PGresult *res;
+
+    if((st = _st_pgsql_prepare(drv, sql, nparams)) == NULL)
+        return NULL;
+
+    res = PQexecPrepared(data->conn, st->name, nparams, vals, NULL, NULL, 0);
+
+    if(PQresultStatus(res) != ok && PQstatus(data->conn) != CONNECTION_OK) {
+        PQclear(res);
+        _st_pgsql_reset(drv);
+
+        if((st = _st_pgsql_prepare(drv, sql, nparams)) == NULL)
+            return NULL;
+
+        res = PQexecPrepared(data->conn, st->name, nparams, vals, NULL, NULL, 0);
+    }
+
+    return res;
+}
+
+/** run a statement with no parameters or results (transaction control) */
+static int _st_pgsql_command(st_driver_t drv, const char *sql) {
+    drvdata_t data = (drvdata_t) drv->private;
+    PGresult *res;
+
+    res = PQexec(data->conn, sql);
+    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
+        PQclear(res);
+        _st_pgsql_reset(drv);
+        res = PQexec(data->conn, sql);
+    }
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_write(drv->st->log, LOG_ERR, "pgsql: sql %s failed: %s", sql, PQresultErrorMessage(res));
+        PQclear(res);
+        return 1;
+    }
+
+    PQclear(res);
+
+    return 0;
+}
+
+/** a parameter list, grown as the sql is built */
+typedef struct params_st {
+    const char  **vals;
+    int         n, max;
+} *params_t;
+
+static int _st_pgsql_param(params_t pp, const char *val) {
+    if(pp->n == pp->max) {
+        pp->max += 8;
+        pp->vals = (const char **) realloc(pp->vals, sizeof(char *) * pp->max);
+    }
+
+    pp->vals[pp->n++] = val;
+
+    return pp->n;
+}
+
+static void _st_pgsql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, unsigned int *buflen, unsigned int *nbuf, params_t pp) {
     st_filter_t scan;
-    int vlen;
-    char *cval;
+    int n;
 
     switch(f->type) {
         case st_filter_type_PAIR:
-            /* do sql escaping for apostrophes */
-            cval = (char *) malloc(sizeof(char) * ((strlen(f->val) * 2) + 1));
-            vlen = PQescapeString(cval, f->val, strlen(f->val));
+            n = _st_pgsql_param(pp, f->val);
 
-            PGSQL_SAFE((*buf), *buflen + 12 + vlen - strlen(f->val), *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( \"%s\" = \'%s\' ) ", f->key, f->val);
-            free(cval);
+            PGSQL_SAFE((*buf), *nbuf + strlen(f->key) + 24, *buflen);
+            *nbuf += sprintf(&((*buf)[*nbuf]), "( \"%s\" = $%d ) ", f->key, n);
 
             break;
 
         case st_filter_type_AND:
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, pp);
 
                 if(scan->next != NULL) {
-                    PGSQL_SAFE((*buf), *buflen + 4, *buflen);
+                    PGSQL_SAFE((*buf), *nbuf + 4, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "AND ");
                 }
             }
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_OR:
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, pp);
 
                 if(scan->next != NULL) {
-                    PGSQL_SAFE((*buf), *buflen + 3, *buflen);
+                    PGSQL_SAFE((*buf), *nbuf + 3, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "OR ");
                 }
             }
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_NOT:
-            PGSQL_SAFE((*buf), *buflen + 6, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 6, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( NOT ");
 
-            _st_pgsql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf);
+            _st_pgsql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf, pp);
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
     }
 }
 
-static char *_st_pgsql_convert_filter(st_driver_t drv, const char *owner, const char *filter) {
-    /* drvdata_t data = (drvdata_t) drv->private;*/
+/** build "<head> "<type>" WHERE <filter><tail>" with placeholders, and the values to go in them.
+ *  the values point into the filter, so pool_free(*f) once it has been run */
+static char *_st_pgsql_convert_filter(st_driver_t drv, const char *head, const char *type, const char *owner, const char *filter, const char *tail, params_t pp, st_filter_t *f) {
     char *buf = NULL;
     unsigned int buflen = 0, nbuf = 0;
-    st_filter_t f;
-
-    PGSQL_SAFE(buf, 24 + strlen(owner), buflen);
 
-    nbuf = sprintf(buf, "\"collection-owner\" = '%s'", owner);
+    PGSQL_SAFE(buf, strlen(head) + strlen(type) + 40, buflen);
+    nbuf = sprintf(buf, "%s \"%s\" WHERE \"collection-owner\" = $%d", head, type, _st_pgsql_param(pp, owner));
 
-    f = storage_filter(filter);
-    if(f == NULL)
-        return buf;
+    *f = storage_filter(filter);
+    if(*f != NULL) {
+        PGSQL_SAFE(buf, nbuf + 5, buflen);
+        nbuf += sprintf(&buf[nbuf], " AND ");
 
-    PGSQL_SAFE(buf, buflen + 5, buflen);
-    nbuf += sprintf(&buf[nbuf], " AND ");
-
-    _st_pgsql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf);
+        _st_pgsql_convert_filter_recursive(drv, *f, &buf, &buflen, &nbuf, pp);
+    }
 
-    pool_free(f->p);
+    PGSQL_SAFE(buf, nbuf + strlen(tail), buflen);
+    strcpy(&buf[nbuf], tail);
 
     return buf;
 }
@@ -166,13 +308,15 @@ static st_ret_t _st_pgsql_add_type(st_driver_t drv, const char *type) {
 static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
     char *left = NULL, *right = NULL;
-    int lleft = 0, lright = 0, nleft, nright;
+    unsigned int lleft = 0, lright = 0, nleft, nright;
+    struct params_st pp = { NULL, 0, 0 };
+    char **cvals = NULL;
     os_object_t o;
     char *key, *cval = NULL;
     void *val;
     os_type_t ot;
     const char *xml;
-    int xlen;
+    int xlen, n, i;
     PGresult *res;
     char tbuf[128];
 
@@ -186,11 +330,13 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
 
     if(os_iter_first(os))
         do {
+            pp.n = 0;
+
             PGSQL_SAFE(left, strlen(type) + 55, lleft);
             nleft = sprintf(left, "INSERT INTO \"%s\" ( \"collection-owner\", \"object-sequence\"", type);
 
-            PGSQL_SAFE(right, strlen(owner) + 43, lright);
-            nright = sprintf(right, " ) VALUES ( '%s', nextval('object-sequence')", owner);
+            PGSQL_SAFE(right, 43, lright);
+            nright = sprintf(right, " ) VALUES ( $%d, nextval('object-sequence')", _st_pgsql_param(&pp, owner));
 
             o = os_iter_object(os);
             if(os_object_iter_first(o))
@@ -214,15 +360,15 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
                             break;
 
                         case os_type_STRING:
-                            cval = (char *) malloc(sizeof(char) * ((strlen((char *) val) * 2) + 1));
-                            PQescapeString(cval, (char *) val, strlen((char *) val));
+                            cval = strdup((char *) val);
                             break;
 
                         case os_type_NAD:
                             nad_print((nad_t) val, 0, &xml, &xlen);
-                            cval = (char *) malloc(sizeof(char) * ((xlen * 2) + 4));
-                            PQescapeString(&cval[3], xml, xlen);
-                            strncpy(cval, "NAD", 3);
+                            cval = (char *) malloc(sizeof(char) * (xlen + 4));
+                            memcpy(&cval[3], xml, xlen);
+                            memcpy(cval, "NAD", 3);
+                            cval[xlen + 3] = '\0';
                             break;
 
                         case os_type_UNKNOWN:
@@ -231,33 +377,35 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
 
                     log_debug(ZONE, "key %s val %s", key, cval);
 
-                    PGSQL_SAFE(left, lleft + strlen(key) + 4, lleft);
-                    nleft += sprintf(&left[nleft], ", \"%s\"", key);
+                    /* values are freed once it has run */
+                    n = _st_pgsql_param(&pp, cval);
+                    cvals = (char **) realloc(cvals, sizeof(char *) * pp.max);
+                    cvals[n - 1] = cval;
 
-                    PGSQL_SAFE(right, lright + strlen(cval) + 4, lright);
-                    nright += sprintf(&right[nright], ", '%s'", cval);
+                    PGSQL_SAFE(left, nleft + strlen(key) + 4, lleft);
+                    nleft += sprintf(&left[nleft], ", \"%s\"", key);
 
-                    free(cval);
+                    PGSQL_SAFE(right, nright + 16, lright);
+                    nright += sprintf(&right[nright], ", $%d", n);
                 } while(os_object_iter_next(o));
 
-            PGSQL_SAFE(left, lleft + strlen(right) + 3, lleft);
-            sprintf(&left[nleft], "%s );", right);
+            PGSQL_SAFE(left, nleft + nright + 3, lleft);
+            sprintf(&left[nleft], "%s )", right);
 
-            log_debug(ZONE, "prepared sql: %s", left);
+            res = _st_pgsql_exec(drv, left, pp.n, pp.vals, PGRES_COMMAND_OK);
 
-            res = PQexec(data->conn, left);
+            for(i = 1; i < pp.n; i++)
+                free(cvals[i]);
 
-            if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-                log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-                PQclear(res);
-                PQreset(data->conn);
-                res = PQexec(data->conn, left);
-            }
-            if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-                log_write(drv->st->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
+            if(res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK) {
+                if(res != NULL) {
+                    log_write(drv->st->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
+                    PQclear(res);
+                }
                 free(left);
                 free(right);
-                PQclear(res);
+                free(pp.vals);
+                free(cvals);
                 return st_FAILED;
             }
 
@@ -267,110 +415,88 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
 
     free(left);
     free(right);
+    free(pp.vals);
+    free(cvals);
 
     return st_SUCCESS;
 }
 
+static int _st_pgsql_commit(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    if(_st_pgsql_command(drv, "COMMIT") != 0) {
+        PQclear(PQexec(data->conn, "ROLLBACK"));
+        return 1;
+    }
+
+    return 0;
+}
+
+static void _st_pgsql_rollback(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    PQclear(PQexec(data->conn, "ROLLBACK"));
+}
+
 static st_ret_t _st_pgsql_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
-    PGresult *res;
+    int txn;
 
     if(os_count(os) == 0)
         return st_SUCCESS;
 
-    if(data->txn) {
-        res = PQexec(data->conn, "BEGIN;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "BEGIN;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction begin failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            return st_FAILED;
-        }
-        PQclear(res);
+    /* a single insert is atomic by itself, so don't spend round trips on a transaction */
+    txn = data->txn && os_count(os) > 1;
 
-        res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction setup failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
-        }
-        PQclear(res);
-    }
+    if(txn && _st_pgsql_command(drv, "BEGIN ISOLATION LEVEL SERIALIZABLE") != 0)
+        return st_FAILED;
 
     if(_st_pgsql_put_guts(drv, type, owner, os) != st_SUCCESS) {
-        if(data->txn)
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
+        if(txn)
+            _st_pgsql_rollback(drv);
         return st_FAILED;
     }
 
-    if(data->txn) {
-        res = PQexec(data->conn, "COMMIT;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "COMMIT;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction commit failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
-        }
-        PQclear(res);
-    }
+    if(txn && _st_pgsql_commit(drv) != 0)
+        return st_FAILED;
 
     return st_SUCCESS;
 }
 
-static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+static st_ret_t _st_pgsql_get_page(st_driver_t drv, const char *type, const char *owner, const char *filter, int offset, int limit, os_t *os) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+    char *buf;
+    struct params_st pp = { NULL, 0, 0 };
+    st_filter_t f;
     PGresult *res;
     int ntuples, nfields, i, j;
     os_object_t o;
     char *fname, *val;
     os_type_t ot;
     int ival;
-    char tbuf[128];
+    char tbuf[128], tail[80];
 
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
-
-    PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 51, buflen);
-    sprintf(buf, "SELECT * FROM \"%s\" WHERE %s ORDER BY \"object-sequence\";", type, cond);
-    free(cond);
+    if(limit > 0)
+        snprintf(tail, sizeof(tail), " ORDER BY \"object-sequence\" LIMIT %d OFFSET %d", limit, offset);
+    else
+        strcpy(tail, " ORDER BY \"object-sequence\"");
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    buf = _st_pgsql_convert_filter(drv, "SELECT * FROM", type, owner, filter, tail, &pp, &f);
 
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
+    res = _st_pgsql_exec(drv, buf, pp.n, pp.vals, PGRES_TUPLES_OK);
 
     free(buf);
+    free(pp.vals);
+    if(f != NULL)
+        pool_free(f->p);
+
+    if(res == NULL)
+        return st_FAILED;
 
     if(PQresultStatus(res) != PGRES_TUPLES_OK) {
         log_write(drv->st->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
@@ -454,10 +580,15 @@ static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *own
     return st_SUCCESS;
 }
 
+static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+    return _st_pgsql_get_page(drv, type, owner, filter, 0, 0, os);
+}
+
 static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+    char *buf;
+    struct params_st pp = { NULL, 0, 0 };
+    st_filter_t f;
     PGresult *res;
     int ntuples, nfields;
     char tbuf[128];
@@ -467,25 +598,17 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
         type = tbuf;
     }
 
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    buf = _st_pgsql_convert_filter(drv, "SELECT COUNT(*) FROM", type, owner, filter, "", &pp, &f);
 
-    PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 31, buflen);
-    sprintf(buf, "SELECT COUNT(*) FROM \"%s\" WHERE %s", type, cond);
-    free(cond);
-
-    log_debug(ZONE, "prepared sql: %s", buf);
-
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
+    res = _st_pgsql_exec(drv, buf, pp.n, pp.vals, PGRES_TUPLES_OK);
 
     free(buf);
+    free(pp.vals);
+    if(f != NULL)
+        pool_free(f->p);
+
+    if(res == NULL)
+        return st_FAILED;
 
     if(PQresultStatus(res) != PGRES_TUPLES_OK) {
         log_write(drv->st->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
@@ -509,8 +632,10 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
         return st_NOTFOUND;
     }
 
-    if(PQgetisnull(res, 0, 0) || PQftype(res, 0) != 20)
+    if(PQgetisnull(res, 0, 0) || PQftype(res, 0) != 20) {
+        PQclear(res);
         return st_NOTFOUND;
+    }
 
     if (count!=NULL)
         *count = atoi(PQgetvalue(res, 0, 0));
@@ -522,8 +647,9 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
 
 static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *owner, const char *filter) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+    char *buf;
+    struct params_st pp = { NULL, 0, 0 };
+    st_filter_t f;
     PGresult *res;
     char tbuf[128];
 
@@ -532,25 +658,17 @@ static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *
         type = tbuf;
     }
 
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    buf = _st_pgsql_convert_filter(drv, "DELETE FROM", type, owner, filter, "", &pp, &f);
 
-    PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 23, buflen);
-    sprintf(buf, "DELETE FROM \"%s\" WHERE %s;", type, cond);
-    free(cond);
-
-    log_debug(ZONE, "prepared sql: %s", buf);
-
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
+    res = _st_pgsql_exec(drv, buf, pp.n, pp.vals, PGRES_COMMAND_OK);
 
     free(buf);
+    free(pp.vals);
+    if(f != NULL)
+        pool_free(f->p);
+
+    if(res == NULL)
+        return st_FAILED;
 
     if(PQresultStatus(res) != PGRES_COMMAND_OK) {
         log_write(drv->st->log, LOG_ERR, "pgsql: sql delete failed: %s", PQresultErrorMessage(res));
@@ -565,67 +683,24 @@ static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *
 
 static st_ret_t _st_pgsql_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
-    PGresult *res;
-
-    if(data->txn) {
-        res = PQexec(data->conn, "BEGIN;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "BEGIN;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction begin failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            return st_FAILED;
-        }
-        PQclear(res);
 
-        res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction setup failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
-        }
-        PQclear(res);
-    }
+    if(data->txn && _st_pgsql_command(drv, "BEGIN ISOLATION LEVEL SERIALIZABLE") != 0)
+        return st_FAILED;
 
     if(_st_pgsql_delete(drv, type, owner, filter) == st_FAILED) {
         if(data->txn)
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
+            _st_pgsql_rollback(drv);
         return st_FAILED;
     }
 
     if(_st_pgsql_put_guts(drv, type, owner, os) == st_FAILED) {
         if(data->txn)
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
+            _st_pgsql_rollback(drv);
         return st_FAILED;
     }
 
-    if(data->txn) {
-        res = PQexec(data->conn, "COMMIT;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "COMMIT;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction commit failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
-        }
-        PQclear(res);
-    }
+    if(data->txn && _st_pgsql_commit(drv) != 0)
+        return st_FAILED;
 
     return st_SUCCESS;
 }
@@ -633,6 +708,9 @@ static st_ret_t _st_pgsql_replace(st_driver_t drv, const char *type, const char
 static void _st_pgsql_free(st_driver_t drv) {
     drvdata_t data = (drvdata_t) drv->private;
 
+    xhash_walk(data->stmts, _st_pgsql_stmt_free, NULL);
+    xhash_free(data->stmts);
+
     PQfinish(data->conn);
 
     free(data);
@@ -674,6 +752,7 @@ st_ret_t st_init(st_driver_t drv) {
     data = (drvdata_t) calloc(1, sizeof(struct drvdata_st));
 
     data->conn = conn;
+    data->stmts = xhash_new(101);
 
     if(config_get_one(drv->st->config, "storage.pgsql.transactions", 0) != NULL)
         data->txn = 1;
@@ -688,6 +767,7 @@ st_ret_t st_init(st_driver_t drv) {
     drv->put = _st_pgsql_put;
     drv->count = _st_pgsql_count;
     drv->get = _st_pgsql_get;
+    drv->get_page = _st_pgsql_get_page;
     drv->delete = _st_pgsql_delete;
     drv->replace = _st_pgsql_replace;
     drv->free = _st_pgsql_free;
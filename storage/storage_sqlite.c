@@ -35,10 +35,20 @@ typedef struct drvdata_st {
     sqlite3 *db;
     const char *prefix;
     int txn;
+    xht stmts;          /* prepared statements, keyed by their sql */
 } *drvdata_t;
 
+/** a prepared statement, kept until the connection closes */
+typedef struct stmt_st {
+    char *sql;
+    sqlite3_stmt *stmt;
+} *stmt_t;
+
 #define BLOCKSIZE (1024)
 
+/* statements we'll keep before starting over */
+#define STMT_MAX (256)
+
 
 /** internal: do and return the math and ensure it gets realloc'd */
 static int _st_sqlite_realloc (void **oblocks, int len) {
@@ -77,6 +87,61 @@ static int _st_sqlite_realloc (void **oblocks, int len) {
 	size += sizeof (s1) + l + sizeof (s3) - 2; \
     } while (0)
 
+static void _st_sqlite_stmt_free (const char *key, int keylen, void *val, void *arg) {
+
+    stmt_t st = (stmt_t) val;
+
+    sqlite3_finalize (st->stmt);
+    free (st->sql);
+    free (st);
+}
+
+/** get a prepared statement for this sql, preparing it the first time.
+ *  the sql names the type, operation and filter shape, values are bound. */
+static sqlite3_stmt *_st_sqlite_stmt (st_driver_t drv, const char *sql) {
+
+    drvdata_t data = (drvdata_t) drv->private;
+    stmt_t st;
+    sqlite3_stmt *stmt;
+
+    st = (stmt_t) xhash_get (data->stmts, sql);
+    if (st != NULL) {
+	return st->stmt;
+    }
+
+    log_debug (ZONE, "preparing sql: %s", sql);
+
+    if (sqlite3_prepare_v2 (data->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	log_write (drv->st->log, LOG_ERR,
+		   "sqlite: sql prepare failed: %s",
+		   sqlite3_errmsg (data->db));
+	return NULL;
+    }
+
+    /* something is making lots of different ones, start again */
+    if (xhash_count (data->stmts) >= STMT_MAX) {
+	log_debug (ZONE, "statement cache full, emptying it");
+	xhash_walk (data->stmts, _st_sqlite_stmt_free, NULL);
+	xhash_free (data->stmts);
+	data->stmts = xhash_new (101);
+    }
+
+    st = (stmt_t) calloc (1, sizeof (struct stmt_st));
+    st->sql = strdup (sql);
+    st->stmt = stmt;
+
+    xhash_put (data->stmts, st->sql, (void *) st);
+
+    return stmt;
+}
+
+/** finished with a statement, ready it for next time */
+static void _st_sqlite_stmt_done (sqlite3_stmt *stmt) {
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+}
+
 static void _st_sqlite_convert_filter_recursive (st_filter_t f, char **buf,
 						 int *buflen, int *nbuf) {
 
@@ -158,31 +223,26 @@ static char *_st_sqlite_convert_filter (st_driver_t drv, const char *owner,
 
 static void _st_sqlite_bind_filter_recursive (st_filter_t f,
 					      sqlite3_stmt *stmt,
-					      unsigned int bind_off) {
+					      unsigned int *bind_off) {
 
     st_filter_t scan;
-    unsigned int i;
 
     switch (f->type) {
      case st_filter_type_PAIR:
-      sqlite3_bind_text (stmt, bind_off, f->val, strlen (f->val),
+      sqlite3_bind_text (stmt, *bind_off, f->val, strlen (f->val),
 			 SQLITE_TRANSIENT);
-      break;
-
-     case st_filter_type_AND:
-      for (scan = f->sub, i = 0; scan != NULL; scan = scan->next, ++i) {
-	  _st_sqlite_bind_filter_recursive (scan, stmt, bind_off + i);
-      }
+      (*bind_off)++;
       return;
 
+     case st_filter_type_AND:
      case st_filter_type_OR:
-      for (scan = f->sub, i = 0; scan != NULL; scan = scan->next, ++i) {
-	  _st_sqlite_bind_filter_recursive (scan, stmt, bind_off + i);
+      for (scan = f->sub; scan != NULL; scan = scan->next) {
+	  _st_sqlite_bind_filter_recursive (scan, stmt, bind_off);
       }
       return;
 
      case st_filter_type_NOT:
-      _st_sqlite_bind_filter_recursive(f->sub, stmt, bind_off);
+      _st_sqlite_bind_filter_recursive (f->sub, stmt, bind_off);
       return;
     }
 }
@@ -203,11 +263,31 @@ static void _st_sqlite_bind_filter (st_driver_t drv, const char *owner,
 	return;
     }
 
-    _st_sqlite_bind_filter_recursive (f, stmt, bind_off + 1);
+    bind_off++;
+    _st_sqlite_bind_filter_recursive (f, stmt, &bind_off);
 
     pool_free (f->p);
 }
 
+/** build "<head> <where> [tail]" for one of the filtered queries */
+static char *_st_sqlite_filtered_sql (st_driver_t drv, const char *head,
+				      const char *type, const char *owner,
+				      const char *filter, const char *tail) {
+
+    char *cond, *buf;
+    int len;
+
+    cond = _st_sqlite_convert_filter (drv, owner, filter);
+
+    len = strlen (head) + strlen (type) + strlen (cond) + strlen (tail) + 11;
+    buf = (char *) malloc (len);
+    snprintf (buf, len, "%s \"%s\" WHERE %s%s", head, type, cond, tail);
+
+    free (cond);
+
+    return buf;
+}
+
 static st_ret_t _st_sqlite_add_type (st_driver_t drv, const char *type) {
 
     return st_SUCCESS;
@@ -273,16 +353,11 @@ static st_ret_t _st_sqlite_put_guts (st_driver_t drv, const char *type,
 
 	    SQLITE_SAFE_CAT (left, nleft, lleft, " )");
 
-	    log_debug (ZONE, "prepared sql: %s", left);
-
-	    res = sqlite3_prepare (data->db, left, strlen (left), &stmt, NULL);
+	    stmt = _st_sqlite_stmt (drv, left);
 	    free (left);
 	    left = NULL;
 	    lleft = 0;
-	    if (res != SQLITE_OK) {
-		log_write (drv->st->log, LOG_ERR,
-			   "sqlite: sql insert failed: %s",
-			   sqlite3_errmsg (data->db));
+	    if (stmt == NULL) {
 		return st_FAILED;
 	    }
 
@@ -340,10 +415,10 @@ static st_ret_t _st_sqlite_put_guts (st_driver_t drv, const char *type,
 		log_write (drv->st->log, LOG_ERR,
 			   "sqlite: sql insert failed: %s",
 			   sqlite3_errmsg (data->db));
-		sqlite3_finalize (stmt);
+		_st_sqlite_stmt_done (stmt);
 		return st_FAILED;
 	    }
-	    sqlite3_finalize (stmt);
+	    _st_sqlite_stmt_done (stmt);
 
 	} while (os_iter_next (os));
     }
@@ -369,14 +444,12 @@ static st_ret_t _st_sqlite_put (st_driver_t drv, const char *type,
     return st_SUCCESS;
 }
 
-static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
-				const char *owner, const char *filter,
-				os_t *os) {
+static st_ret_t _st_sqlite_get_page (st_driver_t drv, const char *type,
+				     const char *owner, const char *filter,
+				     int offset, int limit, os_t *os) {
 
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    unsigned int nbuf = 0;
-    unsigned int buflen = 0;
+    char *buf;
     int i;
     unsigned int num_rows = 0;
     os_object_t o;
@@ -384,6 +457,7 @@ static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
     os_type_t ot;
     int ival;
     char tbuf[128];
+    char tail[80];
 
     sqlite3_stmt *stmt;
     int result;
@@ -393,19 +467,20 @@ static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
 	type = tbuf;
     }
 
-    cond = _st_sqlite_convert_filter (drv, owner, filter);
-
-    SQLITE_SAFE_CAT3 (buf, nbuf, buflen,
-		      "SELECT * FROM \"", type, "\" WHERE ");
-    strcpy (&buf[nbuf], cond);
-    strcpy (&buf[strlen(buf)], " ORDER BY \"object-sequence\"");
-    free (cond);
+    if (limit > 0) {
+	snprintf (tail, sizeof (tail),
+		  " ORDER BY \"object-sequence\" LIMIT %d OFFSET %d",
+		  limit, offset);
+    } else {
+	strcpy (tail, " ORDER BY \"object-sequence\"");
+    }
 
-    log_debug (ZONE, "prepared sql: %s", buf);
+    buf = _st_sqlite_filtered_sql (drv, "SELECT * FROM", type, owner, filter,
+				   tail);
 
-    result = sqlite3_prepare (data->db, buf, strlen (buf), &stmt, NULL);
+    stmt = _st_sqlite_stmt (drv, buf);
     free (buf);
-    if (result != SQLITE_OK) {
+    if (stmt == NULL) {
 	return st_FAILED;
     }
 
@@ -472,7 +547,16 @@ static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
 
     } while (result == SQLITE_ROW);
 
-    sqlite3_finalize (stmt);
+    _st_sqlite_stmt_done (stmt);
+
+    if (result != SQLITE_DONE) {
+	log_write (drv->st->log, LOG_ERR,
+		   "sqlite: sql select failed: %s",
+		   sqlite3_errmsg (data->db));
+	os_free (*os);
+	*os = NULL;
+	return st_FAILED;
+    }
 
     if (num_rows == 0) {
         os_free(*os);
@@ -483,13 +567,18 @@ static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
     return st_SUCCESS;
 }
 
+static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
+				const char *owner, const char *filter,
+				os_t *os) {
+
+    return _st_sqlite_get_page (drv, type, owner, filter, 0, 0, os);
+}
+
 static st_ret_t _st_sqlite_count (st_driver_t drv, const char *type,
 				   const char *owner, const char *filter, int *count) {
 
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    unsigned int nbuf = 0;
-    unsigned int buflen = 0;
+    char *buf;
     char tbuf[128];
     int res, coltype;
     sqlite3_stmt *stmt;
@@ -499,19 +588,12 @@ static st_ret_t _st_sqlite_count (st_driver_t drv, const char *type,
 	type = tbuf;
     }
 
-    cond = _st_sqlite_convert_filter (drv, owner, filter);
-    log_debug (ZONE, "generated filter: %s", cond);
-
-    SQLITE_SAFE_CAT3 (buf, nbuf, buflen,
-		      "SELECT COUNT(*) FROM \"", type, "\" WHERE ");
-    strcpy (&buf[nbuf], cond);
-    free (cond);
-
-    log_debug (ZONE, "prepared sql: %s", buf);
+    buf = _st_sqlite_filtered_sql (drv, "SELECT COUNT(*) FROM", type, owner,
+				   filter, "");
 
-    res = sqlite3_prepare (data->db, buf, strlen (buf), &stmt, NULL);
+    stmt = _st_sqlite_stmt (drv, buf);
     free (buf);
-    if (res != SQLITE_OK) {
+    if (stmt == NULL) {
 	return st_FAILED;
     }
 
@@ -522,7 +604,7 @@ static st_ret_t _st_sqlite_count (st_driver_t drv, const char *type,
 	log_write (drv->st->log, LOG_ERR,
 		   "sqlite: sql select failed: %s",
 		   sqlite3_errmsg (data->db));
-	sqlite3_finalize (stmt);
+	_st_sqlite_stmt_done (stmt);
 	return st_FAILED;
     }
 
@@ -532,13 +614,13 @@ static st_ret_t _st_sqlite_count (st_driver_t drv, const char *type,
 	log_write (drv->st->log, LOG_ERR,
 		   "sqlite: weird, count() returned non integer value: %s",
 		   sqlite3_errmsg (data->db));
-	sqlite3_finalize (stmt);
+	_st_sqlite_stmt_done (stmt);
 	return st_FAILED;
     }
 
     *count = sqlite3_column_int (stmt, 0);
 
-    sqlite3_finalize (stmt);
+    _st_sqlite_stmt_done (stmt);
 
     return st_SUCCESS;
 }
@@ -547,9 +629,7 @@ static st_ret_t _st_sqlite_delete (st_driver_t drv, const char *type,
 				   const char *owner, const char *filter) {
 
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    unsigned int nbuf = 0;
-    unsigned int buflen = 0;
+    char *buf;
     char tbuf[128];
     int res;
     sqlite3_stmt *stmt;
@@ -559,19 +639,11 @@ static st_ret_t _st_sqlite_delete (st_driver_t drv, const char *type,
 	type = tbuf;
     }
 
-    cond = _st_sqlite_convert_filter (drv, owner, filter);
-    log_debug (ZONE, "generated filter: %s", cond);
-
-    SQLITE_SAFE_CAT3 (buf, nbuf, buflen,
-		      "DELETE FROM \"", type, "\" WHERE ");
-    strcpy (&buf[nbuf], cond);
-    free (cond);
+    buf = _st_sqlite_filtered_sql (drv, "DELETE FROM", type, owner, filter, "");
 
-    log_debug (ZONE, "prepared sql: %s", buf);
-
-    res = sqlite3_prepare (data->db, buf, strlen (buf), &stmt, NULL);
+    stmt = _st_sqlite_stmt (drv, buf);
     free (buf);
-    if (res != SQLITE_OK) {
+    if (stmt == NULL) {
 	return st_FAILED;
     }
 
@@ -582,10 +654,10 @@ static st_ret_t _st_sqlite_delete (st_driver_t drv, const char *type,
 	log_write (drv->st->log, LOG_ERR,
 		   "sqlite: sql delete failed: %s",
 		   sqlite3_errmsg (data->db));
-	sqlite3_finalize (stmt);
+	_st_sqlite_stmt_done (stmt);
 	return st_FAILED;
     }
-    sqlite3_finalize (stmt);
+    _st_sqlite_stmt_done (stmt);
 
     return st_SUCCESS;
 }
@@ -610,10 +682,35 @@ static st_ret_t _st_sqlite_replace (st_driver_t drv, const char *type,
     return st_SUCCESS;
 }
 
+static st_ret_t _st_sqlite_batch (st_driver_t drv, int begin) {
+
+    drvdata_t data = (drvdata_t) drv->private;
+    char *err_msg = NULL;
+
+    if (sqlite3_exec (data->db, begin ? "BEGIN" : "COMMIT", NULL, NULL,
+		      &err_msg) != SQLITE_OK) {
+	log_write (drv->st->log, LOG_ERR,
+		   "sqlite: sql transaction %s failed: %s",
+		   begin ? "begin" : "commit", err_msg);
+	sqlite3_free (err_msg);
+
+	if (!begin) {
+	    sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
+	}
+
+	return st_FAILED;
+    }
+
+    return st_SUCCESS;
+}
+
 static void _st_sqlite_free (st_driver_t drv) {
 
     drvdata_t data = (drvdata_t) drv->private;
 
+    xhash_walk (data->stmts, _st_sqlite_stmt_free, NULL);
+    xhash_free (data->stmts);
+
     sqlite3_close (data->db);
 
     free (data);
@@ -660,6 +757,7 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
     data = (drvdata_t) calloc (1, sizeof (struct drvdata_st));
 
     data->db = db;
+    data->stmts = xhash_new (101);
 
     busy_timeout = config_get_one (drv->st->config,
 				   "storage.sqlite.busy-timeout", 0);
@@ -675,8 +773,10 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
     drv->put = _st_sqlite_put;
     drv->count = _st_sqlite_count;
     drv->get = _st_sqlite_get;
+    drv->get_page = _st_sqlite_get_page;
     drv->delete = _st_sqlite_delete;
     drv->replace = _st_sqlite_replace;
+    drv->batch = _st_sqlite_batch;
     drv->free = _st_sqlite_free;
 
     return st_SUCCESS;
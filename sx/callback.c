@@ -26,7 +26,7 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
     char buf[1024];
     char *uri, *elem, *prefix;
     const char **attr;
-    int ns;
+    int ns, ncur;
     int el;
 
     if(s->fail) return;
@@ -35,6 +35,8 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
     if(s->nad == NULL)
         s->nad = nad_new();
 
+    ncur = s->nad->ncur;
+
     /* make a copy */
     strncpy(buf, name, 1024);
     buf[1023] = '\0';
@@ -65,6 +67,17 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
         ns = -1;
     }
 
+    /* top-level element, remember where it starts on the wire. the bytes
+     * only stand on their own if the element declares its namespace
+     * itself rather than inheriting it from the stream header */
+    if((s->flags & SX_RAW_PASSTHROUGH) && s->depth == 1) {
+        if(ns >= 0 && ns < ncur && prefix == NULL) {
+            s->rawstart = (long) XML_GetCurrentByteIndex(s->expat);
+            s->rawend = s->rawstart + XML_GetCurrentByteCount(s->expat);
+        } else
+            s->rawstart = -1;
+    }
+
     /* add it */
     el = nad_append_elem(s->nad, ns, elem, s->depth - 1);
 
@@ -113,6 +126,20 @@ void _sx_element_end(void *arg, const char *name) {
     s->depth--;
 
     if(s->depth == 1) {
+        /* attach the wire form, empty element tags give no byte count on the end event */
+        if((s->flags & SX_RAW_PASSTHROUGH) && s->rawstart >= s->rawoff) {
+            if(XML_GetCurrentByteCount(s->expat) > 0)
+                s->rawend = (long) XML_GetCurrentByteIndex(s->expat) + XML_GetCurrentByteCount(s->expat);
+
+            if(s->rawend <= s->rawoff + s->rawlen) {
+                s->nad->rlen = s->rawend - s->rawstart;
+                s->nad->raw = (char *) malloc(s->nad->rlen);
+                memcpy(s->nad->raw, s->rawbuf + (s->rawstart - s->rawoff), s->nad->rlen);
+            }
+        }
+        s->rawstart = -1;
+        s->rawnext = (long) XML_GetCurrentByteIndex(s->expat) + XML_GetCurrentByteCount(s->expat);
+
         /* completed nad, save it for later processing */
         jqueue_push(s->rnadq, s->nad, 0);
         s->nad = NULL;
@@ -133,8 +160,12 @@ void _sx_cdata(void *arg, const char *str, int len) {
     if(s->fail) return;
 
     /* no nad? no cdata */
-    if(s->nad == NULL)
+    if(s->nad == NULL) {
+        /* whitespace between stanzas, no need to keep it */
+        if(s->flags & SX_RAW_PASSTHROUGH)
+            s->rawnext = (long) XML_GetCurrentByteIndex(s->expat) + XML_GetCurrentByteCount(s->expat);
         return;
+    }
 
     /* go */
     nad_append_cdata(s->nad, (char *) str, len, s->depth - 1);
@@ -45,6 +45,12 @@ void sx_env_free(sx_env_t env) {
     free(env);
 }
 
+void sx_env_read_budget(sx_env_t env, int bytes) {
+    assert((int) (env != NULL));
+
+    env->rbudget = bytes > 0 ? bytes : 0;
+}
+
 sx_plugin_t sx_env_plugin(sx_env_t env, sx_plugin_init_t init, ...) {
     sx_plugin_t p;
     int ret;
@@ -27,6 +27,7 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
     char *errstring;
     int i;
     int ns, elem;
+    long keep;
 
     /* Note that buf->len can validly be 0 here, if we got data from
        the socket but the plugin didn't return anything to us (e.g. a
@@ -35,6 +36,16 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
     /* count bytes parsed */
     s->pbytes += buf->len;
 
+    /* keep the wire bytes around so completed stanzas can carry them */
+    if((s->flags & SX_RAW_PASSTHROUGH) && buf->len > 0) {
+        if(s->rawlen + buf->len > s->rawsize) {
+            s->rawsize = s->rawlen + buf->len;
+            s->rawbuf = (char *) realloc(s->rawbuf, s->rawsize);
+        }
+        memcpy(s->rawbuf + s->rawlen, buf->data, buf->len);
+        s->rawlen += buf->len;
+    }
+
     /* parse it */
     if(XML_Parse(s->expat, buf->data, buf->len, 0) == 0) {
         /* only report error we haven't already */
@@ -86,6 +97,21 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
     /* done with the buffer */
     _sx_buffer_free(buf);
 
+    /* only the unfinished top-level element (if any) is still needed */
+    if(s->flags & SX_RAW_PASSTHROUGH) {
+        if(s->rawstart >= s->rawoff && s->rawstart < s->rawoff + s->rawlen)
+            keep = s->rawstart;
+        else if(s->nad == NULL && s->rawnext >= s->rawoff && s->rawnext < s->rawoff + s->rawlen)
+            keep = s->rawnext;  /* a start tag may be split across reads */
+        else
+            keep = s->rawoff + s->rawlen;
+
+        s->rawlen -= keep - s->rawoff;
+        if(s->rawlen > 0)
+            memmove(s->rawbuf, s->rawbuf + (keep - s->rawoff), s->rawlen);
+        s->rawoff = keep;
+    }
+
     /* process completed nads */
     if(s->state >= state_STREAM)
         while((nad = jqueue_pull(s->rnadq)) != NULL) {
@@ -193,9 +219,18 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
 }
 
 /** we can read */
+/** read sizing: the first read of an event is rsize bytes, which grows while
+ *  the socket keeps filling it and shrinks back when it doesn't */
+#define SX_READ_MIN     (1024)
+#define SX_READ_MAX     (65536)
+
+/** most we'll take off the socket per read event, unless the env says otherwise */
+#define SX_READ_BUDGET  (262144)
+
 int sx_can_read(sx_t s) {
-    sx_buf_t in, out;
-    int read, ret;
+    struct _sx_buf_st view;
+    sx_buf_t in;
+    int read, ret, got, budget, room;
 
     assert((int) (s != NULL));
 
@@ -205,21 +240,69 @@ int sx_can_read(sx_t s) {
 
     _sx_debug(ZONE, "%d ready for reading", s->tag);
 
+    if(s->rsize < SX_READ_MIN)
+        s->rsize = SX_READ_MIN;
+
+    budget = (s->env != NULL && s->env->rbudget > 0) ? s->env->rbudget : SX_READ_BUDGET;
+    if(budget < s->rsize)
+        budget = s->rsize;
+
     /* new buffer */
-    in = _sx_buffer_new(NULL, 1024, NULL, NULL);
+    in = _sx_buffer_new(NULL, s->rsize, NULL, NULL);
+
+    /* get them to read stuff, growing the buffer for as long as they fill it.
+     * if the other end goes away part way through, the app kills us from the
+     * read event, but there may be stanzas in what we already have */
+    memset(&view, 0, sizeof(struct _sx_buf_st));
+    got = 0;
+    s->reading = 1;
+    while(1) {
+        view.data = in->data + got;
+        view.len = in->len - got;
+
+        read = _sx_event(s, event_READ, (void *) &view);
+        if(read <= 0 || view.len == 0)
+            break;
+
+        got += view.len;
+
+        /* socket's drained, or we've had our share */
+        if(got < in->len || in->len >= budget)
+            break;
+
+        room = in->len;
+        if(in->len + room > budget)
+            room = budget - in->len;
+
+        in->heap = (char *) realloc(in->heap, in->len + room);
+        in->data = in->heap;
+        in->len += room;
+    }
+    s->reading = 0;
 
-    /* get them to read stuff */
-    read = _sx_event(s, event_READ, (void *) in);
+    in->len = got;
 
-    /* bail if something went wrong */
-    if(read < 0) {
+    /* size the next one on what we got this time */
+    if(got >= s->rsize) {
+        while(s->rsize < got && s->rsize < SX_READ_MAX)
+            s->rsize <<= 1;
+    } else if(got < s->rsize / 4 && s->rsize > SX_READ_MIN)
+        s->rsize >>= 1;
+
+    /* bail if something went wrong. if it went wrong after we'd already read
+     * something, and the stream is still up (eg rate limited), take what we have */
+    if(read < 0 && (got == 0 || s->state >= state_CLOSED)) {
         _sx_buffer_free(in);
         s->want_read = 0;
         s->want_write = 0;
+        if(s->killed) {
+            s->killed = 0;
+            sx_kill(s);
+        }
         return 0;
     }
 
-    if(read == 0) {
+    if(got == 0) {
         /* nothing to read
          * should never happen because we did get a read event,
          * thus there is something to read, or error handled
@@ -233,11 +316,12 @@ int sx_can_read(sx_t s) {
         /* count bytes read */
         s->rbytes += in->len;
 
-        /* make a copy for processing */
-        out = _sx_buffer_new(in->data, in->len, in->notify, in->notify_arg);
+        /* stop reading until they let us again */
+        if(read < 0)
+            s->want_read = 0;
 
-        /* run it by the plugins */
-        ret = _sx_chain_io_read(s, out);
+        /* run it by the plugins, they work on the buffer in place */
+        ret = _sx_chain_io_read(s, in);
 
         /* check if the stanza size limit is exceeded (it wasn't reset by parser) */
         if(s->rbytesmax && s->rbytes > s->rbytesmax) {
@@ -254,19 +338,31 @@ int sx_can_read(sx_t s) {
             }
 
             _sx_buffer_free(in);
-            _sx_buffer_free(out);
+
+            if(s->killed) {
+                s->killed = 0;
+                if(s->state < state_CLOSED)
+                    sx_kill(s);
+                return 0;
+            }
 
             /* done */
             if(s->want_write) _sx_event(s, event_WANT_WRITE, NULL);
             return s->want_read;
         }
 
-        _sx_buffer_free(in);
-
-        _sx_debug(ZONE, "decoded read data (%d bytes): %.*s", out->len, out->len, out->data);
+        _sx_debug(ZONE, "decoded read data (%d bytes): %.*s", in->len, in->len, in->data);
 
         /* into the parser with you */
-        _sx_process_read(s, out);
+        _sx_process_read(s, in);
+    }
+
+    /* now they can have the close */
+    if(s->killed) {
+        s->killed = 0;
+        if(s->state < state_CLOSED)
+            sx_kill(s);
+        return 0;
     }
 
     /* if we've written everything, and we're closed, then inform the app it can kill us */
@@ -283,6 +379,59 @@ int sx_can_read(sx_t s) {
     return s->want_read;
 }
 
+/** most we'll put together for one write */
+#define SX_WRITE_BATCH (65536)
+
+/** pull whatever else is waiting onto the end of buf, so it takes one trip
+ *  through the plugins and one write. a buffer with a notify ends the batch,
+ *  since the notify may change the plugins (eg starttls) */
+static void _sx_gather_write(sx_t s, sx_buf_t buf) {
+    _jqueue_node_t scan;
+    sx_buf_t next;
+    int len, n = 0;
+    char *heap;
+
+    /* websocket frames each buffer on its own */
+    if(buf->notify != NULL || (s->flags & SX_WEBSOCKET_WRAPPER))
+        return;
+
+    /* see how much will fit */
+    len = buf->len;
+    for(scan = s->wbufq->front; scan != NULL; scan = scan->prev) {
+        next = (sx_buf_t) scan->data;
+        if(len + next->len > SX_WRITE_BATCH)
+            break;
+
+        len += next->len;
+        n++;
+
+        if(next->notify != NULL)
+            break;
+    }
+
+    if(n == 0)
+        return;
+
+    heap = (char *) malloc(sizeof(char) * len);
+    if(buf->len > 0)
+        memcpy(heap, buf->data, buf->len);
+    len = buf->len;
+
+    while(n-- > 0) {
+        next = (sx_buf_t) jqueue_pull(s->wbufq);
+        if(next->len > 0)
+            memcpy(heap + len, next->data, next->len);
+        len += next->len;
+
+        buf->notify = next->notify;
+        buf->notify_arg = next->notify_arg;
+
+        _sx_buffer_free(next);
+    }
+
+    _sx_buffer_set(buf, heap, len, heap);
+}
+
 /** we can write */
 static int _sx_get_pending_write(sx_t s) {
     sx_buf_t in, out;
@@ -303,6 +452,8 @@ static int _sx_get_pending_write(sx_t s) {
         in = _sx_buffer_new(NULL, 0, NULL, NULL);
     }
 
+    _sx_gather_write(s, in);
+
     /* if there's more to write, we want to make sure we get it */
     s->want_write = jqueue_size(s->wbufq);
 
@@ -417,6 +568,7 @@ int sx_can_write(sx_t s) {
 int _sx_nad_write(sx_t s, nad_t nad, int elem) {
     const char *out;
     int len;
+    sx_buf_t buf;
 
     /* silently drop it if we're closing or closed */
     if(s->state >= state_CLOSING) {
@@ -429,6 +581,22 @@ int _sx_nad_write(sx_t s, nad_t nad, int elem) {
     if(_sx_chain_nad_write(s, nad, elem) == 0)
         return 1;
 
+    /* unmodified stanza from a passthrough stream, hand over the bytes we received */
+    if((s->flags & SX_RAW_PASSTHROUGH) && elem == 0 && nad->raw != NULL) {
+        buf = _sx_buffer_new(NULL, 0, NULL, NULL);
+        _sx_buffer_set(buf, nad->raw, nad->rlen, nad->raw);
+        nad->raw = NULL;
+
+        _sx_debug(ZONE, "queueing raw for write: %.*s", buf->len, buf->data);
+
+        jqueue_push(s->wbufq, buf, 0);
+        nad_free(nad);
+
+        s->want_write = 1;
+
+        return 0;
+    }
+
     /* serialise it */
     nad_print(nad, elem, &out, &len);
 
@@ -527,6 +695,12 @@ void sx_close(sx_t s) {
 void sx_kill(sx_t s) {
     assert((int) (s != NULL));
 
+    /* not while sx_can_read is still collecting, it'll do it after */
+    if(s->reading) {
+        s->killed = 1;
+        return;
+    }
+
     _sx_state(s, state_CLOSED);
     _sx_event(s, event_CLOSED, NULL);
 }
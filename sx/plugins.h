@@ -33,6 +33,8 @@
 
 #define SX_WEBSOCKET_WRAPPER    (1<<6)    /** indicates stream over WebSocket connection */
 
+#define SX_RAW_PASSTHROUGH      (1<<7)    /** keep the wire form of received stanzas and write it out again unless modified */
+
 /** magic numbers, so plugins can find each other */
 #define SX_SSL_MAGIC        (0x01)
 
@@ -71,6 +73,29 @@ JABBERD2_API int                         sx_ssl_server_addcert(sx_plugin_t p, co
 /** trigger for client starttls */
 JABBERD2_API int                         sx_ssl_client_starttls(sx_plugin_t p, sx_t s, const char *pemfile, const char *private_key_password);
 
+/** session cache settings for every context, now and later: cache size (0 for no
+ *  server cache), session timeout in seconds (0 for the openssl default), and how
+ *  often ticket keys are replaced in seconds (0 leaves tickets to openssl) */
+JABBERD2_API void                        sx_ssl_session_cache(sx_plugin_t p, int size, int timeout, int ticket_rotate);
+
+/** replace the ticket key if it's due, call this from time to time (returns 1 if it was) */
+JABBERD2_API int                         sx_ssl_ticket_rotate(sx_plugin_t p, time_t now);
+
+/** handshake and resumption counters, since startup */
+typedef struct sx_ssl_stats_st {
+    long        accepts;        /* server handshakes done */
+    long        hits;           /* .. of which were resumed */
+    long        misses;         /* sessions asked for that we didn't have */
+    long        timeouts;       /* .. or had, but expired */
+    long        connects;       /* client handshakes done */
+    long        resumed;        /* .. of which were resumed */
+} *sx_ssl_stats_t;
+
+JABBERD2_API void                        sx_ssl_stats(sx_plugin_t p, sx_ssl_stats_t st);
+
+/** the counters as a line for the log, if there's been a handshake since it was last asked (returns 0 if not) */
+JABBERD2_API int                         sx_ssl_stats_report(sx_plugin_t p, char *buf, int len);
+
 /* previous states */
 #define SX_SSL_STATE_NONE       (0)
 #define SX_SSL_STATE_WANT_READ  (1)
@@ -117,10 +142,14 @@ typedef int                 (*sx_sasl_callback_t)(int cb, void *arg, void **res,
 /* error codes */
 #define sx_sasl_ret_OK		    (0)
 #define sx_sasl_ret_FAIL	    (1)
+#define sx_sasl_ret_PENDING	    (2)     /* CHECK_PASS only, answer with sx_sasl_resume() */
 
 /** trigger for client auth */
 JABBERD2_API int                         sx_sasl_auth(sx_plugin_t p, sx_t s, const char *appname, const char *mech, const char *user, const char *pass);
 
+/** run a handshake step again, once the app has the answer to a pending callback */
+JABBERD2_API void                        sx_sasl_resume(sx_plugin_t p, sx_t s);
+
 /* for passing auth data to callback */
 typedef struct sx_sasl_creds_st {
     const char                  *authnid;
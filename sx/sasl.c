@@ -41,6 +41,11 @@ typedef struct _sx_sasl_st {
 typedef struct _sx_sasl_sess_st {
     sx_t            s;
     _sx_sasl_t      ctx;
+
+    /** the app is still working on a callback, this step is run again when it's done */
+    int             pending;
+    char            *held;
+    size_t          heldlen;
 } *_sx_sasl_sess_t;
 
 /** utility: generate a success nad */
@@ -310,6 +315,8 @@ static void _sx_sasl_notify_success(sx_t s, void *arg) {
     sx_server_init(s, s->flags);
 }
 
+static void _sx_sasl_client_step(sx_t s, sx_plugin_t p, Gsasl_session *sd, char *buf, size_t buflen);
+
 /** process handshake packets from the client */
 static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, const char *mech, const char *in, int inlen) {
     _sx_sasl_t ctx = (_sx_sasl_t) p->private;
@@ -320,7 +327,7 @@ static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
 #ifdef HAVE_SSL
     int i;
 #endif
-    size_t buflen, outlen;
+    size_t buflen;
 
     assert(ctx);
     assert(ctx->cb);
@@ -412,15 +419,6 @@ static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
                 return;
             }
         }
-
-        ret = gsasl_step(sd, buf, buflen, &out, &outlen);
-        if(ret != GSASL_OK && ret != GSASL_NEEDS_MORE) {
-            _sx_debug(ZONE, "gsasl_step failed, no sasl for this conn; (%d): %s", ret, gsasl_strerror(ret));
-            _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_MALFORMED_REQUEST), 0);
-            if(out != NULL) free(out);
-            if(buf != NULL) free(buf);
-            return;
-        }
     }
 
     else {
@@ -439,7 +437,27 @@ static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
             return;
         }
         _sx_debug(ZONE, "response from client (decoded: %.*s)", buflen, buf);
-        ret = gsasl_step(sd, buf, buflen, &out, &outlen);
+    }
+
+    _sx_sasl_client_step(s, p, sd, buf, buflen);
+}
+
+/** run a handshake step, and reply to the client. takes buf */
+static void _sx_sasl_client_step(sx_t s, sx_plugin_t p, Gsasl_session *sd, char *buf, size_t buflen) {
+    _sx_sasl_sess_t sctx = gsasl_session_hook_get(sd);
+    char *out = NULL;
+    size_t outlen;
+    int ret;
+
+    ret = gsasl_step(sd, buf, buflen, &out, &outlen);
+
+    /* the app will tell us when it has an answer */
+    if(sctx != NULL && sctx->pending) {
+        _sx_debug(ZONE, "sasl step waiting for the app");
+        sctx->held = buf;
+        sctx->heldlen = buflen;
+        if(out != NULL) free(out);
+        return;
     }
 
     if(buf != NULL) free(buf);
@@ -547,6 +565,7 @@ static void _sx_sasl_server_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
 /** main nad processor */
 static int _sx_sasl_process(sx_t s, sx_plugin_t p, nad_t nad) {
     Gsasl_session *sd = (Gsasl_session *) s->plugin_data[p->index];
+    _sx_sasl_sess_t sctx;
     int attr;
     char mech[128];
     sx_error_t sxe;
@@ -566,6 +585,12 @@ static int _sx_sasl_process(sx_t s, sx_plugin_t p, nad_t nad) {
 
     /* packets from the client */
     if(s->type == type_SERVER) {
+        if(sd != NULL && (sctx = gsasl_session_hook_get(sd)) != NULL && sctx->pending) {
+            _sx_debug(ZONE, "still working on the last step, ignoring");
+            nad_free(nad);
+            return 0;
+        }
+
         if(!(s->flags & SX_SASL_OFFER)) {
             _sx_debug(ZONE, "they tried to do sasl, but we never offered it, ignoring");
             nad_free(nad);
@@ -703,6 +728,7 @@ static void _sx_sasl_free(sx_t s, sx_plugin_t p) {
     /* we need to clean up our per session context but keep sasl ctx */
     sctx = gsasl_session_hook_get(sd);
     if (sctx != NULL){
+        if(sctx->held != NULL) free(sctx->held);
         free(sctx);
         gsasl_session_hook_set(sd, (void *) NULL);
     }
@@ -768,10 +794,15 @@ static int _sx_sasl_gsasl_callback(Gsasl *gsasl_ctx, Gsasl_session *sd, Gsasl_pr
             if(!creds.authnid) return GSASL_NO_AUTHID;
             if(!creds.realm) return GSASL_NO_AUTHZID;
             if(!creds.pass) return GSASL_NO_PASSWORD;
-            if((ctx->cb)(sx_sasl_cb_CHECK_PASS, &creds, NULL, sctx->s, ctx->cbarg) == sx_sasl_ret_OK)
-                return GSASL_OK;
-            else
-                return GSASL_AUTHENTICATION_ERROR;
+            switch((ctx->cb)(sx_sasl_cb_CHECK_PASS, &creds, NULL, sctx->s, ctx->cbarg)) {
+                case sx_sasl_ret_OK:
+                    return GSASL_OK;
+                case sx_sasl_ret_PENDING:
+                    sctx->pending = 1;
+                    return GSASL_AUTHENTICATION_ERROR;
+                default:
+                    return GSASL_AUTHENTICATION_ERROR;
+            }
 
         case GSASL_VALIDATE_GSSAPI:
             /* GSASL_AUTHZID, GSASL_GSSAPI_DISPLAY_NAME */
@@ -842,6 +873,26 @@ static int _sx_sasl_gsasl_callback(Gsasl *gsasl_ctx, Gsasl_session *sd, Gsasl_pr
     return GSASL_NO_CALLBACK;
 }
 
+/** the app has an answer for a pending callback, run the step again */
+void sx_sasl_resume(sx_plugin_t p, sx_t s) {
+    Gsasl_session *sd = (Gsasl_session *) s->plugin_data[p->index];
+    _sx_sasl_sess_t sctx;
+    char *buf;
+
+    if(sd == NULL || (sctx = gsasl_session_hook_get(sd)) == NULL || !sctx->pending)
+        return;
+
+    _sx_debug(ZONE, "resuming sasl step");
+
+    buf = sctx->held;
+    sctx->held = NULL;
+    sctx->pending = 0;
+
+    _sx_sasl_client_step(s, p, sd, buf, sctx->heldlen);
+
+    if(s->want_write) _sx_event(s, event_WANT_WRITE, NULL);
+}
+
 static void _sx_sasl_unload(sx_plugin_t p) {
     _sx_sasl_t ctx = (_sx_sasl_t) p->private;
     int i;
@@ -27,6 +27,49 @@
 #include <openssl/x509_vfy.h>
 #include <openssl/dh.h>
 #include <openssl/bn.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#endif
+
+/** a session ticket key */
+typedef struct _sx_ssl_tkey_st {
+    unsigned char   name[16];
+    unsigned char   hmac[32];
+    unsigned char   aes[32];
+    time_t          born;
+} *_sx_ssl_tkey_t;
+
+/** a session we can offer when we next connect to this domain from the same one */
+typedef struct _sx_ssl_csess_st {
+    char            *key;
+    SSL_SESSION     *sess;
+} *_sx_ssl_csess_t;
+
+/** plugin state */
+typedef struct _sx_ssl_st {
+    /* SSL_CTX by name, "*" is the default */
+    xht             contexts;
+
+    /* server session cache */
+    int             cache_size, cache_timeout;
+
+    /* ticket keys. tkey is the one we issue with, the one before it is still
+     * accepted. rotation writes the slot after, which nobody reads any more,
+     * before moving tkey on, so handshakes on other threads are safe */
+    int             ticket_rotate;
+    struct _sx_ssl_tkey_st keys[3];
+    int             tkey;
+
+    /* client sessions, by local and remote domain */
+    xht             sessions;
+
+    /* client handshakes, and how many were resumed */
+    long            connects, resumed;
+
+    /* handshakes there were when the stats were last reported */
+    long            reported;
+} *_sx_ssl_t;
 
 
 /* code stolen from SSL_CTX_set_verify(3) */
@@ -441,7 +484,15 @@ static int _sx_ssl_handshake(sx_t s, _sx_ssl_conn_t sc) {
 
             s->ssf = SSL_get_cipher_bits(sc->ssl, NULL);
 
-            _sx_debug(ZONE, "using cipher %s (%d bits)", SSL_get_cipher_name(sc->ssl), s->ssf);
+            if(s->type == type_CLIENT) {
+                _sx_ssl_t st = (_sx_ssl_t) SSL_CTX_get_app_data(SSL_get_SSL_CTX(sc->ssl));
+
+                st->connects++;
+                if(SSL_session_reused(sc->ssl))
+                    st->resumed++;
+            }
+
+            _sx_debug(ZONE, "using cipher %s (%d bits)%s", SSL_get_cipher_name(sc->ssl), s->ssf, SSL_session_reused(sc->ssl) ? ", resumed" : "");
             _sx_ssl_get_external_id(s, sc);
 
             return 1;
@@ -524,6 +575,7 @@ static int _sx_ssl_wio(sx_t s, sx_plugin_t p, sx_buf_t buf) {
 
             /* requeue the buffer */
             jqueue_push(sc->wq, wbuf, (sc->wq->front != NULL) ? sc->wq->front->priority + 1 : 0);
+            wbuf = NULL;
 
             /* error checking */
             err = SSL_get_error(sc->ssl, ret);
@@ -589,7 +641,7 @@ static int _sx_ssl_wio(sx_t s, sx_plugin_t p, sx_buf_t buf) {
 
 static int _sx_ssl_rio(sx_t s, sx_plugin_t p, sx_buf_t buf) {
     _sx_ssl_conn_t sc = (_sx_ssl_conn_t) s->plugin_data[p->index];
-    int est, ret, err, pending;
+    int est, ret, err, pending, room = 0;
     char *errstring;
     sx_error_t sxe;
 
@@ -605,7 +657,12 @@ static int _sx_ssl_rio(sx_t s, sx_plugin_t p, sx_buf_t buf) {
 
         BIO_write(sc->rbio, buf->data, buf->len);
 
-        _sx_buffer_clear(buf);
+        /* the plaintext goes back into the same storage where it fits */
+        if(buf->heap != NULL && buf->data == buf->heap) {
+            room = buf->len;
+            buf->len = 0;
+        } else
+            _sx_buffer_clear(buf);
     }
 
     /* handshake */
@@ -622,7 +679,10 @@ static int _sx_ssl_rio(sx_t s, sx_plugin_t p, sx_buf_t buf) {
 
         /* get it all */
         while((pending = SSL_pending(sc->ssl)) > 0 || (pending = BIO_pending(sc->rbio)) > 0) {
-            _sx_buffer_alloc_margin(buf, 0, pending);
+            if(buf->len + pending > room) {
+                _sx_buffer_alloc_margin(buf, 0, pending);
+                room = buf->len + pending;
+            }
 
             ret = SSL_read(sc->ssl, &(buf->data[buf->len]), pending);
 
@@ -713,12 +773,142 @@ static int _sx_ssl_rio(sx_t s, sx_plugin_t p, sx_buf_t buf) {
     return 1;
 }
 
+/** fill in a ticket key slot */
+static int _sx_ssl_tkey_new(_sx_ssl_tkey_t key, time_t now) {
+    if(RAND_bytes(key->name, sizeof(key->name)) <= 0 ||
+       RAND_bytes(key->hmac, sizeof(key->hmac)) <= 0 ||
+       RAND_bytes(key->aes, sizeof(key->aes)) <= 0)
+        return 1;
+
+    key->born = now;
+
+    return 0;
+}
+
+/** issue tickets with the current key, take them with the current or previous one */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int _sx_ssl_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc) {
+    OSSL_PARAM params[3];
+#else
+static int _sx_ssl_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc) {
+#endif
+    _sx_ssl_t st = (_sx_ssl_t) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    _sx_ssl_tkey_t key;
+    int cur = st->tkey;
+
+    key = &st->keys[cur];
+
+    if(enc) {
+        if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+            return -1;
+
+        memcpy(name, key->name, sizeof(key->name));
+
+        if(EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes, iv) != 1)
+            return -1;
+    }
+
+    else {
+        if(memcmp(name, key->name, sizeof(key->name)) != 0) {
+            key = &st->keys[(cur + 2) % 3];
+            if(key->born == 0 || memcmp(name, key->name, sizeof(key->name)) != 0)
+                return 0;   /* don't know it, full handshake */
+        }
+
+        if(EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes, iv) != 1)
+            return -1;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac, sizeof(key->hmac));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if(EVP_MAC_CTX_set_params(hctx, params) != 1)
+        return -1;
+#else
+    if(HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), NULL) != 1)
+        return -1;
+#endif
+
+    /* always hand out a new one, tls 1.3 clients only use a ticket once */
+    return enc ? 1 : 2;
+}
+
+/** client sessions are kept per pair of domains. a session made for one of
+ *  our domains carries its certificate and identity, it's no good to another */
+static void _sx_ssl_csess_key(sx_t s, char *key, int keylen) {
+    snprintf(key, keylen, "%s/%s", s->req_from != NULL ? s->req_from : "", s->req_to);
+}
+
+/** hang on to client sessions so the next connection between the same domains can resume */
+static int _sx_ssl_new_session(SSL *ssl, SSL_SESSION *sess) {
+    sx_t s = (sx_t) SSL_get_app_data(ssl);
+    _sx_ssl_t st;
+    _sx_ssl_csess_t cs;
+    char key[1024];
+
+    if(SSL_is_server(ssl) || s == NULL || s->req_to == NULL)
+        return 0;
+
+    st = (_sx_ssl_t) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    _sx_ssl_csess_key(s, key, sizeof(key));
+
+    cs = (_sx_ssl_csess_t) xhash_get(st->sessions, key);
+    if(cs == NULL) {
+        cs = (_sx_ssl_csess_t) calloc(1, sizeof(struct _sx_ssl_csess_st));
+        cs->key = strdup(key);
+        xhash_put(st->sessions, cs->key, (void *) cs);
+    } else
+        SSL_SESSION_free(cs->sess);
+
+    _sx_debug(ZONE, "keeping session for the next connection %s", key);
+
+    /* we have the reference now */
+    cs->sess = sess;
+
+    return 1;
+}
+
+/** apply the session cache settings to a context */
+static void _sx_ssl_ctx_cache(_sx_ssl_t st, SSL_CTX *ctx, const char *name, int namelen) {
+    unsigned char sid[SSL_MAX_SID_CTX_LENGTH];
+    unsigned int sidlen = 0;
+
+    SSL_CTX_set_app_data(ctx, (void *) st);
+
+    /* sessions only resume against the context (name) they were made in */
+    EVP_Digest(name, namelen, sid, &sidlen, EVP_sha256(), NULL);
+    SSL_CTX_set_session_id_context(ctx, sid, sidlen);
+
+    if(st->cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_BOTH);
+        SSL_CTX_sess_set_cache_size(ctx, st->cache_size);
+    } else
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+    if(st->cache_timeout > 0)
+        SSL_CTX_set_timeout(ctx, st->cache_timeout);
+
+    SSL_CTX_sess_set_new_cb(ctx, _sx_ssl_new_session);
+
+    if(st->ticket_rotate > 0)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, _sx_ssl_ticket_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, _sx_ssl_ticket_cb);
+#endif
+}
+
 static void _sx_ssl_client(sx_t s, sx_plugin_t p) {
+    _sx_ssl_t st = (_sx_ssl_t) p->private;
     _sx_ssl_conn_t sc;
+    _sx_ssl_csess_t cs;
     SSL_CTX *ctx;
     char *pemfile = NULL;
     int ret, i;
     char *pemfile_password = NULL;
+    char key[1024];
 
     /* only bothering if they asked for wrappermode */
     if(!(s->flags & SX_SSL_WRAPPER) || s->ssf > 0)
@@ -727,10 +917,10 @@ static void _sx_ssl_client(sx_t s, sx_plugin_t p) {
     _sx_debug(ZONE, "preparing for ssl connect for %d from %s", s->tag, s->req_from);
 
     /* find the ssl context for this source */
-    ctx = xhash_get((xht) p->private, s->req_from);
+    ctx = xhash_get(st->contexts, s->req_from);
     if(ctx == NULL) {
         _sx_debug(ZONE, "using default ssl context for %d", s->tag);
-        ctx = xhash_get((xht) p->private, "*");
+        ctx = xhash_get(st->contexts, "*");
     } else {
         _sx_debug(ZONE, "using configured ssl context for %d", s->tag);
     }
@@ -746,7 +936,7 @@ static void _sx_ssl_client(sx_t s, sx_plugin_t p) {
     sc->ssl = SSL_new(ctx);
     SSL_set_bio(sc->ssl, sc->rbio, sc->wbio);
     SSL_set_connect_state(sc->ssl);
-    SSL_set_options(sc->ssl, SSL_OP_NO_TICKET);
+    SSL_set_app_data(sc->ssl, s);
 #if OPENSSL_VERSION_NUMBER < 0x10100005L
 #ifdef ENABLE_EXPERIMENTAL
     SSL_set_ssl_method(sc->ssl, TLSv1_2_client_method());
@@ -757,6 +947,15 @@ static void _sx_ssl_client(sx_t s, sx_plugin_t p) {
     SSL_set_ssl_method(sc->ssl, TLS_client_method());
 #endif
 
+    /* offer the session we had last time, if we still have it */
+    if(s->req_to != NULL) {
+        _sx_ssl_csess_key(s, key, sizeof(key));
+        if((cs = (_sx_ssl_csess_t) xhash_get(st->sessions, key)) != NULL) {
+            _sx_debug(ZONE, "offering session from the last connection %s", key);
+            SSL_set_session(sc->ssl, cs->sess);
+        }
+    }
+
     /* empty external_id */
     for (i = 0; i < SX_CONN_EXTERNAL_ID_MAX_COUNT; i++)
         sc->external_id[i] = NULL;
@@ -833,10 +1032,10 @@ static void _sx_ssl_server(sx_t s, sx_plugin_t p) {
     _sx_debug(ZONE, "preparing for ssl accept for %d to %s", s->tag, s->req_to);
 
     /* find the ssl context for this destination */
-    ctx = xhash_get((xht) p->private, s->req_to);
+    ctx = xhash_get(((_sx_ssl_t) p->private)->contexts, s->req_to);
     if(ctx == NULL) {
         _sx_debug(ZONE, "using default ssl context for %d", s->tag);
-        ctx = xhash_get((xht) p->private, "*");
+        ctx = xhash_get(((_sx_ssl_t) p->private)->contexts, "*");
     } else {
         _sx_debug(ZONE, "using configured ssl context for %d", s->tag);
     }
@@ -893,6 +1092,11 @@ static void _sx_ssl_free(sx_t s, sx_plugin_t p) {
 
     if(sc->private_key_password != NULL) free(sc->private_key_password);
 
+    /* openssl drops the session of a connection that goes away without a
+     * close notify, which is most of them. only errors make it bad for us */
+    if(sc->ssl != NULL && sc->last_state != SX_SSL_STATE_ERROR)
+        SSL_set_shutdown(sc->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+
     if(sc->ssl != NULL) SSL_free(sc->ssl);      /* frees wbio and rbio too */
 
     if(sc->wq != NULL) {
@@ -908,16 +1112,30 @@ static void _sx_ssl_free(sx_t s, sx_plugin_t p) {
 }
 
 static void _sx_ssl_unload(sx_plugin_t p) {
-    xht contexts = (xht) p->private;
+    _sx_ssl_t st = (_sx_ssl_t) p->private;
+    _sx_ssl_csess_t cs;
     void *ctx;
 
-    if(xhash_iter_first(contexts))
+    if(xhash_iter_first(st->sessions))
         do {
-            xhash_iter_get(contexts, NULL, NULL, &ctx);
+            xhash_iter_get(st->sessions, NULL, NULL, (void *) &cs);
+            SSL_SESSION_free(cs->sess);
+            free(cs->key);
+            free(cs);
+        } while(xhash_iter_next(st->sessions));
+
+    xhash_free(st->sessions);
+
+    if(xhash_iter_first(st->contexts))
+        do {
+            xhash_iter_get(st->contexts, NULL, NULL, &ctx);
             SSL_CTX_free((SSL_CTX *) ctx);
-        } while(xhash_iter_next(contexts));
+        } while(xhash_iter_next(st->contexts));
+
+    xhash_free(st->contexts);
 
-    xhash_free(contexts);
+    OPENSSL_cleanse(st->keys, sizeof(st->keys));
+    free(st);
 
     sx_ssl_free_dh_params();
 }
@@ -975,7 +1193,7 @@ int sx_ssl_init(sx_env_t env, sx_plugin_t p, va_list args) {
 
 /** args: name, pemfile, cachain, mode */
 int sx_ssl_server_addcert(sx_plugin_t p, const char *name, const char *pemfile, const char *cachain, int mode, const char *password, const char *ciphers) {
-    xht contexts = (xht) p->private;
+    _sx_ssl_t st = (_sx_ssl_t) p->private;
     SSL_CTX *ctx;
     SSL_CTX *tmp;
     STACK_OF(X509_NAME) *cert_names;
@@ -1116,9 +1334,12 @@ int sx_ssl_server_addcert(sx_plugin_t p, const char *name, const char *pemfile,
     EC_KEY_free(eckey);
 
     /* create hash and create default context */
-    if(contexts == NULL) {
-        contexts = xhash_new(1021);
-        p->private = (void *) contexts;
+    if(st == NULL) {
+        st = (_sx_ssl_t) calloc(1, sizeof(struct _sx_ssl_st));
+        st->contexts = xhash_new(1021);
+        st->sessions = xhash_new(101);
+        st->cache_size = SSL_SESSION_CACHE_MAX_SIZE_DEFAULT;
+        p->private = (void *) st;
 
         /* this is the first context, if it's not the default then make a copy of it as the default */
         if(!(name[0] == '*' && name[1] == 0)) {
@@ -1126,21 +1347,26 @@ int sx_ssl_server_addcert(sx_plugin_t p, const char *name, const char *pemfile,
 
             if(ret) {
                 /* uh-oh */
-                xhash_free(contexts);
+                xhash_free(st->contexts);
+                xhash_free(st->sessions);
+                free(st);
                 p->private = NULL;
+                SSL_CTX_free(ctx);
                 return 1;
             }
         }
     }
 
+    _sx_ssl_ctx_cache(st, ctx, name, strlen(name));
+
     _sx_debug(ZONE, "ssl context '%s' initialised; certificate and key loaded from %s", name, pemfile);
 
     /* remove an existing context with the same name before replacing it */
-    tmp = xhash_get(contexts, name);
+    tmp = xhash_get(st->contexts, name);
     if(tmp != NULL)
         SSL_CTX_free((SSL_CTX *) tmp);
 
-    xhash_put(contexts, name, ctx);
+    xhash_put(st->contexts, name, ctx);
 
     return 0;
 }
@@ -1180,3 +1406,89 @@ int sx_ssl_client_starttls(sx_plugin_t p, sx_t s, const char *pemfile, const cha
 
     return 0;
 }
+
+void sx_ssl_session_cache(sx_plugin_t p, int size, int timeout, int ticket_rotate) {
+    _sx_ssl_t st = (_sx_ssl_t) p->private;
+    const char *name;
+    int namelen;
+    void *ctx;
+
+    assert((int) (st != NULL));
+
+    st->cache_size = size > 0 ? size : 0;
+    st->cache_timeout = timeout > 0 ? timeout : 0;
+
+    /* first key, before any context can ask for it */
+    if(ticket_rotate > 0 && st->keys[st->tkey].born == 0 && _sx_ssl_tkey_new(&st->keys[st->tkey], time(NULL)) != 0) {
+        _sx_debug(ZONE, "couldn't make a ticket key, leaving tickets to openssl");
+        ticket_rotate = 0;
+    }
+    st->ticket_rotate = ticket_rotate > 0 ? ticket_rotate : 0;
+
+    if(xhash_iter_first(st->contexts))
+        do {
+            xhash_iter_get(st->contexts, &name, &namelen, &ctx);
+            _sx_ssl_ctx_cache(st, (SSL_CTX *) ctx, name, namelen);
+        } while(xhash_iter_next(st->contexts));
+}
+
+int sx_ssl_ticket_rotate(sx_plugin_t p, time_t now) {
+    _sx_ssl_t st = (_sx_ssl_t) p->private;
+    int next;
+
+    if(st == NULL || st->ticket_rotate <= 0 || now - st->keys[st->tkey].born < st->ticket_rotate)
+        return 0;
+
+    /* the slot after the previous key, nobody's using it */
+    next = (st->tkey + 1) % 3;
+    if(_sx_ssl_tkey_new(&st->keys[next], now) != 0) {
+        _sx_debug(ZONE, "couldn't make a new ticket key, keeping the old one");
+        return 0;
+    }
+
+    st->tkey = next;
+
+    _sx_debug(ZONE, "ticket key rotated");
+
+    return 1;
+}
+
+void sx_ssl_stats(sx_plugin_t p, sx_ssl_stats_t stats) {
+    _sx_ssl_t st = (_sx_ssl_t) p->private;
+    void *ctx;
+
+    memset(stats, 0, sizeof(struct sx_ssl_stats_st));
+
+    if(st == NULL)
+        return;
+
+    if(xhash_iter_first(st->contexts))
+        do {
+            xhash_iter_get(st->contexts, NULL, NULL, &ctx);
+            stats->accepts += SSL_CTX_sess_accept_good((SSL_CTX *) ctx);
+            stats->hits += SSL_CTX_sess_hits((SSL_CTX *) ctx);
+            stats->misses += SSL_CTX_sess_misses((SSL_CTX *) ctx);
+            stats->timeouts += SSL_CTX_sess_timeouts((SSL_CTX *) ctx);
+        } while(xhash_iter_next(st->contexts));
+
+    stats->connects = st->connects;
+    stats->resumed = st->resumed;
+}
+
+int sx_ssl_stats_report(sx_plugin_t p, char *buf, int len) {
+    _sx_ssl_t st = (_sx_ssl_t) p->private;
+    struct sx_ssl_stats_st stats;
+
+    if(st == NULL)
+        return 0;
+
+    sx_ssl_stats(p, &stats);
+    if(stats.accepts + stats.connects == st->reported)
+        return 0;
+    st->reported = stats.accepts + stats.connects;
+
+    snprintf(buf, len, "tls sessions: %ld accepted, %ld resumed (%ld%%), %ld unknown, %ld expired; %ld connected, %ld resumed",
+        stats.accepts, stats.hits, (stats.accepts > 0) ? stats.hits * 100 / stats.accepts : 0, stats.misses, stats.timeouts, stats.connects, stats.resumed);
+
+    return 1;
+}
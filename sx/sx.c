@@ -54,6 +54,8 @@ sx_t sx_new(sx_env_t env, int tag, sx_callback_t cb, void *arg) {
     s->wbufq = jqueue_new();
     s->rnadq = jqueue_new();
 
+    s->rawstart = -1;
+
     if(env != NULL) {
         s->plugin_data = (void **) calloc(1, sizeof(void *) * env->nplugins);
 
@@ -108,6 +110,8 @@ void sx_free(sx_t s) {
 
     if(s->nad != NULL) nad_free(s->nad);
 
+    if(s->rawbuf != NULL) free(s->rawbuf);
+
     if(s->auth_method != NULL) free((void*)s->auth_method);
     if(s->auth_id != NULL) free((void*)s->auth_id);
 
@@ -178,6 +182,7 @@ void _sx_reset(sx_t s) {
     temp.wnad = s->wnad;
     temp.rnad = s->rnad;
     temp.rbytesmax = s->rbytesmax;
+    temp.rsize = s->rsize;
     temp.plugin_data = s->plugin_data;
 
     s->reentry = 0;
@@ -206,6 +211,7 @@ void _sx_reset(sx_t s) {
     s->wnad = temp.wnad;
     s->rnad = temp.rnad;
     s->rbytesmax = temp.rbytesmax;
+    s->rsize = temp.rsize;
     s->plugin_data = temp.plugin_data;
 
     s->has_reset = 1;
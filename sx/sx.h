@@ -179,6 +179,9 @@ JABBERD2_API void                        sx_env_free(sx_env_t env);
 /** load a plugin into the environment */
 JABBERD2_API sx_plugin_t                 sx_env_plugin(sx_env_t env, sx_plugin_init_t init, ...);
 
+/** set the most bytes read from a stream's socket per read event (0 for the default) */
+JABBERD2_API void                        sx_env_read_budget(sx_env_t env, int bytes);
+
 /* send errors and close stuff */
 JABBERD2_API void                        sx_error(sx_t s, int err, const char *text);
 JABBERD2_API void                        sx_error_extended(sx_t s, int err, const char *content);
@@ -315,6 +318,12 @@ struct _sx_st {
     /* read bytes maximum */
     int                      rbytesmax;
 
+    /* size of the next read, follows what the socket has been giving us */
+    int                      rsize;
+
+    /* app killed us while we were reading, we do it once what was read is dealt with */
+    int                      reading, killed;
+
     /* current state */
     _sx_state_t              state;
 
@@ -326,6 +335,15 @@ struct _sx_st {
     /* nad currently being built */
     nad_t                    nad;
 
+    /* wire bytes kept for SX_RAW_PASSTHROUGH, rawbuf[0] is at parser offset rawoff */
+    char                    *rawbuf;
+    int                      rawlen, rawsize;
+    long                     rawoff;
+    /* span of the top-level element being parsed, rawstart is -1 if it can't be passed through */
+    long                     rawstart, rawend;
+    /* end of the last thing seen between top-level elements */
+    long                     rawnext;
+
     /* plugin storage */
     void                   **plugin_data;
 
@@ -382,6 +400,9 @@ struct _sx_plugin_st {
 struct _sx_env_st {
     sx_plugin_t             *plugins;
     int                     nplugins;
+
+    /* most bytes to take off a socket per read event (0 for the default) */
+    int                     rbudget;
 };
 
 /** debugging macros */
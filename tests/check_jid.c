@@ -0,0 +1,80 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "util/util.h"
+
+START_TEST (check_ascii)
+{
+    jid_t jid;
+
+    /* node and domain fold case, resource doesn't */
+    jid = jid_new("Romeo@Example.NET/Orchard Wall", -1);
+    ck_assert(jid != NULL);
+    ck_assert_str_eq("romeo", jid->node);
+    ck_assert_str_eq("example.net", jid->domain);
+    ck_assert_str_eq("Orchard Wall", jid->resource);
+    jid_free(jid);
+
+    /* prohibited in a node */
+    ck_assert(jid_new("rom eo@example.net", -1) == NULL);
+    ck_assert(jid_new("rom<eo@example.net", -1) == NULL);
+    ck_assert(jid_new("rom:eo@example.net", -1) == NULL);
+    ck_assert(jid_new("rom\"eo@example.net", -1) == NULL);
+
+    /* controls are no good in a resource */
+    ck_assert(jid_new("romeo@example.net/a\tb", -1) == NULL);
+    ck_assert(jid_new("romeo@example.net/a\177b", -1) == NULL);
+}
+END_TEST
+
+START_TEST (check_cached)
+{
+    jid_t jid;
+    int i;
+
+    /* the second time round comes from the cache, and must be the same */
+    for(i = 0; i < 2; i++) {
+        jid = jid_new("J\xc3\x9cRGEN@\xc3\x9c" "ber.example/R\xc3\xa9sum\xc3\xa9", -1);
+        ck_assert(jid != NULL);
+        ck_assert_str_eq("j\xc3\xbcrgen", jid->node);
+        ck_assert_str_eq("\xc3\xbc" "ber.example", jid->domain);
+        ck_assert_str_eq("R\xc3\xa9sum\xc3\xa9", jid->resource);
+        jid_free(jid);
+    }
+
+    /* failures are remembered too */
+    for(i = 0; i < 2; i++)
+        ck_assert(jid_new("j\xc3\xbcr gen@example.net", -1) == NULL);
+}
+END_TEST
+
+Suite* jid_suite (void)
+{
+    Suite *s = suite_create ("jid");
+
+    TCase *tc_ascii = tcase_create ("ASCII");
+    tcase_add_test (tc_ascii, check_ascii);
+    suite_add_tcase (s, tc_ascii);
+
+    TCase *tc_cached = tcase_create ("Cached");
+    tcase_add_test (tc_cached, check_cached);
+    suite_add_tcase (s, tc_cached);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = jid_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -8,6 +8,9 @@
 
 #include "util/util.h"
 
+/* the escaper is internal to nad.c, so take our own copy of it to get at it */
+#include "util/nad.c"
+
 #define NADTXT_COUNT 4
 char *nadtxt[NADTXT_COUNT] = {
 "<presence to='test@chrome.pl' from='test%gmail.com@jabber.chrome.pl/gmail.EBAFDAF7'>"
@@ -199,6 +202,284 @@ START_TEST (check_leaf_path)
 }
 END_TEST
 
+static int mcast_count;
+
+static void mcast_cb(nad_t nad, void *arg)
+{
+    const char **expect = (const char **) arg;
+    const char *buf;
+    int len;
+
+    nad_print(nad, 0, &buf, &len);
+    fprintf(stdout, "Unicast:\n%.*s\n", len, buf);
+
+    ck_assert_int_eq (strlen(expect[mcast_count]), len);
+    fail_if (strncmp(expect[mcast_count], buf, len));
+
+    mcast_count++;
+    nad_free(nad);
+}
+
+START_TEST (check_multicast_split)
+{
+    const char *mcast =
+"<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' type='multicast' from='sm'>"
+    "<presence xmlns='jabber:client' from='a@b/c'><show>away</show></presence>"
+    "<addresses><address to='x@remote.org'/><address to='y@local/r@s'/><address to='local'/></addresses>"
+"</route>";
+
+    const char *expect[] = {
+"<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='remote.org' from='sm'><presence xmlns='jabber:client' to='x@remote.org' from='a@b/c'><show>away</show></presence></route>",
+"<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='local' from='sm'><presence xmlns='jabber:client' to='y@local/r@s' from='a@b/c'><show>away</show></presence></route>",
+"<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='local' from='sm'><presence xmlns='jabber:client' to='local' from='a@b/c'><show>away</show></presence></route>"
+    };
+
+    nad_t nad = nad_parse(mcast, 0);
+
+    mcast_count = 0;
+    ck_assert_int_eq (3, stanza_multicast_split(nad, mcast_cb, (void *) expect));
+    ck_assert_int_eq (3, mcast_count);
+
+    /* plain routes have nothing to split */
+    nad_free(nad);
+    nad = nad_parse(nadmangled[2], 0);
+    ck_assert_int_eq (0, stanza_multicast_split(nad, mcast_cb, (void *) expect));
+
+    nad_free(nad);
+}
+END_TEST
+
+START_TEST (check_recycle)
+{
+    const char *buf, *copybuf;
+    char first[1024];
+    int len, copylen, ccur, i;
+    nad_t nad, copy;
+
+    nad = nad_parse(nadtxt[0], 0);
+
+    nad_print(nad, 0, &buf, &len);
+    memcpy(first, buf, len);
+    ccur = nad->ccur;
+
+    /* printing again reuses the space */
+    for(i = 0; i < 10; i++)
+        nad_print(nad, 0, &buf, &len);
+    ck_assert_int_eq (ccur, nad->ccur);
+    fail_if (strncmp(first, buf, len));
+
+    /* lots of dead values, the copy leaves them behind */
+    for(i = 0; i < 200; i++)
+        nad_set_attr(nad, 0, -1, "to", i % 2 ? "test@chrome.pl" : "someone.else@example.com", 0);
+    nad_set_attr(nad, 0, -1, "to", "test@chrome.pl", 0);
+
+    copy = nad_copy(nad);
+    ck_assert (copy->ccur < nad->ccur / 2);
+
+    nad_print(nad, 0, &buf, &len);
+    nad_print(copy, 0, &copybuf, &copylen);
+    ck_assert_int_eq (len, copylen);
+    fail_if (strncmp(buf, copybuf, len));
+
+    /* a freed nad comes back empty */
+    nad_free(copy);
+    copy = nad_new();
+    ck_assert_int_eq (0, copy->ecur);
+    ck_assert_int_eq (0, copy->ccur);
+    ck_assert (copy->raw == NULL);
+    ck_assert_int_eq (-1, copy->scope);
+
+    nad_free(copy);
+    nad_free(nad);
+}
+END_TEST
+
+#ifdef NAD_FREE_THREAD
+static void *_recycle_thread(void *arg)
+{
+    nad_t *nads = (nad_t *) arg;
+    int i;
+
+    /* free what the main thread made, more than one thread keeps */
+    for(i = 0; i < NAD_FREE_LOCAL * 3; i++)
+        nad_free(nads[i]);
+
+    return NULL;
+}
+
+START_TEST (check_recycle_threads)
+{
+    nad_t nads[NAD_FREE_LOCAL * 3];
+    pthread_t t;
+    int i;
+
+    for(i = 0; i < NAD_FREE_LOCAL * 3; i++)
+        nads[i] = nad_parse(nadtxt[i % NADTXT_COUNT], 0);
+
+    ck_assert_int_eq (0, pthread_create(&t, NULL, _recycle_thread, nads));
+    ck_assert_int_eq (0, pthread_join(t, NULL));
+
+    /* everything the thread kept was handed back when it went away */
+    ck_assert (_nad_free_count >= NAD_FREE_LOCAL * 3);
+
+    /* and this thread can have them */
+    for(i = 0; i < NAD_FREE_LOCAL * 3; i++) {
+        nads[i] = nad_new();
+        ck_assert_int_eq (0, nads[i]->ecur);
+        ck_assert (nads[i]->raw == NULL);
+    }
+    ck_assert (_nad_local_list == NULL);
+
+    for(i = 0; i < NAD_FREE_LOCAL * 3; i++)
+        nad_free(nads[i]);
+    ck_assert (_nad_local_count <= NAD_FREE_LOCAL);
+}
+END_TEST
+#endif
+
+START_TEST (check_serialize)
+{
+    const char *buf, *copybuf;
+    char *ser;
+    int len, copylen, serlen;
+    nad_t nad, copy;
+
+    nad = nad_parse(nadtxt[_i], 0);
+    nad_serialize(nad, &ser, &serlen);
+
+    /* version, then the length most significant byte first */
+    ck_assert_int_eq (1, ser[0]);
+    ck_assert_int_eq (serlen, ((unsigned char) ser[1] << 24) | ((unsigned char) ser[2] << 16) | ((unsigned char) ser[3] << 8) | (unsigned char) ser[4]);
+
+    copy = nad_deserialize(ser, serlen);
+    fail_unless (copy != NULL);
+
+    nad_print(nad, 0, &buf, &len);
+    nad_print(copy, 0, &copybuf, &copylen);
+    ck_assert_int_eq (len, copylen);
+    fail_if (strncmp(buf, copybuf, len));
+
+    /* appending works on what comes back */
+    nad_append_elem(copy, -1, "extra", 1);
+    ck_assert_int_eq (0, copy->elems[copy->ecur - 1].parent);
+    nad_free(copy);
+
+    /* cut short */
+    fail_unless (nad_deserialize(ser, serlen - 1) == NULL);
+    fail_unless (nad_deserialize(ser, 3) == NULL);
+
+    /* a version we don't know */
+    ser[0] = 2;
+    fail_unless (nad_deserialize(ser, serlen) == NULL);
+    ser[0] = 1;
+
+    /* pointing outside the cdata, the first elem's iname is just after the header */
+    memset(ser + 21, 0x7f, 4);
+    fail_unless (nad_deserialize(ser, serlen) == NULL);
+
+    free(ser);
+    nad_free(nad);
+}
+END_TEST
+
+/** the escaper as it was before it went to a single pass, to check the output hasn't changed */
+static int _old_escape(const char *in, int len, int flag, char *out)
+{
+    static const char chars[] = "&><'\"";
+    static const char *ents[] = { "&amp;", "&gt;", "&lt;", "&apos;", "&quot;" };
+    const char *c;
+    int o = 0, ic;
+
+    if(len <= 0) return 0;
+
+    /* ", then ', <, > in turn, whatever comes before each one being escaped a level down */
+    for(; flag >= 1; flag--)
+        while((c = memchr(in, chars[flag], len)) != NULL) {
+            ic = c - in;
+            o += _old_escape(in, ic, flag - 1, out + o);
+            memcpy(out + o, ents[flag], strlen(ents[flag]));
+            o += strlen(ents[flag]);
+            len -= ic + 1;
+            in += ic + 1;
+        }
+
+    while((c = memchr(in, '&', len)) != NULL) {
+        ic = c - in;
+        memcpy(out + o, in, ic);
+        o += ic;
+        memcpy(out + o, "&amp;", 5);
+        o += 5;
+        len -= ic + 1;
+        in += ic + 1;
+    }
+
+    memcpy(out + o, in, len);
+
+    return o + len;
+}
+
+static void _check_escape(const char *in, int len)
+{
+    char old[1024];
+    int flag, olen, data, start;
+    nad_t nad;
+
+    for(flag = 0; flag <= 4; flag++) {
+        olen = _old_escape(in, len, flag, old);
+
+        nad = nad_new();
+        data = _nad_cdata(nad, in, len);
+        start = nad->ccur;
+        _nad_escape(nad, data, len, flag);
+
+        ck_assert_int_eq (olen, nad->ccur - start);
+        fail_if (memcmp(old, nad->cdata + start, olen));
+
+        nad_free(nad);
+    }
+}
+
+START_TEST (check_escape)
+{
+    static const char special[] = "&><'\"";
+    static const int lens[] = { 1, 15, 16, 17, 31, 32, 33, 47, 48, 50, 100 };
+    char buf[128];
+    int i, j, k, pos, len;
+    unsigned int r = 1;
+
+    /* one special character, either side of each 16 byte chunk boundary and in the tail */
+    for(i = 0; i < (int) (sizeof(lens) / sizeof(lens[0])); i++)
+        for(j = 0; special[j] != '\0'; j++)
+            for(pos = 0; pos < lens[i]; pos++) {
+                memset(buf, 'x', lens[i]);
+                buf[pos] = special[j];
+                _check_escape(buf, lens[i]);
+            }
+
+    /* nothing but special characters */
+    for(len = 1; len <= 100; len++) {
+        for(k = 0; k < len; k++)
+            buf[k] = special[k % 5];
+        _check_escape(buf, len);
+    }
+
+    /* plain text */
+    memset(buf, 'x', 100);
+    _check_escape(buf, 100);
+
+    /* a bit of everything */
+    for(i = 0; i < 2000; i++) {
+        r = r * 1103515245 + 12345;
+        len = 16 + (r >> 16) % 100;
+        for(k = 0; k < len; k++) {
+            r = r * 1103515245 + 12345;
+            buf[k] = ((r >> 16) % 4 == 0) ? special[(r >> 8) % 5] : 'a' + (r >> 20) % 26;
+        }
+        _check_escape(buf, len);
+    }
+}
+END_TEST
+
 Suite* s2s_wrapper_suite (void)
 {
     Suite *s = suite_create ("s2s incoming packet wrapper");
@@ -211,6 +492,25 @@ Suite* s2s_wrapper_suite (void)
     tcase_add_test (tc_nad_find_elem_path, check_leaf_path);
     suite_add_tcase (s, tc_nad_find_elem_path);
 
+    TCase *tc_multicast = tcase_create ("Multicast routes");
+    tcase_add_test (tc_multicast, check_multicast_split);
+    suite_add_tcase (s, tc_multicast);
+
+    TCase *tc_recycle = tcase_create ("Recycling");
+    tcase_add_test (tc_recycle, check_recycle);
+#ifdef NAD_FREE_THREAD
+    tcase_add_test (tc_recycle, check_recycle_threads);
+#endif
+    suite_add_tcase (s, tc_recycle);
+
+    TCase *tc_serialize = tcase_create ("Serialize");
+    tcase_add_loop_test (tc_serialize, check_serialize, 0, NADTXT_COUNT);
+    suite_add_tcase (s, tc_serialize);
+
+    TCase *tc_escape = tcase_create ("Escaping");
+    tcase_add_test (tc_escape, check_escape);
+    suite_add_tcase (s, tc_escape);
+
 
     return s;
 }
@@ -0,0 +1,152 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "util/util.h"
+
+#define TIMER_COUNT 100
+
+static struct wheel_timer_st timers[TIMER_COUNT];
+static int fired[TIMER_COUNT];
+
+static void count_fn(wheel_t w, wheel_timer_t t, void *arg)
+{
+    fired[(wheel_timer_t) arg - timers]++;
+}
+
+static void again_fn(wheel_t w, wheel_timer_t t, void *arg)
+{
+    fired[0]++;
+
+    /* rescheduling from the callback puts it back for a later run */
+    if(fired[0] < 3)
+        wheel_at(w, t, wheel_clock());
+}
+
+START_TEST (check_due)
+{
+    wheel_t w = wheel_new(8, 10);
+    long long now = wheel_clock();
+    int i;
+
+    memset(fired, 0, sizeof(fired));
+
+    /* half already due, half a long way off (many turns of the wheel) */
+    for(i = 0; i < TIMER_COUNT; i++) {
+        wheel_timer_init(&timers[i], count_fn, &timers[i]);
+        wheel_at(w, &timers[i], i % 2 ? now + 60000 + i : now - i);
+    }
+
+    ck_assert_int_eq(TIMER_COUNT, wheel_count(w));
+    ck_assert_int_eq(TIMER_COUNT / 2, wheel_run(w));
+    ck_assert_int_eq(TIMER_COUNT / 2, wheel_count(w));
+
+    for(i = 0; i < TIMER_COUNT; i++)
+        ck_assert_int_eq(i % 2 ? 0 : 1, fired[i]);
+
+    /* nothing else is due, however many times we look */
+    ck_assert_int_eq(0, wheel_run(w));
+    ck_assert(wheel_next(w) >= 0);
+
+    for(i = 1; i < TIMER_COUNT; i += 2)
+        wheel_del(w, &timers[i]);
+
+    ck_assert_int_eq(0, wheel_count(w));
+    ck_assert_int_eq(-1, wheel_next(w));
+
+    /* deleting twice is harmless */
+    wheel_del(w, &timers[1]);
+    ck_assert_int_eq(0, wheel_count(w));
+
+    wheel_free(w);
+}
+END_TEST
+
+START_TEST (check_later)
+{
+    wheel_t w = wheel_new(8, 10);
+    int next;
+
+    memset(fired, 0, sizeof(fired));
+
+    wheel_timer_init(&timers[0], count_fn, &timers[0]);
+    wheel_in(w, &timers[0], 30);
+
+    ck_assert_int_eq(0, wheel_run(w));
+
+    next = wheel_next(w);
+    ck_assert(next >= 0 && next <= 40);
+
+    usleep(50000);
+
+    ck_assert_int_eq(1, wheel_run(w));
+    ck_assert_int_eq(1, fired[0]);
+    ck_assert_int_eq(-1, wheel_next(w));
+
+    /* moving a scheduled timer doesn't add another one */
+    wheel_in(w, &timers[0], 1000);
+    wheel_in(w, &timers[0], 0);
+    ck_assert_int_eq(1, wheel_count(w));
+    ck_assert_int_eq(1, wheel_run(w));
+    ck_assert_int_eq(2, fired[0]);
+
+    wheel_free(w);
+}
+END_TEST
+
+START_TEST (check_again)
+{
+    wheel_t w = wheel_new(8, 10);
+    int runs = 0;
+
+    memset(fired, 0, sizeof(fired));
+
+    wheel_timer_init(&timers[0], again_fn, NULL);
+    wheel_at(w, &timers[0], wheel_clock());
+
+    ck_assert_int_eq(1, wheel_run(w));
+    ck_assert_int_eq(1, wheel_count(w));
+
+    while(wheel_count(w) > 0 && runs++ < 10)
+        wheel_run(w);
+
+    ck_assert_int_eq(3, fired[0]);
+
+    wheel_free(w);
+}
+END_TEST
+
+Suite* wheel_suite (void)
+{
+    Suite *s = suite_create ("wheel");
+
+    TCase *tc_due = tcase_create ("Due");
+    tcase_add_test (tc_due, check_due);
+    suite_add_tcase (s, tc_due);
+
+    TCase *tc_later = tcase_create ("Later");
+    tcase_add_test (tc_later, check_later);
+    suite_add_tcase (s, tc_later);
+
+    TCase *tc_again = tcase_create ("Again");
+    tcase_add_test (tc_again, check_again);
+    suite_add_tcase (s, tc_again);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = wheel_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
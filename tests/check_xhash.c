@@ -0,0 +1,154 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "util/util.h"
+
+#define KEY_COUNT 20000
+
+static char keys[KEY_COUNT][32];
+
+static void make_keys(void)
+{
+    int i;
+
+    for(i = 0; i < KEY_COUNT; i++)
+        snprintf(keys[i], sizeof(keys[i]), "user%d@example.com", i);
+}
+
+START_TEST (check_grow)
+{
+    xht h = xhash_new(11);
+    int i;
+
+    make_keys();
+
+    /* far more keys than initial buckets, lookups must survive every resize */
+    for(i = 0; i < KEY_COUNT; i++) {
+        xhash_put(h, keys[i], keys[i]);
+        ck_assert_ptr_eq(keys[i / 2], xhash_get(h, keys[i / 2]));
+    }
+
+    ck_assert_int_eq(KEY_COUNT, xhash_count(h));
+
+    for(i = 0; i < KEY_COUNT; i++)
+        ck_assert_ptr_eq(keys[i], xhash_get(h, keys[i]));
+
+    for(i = 0; i < KEY_COUNT; i += 2)
+        xhash_zap(h, keys[i]);
+
+    ck_assert_int_eq(KEY_COUNT / 2, xhash_count(h));
+
+    for(i = 0; i < KEY_COUNT; i++)
+        ck_assert_ptr_eq(i % 2 ? keys[i] : NULL, xhash_get(h, keys[i]));
+
+    xhash_free(h);
+}
+END_TEST
+
+START_TEST (check_iter)
+{
+    xht h = xhash_new(11);
+    const char *key;
+    int i, keylen, seen = 0;
+    void *val;
+
+    make_keys();
+
+    for(i = 0; i < KEY_COUNT; i++)
+        xhash_put(h, keys[i], keys[i]);
+
+    /* every entry is visited exactly once, zapping as we go */
+    if(xhash_iter_first(h))
+        do {
+            ck_assert(xhash_iter_get(h, &key, &keylen, &val));
+            ck_assert_ptr_eq(key, val);
+            ck_assert_int_eq(strlen(key), keylen);
+            seen++;
+            if(seen % 3 == 0)
+                xhash_iter_zap(h);
+        } while(xhash_iter_next(h));
+
+    ck_assert_int_eq(KEY_COUNT, seen);
+    ck_assert_int_eq(KEY_COUNT - KEY_COUNT / 3, xhash_count(h));
+
+    seen = 0;
+    if(xhash_iter_first(h))
+        do {
+            seen++;
+        } while(xhash_iter_next(h));
+
+    ck_assert_int_eq(xhash_count(h), seen);
+
+    xhash_free(h);
+}
+END_TEST
+
+START_TEST (check_iter_abandoned)
+{
+    xht h = xhash_new(11);
+    const char *key;
+    int i, keylen, missing = 0;
+    void *val;
+
+    make_keys();
+
+    for(i = 0; i < 100; i++)
+        xhash_put(h, keys[i], keys[i]);
+
+    /* give up part way, the way an early return out of a loop does */
+    ck_assert(xhash_iter_first(h));
+    ck_assert(xhash_iter_next(h));
+    xhash_iter_zap(h);
+
+    /* the table still has to grow, rather than its chains getting longer */
+    for(i = 100; i < KEY_COUNT; i++)
+        xhash_put(h, keys[i], keys[i]);
+
+    ck_assert(h->prime >= KEY_COUNT / 2);
+
+    /* only the one zapped during the iteration has gone */
+    for(i = 0; i < KEY_COUNT; i++)
+        if(xhash_get(h, keys[i]) == NULL)
+            missing++;
+    ck_assert_int_eq(1, missing);
+    ck_assert_int_eq(KEY_COUNT - 1, xhash_count(h));
+
+    /* the abandoned iteration is over */
+    ck_assert(!xhash_iter_next(h));
+    ck_assert(!xhash_iter_get(h, &key, &keylen, &val));
+
+    xhash_free(h);
+}
+END_TEST
+
+Suite* xhash_suite (void)
+{
+    Suite *s = suite_create ("xhash");
+
+    TCase *tc_grow = tcase_create ("Grow");
+    tcase_add_test (tc_grow, check_grow);
+    suite_add_tcase (s, tc_grow);
+
+    TCase *tc_iter = tcase_create ("Iterate");
+    tcase_add_test (tc_iter, check_iter);
+    tcase_add_test (tc_iter, check_iter_abandoned);
+    suite_add_tcase (s, tc_iter);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = xhash_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1106,10 +1106,10 @@ char *crypt_ra(const char *key, const char *setting,
 	return _crypt_blowfish_rn(key, setting, (char *)*data, *size);
 }
 
-char *crypt_r(const char *key, const char *setting, void *data)
+char *bcrypt_r(const char *key, const char *setting, void *data)
 {
 	return _crypt_retval_magic(
-		crypt_rn(key, setting, data, CRYPT_OUTPUT_SIZE),
+		_crypt_blowfish_rn(key, setting, (char *)data, CRYPT_OUTPUT_SIZE),
 		setting, (char *)data, CRYPT_OUTPUT_SIZE);
 }
 
@@ -1117,9 +1117,7 @@ char *bcrypt(const char *key, const char *setting)
 {
 	static char output[CRYPT_OUTPUT_SIZE];
 
-	return _crypt_retval_magic(
-		crypt_rn(key, setting, output, sizeof(output)),
-		setting, output, sizeof(output));
+	return bcrypt_r(key, setting, output);
 }
 
 #define __crypt_gensalt_rn crypt_gensalt_rn
@@ -22,8 +22,15 @@
 #define __const const
 #endif
 
+/* room for a hash, and for a setting from bcrypt_gensalt */
+#define BCRYPT_OUTPUT_SIZE		(7 + 22 + 31 + 1)
+#define BCRYPT_GENSALT_OUTPUT_SIZE	(7 + 22 + 1)
+
+/* bcrypt and bcrypt_gensalt return a static buffer. bcrypt_r writes to data,
+ * which has room for BCRYPT_OUTPUT_SIZE (it isn't called crypt_r, so it doesn't
+ * clash with the one in libcrypt) */
 extern char *bcrypt(__const char *key, __const char *setting);
-extern char *crypt_r(__const char *key, __const char *setting, void *data);
+extern char *bcrypt_r(__const char *key, __const char *setting, void *data);
 
 #ifndef __SKIP_OW
 extern char *crypt_rn(__const char *key, __const char *setting,
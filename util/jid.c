@@ -21,20 +21,170 @@
 #include "util.h"
 #include <stringprep.h>
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
 /** Forward declaration **/
 static jid_t jid_reset_components_internal(jid_t jid, const char *node, const char *domain, const char *resource, int prepare);
 
+#define JID_PREP_NODE       (0)
+#define JID_PREP_DOMAIN     (1)
+#define JID_PREP_RESOURCE   (2)
+
+/** stringprep of pure ascii comes down to case folding and a few
+ *  prohibited characters, so do it here.
+ *  @return 0 if prepped, 1 if it can't be, -1 if it isn't ascii */
+static int jid_prep_ascii(char *str, int profile) {
+    unsigned char *c;
+
+    for(c = (unsigned char *) str; *c != '\0'; c++)
+        if(*c >= 0x80)
+            return -1;
+
+    for(c = (unsigned char *) str; *c != '\0'; c++) {
+        switch(profile) {
+            case JID_PREP_NODE:
+                if(*c <= 0x20 || *c == 0x7f || strchr("\"&'/:<>@", *c) != NULL)
+                    return 1;
+                if(*c >= 'A' && *c <= 'Z')
+                    *c += 'a' - 'A';
+                break;
+
+            case JID_PREP_DOMAIN:
+                if(*c >= 'A' && *c <= 'Z')
+                    *c += 'a' - 'A';
+                break;
+
+            case JID_PREP_RESOURCE:
+                if(*c < 0x20 || *c == 0x7f)
+                    return 1;
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/* everything else goes through libidn, with the answers remembered in a
+ * bounded cache. it's split into shards so threads rarely wait on each other */
+#define JID_CACHE_SHARDS    (16)
+#define JID_CACHE_SLOTS     (256)
+
+struct jid_cache_ent_st {
+    unsigned int        hash;
+    int                 profile;
+    char                *raw;
+    char                *prep;      /* NULL if it failed */
+};
+
+static struct jid_cache_shard_st {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t     lock;
+#endif
+    struct jid_cache_ent_st ents[JID_CACHE_SLOTS];
+} jid_cache[JID_CACHE_SHARDS];
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t jid_cache_once = PTHREAD_ONCE_INIT;
+
+static void jid_cache_init(void) {
+    int i;
+
+    for(i = 0; i < JID_CACHE_SHARDS; i++)
+        pthread_mutex_init(&jid_cache[i].lock, NULL);
+}
+#endif
+
+static unsigned int jid_cache_hash(const char *str, int profile) {
+    unsigned int h = 2166136261U ^ profile;
+
+    for(; *str != '\0'; str++) {
+        h ^= (unsigned char) *str;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/** prep one piece, in place */
+static int jid_prep_piece(char *str, int profile) {
+    struct jid_cache_shard_st *shard;
+    struct jid_cache_ent_st *ent;
+    unsigned int hash;
+    char *raw;
+    int ret;
+
+    if((ret = jid_prep_ascii(str, profile)) >= 0)
+        return ret;
+
+    hash = jid_cache_hash(str, profile);
+    shard = &jid_cache[hash % JID_CACHE_SHARDS];
+    ent = &shard->ents[(hash / JID_CACHE_SHARDS) % JID_CACHE_SLOTS];
+
+#ifdef HAVE_PTHREAD
+    pthread_once(&jid_cache_once, jid_cache_init);
+    pthread_mutex_lock(&shard->lock);
+#endif
+    if(ent->raw != NULL && ent->hash == hash && ent->profile == profile && strcmp(ent->raw, str) == 0) {
+        ret = 1;
+        if(ent->prep != NULL) {
+            strcpy(str, ent->prep);
+            ret = 0;
+        }
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&shard->lock);
+#endif
+        return ret;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&shard->lock);
+#endif
+
+    raw = strdup(str);
+
+    switch(profile) {
+        case JID_PREP_NODE:
+            ret = stringprep_xmpp_nodeprep(str, 1024);
+            break;
+        case JID_PREP_DOMAIN:
+            ret = stringprep_nameprep(str, 1024);
+            break;
+        default:
+            ret = stringprep_xmpp_resourceprep(str, 1024);
+            break;
+    }
+    ret = (ret != 0);
+
+    /* replace whatever was there before */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&shard->lock);
+#endif
+    if(ent->raw != NULL) free(ent->raw);
+    if(ent->prep != NULL) free(ent->prep);
+
+    ent->hash = hash;
+    ent->profile = profile;
+    ent->raw = raw;
+    ent->prep = ret ? NULL : strdup(str);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&shard->lock);
+#endif
+
+    return ret;
+}
+
 /** do stringprep on the pieces */
 static int jid_prep_pieces(char *node, char *domain, char *resource) {
     if(node[0] != '\0')
-        if(stringprep_xmpp_nodeprep(node, 1024) != 0)
+        if(jid_prep_piece(node, JID_PREP_NODE) != 0)
             return 1;
 
-    if(stringprep_nameprep(domain, 1024) != 0)
+    if(jid_prep_piece(domain, JID_PREP_DOMAIN) != 0)
         return 1;
 
     if(resource[0] != '\0')
-        if(stringprep_xmpp_resourceprep(resource, 1024) != 0)
+        if(jid_prep_piece(resource, JID_PREP_RESOURCE) != 0)
             return 1;
 
     return 0;
@@ -105,6 +105,9 @@ void log_write(log_t log, int level, const char *msgfmt, ...)
 {
     va_list ap;
     char *pos, message[MAX_LOG_LINE+1];
+#ifdef HAVE_CTIME_R
+    char timebuf[26];
+#endif
     int sz, len;
     time_t t;
 
@@ -129,7 +132,11 @@ void log_write(log_t log, int level, const char *msgfmt, ...)
 
     /* timestamp */
     t = time(NULL);
+#ifdef HAVE_CTIME_R
+    pos = ctime_r(&t, timebuf);
+#else
     pos = ctime(&t);
+#endif
     sz = strlen(pos);
     /* chop off the \n */
     pos[sz-1]=' ';
@@ -35,6 +35,14 @@
 #include "nad.h"
 #include "util.h"
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 /* define NAD_DEBUG to get pointer tracking - great for weird bugs that you can't reproduce */
 #ifdef NAD_DEBUG
 
@@ -67,16 +75,21 @@ static void _nad_ptr_check(const char *func, nad_t nad) {
  * Reallocate the given buffer to make it larger.
  *
  * @param oblocks A pointer to a buffer that will be made larger.
+ * @param olen    The current size of the buffer in bytes.
  * @param len     The minimum size in bytes to make the buffer.  The
  *                actual size of the buffer will be rounded up to the
  *                nearest block of 1024 bytes.
  *
  * @return The new size of the buffer in bytes.
  */
-static int _nad_realloc(void **oblocks, int len)
+static int _nad_realloc(void **oblocks, int olen, int len)
 {
     int nlen;
 
+    /* big ones grow by half again, so appending a lot doesn't realloc every block */
+    if(len > BLOCKSIZE * 8 && len < olen + olen / 2)
+        len = olen + olen / 2;
+
     /* round up to standard block sizes */
     nlen = (((len-1)/BLOCKSIZE)+1)*BLOCKSIZE;
 
@@ -86,7 +99,7 @@ static int _nad_realloc(void **oblocks, int len)
 }
 
 /** this is the safety check used to make sure there's always enough mem */
-#define NAD_SAFE(blocks, size, len) if((size) > len) len = _nad_realloc((void**)&(blocks),(size));
+#define NAD_SAFE(blocks, size, len) if((size) > len) len = _nad_realloc((void**)&(blocks),len,(size));
 
 /** internal: append some cdata and return the index to it */
 static int _nad_cdata(nad_t nad, const char *cdata, int len)
@@ -122,11 +135,140 @@ static int _nad_attr(nad_t nad, int elem, int ns, const char *name, const char *
     return attr;
 }
 
-nad_t nad_new(void)
+/* freed nads are kept with their buffers, so the next one costs nothing to
+ * make. each thread keeps its own, so the c2s, router, storage and authreg
+ * workers aren't all after one lock. nads move between threads (a worker frees
+ * what the main thread made), so a thread with too many passes half of them to
+ * a shared list, and a thread that has run out takes some back from it. big
+ * ones aren't kept, they'd just sit on the memory */
+#define NAD_FREE_MAX    (1024)
+#define NAD_FREE_LOCAL  (64)
+#define NAD_FREE_BIG    (32768)
+
+static nad_t _nad_free_list = NULL;
+static int _nad_free_count = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t _nad_free_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#if defined(HAVE_PTHREAD) && defined(HAVE___THREAD) && !defined(NAD_DEBUG)
+# define NAD_FREE_THREAD
+static __thread nad_t _nad_local_list = NULL;
+static __thread int _nad_local_count = 0;
+static __thread int _nad_local_seen = 0;
+
+/* so we hear about a thread going away */
+static pthread_key_t _nad_local_key;
+static pthread_once_t _nad_local_once = PTHREAD_ONCE_INIT;
+#endif
+
+#ifdef NAD_FREE_THREAD
+/** free a nad we're not keeping */
+static void _nad_release(nad_t nad)
+{
+    free(nad->elems);
+    free(nad->attrs);
+    free(nad->cdata);
+    free(nad->nss);
+    free(nad->depths);
+    free(nad);
+}
+#endif
+
+#ifdef NAD_FREE_THREAD
+/** move up to n nads from this thread's list to the shared one, freeing any it has no room for */
+static void _nad_local_spill(int n)
+{
+    nad_t nad, drop = NULL;
+
+    pthread_mutex_lock(&_nad_free_lock);
+    while(n-- > 0 && (nad = _nad_local_list) != NULL) {
+        _nad_local_list = nad->next;
+        _nad_local_count--;
+
+        if(_nad_free_count < NAD_FREE_MAX) {
+            nad->next = _nad_free_list;
+            _nad_free_list = nad;
+            _nad_free_count++;
+        } else {
+            nad->next = drop;
+            drop = nad;
+        }
+    }
+    pthread_mutex_unlock(&_nad_free_lock);
+
+    while((nad = drop) != NULL) {
+        drop = nad->next;
+        _nad_release(nad);
+    }
+}
+
+/** take some from the shared list */
+static void _nad_local_refill(void)
 {
     nad_t nad;
+    int n = NAD_FREE_LOCAL / 2;
+
+    pthread_mutex_lock(&_nad_free_lock);
+    while(n-- > 0 && (nad = _nad_free_list) != NULL) {
+        _nad_free_list = nad->next;
+        _nad_free_count--;
+
+        nad->next = _nad_local_list;
+        _nad_local_list = nad;
+        _nad_local_count++;
+    }
+    pthread_mutex_unlock(&_nad_free_lock);
+}
+
+/** a thread is going away, what it kept goes back to the shared list */
+static void _nad_local_exit(void *arg)
+{
+    _nad_local_spill(_nad_local_count);
+}
+
+static void _nad_local_init(void)
+{
+    pthread_key_create(&_nad_local_key, _nad_local_exit);
+}
+#endif
+
+/** the live cdata, not counting output from the last nad_print() */
+#define NAD_CLIVE(nad) ((nad)->pend > 0 && (nad)->pend == (nad)->ccur ? (nad)->pstart : (nad)->ccur)
+
+nad_t nad_new(void)
+{
+    nad_t nad = NULL;
+
+#ifdef NAD_FREE_THREAD
+    if(_nad_local_list == NULL)
+        _nad_local_refill();
+
+    if(_nad_local_list != NULL) {
+        nad = _nad_local_list;
+        _nad_local_list = nad->next;
+        _nad_local_count--;
+    }
+#elif !defined(NAD_DEBUG)
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&_nad_free_lock);
+#endif
+    if(_nad_free_list != NULL) {
+        nad = _nad_free_list;
+        _nad_free_list = nad->next;
+        _nad_free_count--;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&_nad_free_lock);
+#endif
+#endif
 
-    nad = calloc(1, sizeof(struct nad_st));
+    if(nad != NULL) {
+        nad->ecur = nad->acur = nad->ncur = nad->ccur = 0;
+        nad->pstart = nad->pend = 0;
+        nad->next = NULL;
+    } else
+        nad = calloc(1, sizeof(struct nad_st));
 
     nad->scope = -1;
 
@@ -144,6 +286,58 @@ nad_t nad_new(void)
     return nad;
 }
 
+/** internal: move one piece of cdata into the copy */
+static void _nad_move_cdata(nad_t copy, nad_t nad, int *i, int len)
+{
+    if(len > 0)
+        *i = _nad_cdata(copy, nad->cdata + *i, len);
+    else
+        *i = 0;
+}
+
+/** internal: copy the cdata, leaving out whatever nothing refers to any more
+ *  (replaced attribute values, print output) if that's most of it */
+static void _nad_copy_cdata(nad_t copy, nad_t nad)
+{
+    int clive, used = 0, i;
+
+    clive = NAD_CLIVE(nad);
+
+    for(i = 0; i < nad->ecur; i++)
+        used += nad->elems[i].lname + nad->elems[i].lcdata + nad->elems[i].ltail;
+    for(i = 0; i < nad->acur; i++)
+        used += nad->attrs[i].lname + nad->attrs[i].lval;
+    for(i = 0; i < nad->ncur; i++)
+        used += nad->nss[i].luri + (nad->nss[i].iprefix >= 0 ? nad->nss[i].lprefix : 0);
+
+    if(clive <= used * 2 + BLOCKSIZE) {
+        NAD_SAFE(copy->cdata, clive, copy->clen);
+        memcpy(copy->cdata, nad->cdata, clive);
+        copy->ccur = clive;
+        return;
+    }
+
+    NAD_SAFE(copy->cdata, used, copy->clen);
+    copy->ccur = 0;
+
+    /* names first, so no cdata lands at 0 (which means "none" for cdata and tails) */
+    for(i = 0; i < nad->ecur; i++)
+        _nad_move_cdata(copy, nad, &copy->elems[i].iname, copy->elems[i].lname);
+    for(i = 0; i < nad->ecur; i++) {
+        _nad_move_cdata(copy, nad, &copy->elems[i].icdata, copy->elems[i].lcdata);
+        _nad_move_cdata(copy, nad, &copy->elems[i].itail, copy->elems[i].ltail);
+    }
+    for(i = 0; i < nad->acur; i++) {
+        _nad_move_cdata(copy, nad, &copy->attrs[i].iname, copy->attrs[i].lname);
+        _nad_move_cdata(copy, nad, &copy->attrs[i].ival, copy->attrs[i].lval);
+    }
+    for(i = 0; i < nad->ncur; i++) {
+        _nad_move_cdata(copy, nad, &copy->nss[i].iuri, copy->nss[i].luri);
+        if(copy->nss[i].iprefix >= 0)
+            _nad_move_cdata(copy, nad, &copy->nss[i].iprefix, copy->nss[i].lprefix);
+    }
+}
+
 nad_t nad_copy(nad_t nad)
 {
     nad_t copy;
@@ -155,25 +349,36 @@ nad_t nad_copy(nad_t nad)
     copy = nad_new();
 
     /* if it's not large enough, make bigger */
-    NAD_SAFE(copy->elems, nad->elen, copy->elen);
-    NAD_SAFE(copy->attrs, nad->alen, copy->alen);
-    NAD_SAFE(copy->nss, nad->nlen, copy->nlen);
-    NAD_SAFE(copy->cdata, nad->clen, copy->clen);
+    NAD_SAFE(copy->elems, nad->ecur * sizeof(struct nad_elem_st), copy->elen);
+    NAD_SAFE(copy->attrs, nad->acur * sizeof(struct nad_attr_st), copy->alen);
+    NAD_SAFE(copy->nss, nad->ncur * sizeof(struct nad_ns_st), copy->nlen);
 
-    /* copy all data */
-    memcpy(copy->elems, nad->elems, nad->elen);
-    memcpy(copy->attrs, nad->attrs, nad->alen);
-    memcpy(copy->nss, nad->nss, nad->nlen);
-    memcpy(copy->cdata, nad->cdata, nad->clen);
+    /* copy what's in use */
+    memcpy(copy->elems, nad->elems, nad->ecur * sizeof(struct nad_elem_st));
+    memcpy(copy->attrs, nad->attrs, nad->acur * sizeof(struct nad_attr_st));
+    memcpy(copy->nss, nad->nss, nad->ncur * sizeof(struct nad_ns_st));
 
     /* sync data */
     copy->ecur = nad->ecur;
     copy->acur = nad->acur;
     copy->ncur = nad->ncur;
-    copy->ccur = nad->ccur;
+
+    _nad_copy_cdata(copy, nad);
 
     copy->scope = nad->scope;
 
+    /* so that appending to the copy links up the same way */
+    if(nad->dlen > 0) {
+        NAD_SAFE(copy->depths, nad->dlen, copy->dlen);
+        memcpy(copy->depths, nad->depths, nad->dlen);
+    }
+
+    if(nad->raw != NULL) {
+        copy->raw = malloc(nad->rlen);
+        memcpy(copy->raw, nad->raw, nad->rlen);
+        copy->rlen = nad->rlen;
+    }
+
     return copy;
 }
 
@@ -191,6 +396,48 @@ void nad_free(nad_t nad)
     }
 #endif
 
+    free(nad->raw);
+    nad->raw = NULL;
+    nad->rlen = 0;
+
+#ifdef NAD_FREE_THREAD
+    /* keep it for next time */
+    if(nad->elen + nad->alen + nad->nlen + nad->clen + nad->dlen <= NAD_FREE_BIG) {
+        if(!_nad_local_seen) {
+            pthread_once(&_nad_local_once, _nad_local_init);
+            pthread_setspecific(_nad_local_key, (void *) 1);
+            _nad_local_seen = 1;
+        }
+
+        if(_nad_local_count >= NAD_FREE_LOCAL)
+            _nad_local_spill(NAD_FREE_LOCAL / 2);
+
+        nad->next = _nad_local_list;
+        _nad_local_list = nad;
+        _nad_local_count++;
+
+        return;
+    }
+#elif !defined(NAD_DEBUG)
+    /* keep it for next time */
+    if(nad->elen + nad->alen + nad->nlen + nad->clen + nad->dlen <= NAD_FREE_BIG) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&_nad_free_lock);
+#endif
+        if(_nad_free_count < NAD_FREE_MAX) {
+            nad->next = _nad_free_list;
+            _nad_free_list = nad;
+            _nad_free_count++;
+            nad = NULL;
+        }
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&_nad_free_lock);
+#endif
+        if(nad == NULL)
+            return;
+    }
+#endif
+
     /* Free nad */
     free(nad->elems);
     free(nad->attrs);
@@ -202,6 +449,16 @@ void nad_free(nad_t nad)
 #endif
 }
 
+/** the received wire form no longer matches once the nad is changed */
+void nad_drop_raw(nad_t nad)
+{
+    if(nad->raw == NULL) return;
+
+    free(nad->raw);
+    nad->raw = NULL;
+    nad->rlen = 0;
+}
+
 /** locate the next elem at a given depth with an optional matching name */
 int nad_find_elem(nad_t nad, unsigned int elem, int ns, const char *name, int depth)
 {
@@ -409,6 +666,7 @@ void nad_set_attr(nad_t nad, unsigned int elem, int ns, const char *name, const
     int attr;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     /* find one to replace first */
     if((attr = nad_find_attr(nad, elem, ns, name, NULL)) < 0)
@@ -448,6 +706,7 @@ int nad_insert_elem(nad_t nad, unsigned int parent, int ns, const char *name, co
     elem = parent + 1;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     NAD_SAFE(nad->elems, (nad->ecur + 1) * sizeof(struct nad_elem_st), nad->elen);
 
@@ -485,6 +744,7 @@ void nad_drop_elem(nad_t nad, unsigned int elem) {
     int next, cur;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     if(elem >= nad->ecur) return;
 
@@ -509,6 +769,7 @@ void nad_wrap_elem(nad_t nad, unsigned int elem, int ns, const char *name)
     int cur;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     if(elem >= nad->ecur) return;
 
@@ -547,6 +808,7 @@ int nad_insert_nad(nad_t dest, int delem, nad_t src, int selem) {
 
     _nad_ptr_check(__func__, dest);
     _nad_ptr_check(__func__, src);
+    nad_drop_raw(dest);
 
     /* can't do anything if these aren't real elems */
     if(src->ecur <= selem || dest->ecur <= delem)
@@ -713,6 +975,7 @@ int nad_append_elem(nad_t nad, int ns, const char *name, int depth)
     int elem;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     /* make sure there's mem for us */
     NAD_SAFE(nad->elems, (nad->ecur + 1) * sizeof(struct nad_elem_st), nad->elen);
@@ -745,6 +1008,7 @@ int nad_append_elem(nad_t nad, int ns, const char *name, int depth)
 int nad_append_attr(nad_t nad, int ns, const char *name, const char *val)
 {
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     return _nad_attr(nad, nad->ecur - 1, ns, name, val, 0);
 }
@@ -755,6 +1019,7 @@ void nad_append_cdata(nad_t nad, const char *cdata, int len, int depth)
     int elem = nad->ecur - 1;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     /* make sure this cdata is the child of the last elem to append */
     if(nad->elems[elem].depth == depth - 1)
@@ -780,6 +1045,7 @@ int nad_add_namespace(nad_t nad, const char *uri, const char *prefix)
     int ns;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     /* only add it if its not already in scope */
     ns = nad_find_scoped_namespace(nad, uri, NULL);
@@ -815,6 +1081,7 @@ int nad_append_namespace(nad_t nad, unsigned int elem, const char *uri, const ch
     int ns;
 
     _nad_ptr_check(__func__, nad);
+    nad_drop_raw(nad);
 
     /* see if its already scoped on this element */
     ns = nad_find_namespace(nad, elem, uri, NULL);
@@ -845,107 +1112,98 @@ int nad_append_namespace(nad_t nad, unsigned int elem, const char *uri, const ch
     return ns;
 }
 
-static void _nad_escape(nad_t nad, int data, int len, int flag)
-{
-    char *c;
-    int ic;
-
-    if(len <= 0) return;
-
-    /* first, if told, find and escape " */
-    while(flag >= 4 && (c = memchr(nad->cdata + data,'"',len)) != NULL)
-    {
-        /* get offset */
-        ic = c - nad->cdata;
-
-        /* cute, eh?  handle other data before this normally */
-        _nad_escape(nad, data, ic - data, 3);
-
-        /* ensure enough space, and add our escaped &quot; */
-        NAD_SAFE(nad->cdata, nad->ccur + 6, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&quot;", 6);
-        nad->ccur += 6;
+/* how far down the flag has to go before a character stops being escaped:
+ * flag 0 escapes only &, 1 adds >, 2 adds <, 3 adds ' and 4 adds " */
+static const struct {
+    int flag;
+    int len;
+    const char *ent;
+} _nad_escapes[256] = {
+    ['&'] = { 0, 5, "&amp;" },
+    ['>'] = { 1, 4, "&gt;" },
+    ['<'] = { 2, 4, "&lt;" },
+    ['\''] = { 3, 6, "&apos;" },
+    ['"'] = { 4, 6, "&quot;" },
+};
 
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
+/** find the next character that might need escaping, or end */
+static const char *_nad_escape_next(const char *c, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i amp = _mm_set1_epi8('&'), gt = _mm_set1_epi8('>'), lt = _mm_set1_epi8('<'),
+                  apos = _mm_set1_epi8('\''), quot = _mm_set1_epi8('"');
+    __m128i v, hit;
+    int mask;
+
+    /* sixteen at a time while we can */
+    for(; end - c >= 16; c += 16) {
+        v = _mm_loadu_si128((const __m128i *) c);
+        hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, gt)),
+                           _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, apos)), _mm_cmpeq_epi8(v, quot)));
+        mask = _mm_movemask_epi8(hit);
+        if(mask != 0)
+            return c + __builtin_ctz(mask);
     }
+#endif
 
-    /* next, find and escape ' */
-    while(flag >= 3 && (c = memchr(nad->cdata + data,'\'',len)) != NULL)
-    {
-        ic = c - nad->cdata;
-        _nad_escape(nad, data, ic - data, 2);
-
-        /* ensure enough space, and add our escaped &apos; */
-        NAD_SAFE(nad->cdata, nad->ccur + 6, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&apos;", 6);
-        nad->ccur += 6;
+    for(; c < end; c++)
+        if(_nad_escapes[(unsigned char) *c].ent != NULL)
+            return c;
 
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
-    }
+    return end;
+}
 
-    /* next look for < */
-    while(flag >= 2 && (c = memchr(nad->cdata + data,'<',len)) != NULL)
-    {
-        ic = c - nad->cdata;
-        _nad_escape(nad, data, ic - data, 1);
+/** append cdata from within the nad, escaped. one pass to size it, one to write it */
+static void _nad_escape(nad_t nad, int data, int len, int flag)
+{
+    const char *c, *end, *run;
+    char *out;
+    int olen, e;
 
-        /* ensure enough space, and add our escaped &lt; */
-        NAD_SAFE(nad->cdata, nad->ccur + 4, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&lt;", 4);
-        nad->ccur += 4;
+    if(len <= 0) return;
 
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
+    /* work out how big it'll be */
+    olen = len;
+    c = nad->cdata + data;
+    end = c + len;
+    while((c = _nad_escape_next(c, end)) < end) {
+        e = (unsigned char) *c;
+        if(_nad_escapes[e].flag <= flag)
+            olen += _nad_escapes[e].len - 1;
+        c++;
     }
 
-    /* next look for > */
-    while(flag >= 1 && (c = memchr(nad->cdata + data, '>', len)) != NULL)
-    {
-        ic = c - nad->cdata;
-        _nad_escape(nad, data, ic - data, 0);
+    /* this may move cdata, so only take pointers after */
+    NAD_SAFE(nad->cdata, nad->ccur + olen, nad->clen);
 
-        /* ensure enough space, and add our escaped &gt; */
-        NAD_SAFE(nad->cdata, nad->ccur + 4, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&gt;", 4);
-        nad->ccur += 4;
+    out = nad->cdata + nad->ccur;
+    nad->ccur += olen;
 
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
+    /* nothing to escape, just copy it */
+    if(olen == len) {
+        memcpy(out, nad->cdata + data, len);
+        return;
     }
 
-    /* if & is found, escape it */
-    while((c = memchr(nad->cdata + data,'&',len)) != NULL)
-    {
-        ic = c - nad->cdata;
-
-        /* ensure enough space */
-        NAD_SAFE(nad->cdata, nad->ccur + 5 + (ic - data), nad->clen);
+    run = c = nad->cdata + data;
+    end = c + len;
+    while((c = _nad_escape_next(c, end)) < end) {
+        e = (unsigned char) *c;
+        if(_nad_escapes[e].flag > flag) {
+            c++;
+            continue;
+        }
 
-        /* handle normal data */
-        memcpy(nad->cdata + nad->ccur, nad->cdata + data, (ic - data));
-        nad->ccur += (ic - data);
+        memcpy(out, run, c - run);
+        out += c - run;
 
-        /* append escaped &amp; */
-        memcpy(nad->cdata + nad->ccur, "&amp;", 5);
-        nad->ccur += 5;
+        memcpy(out, _nad_escapes[e].ent, _nad_escapes[e].len);
+        out += _nad_escapes[e].len;
 
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
+        run = ++c;
     }
 
-    /* nothing exciting, just append normal cdata */
-    if(len > 0) {
-        NAD_SAFE(nad->cdata, nad->ccur + len, nad->clen);
-        memcpy(nad->cdata + nad->ccur, nad->cdata + data, len);
-        nad->ccur += len;
-    }
+    memcpy(out, run, end - run);
 }
 
 /** internal recursive printing function */
@@ -1207,100 +1465,256 @@ static int _nad_lp0(nad_t nad, unsigned int elem)
 
 void nad_print(nad_t nad, unsigned int elem, const char **xml, int *len)
 {
-    int ixml = nad->ccur;
+    int ixml;
 
     _nad_ptr_check(__func__, nad);
 
+    /* write over the last print, if nothing's been added since */
+    nad->ccur = NAD_CLIVE(nad);
+    ixml = nad->ccur;
+
     _nad_lp0(nad, elem);
     *len = nad->ccur - ixml;
     *xml = nad->cdata + ixml;
+
+    nad->pstart = ixml;
+    nad->pend = nad->ccur;
 }
 
 /**
  * nads serialize to a buffer of this form:
  *
- * [buflen][ecur][acur][ncur][ccur][elems][attrs][nss][cdata]
+ * [version][buflen][ecur][acur][ncur][ccur][elems][attrs][nss][cdata]
  *
- * nothing is done with endianness or word length, so the nad must be
- * serialized and deserialized on the same platform
+ * version is one byte. everything else up to the cdata is a 32 bit
+ * integer, most significant byte first, with each elem, attr and ns
+ * written out field by field. so a nad serialized on one platform can
+ * be deserialized on any other
  *
- * buflen is not actually used by deserialize(), but is provided as a
- * convenience to the application so it knows how many bytes to read before
- * passing them in to deserialize()
+ * deserialize() checks the version, and buflen and the counts against
+ * the length it's given, so a buffer that was cut short, came from a
+ * later version or is otherwise broken gives NULL rather than a broken
+ * nad
  *
- * the depths array is not stored, so after deserialization
- * nad_append_elem() and nad_append_cdata() will not work. this is rarely
- * a problem
+ * the depths array is not stored, it's rebuilt on deserialization so
+ * nad_append_elem() and nad_append_cdata() work after it
  */
 
+#define NAD_SER_VERSION (1)
+#define NAD_SER_HEAD    (1 + 4 * 5)
+#define NAD_SER_ELEM    (4 * 11)
+#define NAD_SER_ATTR    (4 * 6)
+#define NAD_SER_NS      (4 * 5)
+
+/** internal: write out a 32 bit int */
+static char *_nad_ser_put(char *pos, int val)
+{
+    unsigned int u = (unsigned int) val;
+
+    pos[0] = (char) (u >> 24);
+    pos[1] = (char) (u >> 16);
+    pos[2] = (char) (u >> 8);
+    pos[3] = (char) u;
+
+    return pos + 4;
+}
+
+/** internal: read one back */
+static const char *_nad_ser_get(const char *pos, int *val)
+{
+    const unsigned char *u = (const unsigned char *) pos;
+
+    *val = (int) (((unsigned int) u[0] << 24) | ((unsigned int) u[1] << 16) | ((unsigned int) u[2] << 8) | (unsigned int) u[3]);
+
+    return pos + 4;
+}
+
 void nad_serialize(nad_t nad, char **buf, int *len) {
     char *pos;
+    int i;
 
     _nad_ptr_check(__func__, nad);
 
-    *len = sizeof(int) * 5 + /* 4 ints in nad_t, plus one for len */
-           sizeof(struct nad_elem_st) * nad->ecur +
-           sizeof(struct nad_attr_st) * nad->acur +
-           sizeof(struct nad_ns_st) * nad->ncur +
-           sizeof(char) * nad->ccur;
+    *len = NAD_SER_HEAD +
+           NAD_SER_ELEM * nad->ecur +
+           NAD_SER_ATTR * nad->acur +
+           NAD_SER_NS * nad->ncur +
+           NAD_CLIVE(nad);
 
     *buf = (char *) malloc(*len);
     pos = *buf;
 
-    * (int *) pos = *len;       pos += sizeof(int);
-    * (int *) pos = nad->ecur;  pos += sizeof(int);
-    * (int *) pos = nad->acur;  pos += sizeof(int);
-    * (int *) pos = nad->ncur;  pos += sizeof(int);
-    * (int *) pos = nad->ccur;  pos += sizeof(int);
+    *pos++ = NAD_SER_VERSION;
+    pos = _nad_ser_put(pos, *len);
+    pos = _nad_ser_put(pos, nad->ecur);
+    pos = _nad_ser_put(pos, nad->acur);
+    pos = _nad_ser_put(pos, nad->ncur);
+    pos = _nad_ser_put(pos, NAD_CLIVE(nad));
+
+    for(i = 0; i < nad->ecur; i++) {
+        pos = _nad_ser_put(pos, nad->elems[i].parent);
+        pos = _nad_ser_put(pos, nad->elems[i].iname);
+        pos = _nad_ser_put(pos, nad->elems[i].lname);
+        pos = _nad_ser_put(pos, nad->elems[i].icdata);
+        pos = _nad_ser_put(pos, nad->elems[i].lcdata);
+        pos = _nad_ser_put(pos, nad->elems[i].itail);
+        pos = _nad_ser_put(pos, nad->elems[i].ltail);
+        pos = _nad_ser_put(pos, nad->elems[i].attr);
+        pos = _nad_ser_put(pos, nad->elems[i].ns);
+        pos = _nad_ser_put(pos, nad->elems[i].my_ns);
+        pos = _nad_ser_put(pos, (int) nad->elems[i].depth);
+    }
+
+    for(i = 0; i < nad->acur; i++) {
+        pos = _nad_ser_put(pos, nad->attrs[i].iname);
+        pos = _nad_ser_put(pos, nad->attrs[i].lname);
+        pos = _nad_ser_put(pos, nad->attrs[i].ival);
+        pos = _nad_ser_put(pos, nad->attrs[i].lval);
+        pos = _nad_ser_put(pos, nad->attrs[i].my_ns);
+        pos = _nad_ser_put(pos, nad->attrs[i].next);
+    }
+
+    for(i = 0; i < nad->ncur; i++) {
+        pos = _nad_ser_put(pos, nad->nss[i].iuri);
+        pos = _nad_ser_put(pos, nad->nss[i].luri);
+        pos = _nad_ser_put(pos, nad->nss[i].iprefix);
+        pos = _nad_ser_put(pos, nad->nss[i].lprefix);
+        pos = _nad_ser_put(pos, nad->nss[i].next);
+    }
+
+    memcpy(pos, nad->cdata, NAD_CLIVE(nad));
+}
 
-    memcpy(pos, nad->elems, sizeof(struct nad_elem_st) * nad->ecur);    pos += sizeof(struct nad_elem_st) * nad->ecur;
-    memcpy(pos, nad->attrs, sizeof(struct nad_attr_st) * nad->acur);    pos += sizeof(struct nad_attr_st) * nad->acur;
-    memcpy(pos, nad->nss, sizeof(struct nad_ns_st) * nad->ncur);        pos += sizeof(struct nad_ns_st) * nad->ncur;
-    memcpy(pos, nad->cdata, sizeof(char) * nad->ccur);
+/** internal: a piece of cdata that's really in there */
+#define NAD_CREF_OK(nad, i, l) ((l) == 0 || ((i) >= 0 && (l) > 0 && (i) <= (nad)->ccur - (l)))
+
+/** internal: make sure nothing points outside the nad */
+static int _nad_check(nad_t nad)
+{
+    int i;
+
+    for(i = 0; i < nad->ecur; i++)
+        if(!NAD_CREF_OK(nad, nad->elems[i].iname, nad->elems[i].lname) ||
+           !NAD_CREF_OK(nad, nad->elems[i].icdata, nad->elems[i].lcdata) ||
+           !NAD_CREF_OK(nad, nad->elems[i].itail, nad->elems[i].ltail) ||
+           nad->elems[i].parent < -1 || nad->elems[i].parent >= i ||
+           nad->elems[i].attr < -1 || nad->elems[i].attr >= nad->acur ||
+           nad->elems[i].ns < -1 || nad->elems[i].ns >= nad->ncur ||
+           nad->elems[i].my_ns < -1 || nad->elems[i].my_ns >= nad->ncur ||
+           nad->elems[i].depth > (unsigned int) nad->ecur)
+            return 1;
+
+    for(i = 0; i < nad->acur; i++)
+        if(!NAD_CREF_OK(nad, nad->attrs[i].iname, nad->attrs[i].lname) ||
+           !NAD_CREF_OK(nad, nad->attrs[i].ival, nad->attrs[i].lval) ||
+           nad->attrs[i].my_ns < -1 || nad->attrs[i].my_ns >= nad->ncur ||
+           nad->attrs[i].next < -1 || nad->attrs[i].next >= nad->acur)
+            return 1;
+
+    for(i = 0; i < nad->ncur; i++)
+        if(!NAD_CREF_OK(nad, nad->nss[i].iuri, nad->nss[i].luri) ||
+           (nad->nss[i].iprefix >= 0 && !NAD_CREF_OK(nad, nad->nss[i].iprefix, nad->nss[i].lprefix)) ||
+           nad->nss[i].next < -1 || nad->nss[i].next >= nad->ncur)
+            return 1;
+
+    return 0;
 }
 
-nad_t nad_deserialize(const char *buf) {
-    nad_t nad = nad_new();
-    const char *pos = buf + sizeof(int);  /* skip len */
+nad_t nad_deserialize(const char *buf, int buflen) {
+    nad_t nad;
+    const char *pos = buf;
+    int len, ecur, acur, ncur, ccur, depth, i;
+
+    if(buflen < NAD_SER_HEAD || *pos++ != NAD_SER_VERSION)
+        return NULL;
+
+    pos = _nad_ser_get(pos, &len);
+    pos = _nad_ser_get(pos, &ecur);
+    pos = _nad_ser_get(pos, &acur);
+    pos = _nad_ser_get(pos, &ncur);
+    pos = _nad_ser_get(pos, &ccur);
+
+    /* the counts have to add up to what we were given */
+    if(len != buflen || ecur < 0 || acur < 0 || ncur < 0 || ccur < 0 ||
+       ecur > len || acur > len || ncur > len || ccur > len ||
+       (long) len != (long) NAD_SER_HEAD +
+                     (long) NAD_SER_ELEM * ecur +
+                     (long) NAD_SER_ATTR * acur +
+                     (long) NAD_SER_NS * ncur +
+                     (long) ccur)
+        return NULL;
+
+    nad = nad_new();
 
     _nad_ptr_check(__func__, nad);
 
-    nad->ecur = * (int *) pos; pos += sizeof(int);
-    nad->acur = * (int *) pos; pos += sizeof(int);
-    nad->ncur = * (int *) pos; pos += sizeof(int);
-    nad->ccur = * (int *) pos; pos += sizeof(int);
-    nad->elen = nad->ecur;
-    nad->alen = nad->acur;
-    nad->nlen = nad->ncur;
-    nad->clen = nad->ccur;
+    nad->ecur = ecur;
+    nad->acur = acur;
+    nad->ncur = ncur;
+    nad->ccur = ccur;
 
+    /* it may be a recycled one, with buffers already */
     if(nad->ecur > 0)
     {
-        nad->elems = (struct nad_elem_st *) malloc(sizeof(struct nad_elem_st) * nad->ecur);
-        memcpy(nad->elems, pos, sizeof(struct nad_elem_st) * nad->ecur);
-        pos += sizeof(struct nad_elem_st) * nad->ecur;
+        NAD_SAFE(nad->elems, sizeof(struct nad_elem_st) * nad->ecur, nad->elen);
+        for(i = 0; i < nad->ecur; i++) {
+            pos = _nad_ser_get(pos, &nad->elems[i].parent);
+            pos = _nad_ser_get(pos, &nad->elems[i].iname);
+            pos = _nad_ser_get(pos, &nad->elems[i].lname);
+            pos = _nad_ser_get(pos, &nad->elems[i].icdata);
+            pos = _nad_ser_get(pos, &nad->elems[i].lcdata);
+            pos = _nad_ser_get(pos, &nad->elems[i].itail);
+            pos = _nad_ser_get(pos, &nad->elems[i].ltail);
+            pos = _nad_ser_get(pos, &nad->elems[i].attr);
+            pos = _nad_ser_get(pos, &nad->elems[i].ns);
+            pos = _nad_ser_get(pos, &nad->elems[i].my_ns);
+            pos = _nad_ser_get(pos, &depth);
+            nad->elems[i].depth = (unsigned int) depth;
+        }
     }
 
     if(nad->acur > 0)
     {
-        nad->attrs = (struct nad_attr_st *) malloc(sizeof(struct nad_attr_st) * nad->acur);
-        memcpy(nad->attrs, pos, sizeof(struct nad_attr_st) * nad->acur);
-        pos += sizeof(struct nad_attr_st) * nad->acur;
+        NAD_SAFE(nad->attrs, sizeof(struct nad_attr_st) * nad->acur, nad->alen);
+        for(i = 0; i < nad->acur; i++) {
+            pos = _nad_ser_get(pos, &nad->attrs[i].iname);
+            pos = _nad_ser_get(pos, &nad->attrs[i].lname);
+            pos = _nad_ser_get(pos, &nad->attrs[i].ival);
+            pos = _nad_ser_get(pos, &nad->attrs[i].lval);
+            pos = _nad_ser_get(pos, &nad->attrs[i].my_ns);
+            pos = _nad_ser_get(pos, &nad->attrs[i].next);
+        }
     }
 
     if(nad->ncur > 0)
     {
-        nad->nss = (struct nad_ns_st *) malloc(sizeof(struct nad_ns_st) * nad->ncur);
-        memcpy(nad->nss, pos, sizeof(struct nad_ns_st) * nad->ncur);
-        pos += sizeof(struct nad_ns_st) * nad->ncur;
+        NAD_SAFE(nad->nss, sizeof(struct nad_ns_st) * nad->ncur, nad->nlen);
+        for(i = 0; i < nad->ncur; i++) {
+            pos = _nad_ser_get(pos, &nad->nss[i].iuri);
+            pos = _nad_ser_get(pos, &nad->nss[i].luri);
+            pos = _nad_ser_get(pos, &nad->nss[i].iprefix);
+            pos = _nad_ser_get(pos, &nad->nss[i].lprefix);
+            pos = _nad_ser_get(pos, &nad->nss[i].next);
+        }
     }
 
     if(nad->ccur > 0)
     {
-        nad->cdata = (char *) malloc(sizeof(char) * nad->ccur);
+        NAD_SAFE(nad->cdata, sizeof(char) * nad->ccur, nad->clen);
         memcpy(nad->cdata, pos, sizeof(char) * nad->ccur);
     }
 
+    if(_nad_check(nad)) {
+        nad_free(nad);
+        return NULL;
+    }
+
+    /* the last elem at each depth, for appending */
+    for(i = 0; i < nad->ecur; i++) {
+        NAD_SAFE(nad->depths, (nad->elems[i].depth + 1) * sizeof(int), nad->dlen);
+        nad->depths[nad->elems[i].depth] = i;
+    }
+
     return nad;
 }
 
@@ -106,6 +106,13 @@ typedef struct nad_st
 
     int scope; /* currently scoped namespaces, get attached to the next element */
     struct nad_st *next; /* for keeping a list of nads */
+
+    /* The wire form of element 0 as it was received, if known. Any modification through the nad_* functions drops it. */
+    char *raw;
+    int rlen;
+
+    /* Where the output of the last nad_print() is in cdata, so the next one can reuse the space. */
+    int pstart, pend;
 } *nad_t;
 
 /** create a new nad */
@@ -117,6 +124,9 @@ JABBERD2_API nad_t nad_copy(nad_t nad);
 /** free that nad */
 JABBERD2_API void nad_free(nad_t nad);
 
+/** forget the received wire form, call this after modifying the nad directly */
+JABBERD2_API void nad_drop_raw(nad_t nad);
+
 /** find the next element with this name/depth */
 /** 0 for siblings, 1 for children and so on */
 JABBERD2_API int nad_find_elem(nad_t nad, unsigned int elem, int ns, const char *name, int depth);
@@ -169,12 +179,13 @@ JABBERD2_API int nad_add_namespace(nad_t nad, const char *uri, const char *prefi
 /** declare a namespace on an already existing element */
 JABBERD2_API int nad_append_namespace(nad_t nad, unsigned int elem, const char *uri, const char *prefix);
 
-/** create a string representation of the given element (and children), point references to it */
+/** create a string representation of the given element (and children), point references to it.
+ *  it stays valid until the nad is changed or printed again */
 JABBERD2_API void nad_print(nad_t nad, unsigned int elem, const char **xml, int *len);
 
-/** serialize and deserialize a nad */
+/** serialize and deserialize a nad, in a form that can be moved between platforms */
 JABBERD2_API void nad_serialize(nad_t nad, char **buf, int *len);
-JABBERD2_API nad_t nad_deserialize(const char *buf);
+JABBERD2_API nad_t nad_deserialize(const char *buf, int len);
 
 /** create a nad from raw xml */
 JABBERD2_API nad_t nad_parse(const char *buf, int len);
@@ -97,3 +97,86 @@ nad_t stanza_tofrom(nad_t nad, int elem) {
 
     return nad;
 }
+
+/*
+ * multicast routes carry one stanza, with the recipients in an <addresses/>
+ * list next to it:
+ *
+ *   <route type='multicast' from='sm'>
+ *     <presence from='user@domain/resource'/>
+ *     <addresses>
+ *       <address to='contact@domain'/>
+ *       ...
+ *     </addresses>
+ *   </route>
+ *
+ * whoever can't pass it on as is expands it into ordinary unicast routes
+ */
+
+/** find the address list of a multicast route, -1 if it has none */
+int stanza_multicast_addresses(nad_t nad) {
+    if(nad->ecur < 2)
+        return -1;
+
+    return nad_find_elem(nad, 1, NAD_ENS(nad, 0), "addresses", 0);
+}
+
+/** domain part of a jid string, no prepping done */
+const char *stanza_jid_domain(const char *jid, int len, int *dlen) {
+    const char *c, *end = jid + len;
+
+    /* resources can have anything in them, so cut that off first */
+    for(c = jid; c < end && *c != '/'; c++);
+    end = c;
+
+    for(c = jid; c < end && *c != '@'; c++);
+    if(c < end)
+        jid = c + 1;
+
+    *dlen = end - jid;
+    return jid;
+}
+
+/** unicast route for one recipient, from a multicast route with its address list dropped */
+nad_t stanza_multicast_unicast(nad_t tmpl, const char *to, int tolen) {
+    nad_t nad;
+    const char *domain;
+    int dlen;
+
+    nad = nad_copy(tmpl);
+
+    domain = stanza_jid_domain(to, tolen, &dlen);
+
+    nad_set_attr(nad, 0, -1, "type", NULL, 0);
+    nad_set_attr(nad, 0, -1, "to", domain, dlen);
+    nad_set_attr(nad, 1, -1, "to", to, tolen);
+
+    return nad;
+}
+
+/** expand a multicast route, handing a unicast route for each recipient to the callback */
+int stanza_multicast_split(nad_t nad, void (*cb)(nad_t nad, void *arg), void *arg) {
+    nad_t tmpl;
+    int addrs, ns, elem, attr, n = 0;
+
+    addrs = stanza_multicast_addresses(nad);
+    if(addrs < 0)
+        return 0;
+
+    tmpl = nad_copy(nad);
+    nad_drop_elem(tmpl, addrs);
+
+    ns = NAD_ENS(nad, addrs);
+    for(elem = nad_find_elem(nad, addrs, ns, "address", 1); elem >= 0; elem = nad_find_elem(nad, elem, ns, "address", 0)) {
+        attr = nad_find_attr(nad, elem, -1, "to", NULL);
+        if(attr < 0 || NAD_AVAL_L(nad, attr) == 0)
+            continue;
+
+        (cb)(stanza_multicast_unicast(tmpl, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr)), arg);
+        n++;
+    }
+
+    nad_free(tmpl);
+
+    return n;
+}
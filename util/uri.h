@@ -45,6 +45,7 @@
 #define uri_COMPRESS    "http://jabber.org/protocol/compress"
 #define uri_COMPRESS_FEATURE "http://jabber.org/features/compress"
 #define uri_ACK         "http://www.xmpp.org/extensions/xep-0198.html#ns"
+#define uri_STREAMMGMT  "urn:xmpp:sm:3"
 #define uri_IQAUTH      "http://jabber.org/features/iq-auth"
 #define uri_IQREGISTER  "http://jabber.org/features/iq-register"
 #define uri_STREAM_ERR  "urn:ietf:params:xml:ns:xmpp-streams"
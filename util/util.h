@@ -291,6 +291,55 @@ JABBERD2_API int         rate_left(rate_t rt);
  */
 JABBERD2_API int         rate_check(rate_t rt);
 
+/*
+ * timer wheel
+ */
+
+typedef struct wheel_st         *wheel_t;
+typedef struct wheel_timer_st   *wheel_timer_t;
+
+typedef void (*wheel_fn)(wheel_t w, wheel_timer_t t, void *arg);
+
+/** embed one of these in whatever needs waking up, init it once */
+struct wheel_timer_st {
+    wheel_timer_t   next, prev;
+    int             slot;       /* -1 if not scheduled */
+    long long       when;       /* ms since the epoch */
+
+    wheel_fn        fn;
+    void            *arg;
+};
+
+struct wheel_st {
+    int             nslots;
+    int             tick;       /* ms per slot */
+
+    wheel_timer_t   *slots;
+
+    long long       last;       /* last tick fully processed */
+    int             count;
+};
+
+JABBERD2_API long long   wheel_clock(void);
+JABBERD2_API wheel_t     wheel_new(int slots, int tick);
+JABBERD2_API void        wheel_free(wheel_t w);
+JABBERD2_API void        wheel_timer_init(wheel_timer_t t, wheel_fn fn, void *arg);
+
+/** (re)schedule a timer, for an absolute time or in a number of ms */
+JABBERD2_API void        wheel_at(wheel_t w, wheel_timer_t t, long long when);
+JABBERD2_API void        wheel_in(wheel_t w, wheel_timer_t t, int ms);
+JABBERD2_API void        wheel_del(wheel_t w, wheel_timer_t t);
+
+/** fire everything that's due, the timer is unscheduled before its callback is called */
+JABBERD2_API int         wheel_run(wheel_t w);
+
+/**
+ * @return ms until the next timer might be due, or -1 if there's nothing
+ *         scheduled.
+ */
+JABBERD2_API int         wheel_next(wheel_t w);
+JABBERD2_API int         wheel_count(wheel_t w);
+
 /*
  * helpers for ip addresses
  */
@@ -392,6 +441,12 @@ JABBERD2_API char *b64_decode(char *buf);
 JABBERD2_API nad_t stanza_error(nad_t nad, int elem, int err);
 JABBERD2_API nad_t stanza_tofrom(nad_t nad, int elem);
 
+/* multicast routes */
+JABBERD2_API int stanza_multicast_addresses(nad_t nad);
+JABBERD2_API const char *stanza_jid_domain(const char *jid, int len, int *dlen);
+JABBERD2_API nad_t stanza_multicast_unicast(nad_t tmpl, const char *to, int tolen);
+JABBERD2_API int stanza_multicast_split(nad_t nad, void (*cb)(nad_t nad, void *arg), void *arg);
+
 typedef struct _stanza_error_st {
     const char  *name;
     const char  *type;
@@ -0,0 +1,204 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* timer wheel - timers hash into a ring of slots by their expiry tick,
+ * so each run only looks at the slots whose time has come. timers more
+ * than a full turn away just sit in their slot until it comes round again */
+
+#include "util.h"
+
+long long wheel_clock(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+wheel_t wheel_new(int slots, int tick)
+{
+    wheel_t w;
+    int n;
+
+    /* round up to a power of two so the slot is just a mask */
+    for(n = 1; n < slots; n <<= 1);
+
+    w = (wheel_t) calloc(1, sizeof(struct wheel_st));
+    w->nslots = n;
+    w->tick = tick > 0 ? tick : 1;
+
+    /* one more for timers that are being fired */
+    w->slots = (wheel_timer_t *) calloc(n + 1, sizeof(wheel_timer_t));
+
+    w->last = wheel_clock() / w->tick - 1;
+
+    return w;
+}
+
+void wheel_free(wheel_t w)
+{
+    int i;
+    wheel_timer_t t;
+
+    /* leave them looking unscheduled, they belong to someone else */
+    for(i = 0; i <= w->nslots; i++)
+        while((t = w->slots[i]) != NULL) {
+            w->slots[i] = t->next;
+            t->next = t->prev = NULL;
+            t->slot = -1;
+        }
+
+    free(w->slots);
+    free(w);
+}
+
+void wheel_timer_init(wheel_timer_t t, wheel_fn fn, void *arg)
+{
+    t->next = t->prev = NULL;
+    t->slot = -1;
+    t->when = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+static void _wheel_link(wheel_t w, wheel_timer_t t, int slot)
+{
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = w->slots[slot];
+    if(t->next != NULL)
+        t->next->prev = t;
+    w->slots[slot] = t;
+}
+
+static void _wheel_unlink(wheel_t w, wheel_timer_t t)
+{
+    if(t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        w->slots[t->slot] = t->next;
+
+    if(t->next != NULL)
+        t->next->prev = t->prev;
+
+    t->next = t->prev = NULL;
+    t->slot = -1;
+}
+
+void wheel_at(wheel_t w, wheel_timer_t t, long long when)
+{
+    long long tick;
+
+    if(t->slot >= 0)
+        _wheel_unlink(w, t);
+    else
+        w->count++;
+
+    t->when = when;
+
+    /* already due goes in the next slot to be looked at */
+    tick = when / w->tick;
+    if(tick <= w->last)
+        tick = w->last + 1;
+
+    _wheel_link(w, t, (int) (tick & (w->nslots - 1)));
+}
+
+void wheel_in(wheel_t w, wheel_timer_t t, int ms)
+{
+    wheel_at(w, t, wheel_clock() + ms);
+}
+
+void wheel_del(wheel_t w, wheel_timer_t t)
+{
+    if(t->slot < 0)
+        return;
+
+    _wheel_unlink(w, t);
+    w->count--;
+}
+
+int wheel_run(wheel_t w)
+{
+    long long now, tick, end;
+    wheel_timer_t t, next;
+    int fired = 0;
+
+    now = wheel_clock();
+    end = now / w->tick;
+
+    /* a full turn covers every slot, no need to go round twice */
+    tick = w->last + 1;
+    if(end - tick >= w->nslots)
+        tick = end - w->nslots + 1;
+
+    for(; tick <= end; tick++)
+        for(t = w->slots[tick & (w->nslots - 1)]; t != NULL; t = next) {
+            next = t->next;
+
+            if(t->when > now)
+                continue;
+
+            _wheel_unlink(w, t);
+            _wheel_link(w, t, w->nslots);
+        }
+
+    /* this tick isn't over, later timers in it get another look next time */
+    w->last = end - 1;
+
+    /* callbacks can add and delete timers, including ones still waiting here */
+    while((t = w->slots[w->nslots]) != NULL) {
+        _wheel_unlink(w, t);
+        w->count--;
+        fired++;
+
+        (t->fn)(w, t, t->arg);
+    }
+
+    return fired;
+}
+
+int wheel_next(wheel_t w)
+{
+    long long now, tick;
+    int i;
+
+    if(w->count == 0)
+        return -1;
+
+    now = wheel_clock();
+
+    /* the first slot with anything in it, it may only be there for a later turn */
+    for(i = 1; i <= w->nslots; i++) {
+        tick = w->last + i;
+        if(w->slots[tick & (w->nslots - 1)] != NULL) {
+            tick = (tick + 1) * w->tick;
+            return tick > now ? (int) (tick - now) : 0;
+        }
+    }
+
+    return -1;
+}
+
+int wheel_count(wheel_t w)
+{
+    return w->count;
+}
@@ -22,73 +22,242 @@
 #include "util.h"
 
 
+/* secret constants of wyhash (public domain, Wang Yi) */
+#define XHASH_P0 0xa0761d6478bd642fULL
+#define XHASH_P1 0xe7037ed1a0b428dbULL
+#define XHASH_P2 0x8ebc6af09c88c6e3ULL
+
+/* number of old buckets migrated by each table operation during a resize */
+#define XHASH_REHASH_STEP 4
+
+/* 64x64->128 bit multiply, folded back to 64 bits */
+static uint64_t _xhash_mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t) a, lb = (uint32_t) b, hi, lo;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return hi ^ lo;
+#endif
+}
+
+static uint64_t _xhash_r8(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static uint64_t _xhash_r4(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
 /* Generates a hash code for a string.
- * This function uses the ELF hashing algorithm as reprinted in 
- * Andrew Binstock, "Hashing Rehashed," Dr. Dobb's Journal, April 1996.
+ * This is a reduced form of wyhash: it consumes the key 16 bytes at a time
+ * and mixes with a wide multiply, which is both much faster than a byte
+ * loop and distributes well enough to use the low bits as a bucket index.
  */
-static int _xhasher(const char *s, int len)
+static unsigned int _xhasher(const char *s, int len)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    uint64_t seed = XHASH_P0, a, b;
+    int i = len;
+
+    if(len <= 16) {
+        if(len >= 4) {
+            a = (_xhash_r4(p) << 32) | _xhash_r4(p + ((len >> 3) << 2));
+            b = (_xhash_r4(p + len - 4) << 32) | _xhash_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if(len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else
+            a = b = 0;
+    } else {
+        while(i > 16) {
+            seed = _xhash_mum(_xhash_r8(p) ^ XHASH_P1, _xhash_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = _xhash_r8(p + i - 16);
+        b = _xhash_r8(p + i - 8);
+    }
+
+    return (unsigned int) _xhash_mum(XHASH_P1 ^ (uint64_t) len, _xhash_mum(a ^ XHASH_P1, b ^ seed) ^ XHASH_P2);
+}
+
+
+/** the bucket slot that holds the chain n is the head of */
+static xhn *_xhash_head_slot(xht h, xhn n)
+{
+    int i;
+
+    if(h->ozen != NULL) {
+        i = n->hash & (h->oprime - 1);
+        if(h->ozen[i] == n)
+            return &h->ozen[i];
+    }
+
+    return &h->zen[n->hash & (h->prime - 1)];
+}
+
+/** take n out of its chain and put it on the free list */
+static void _xhash_node_release(xht h, xhn n)
+{
+    if(n->prev) n->prev->next = n->next;
+    else *_xhash_head_slot(h, n) = n->next;
+    if(n->next) n->next->prev = n->prev;
+
+    // add it to the free_list head.
+    n->prev = NULL;
+    n->next = h->free_list;
+    h->free_list = n;
+}
+
+/** no migrating while an iteration is in flight, it would move nodes under the iterator */
+static int _xhash_busy(xht h)
+{
+    return h->iter_node != NULL || h->walking;
+}
+
+/* iter_bucket once an iteration has been ended under the caller */
+#define XHASH_ITER_ENDED (-2)
+
+/** end the current iteration, the next xhash_iter_next() says there are no more */
+static void _xhash_iter_end(xht h)
+{
+    /* it was zapped while current, so it's still linked in */
+    if(h->iter_node->key == NULL)
+        _xhash_node_release(h, h->iter_node);
+
+    h->iter_node = NULL;
+    h->iter_bucket = XHASH_ITER_ENDED;
+}
+
+/** migrate a few buckets from the old table, finishing the resize eventually */
+static void _xhash_rehash_step(xht h)
 {
-    /* ELF hash uses unsigned chars and unsigned arithmetic for portability */
-    const unsigned char *name = (const unsigned char *)s;
-    unsigned long h = 0, g;
+    int steps = XHASH_REHASH_STEP, empty = XHASH_REHASH_STEP * 8;
+    xhn n, next;
     int i;
 
-    for(i=0;i<len;i++)
-    { /* do some fancy bitwanking on the string */
-        h = (h << 4) + (unsigned long)(name[i]);
-        if ((g = (h & 0xF0000000UL))!=0)
-            h ^= (g >> 24);
-        h &= ~g;
+    if(h->ozen == NULL || _xhash_busy(h))
+        return;
+
+    while(h->rehash < h->oprime && steps > 0 && empty > 0) {
+        n = h->ozen[h->rehash];
+        if(n == NULL) {
+            empty--;
+            h->rehash++;
+            continue;
+        }
+
+        for(; n != NULL; n = next) {
+            next = n->next;
 
+            /* leftovers from an abandoned iteration */
+            if(n->key == NULL) {
+                n->prev = NULL;
+                n->next = h->free_list;
+                h->free_list = n;
+                continue;
+            }
+
+            i = n->hash & (h->prime - 1);
+            n->prev = NULL;
+            n->next = h->zen[i];
+            if(n->next) n->next->prev = n;
+            h->zen[i] = n;
+        }
+
+        h->ozen[h->rehash] = NULL;
+        h->rehash++;
+        steps--;
+    }
+
+    if(h->rehash == h->oprime) {
+        free(h->ozen);
+        h->ozen = NULL;
+        h->oprime = 0;
+        h->rehash = 0;
     }
+}
+
+/** start a resize once the table gets crowded */
+static void _xhash_grow(xht h)
+{
+    xhn *zen;
+
+    if(h->count <= h->prime || h->walking)
+        return;
+
+    /* an iteration that was given up on part way looks just like one in flight,
+     * and would hold up the resize for good. nothing adds keys to a table it is
+     * iterating, so the table needing to grow ends any iteration */
+    if(h->iter_node != NULL)
+        _xhash_iter_end(h);
+
+    if(h->ozen != NULL)
+        return;
+
+    zen = calloc(h->prime * 2, sizeof(xhn));
+    if(zen == NULL)
+        return;
 
-    return (int)h;
+    h->ozen = h->zen;
+    h->oprime = h->prime;
+    h->rehash = 0;
+    h->zen = zen;
+    h->prime *= 2;
+}
+
+/** the bucket arrays live outside the pool, so they can be dropped on resize */
+static void _xhash_buckets_free(void *arg)
+{
+    xht h = (xht) arg;
+
+    free(h->zen);
+    free(h->ozen);
 }
 
 
-static xhn _xhash_node_new(xht h, int index)
+static xhn _xhash_node_new(xht h, unsigned int hash)
 {
     xhn n;
-    int i = index % h->prime;
+    int i = hash & (h->prime - 1);
 
     /* track total */
     h->count++;
 
-#ifdef XHASH_DEBUG
-    h->stat[i]++;
-#endif
- 
-    // if the zen[i] is empty, reuse it, else get a new one.
-    n = &h->zen[i];
-    
-    if( n->key != NULL ) 
+    if( h->free_list )
     {
-        if( h->free_list )
-        {
-            n = h->free_list;
-            h->free_list = h->free_list->next;        
-        }else
-            n = pmalloco(h->p, sizeof(_xhn));
-
-        //add it to the bucket list head.
-        n->prev = &h->zen[i];
-        n->next = h->zen[i].next;
-
-        if( n->next ) n->next->prev = n;
-        h->zen[i].next = n;
-    }
+        n = h->free_list;
+        h->free_list = h->free_list->next;
+    }else
+        n = pmalloco(h->p, sizeof(_xhn));
+
+    //add it to the bucket list head.
+    n->hash = hash;
+    n->prev = NULL;
+    n->next = h->zen[i];
+    if( n->next ) n->next->prev = n;
+    h->zen[i] = n;
 
     return n;
 }
 
 
-static xhn _xhash_node_get(xht h, const char *key, int len, int index)
+static xhn _xhash_node_get(xht h, const char *key, int len, unsigned int hash)
 {
     xhn n;
-    int i = index % h->prime;
-    for(n = &h->zen[i]; n != NULL; n = n->next)
-        if(n->key != NULL && (n->keylen==len) && (strncmp(key, n->key, len) == 0))
+    int i;
+
+    for(n = h->zen[hash & (h->prime - 1)]; n != NULL; n = n->next)
+        if(n->hash == hash && n->key != NULL && (n->keylen==len) && (memcmp(key, n->key, len) == 0))
             return n;
+
+    /* buckets below the rehash mark have already moved over */
+    if(h->ozen != NULL && (i = hash & (h->oprime - 1)) >= h->rehash)
+        for(n = h->ozen[i]; n != NULL; n = n->next)
+            if(n->hash == hash && n->key != NULL && (n->keylen==len) && (memcmp(key, n->key, len) == 0))
+                return n;
+
     return NULL;
 }
 
@@ -97,51 +266,54 @@ xht xhash_new(int prime)
 {
     xht xnew;
     pool_t p;
+    int size = 8;
 
 /*    log_debug(ZONE,"creating new hash table of size %d",prime); */
 
+    /* the bucket count is a power of two so we can mask instead of mod */
+    while(size < prime)
+        size <<= 1;
+
     /**
      * NOTE:
-     * all xhash's memory should be allocated from the pool by using pmalloco()/pmallocx(),
-     * so that the xhash_free() can just call pool_free() simply.
+     * all xhash's node memory should be allocated from the pool by using pmalloco()/pmallocx(),
+     * so that the xhash_free() can just call pool_free() simply. The bucket
+     * arrays are the exception, they are released by a pool cleanup.
      */
-    
-    p = pool_heap(sizeof(_xhn)*prime + sizeof(_xht));
+
+    p = pool_heap(sizeof(_xhn)*size + sizeof(_xht));
     xnew = pmalloco(p, sizeof(_xht));
-    xnew->prime = prime;
+    xnew->prime = size;
     xnew->p = p;
-    xnew->zen = pmalloco(p, sizeof(_xhn)*prime); /* array of xhn size of prime */
+    while((xnew->zen = calloc(size, sizeof(xhn))) == NULL) sleep(1);
+    pool_cleanup(p, _xhash_buckets_free, (void *) xnew);
 
     xnew->free_list = NULL;
-    
+
     xnew->iter_bucket = -1;
     xnew->iter_node = NULL;
 
-#ifdef XHASH_DEBUG
-    xnew->stat = pmalloco(p, sizeof(int)*prime );
-#else
-    xnew->stat = NULL;
-#endif
-
     return xnew;
 }
 
 
 void xhash_putx(xht h, const char *key, int len, void *val)
 {
-    int index;
+    unsigned int hash;
     xhn n;
 
     if(h == NULL || key == NULL)
         return;
 
-    index = _xhasher(key,len);
+    hash = _xhasher(key,len);
+
+    _xhash_rehash_step(h);
 
     /* dirty the xht */
     h->dirty++;
 
     /* if existing key, replace it */
-    if((n = _xhash_node_get(h, key, len, index)) != NULL)
+    if((n = _xhash_node_get(h, key, len, hash)) != NULL)
     {
 /*        log_debug(ZONE,"replacing %s with new val %X",key,val); */
 
@@ -154,7 +326,8 @@ void xhash_putx(xht h, const char *key, int len, void *val)
 /*    log_debug(ZONE,"saving %s val %X",key,val); */
 
     /* new node */
-    n = _xhash_node_new(h, index);
+    _xhash_grow(h);
+    n = _xhash_node_new(h, hash);
     n->key = key;
     n->keylen = len;
     n->val = val;
@@ -171,7 +344,12 @@ void *xhash_getx(xht h, const char *key, int len)
 {
     xhn n;
 
-    if(h == NULL || key == NULL || len <= 0 || (n = _xhash_node_get(h, key, len, _xhasher(key,len))) == NULL)
+    if(h == NULL || key == NULL || len <= 0)
+        return NULL;
+
+    _xhash_rehash_step(h);
+
+    if((n = _xhash_node_get(h, key, len, _xhasher(key,len))) == NULL)
     {
 /*        log_debug(ZONE,"failed lookup of %s",key); */
         return NULL;
@@ -187,21 +365,12 @@ void *xhash_get(xht h, const char *key)
     return xhash_getx(h,key,strlen(key));
 }
 
-void xhash_zap_inner( xht h, xhn n, int index)
+static void xhash_zap_inner(xht h, xhn n)
 {
-    int i = index % h->prime;
-
-    // if element:n is in bucket list and it's not the current iter
-    if( &h->zen[i] != n && h->iter_node != n )
-    {
-        if(n->prev) n->prev->next = n->next;
-        if(n->next) n->next->prev = n->prev;
-
-        // add it to the free_list head.
-        n->prev = NULL;
-        n->next = h->free_list;
-        h->free_list = n;
-    }
+    // if element:n is not the current iter, unlink it now,
+    // otherwise xhash_iter_next() will do it when moving on
+    if( h->iter_node != n )
+        _xhash_node_release(h, n);
 
     //empty the value.
     n->key = NULL;
@@ -210,26 +379,22 @@ void xhash_zap_inner( xht h, xhn n, int index)
     /* dirty the xht and track the total */
     h->dirty++;
     h->count--;
-
-#ifdef XHASH_DEBUG
-    h->stat[i]--;
-#endif
 }
 
 void xhash_zapx(xht h, const char *key, int len)
 {
     xhn n;
-    int index;
 
     if( !h || !key ) return;
-    
-    index = _xhasher(key,len);
-    n = _xhash_node_get(h, key, len, index);
+
+    _xhash_rehash_step(h);
+
+    n = _xhash_node_get(h, key, len, _xhasher(key,len));
     if( !n ) return;
 
 /*    log_debug(ZONE,"zapping %s",key); */
 
-    xhash_zap_inner(h ,n, index );
+    xhash_zap_inner(h, n);
 }
 
 void xhash_zap(xht h, const char *key)
@@ -250,35 +415,56 @@ void xhash_free(xht h)
 void xhash_stat( xht h )
 {
 #ifdef XHASH_DEBUG
+    int i, len, longest = 0, used = 0;
+    xhn n;
+
     if( !h ) return;
-    
-    fprintf(stderr, "XHASH: table prime: %d , number of elements: %d\n", h->prime, h->count );
 
-    int i;
+    fprintf(stderr, "XHASH: table size: %d , number of elements: %d%s\n", h->prime, h->count, h->ozen ? " (resizing)" : "" );
+
     for( i = 0; i< h->prime ; ++i )
     {
-        if( h->stat[i] > 1 )
-            fprintf(stderr, "%d: %d\t", i, h->stat[i]);
+        for( len = 0, n = h->zen[i]; n != NULL; n = n->next ) len++;
+        if( len > 0 ) used++;
+        if( len > longest ) longest = len;
+        if( len > 1 )
+            fprintf(stderr, "%d: %d\t", i, len);
     }
-    fprintf(stderr, "\n");
-    
+    fprintf(stderr, "\nXHASH: %d buckets used, longest chain %d\n", used, longest);
 #endif
 }
 
+/** bucket b of the combined (new, then old) table used by walk and iteration */
+static xhn _xhash_bucket(xht h, int b)
+{
+    if(b < h->prime)
+        return h->zen[b];
+    return h->ozen[b - h->prime];
+}
+
+static int _xhash_buckets(xht h)
+{
+    return h->prime + (h->ozen != NULL ? h->oprime : 0);
+}
+
 void xhash_walk(xht h, xhash_walker w, void *arg)
 {
     int i;
-    xhn n;
+    xhn n, next;
 
     if(h == NULL || w == NULL)
         return;
 
 /*    log_debug(ZONE,"walking %X",h); */
 
-    for(i = 0; i < h->prime; i++)
-        for(n = &h->zen[i]; n != NULL; n = n->next)
+    h->walking++;
+    for(i = 0; i < _xhash_buckets(h); i++)
+        for(n = _xhash_bucket(h, i); n != NULL; n = next) {
+            next = n->next;
             if(n->key != NULL && n->val != NULL)
                 (*w)(n->key, n->keylen, n->val, arg);
+        }
+    h->walking--;
 }
 
 /** return the dirty flag (and reset) */
@@ -318,39 +504,32 @@ int xhash_iter_first(xht h) {
 }
 
 int xhash_iter_next(xht h) {
-    if(h == NULL) return 0;
-
-    /* next in this bucket */
-    h->iter_node = h->iter_node ? h->iter_node->next : NULL;
-    while(h->iter_node != NULL) {
-        xhn n = h->iter_node;
+    xhn cur, n;
 
-        if(n->key != NULL && n->val != NULL)
-            return 1;
-
-        h->iter_node = n->next;
-
-        if (n != &h->zen[h->iter_bucket]) {
-            if(n->prev) n->prev->next = n->next;
-            if(n->next) n->next->prev = n->prev;
+    if(h == NULL) return 0;
 
-            // add it to the free_list head.
-            n->prev = NULL;
-            n->next = h->free_list;
-            h->free_list = n;
-        }
+    if(h->iter_bucket == XHASH_ITER_ENDED) {
+        h->iter_bucket = -1;
+        return 0;
     }
 
-    /* next bucket */
-    for(h->iter_bucket++; h->iter_bucket < h->prime; h->iter_bucket++) {
-        h->iter_node = &h->zen[h->iter_bucket];
+    /* next in this bucket, dropping the current node if it was zapped under us */
+    cur = h->iter_node;
+    n = cur ? cur->next : NULL;
+    if(cur != NULL && cur->key == NULL)
+        _xhash_node_release(h, cur);
 
-        while(h->iter_node != NULL) {
-            if(h->iter_node->key != NULL && h->iter_node->val != NULL)
+    for(;;) {
+        for(; n != NULL; n = n->next)
+            if(n->key != NULL && n->val != NULL) {
+                h->iter_node = n;
                 return 1;
+            }
 
-            h->iter_node = h->iter_node->next;
-        }
+        /* next bucket */
+        if(++h->iter_bucket >= _xhash_buckets(h))
+            break;
+        n = _xhash_bucket(h, h->iter_bucket);
     }
 
     /* there is no next */
@@ -362,13 +541,9 @@ int xhash_iter_next(xht h) {
 
 void xhash_iter_zap(xht h)
 {
-    int index;
-
     if( !h || !h->iter_node ) return;
 
-    index = _xhasher( h->iter_node->key, h->iter_node->keylen );
-
-    xhash_zap_inner( h ,h->iter_node, index);
+    xhash_zap_inner( h ,h->iter_node );
 }
 
 int xhash_iter_get(xht h, const char **key, int *keylen, void **val) {
@@ -39,20 +39,27 @@ typedef struct xhn_struct
     struct xhn_struct *prev;
     const char *key;
     int keylen;
+    unsigned int hash;  /* cached full hash of key, compared before the key itself */
     void *val;
 } *xhn, _xhn;
 
+/** the table grows by doubling once count exceeds the number of buckets;
+  * the old bucket array is then migrated a few buckets per operation, so
+  * no single call has to rehash the whole table */
 typedef struct xht_struct
 {
     pool_t p;
-    int prime;
+    int prime;          /* number of buckets in zen (always a power of two) */
     int dirty;
     int count;
-    struct xhn_struct *zen;
+    struct xhn_struct **zen;
+    struct xhn_struct **ozen;   /* previous bucket array while a resize is in progress */
+    int oprime;         /* number of buckets in ozen */
+    int rehash;         /* next ozen bucket to be migrated */
+    int walking;        /* migration is suspended during xhash_walk() */
     struct xhn_struct *free_list; // list of zaped elements to be reused.
     int iter_bucket;
     xhn iter_node;
-    int *stat;
 } *xht, _xht;
 
 JABBERD2_API xht xhash_new(int prime);
@@ -70,7 +77,7 @@ JABBERD2_API int xhash_dirty(xht h);
 JABBERD2_API int xhash_count(xht h);
 JABBERD2_API pool_t xhash_pool(xht h);
 
-/* iteration functions */
+/* iteration functions. adding keys to a table while iterating it may end the iteration */
 JABBERD2_API int xhash_iter_first(xht h);
 JABBERD2_API int xhash_iter_next(xht h);
 JABBERD2_API void xhash_iter_zap(xht h);